@@ -1,36 +1,37 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <stdint.h>
 #include <time.h>
 
 #include "nn_impl.h"
 #include "nn_rnd.h"
 #include "nn_alloc.h"
+#include "nn_data.h"
+#include "nn_sched.h"
 #include "nn_params.h"
 
-#if WITH_THPOOL
-
-#include "../lib/thpool.h"
-
-#endif
-
-typedef void (*setfunc_)(double_ **, const size_t, const size_t);
+typedef void (*setfunc_)(nnmtx);
 /**
  *
  * Functions that set input/expected output for the network
  *
  * It could be functions that will 
- *  - parse a data set from the file
  *  - fetch a data set from the db
  *  ...
  *
  * Here, rnd_mtx_gen is a stub function 
- * that will generate random input/expected output
+ * that will generate random input/expected output,
+ * it is used for networks without DATASET file (see nn_data.h)
  *
  **/
 static const setfunc_ SETINP  = rnd_mtx_gen;
 static const setfunc_ SETOUTP = rnd_mtx_gen;
 
+/* Stream of random examples, streams 0, 1, ... are networks weights */
+#define DATA_STREAM           UINT64_MAX
+
 int main (void)
 {
   clock_t cbegin, cend;
@@ -58,55 +59,278 @@ static void main_exit_ (void)
   exit (1);
 }
 
-static double_ **getinp_ (
-    const size_t nexamples, const size_t nfeatures,
-    const setfunc_ setinp)
+/**
+ *
+ * Data sets that are already loaded or generated, keyed by their source,
+ * networks with the same source share one read-only copy (see data_ref())
+ *
+ * @var path          data set file, NULL for random data
+ * @var seed          seed of random data
+ * @var nexamples     # of random examples
+ * @var ninps         # of random inputs
+ * @var noutps        # of random outputs
+ * @var data          data set, NULL if the entry is not used
+ *
+ **/
+typedef struct nnshared_
 {
-  double_ **inp;
+  const char   *path;
+  uint64_t      seed;
+  size_t   nexamples;
+  size_t       ninps;
+  size_t      noutps;
+  nndata        data;
 
-  /* Generate random input values */
-  if ((inp = alloc_mtx (nexamples, nfeatures, 0)) == NULL)
-    main_exit_();
+} nnshared_;
 
-  setinp (inp, nexamples, nfeatures);
-  return inp;
+static nnshared_ SHARED[NNETWORKS];
+
+/* Shared data set of the source, NULL if none yet */
+static nndata shared_get_ (const size_t i, const nnshared_ *key)
+{
+  for (size_t k = 0; k < NNETWORKS; k++)
+    {
+      const nnshared_ *sh = &SHARED[k];
+      if (sh->data == NULL)
+        break;
+      if (key->path != NULL ? sh->path != NULL && strcmp (sh->path, key->path) == 0
+                            : sh->path == NULL && sh->seed == key->seed
+                           && sh->nexamples == key->nexamples
+                           && sh->ninps == key->ninps && sh->noutps == key->noutps)
+        {
+          printf ("[%ld]: Sharing data set of %s ...\n", i,
+                  key->path != NULL ? key->path : "random examples");
+          return data_ref (sh->data);
+        }
+    }
+  return NULL;
 }
 
-static double_ **getoutp_ (
-    const size_t nexamples, const size_t nlabels,
-    const setfunc_ setoutp)
+/* Keep the reference until all jobs are done, see free_shared_() */
+static nndata shared_put_ (const nnshared_ *key, nndata data)
 {
-  double_ **outp;
+  for (size_t k = 0; k < NNETWORKS; k++)
+    if (SHARED[k].data == NULL)
+      {
+        SHARED[k] = *key;
+        SHARED[k].data = data_ref (data);
+        break;
+      }
+  return data;
+}
 
-  /* Generate random output values */
-  if ((outp = alloc_mtx (nexamples, nlabels, 0)) == NULL)
-    main_exit_();
+static void free_shared_ (void)
+{
+  for (size_t k = 0; k < NNETWORKS; k++)
+    {
+      data_free (SHARED[k].data);
+      SHARED[k].data = NULL;
+    }
+}
 
-  setoutp (outp, nexamples, nlabels);
-  return outp;
+/**
+ *
+ * Generate random examples, the stream doesn't depend on the network, 
+ * so networks with the same SEED and shape train on the same examples
+ *
+ **/
+static nndata getrnd_ (const size_t i)
+{
+  const nnshared_ key = 
+    { NULL, SEEDS[i], NEXAMPLES[i], NFEATURES[i], NLABELS[i], NULL };
+
+  nndata data;
+  if ((data = shared_get_ (i, &key)) != NULL)
+    return data;
+
+  data = data_alloc (NEXAMPLES[i], NFEATURES[i], NLABELS[i]);
+  rnd_seed (SEEDS[i], DATA_STREAM);
+  SETINP  (&data->inps);
+  SETOUTP (&data->outps);
+  return shared_put_ (&key, data);
 }
 
 typedef struct backprop_params_
 {
   size_t        id;
   nnetwork    netw;
-  double_    **inp;
-  double_   **outp;
+  nnmtx        inp;
+  nnmtx       outp;
+  nndata      data;
+  nnstream  stream;
   nnparams nparams;
+  nnparams fparams;
+  nnmtx_      tinp;
+  nnmtx_     toutp;
+  nnmtx_      vinp;
+  nnmtx_     voutp;
+  nncsr        csr;
+  nnqmtx         q;
+  uint32_t *labels;
 
 } bprop_params_;
 
-static bprop_params_ *alloc_bparams_ (const size_t i)
+static void checkdata_ (const size_t i, const size_t ninps, const size_t noutps)
+{
+  if (ninps != NINPUNITS[i] || noutps != NOUTPUNITS[i])
+    {
+      fprintf (stderr, "main(): %s has %ld inputs and %ld outputs, "
+                       "network expects %ld and %ld\n", DATASETS[i], 
+               ninps, noutps, NINPUNITS[i], NOUTPUNITS[i]);
+      exit (1);
+    }
+}
+
+/**
+ *
+ * Map network data set file, so that inp/outp rows point into the mapping,
+ * or open it to be streamed chunk by chunk if STREAM_CHUNK is set
+ *
+ * Returns # of examples in the data set
+ *
+ **/
+static size_t getdata_ (bprop_params_ *bs, const size_t i)
+{
+  size_t nexamples, ninps, noutps;
+
+  bs->data   = NULL;
+  bs->stream = NULL;
+  bs->inp    = NULL;
+  bs->outp   = NULL;
+
+  if (STREAM_CHUNK[i] > 0)
+    {
+      bs->stream = data_stream_open (DATASETS[i], STREAM_CHUNK[i], 
+                                                  STREAM_DEPTH[i]);
+      if (bs->stream == NULL)
+        exit (1);
+      data_stream_shape (bs->stream, &nexamples, &ninps, &noutps);
+    }
+  else
+    {
+      const nnshared_ key = { DATASETS[i], 0, 0, 0, 0, NULL };
+      if ((bs->data = shared_get_ (i, &key)) == NULL)
+        {
+          if ((bs->data = data_load (DATASETS[i])) == NULL)
+            exit (1);
+          shared_put_ (&key, bs->data);
+        }
+      bs->inp  = &bs->data->inps;
+      bs->outp = &bs->data->outps;
+      nexamples = bs->inp->nrows;
+      ninps     = bs->inp->ncols;
+      noutps    = bs->outp->ncols;
+    }
+
+  checkdata_ (i, ninps, noutps);
+  return nexamples;
+}
+
+/**
+ *
+ * Hold out the last VALID_SPLIT of the examples for validation,
+ * both parts are views into the data set rows
+ *
+ * Returns # of examples left to train on
+ *
+ **/
+static size_t split_ (bprop_params_ *bs, const size_t i, const size_t nexamples)
+{
+  size_t nvalid = VALID_SPLITS[i] * nexamples;
+  if (bs->stream != NULL || nvalid == 0 || nvalid >= nexamples)
+    return nexamples;
+
+  size_t ntrain = nexamples - nvalid;
+  bs->tinp  = (nnmtx_) { bs->inp->data,  ntrain, bs->inp->ncols,  bs->inp->ld };
+  bs->toutp = (nnmtx_) { bs->outp->data, ntrain, bs->outp->ncols, bs->outp->ld };
+  bs->vinp  = (nnmtx_) { MTX_ROW (bs->inp, ntrain), nvalid, 
+                         bs->inp->ncols, bs->inp->ld };
+  bs->voutp = (nnmtx_) { MTX_ROW (bs->outp, ntrain), nvalid, 
+                         bs->outp->ncols, bs->outp->ld };
+  bs->inp   = &bs->tinp;
+  bs->outp  = &bs->toutp;
+  printf ("[%ld]: Holding out %ld examples for validation ...\n", i, nvalid);
+  return ntrain;
+}
+
+/* Parameters of training for niters iterations on ntrain examples */
+static nnparams 
+alloc_nparams_ (bprop_params_ *bs, const size_t ntrain, 
+                const size_t nexamples, const size_t niters, FILE *tel)
+{
+  const size_t i = bs->id;
+  nnparams ps = nn_alloc_nparams (
+    ntrain, niters, LEARN_PARAMS[i], REGUR_PARAMS[i], DIST_FUNCS[i]);
+  nn_set_nbatch     (ps, NBATCH[i]);
+  nn_set_minibatch  (ps, MINIBATCH[i]);
+  nn_set_cost_every (ps, COST_EVERY[i]);
+  nn_set_seed       (ps, SEEDS[i]);
+  nn_set_optimizer  (ps, OPTIMIZERS[i], OPT_BETA1, OPT_BETA2);
+  nn_set_lr_schedule (ps, LR_SCHEDULES[i], LR_WARMUP, LR_PERIOD, LR_GAMMA);
+  if (bs->labels != NULL)
+    nn_set_labels (ps, bs->labels, bs->labels + ntrain);
+  if (ntrain < nexamples)
+    {
+      nn_set_validation (ps, &bs->vinp, &bs->voutp, VALID_EVERY);
+      nn_set_early_stop (ps, PATIENCES[i], VALID_MIN_DELTA, VALID_TARGET);
+    }
+  if (tel != NULL)
+    nn_set_report   (ps, nn_report_jsonl, tel);
+  return ps;
+}
+
+static bprop_params_ *alloc_bparams_ (const size_t i, FILE *tel)
 {
   printf ("[%ld]: Allocating all resource for the job ...\n", i);
-  bprop_params_ *bs = malloc (sizeof *bs);
+  bprop_params_ *bs;
+  if ((bs = malloc (sizeof *bs)) == NULL)
+    main_exit_();
   bs->id   = i;
   bs->netw = nn_alloc (i, NINPUNITS[i], NOUTPUNITS[i], 
                           NHIDLAYERS[i], NHIDUNITS[i]);
-  bs->inp  = getinp_  (NEXAMPLES[i], NFEATURES[i], SETINP);
-  bs->outp = getoutp_ (NEXAMPLES[i], NLABELS[i],   SETOUTP);
-  bs->nparams = nn_alloc_nparams (
-    NEXAMPLES[i], NITERS[i], LEARN_PARAMS[i], REGUR_PARAMS[i], DIST_FUNCS[i]);
+  nn_set_fast_sigmoid (bs->netw, FAST_SIGMOID[i]);
+  size_t nexamples = NEXAMPLES[i];
+  if (DATASETS[i] != NULL)
+    nexamples = getdata_ (bs, i);
+  else
+    {
+      bs->data   = getrnd_ (i);
+      bs->stream = NULL;
+      bs->inp    = &bs->data->inps;
+      bs->outp   = &bs->data->outps;
+    }
+  size_t ntrain = split_ (bs, i, nexamples);
+  bs->csr = NULL;
+  if (SPARSE[i] && bs->stream == NULL)
+    {
+      /* Training rows only, held out ones are validated dense */
+      if ((bs->csr = csr_from_mtx (bs->inp)) == NULL)
+        main_exit_();
+      printf ("[%ld]: Compressed inputs, %.1f%% nonzero ...\n", i, 
+              100.0 * bs->csr->rowptr[ntrain] / (ntrain * bs->csr->ncols));
+    }
+  bs->q = NULL;
+  if (QUANT_BITS[i] && bs->csr == NULL && bs->stream == NULL)
+    {
+      /* Per input ranges of the training rows, see qmtx_from_mtx() */
+      if ((bs->q = qmtx_from_mtx (bs->inp, QUANT_BITS[i], 0)) == NULL)
+        exit (1);
+      printf ("[%ld]: Quantized inputs to %d bits ...\n", i, bs->q->bits);
+    }
+  bs->labels = NULL;
+  if (LABEL_INDEX[i] && bs->stream == NULL)
+    {
+      /* Held out rows too, they follow the training ones */
+      if ((bs->labels = labels_from_mtx (&bs->data->outps)) != NULL)
+        printf ("[%ld]: Encoded expected outputs as class indices ...\n", i);
+      else
+        printf ("[%ld]: Expected outputs are kept as rows ...\n", i);
+    }
+  bs->nparams = alloc_nparams_ (bs, ntrain, nexamples, NITERS[i], tel);
+  bs->fparams = PRUNE_SPARSITY[i] > 0.0
+              ? alloc_nparams_ (bs, ntrain, nexamples, PRUNE_ITERS, tel)
+              : NULL;
+  nn_weights_rnd    (bs->netw, bs->nparams);
   return bs;
 }
 
@@ -115,50 +339,123 @@ static void free_bparams_ (bprop_params_ *bs)
   printf ("[%ld]: Freeing all resources after the job done...\n", bs->id);
   nn_destroy         (bs->netw);
   nn_destroy_nparams (bs->nparams);
-  free_mtx (bs->inp,  NEXAMPLES[bs->id]);
-  free_mtx (bs->outp, NEXAMPLES[bs->id]);
+  nn_destroy_nparams (bs->fparams);
+  if (bs->stream != NULL)
+    data_stream_close (bs->stream);
+  free_csr  (bs->csr);
+  free_qmtx (bs->q);
+  free (bs->labels);
+  data_free (bs->data);
   free (bs);
 }
 
-static void backprop_ (void *bparams)
+/* Start training, it is done when the scheduler has no tasks left */
+static void backprop_ (nnsched sched, bprop_params_ *bs, nnparams ps)
 {
-  bprop_params_ *bs = (bprop_params_ *)bparams;
-  nn_backprop (bs->netw, bs->inp, bs->outp, bs->nparams);
+  if (bs->stream != NULL)
+    nn_backprop_stream_async (sched, bs->netw, 
+                              data_stream_source (bs->stream), ps);
+  else if (bs->csr != NULL)
+    nn_backprop_sparse_async (sched, bs->netw, bs->csr, bs->outp, ps);
+  else if (bs->q != NULL)
+    nn_backprop_quant_async (sched, bs->netw, bs->q, bs->outp, ps);
+  else
+    nn_backprop_async (sched, bs->netw, bs->inp, bs->outp, ps);
 }
 
-void train_networks_ (void)
+/* Prune s'th step of PRUNE_STEPS and fine-tune the kept weights */
+static void pruned_ (nnsched sched, bprop_params_ *bs, const size_t s)
 {
-  /* Train network 1 */
-  bprop_params_ *bs0 = alloc_bparams_ (0);
-
-  #if WITH_THPOOL
-    const threadpool thpool = thpool_init (NTHREADS);
-
-    /* Train networks 2, 3, ... */
-    bprop_params_ *bs[NNETWORKS];
-    bs[0] = bs0;
-
-    for (size_t i = 0; i < NNETWORKS; i++)
-      {
-        bs[i] = alloc_bparams_ (i);
-
-        /* Add new job to the thread pool */
-        thpool_add_work (thpool, &backprop_, (void *)bs[i]);
-
-        printf ("[%ld]: Added new job to threadpool ...\n", i);
-      }
+  double sparsity = PRUNE_SPARSITY[bs->id] * s / PRUNE_STEPS;
+  if (nn_prune (bs->netw, sparsity) != 0)
+    exit (1);
+  printf ("[%ld]: Pruned %.1f%% of weights, fine-tuning for %d iterations "
+          "...\n", bs->id, 100 * nn_sparsity (bs->netw), PRUNE_ITERS);
+  backprop_ (sched, bs, bs->fparams);
+}
 
-    /* Wait for thread pool to finish all jobs */
-    thpool_wait (thpool);
+/* Accuracy and size of the int8 inference model of the trained network */
+static void quantized_ (bprop_params_ *bs)
+{
+  nnmtx_ calib = { bs->inp->data, bs->inp->nrows, bs->inp->ncols, 
+                   bs->inp->ld };
+  calib.nrows  = calib.nrows < QUANT_CALIB ? calib.nrows : QUANT_CALIB;
+  nnmtx  evals = bs->inp == &bs->tinp ? &bs->vinp : bs->inp;
+
+  nnqnet  qnet = nn_quantize (bs->netw, &calib);
+  nnwork  work = nn_alloc_work (bs->netw, NBATCH[bs->id]);
+  nnqerr_ err;
+  if (qnet != NULL && nn_qnet_error (bs->netw, qnet, work, evals, &err) == 0)
+    printf ("[%ld]: Int8 model of %ld KB (%.1fx smaller), the same class "
+            "for %.2f%% of %ld examples, max |dh| = %.2g\n", bs->id, 
+            err.bytes / 1024, (double) err.fbytes / err.bytes, 
+            100 * err.agree, evals->nrows, err.maxerr);
+  nn_destroy_work (work);
+  nn_destroy_qnet (qnet);
+}
 
-    thpool_destroy (thpool);
+static void trained_ (bprop_params_ *bs)
+{
+  /* Time training waited for chunks, to size STREAM_CHUNK/DEPTH */
+  if (bs->stream != NULL)
+    {
+      size_t nchunks;
+      double stall = data_stream_stall (bs->stream, &nchunks);
+      printf ("[%ld]: Waited %.3f secs for %ld data set chunks\n", 
+              bs->id, stall, nchunks);
+    }
+
+  if (INT8_INFER[bs->id] && bs->inp != NULL)
+    quantized_ (bs);
+
+  /* Keep trained weights, they are lost when the network is freed */
+  if (CHECKPOINTS[bs->id] != NULL
+   && nn_save (bs->netw, CHECKPOINTS[bs->id]) == 0)
+    printf ("[%ld]: Saved network to %s\n", bs->id, CHECKPOINTS[bs->id]);
+}
 
-    /* Free all resources */
-    for (size_t i = 0; i < NNETWORKS; i++)
+void train_networks_ (void)
+{
+  /* Networks share scheduler threads, idle threads steal shards */
+  nnsched sched = sched_alloc (NTHREADS);
+  bprop_params_ *bs[NNETWORKS];
+
+  /* Records of all networks go to one file, a line at a time */
+  FILE *tel = NULL;
+  const char *tel_path = TELEMETRY;
+  if (tel_path != NULL && (tel = fopen (tel_path, "w")) == NULL)
+    {
+      fprintf (stderr, "main(): could not open %s\n", tel_path);
+      exit (1);
+    }
+
+  for (size_t i = 0; i < NNETWORKS; i++)
+    {
+      bs[i] = alloc_bparams_ (i, tel);
+      backprop_ (sched, bs[i], bs[i]->nparams);
+    }
+
+  /* Wait for all networks to be trained */
+  sched_wait (sched);
+
+  /* Pruned networks are fine-tuned together, a step at a time */
+  for (size_t s = 1; s <= PRUNE_STEPS; s++)
+    {
+      for (size_t i = 0; i < NNETWORKS; i++)
+        if (bs[i]->fparams != NULL)
+          pruned_ (sched, bs[i], s);
+      sched_wait (sched);
+    }
+  sched_destroy (sched);
+
+  /* Free all resources */
+  for (size_t i = 0; i < NNETWORKS; i++)
+    {
+      trained_ (bs[i]);
       free_bparams_ (bs[i]);
+    }
 
-  #else
-    nn_backprop (bs0->netw, bs0->inp, bs0->outp, bs0->nparams);
-    free_bparams_ (bs0);
-  #endif
+  if (tel != NULL)
+    fclose (tel);
+  free_shared_ ();
 }
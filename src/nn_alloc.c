@@ -1,12 +1,57 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "nn_impl.h"
+#include "nn_alloc.h"
 
-void free_mtx (double_ **mtx, const size_t n)
+#define MTX_ALIGN_N     (MTX_ALIGN / sizeof (double_))
+
+size_t mtx_ld (const size_t m)
+{
+  return (m + MTX_ALIGN_N - 1) / MTX_ALIGN_N * MTX_ALIGN_N;
+}
+
+static const char *ALLOC_SLAB_ERR_MSG[] =
+  {
+    "alloc_slab(): could not allocate space for slab"
+  };
+double_ *alloc_slab (const size_t n, const int init)
+{
+  void *slab;
+  size_t size = mtx_ld (n ? n : 1) * sizeof (double_);
+
+  if (posix_memalign (&slab, MTX_ALIGN, size) != 0)
+    {
+      fprintf (stderr, "%s (n=%ld)\n", ALLOC_SLAB_ERR_MSG[0], n);
+      return NULL;
+    }
+
+  if (init)
+    memset (slab, 0, size);
+
+  return slab;
+}
+
+void free_slab (double_ *slab)
+{
+  free (slab);
+}
+
+double_ *mtx_view (nnmtx_ *mtx, double_ *data, const size_t n, const size_t m)
+{
+  mtx->data  = data;
+  mtx->nrows = n;
+  mtx->ncols = m;
+  mtx->ld    = mtx_ld (m);
+  return data + n * mtx->ld;
+}
+
+void free_mtx (nnmtx mtx)
 {
-  for (size_t i = 0; i < n; i++)
-    free (mtx[i]);
+  if (mtx == NULL)
+    return;
+  free_slab (mtx->data);
   free (mtx);
 }
 
@@ -14,24 +59,259 @@ static const char *ALLOC_MTX_ERR_MSG[] =
   {
     "alloc_mtx(): could not allocate space for matrix"
   };
-double_ **alloc_mtx (const size_t n, const size_t m, const int init)
+nnmtx alloc_mtx (const size_t n, const size_t m, const int init)
 {
-  double_ **mtx;
+  nnmtx mtx;
 
-  if ((mtx = malloc (n * sizeof *mtx)) == NULL)
+  if ((mtx = malloc (sizeof *mtx)) == NULL)
     {
       fprintf (stderr, "%s (n=%ld)\n", ALLOC_MTX_ERR_MSG[0], n);
       return mtx;
     }
 
-  for (size_t i = 0; i < n; i++)
-    if ((mtx[i] = init ? calloc (m,  sizeof *mtx[i]) 
-                       : malloc (m * sizeof *mtx[i])) == NULL)
-      {
-        fprintf (stderr, "%s (n=%ld, m=%ld)\n", ALLOC_MTX_ERR_MSG[0], n, m);
-        free_mtx (mtx, i);
-        return NULL;
-      }
+  double_ *data;
+  if ((data = alloc_slab (n * mtx_ld (m), init)) == NULL)
+    {
+      fprintf (stderr, "%s (n=%ld, m=%ld)\n", ALLOC_MTX_ERR_MSG[0], n, m);
+      free (mtx);
+      return NULL;
+    }
+
+  mtx_view (mtx, data, n, m);
+
+  /* Padding at the end of each row is always zeroed, so it is safe to read */
+  if (! init && mtx->ld > m)
+    for (size_t i = 0; i < n; i++)
+      memset (MTX_ROW (mtx, i) + m, 0, (mtx->ld - m) * sizeof *data);
 
   return mtx;
 }
+
+static const char *ALLOC_CSR_ERR_MSG[] =
+  {
+    "alloc_csr(): could not allocate space for sparse matrix"
+  };
+nncsr alloc_csr (const size_t n, const size_t m, const size_t nnz)
+{
+  nncsr csr;
+
+  if ((csr = malloc (sizeof *csr)) == NULL)
+    {
+      fprintf (stderr, "%s (n=%ld)\n", ALLOC_CSR_ERR_MSG[0], n);
+      return csr;
+    }
+
+  csr->vals   = malloc ((nnz ? nnz : 1) * sizeof *csr->vals);
+  csr->cols   = malloc ((nnz ? nnz : 1) * sizeof *csr->cols);
+  csr->rowptr = calloc (n + 1, sizeof *csr->rowptr);
+  if (csr->vals == NULL || csr->cols == NULL || csr->rowptr == NULL)
+    {
+      fprintf (stderr, "%s (n=%ld, nnz=%ld)\n", ALLOC_CSR_ERR_MSG[0], n, nnz);
+      free_csr (csr);
+      return NULL;
+    }
+
+  csr->nrows = n;
+  csr->ncols = m;
+  return csr;
+}
+
+void free_csr (nncsr csr)
+{
+  if (csr == NULL)
+    return;
+  free (csr->vals);
+  free (csr->cols);
+  free (csr->rowptr);
+  free (csr);
+}
+
+nncsr csr_from_mtx (nnmtx mtx)
+{
+  /* Count nonzeros first, so that the arrays are allocated once */
+  size_t nnz = 0;
+  for (size_t i = 0; i < mtx->nrows; i++)
+    for (size_t j = 0; j < mtx->ncols; j++)
+      nnz += MTX_ROW (mtx, i)[j] != 0.0;
+
+  nncsr csr;
+  if ((csr = alloc_csr (mtx->nrows, mtx->ncols, nnz)) == NULL)
+    return NULL;
+
+  size_t k = 0;
+  for (size_t i = 0; i < mtx->nrows; i++)
+    {
+      const double_ *row = MTX_ROW (mtx, i);
+      for (size_t j = 0; j < mtx->ncols; j++)
+        if (row[j] != 0.0)
+          {
+            csr->vals[k] = row[j];
+            csr->cols[k] = j;
+            k++;
+          }
+      csr->rowptr[i + 1] = k;
+    }
+  return csr;
+}
+
+uint32_t *labels_from_mtx (nnmtx mtx)
+{
+  uint32_t *labels;
+  if ((labels = malloc ((mtx->nrows ? mtx->nrows : 1) * sizeof *labels)) 
+      == NULL)
+    {
+      fprintf (stderr, "labels_from_mtx(): could not allocate space "
+                       "for labels (n=%ld)\n", mtx->nrows);
+      return NULL;
+    }
+
+  for (size_t i = 0; i < mtx->nrows; i++)
+    {
+      const double_ *row = MTX_ROW (mtx, i);
+      size_t nones = 0, nzeros = 0;
+      for (size_t j = 0; j < mtx->ncols; j++)
+        if (row[j] == 1.0)
+          {
+            labels[i] = j;
+            nones++;
+          }
+        else
+          nzeros += row[j] == 0.0;
+
+      if (nones != 1 || nzeros != mtx->ncols - 1)
+        {
+          fprintf (stderr, "labels_from_mtx(): row %ld is not one-hot\n", i);
+          free (labels);
+          return NULL;
+        }
+    }
+  return labels;
+}
+
+static const char *ALLOC_QMTX_ERR_MSG[] =
+  {
+    "alloc_qmtx(): could not allocate space for quantized matrix",
+    "alloc_qmtx(): elements should be of 8 or 16 bits"
+  };
+nnqmtx alloc_qmtx (const size_t n, const size_t m, const int bits)
+{
+  if (bits != 8 && bits != 16)
+    {
+      fprintf (stderr, "%s (bits=%d)\n", ALLOC_QMTX_ERR_MSG[1], bits);
+      return NULL;
+    }
+
+  nnqmtx qmtx;
+  if ((qmtx = malloc (sizeof *qmtx)) == NULL)
+    {
+      fprintf (stderr, "%s (n=%ld)\n", ALLOC_QMTX_ERR_MSG[0], n);
+      return qmtx;
+    }
+
+  /* Rows start at MTX_ALIGN boundary, as rows of nnmtx */
+  size_t esize = bits / 8, align_n = MTX_ALIGN / esize;
+  qmtx->nrows  = n;
+  qmtx->ncols  = m;
+  qmtx->ld     = (m + align_n - 1) / align_n * align_n;
+  qmtx->bits   = bits;
+  qmtx->scale  = alloc_slab (m, 0);
+  qmtx->offset = alloc_slab (m, 0);
+  if (posix_memalign (&qmtx->data, MTX_ALIGN, 
+                      (n ? n : 1) * (qmtx->ld ? qmtx->ld : align_n) * esize) 
+      != 0)
+    qmtx->data = NULL;
+
+  if (qmtx->data == NULL || qmtx->scale == NULL || qmtx->offset == NULL)
+    {
+      fprintf (stderr, "%s (n=%ld, m=%ld)\n", ALLOC_QMTX_ERR_MSG[0], n, m);
+      free_qmtx (qmtx);
+      return NULL;
+    }
+  return qmtx;
+}
+
+void free_qmtx (nnqmtx qmtx)
+{
+  if (qmtx == NULL)
+    return;
+  free (qmtx->data);
+  free_slab (qmtx->scale);
+  free_slab (qmtx->offset);
+  free (qmtx);
+}
+
+nnqmtx qmtx_from_mtx (nnmtx mtx, const int bits, const int global)
+{
+  nnqmtx qmtx;
+  if ((qmtx = alloc_qmtx (mtx->nrows, mtx->ncols, bits)) == NULL)
+    return NULL;
+
+  /* Range of every column first */
+  double_ *lo = qmtx->offset, *hi = qmtx->scale;
+  for (size_t j = 0; j < mtx->ncols; j++)
+    {
+      lo[j] = mtx->nrows > 0 ? MTX_ROW (mtx, 0)[j] : 0.0;
+      hi[j] = lo[j];
+    }
+  for (size_t i = 0; i < mtx->nrows; i++)
+    {
+      const double_ *row = MTX_ROW (mtx, i);
+      for (size_t j = 0; j < mtx->ncols; j++)
+        {
+          lo[j] = row[j] < lo[j] ? row[j] : lo[j];
+          hi[j] = row[j] > hi[j] ? row[j] : hi[j];
+        }
+    }
+
+  /* Range of the whole matrix is kept apart from the column ranges,
+     which are turned into offsets and scales in place below */
+  double_ glo = mtx->ncols > 0 ? lo[0] : 0.0,
+          ghi = mtx->ncols > 0 ? hi[0] : 0.0;
+  for (size_t j = 1; global && j < mtx->ncols; j++)
+    {
+      glo = lo[j] < glo ? lo[j] : glo;
+      ghi = hi[j] > ghi ? hi[j] : ghi;
+    }
+
+  const double qmax = (1 << bits) - 1;
+  for (size_t j = 0; j < mtx->ncols; j++)
+    {
+      double_ l = global ? glo : lo[j], h = global ? ghi : hi[j];
+      lo[j] = l;
+      hi[j] = (h - l) / qmax;
+    }
+
+  for (size_t i = 0; i < mtx->nrows; i++)
+    {
+      const double_ *row = MTX_ROW (mtx, i);
+      for (size_t j = 0; j < mtx->ncols; j++)
+        {
+          /* Constant columns are all q = 0 */
+          double q = qmtx->scale[j] > 0.0 
+                   ? (row[j] - qmtx->offset[j]) / qmtx->scale[j] + 0.5 : 0.0;
+          q = q < qmax ? q : qmax;
+          if (bits == 8)
+            ((uint8_t *)  qmtx->data)[i * qmtx->ld + j] = q;
+          else
+            ((uint16_t *) qmtx->data)[i * qmtx->ld + j] = q;
+        }
+    }
+  return qmtx;
+}
+
+void qmtx_row (const nnqmtx_ *qmtx, const size_t i, double_ *out)
+{
+  const double_ *scale = qmtx->scale, *offset = qmtx->offset;
+  if (qmtx->bits == 8)
+    {
+      const uint8_t *q = (const uint8_t *) qmtx->data + i * qmtx->ld;
+      for (size_t j = 0; j < qmtx->ncols; j++)
+        out[j] = offset[j] + scale[j] * q[j];
+    }
+  else
+    {
+      const uint16_t *q = (const uint16_t *) qmtx->data + i * qmtx->ld;
+      for (size_t j = 0; j < qmtx->ncols; j++)
+        out[j] = offset[j] + scale[j] * q[j];
+    }
+}
@@ -1,18 +1,113 @@
 #ifndef _NN_ALLOC_
 #define _NN_ALLOC_
 
+#define MTX_ALIGN       64    /* alignment of slabs and matrix rows, bytes */
+
+/**
+ *
+ * @brief Leading dimension for matrix with m columns,
+ *        m rounded up so that each row starts at MTX_ALIGN boundary
+ *
+ **/
+size_t mtx_ld (const size_t m);
+
+/**
+ *
+ * @brief Allocate/free MTX_ALIGN-aligned slab of n elements
+ *
+ * @param n       # of elements
+ * @param init    1 to initialize slab with 0.0 values
+ *
+ * @return pointer to the slab[0], NULL on failure
+ *
+ **/
+double_ *alloc_slab (const size_t n, const int init);
+void      free_slab (double_ *slab);
+
 /**
  *
- * @brief Allocate/free space for/from matrix of n rows and m columns
+ * @brief Describe n x m matrix that lives in an already allocated slab
+ *
+ * @param mtx     matrix descriptor to fill
+ * @param data    slab region of at least n * mtx_ld (m) elements
+ * @param n       # of rows
+ * @param m       # of columns
+ *
+ * @return pointer to the first element after the matrix
+ *
+ **/
+double_ *mtx_view (nnmtx_ *mtx, double_ *data, const size_t n, const size_t m);
+
+/**
+ *
+ * @brief Allocate/free space for/from matrix of n rows and m columns,
+ *        all rows are stored in one contiguous slab
  *
  * @param n       # of rows
  * @param m       # of columns
  * @param init    1 to initialize matrix with 0.0 values
  *
- * @return pointer to the mtx[0][0]
+ * @return matrix, NULL on failure
  *
  **/
-double_ **alloc_mtx (const size_t n, const size_t m, const int init);
-void       free_mtx (double_ **mtx, const size_t n);
+nnmtx alloc_mtx (const size_t n, const size_t m, const int init);
+void   free_mtx (nnmtx mtx);
+
+/**
+ *
+ * @brief Allocate/free sparse matrix of n rows and m columns
+ *        with space for nnz nonzero elements, rowptr is zeroed
+ *
+ * @return matrix, NULL on failure
+ *
+ **/
+nncsr alloc_csr (const size_t n, const size_t m, const size_t nnz);
+void   free_csr (nncsr csr);
+
+/**
+ *
+ * @brief Compress dense matrix, its zero elements are dropped
+ *
+ * @return sparse matrix with the same elements, NULL on failure
+ *
+ **/
+nncsr csr_from_mtx (nnmtx mtx);
+
+/**
+ *
+ * @brief Class index of every row of one-hot encoded matrix,
+ *        the column of its only 1.0 element, free it with free ()
+ *
+ * @return mtx->nrows class indices, NULL on failure or if a row 
+ *         is not one-hot
+ *
+ **/
+uint32_t *labels_from_mtx (nnmtx mtx);
+
+/**
+ *
+ * @brief Allocate/free quantized matrix of n rows and m columns
+ *        of bits-bit elements (see nnqmtx), scale and offset 
+ *        are left to be set
+ *
+ * @return matrix, NULL on failure or if bits is not 8 or 16
+ *
+ **/
+nnqmtx alloc_qmtx (const size_t n, const size_t m, const int bits);
+void    free_qmtx (nnqmtx qmtx);
+
+/**
+ *
+ * @brief Quantize dense matrix: [min,max] of every column, or of the 
+ *        whole matrix if global is 1, is split into 2^bits - 1 equal 
+ *        steps, every element is rounded to the nearest one
+ *
+ * @return quantized matrix, NULL on failure
+ *
+ **/
+nnqmtx qmtx_from_mtx (nnmtx mtx, const int bits, const int global);
+
+/* Widen row i of quantized matrix into qmtx->ncols double_ values */
+void qmtx_row (const nnqmtx_ *qmtx, const size_t i, double_ *out);
 
 #endif
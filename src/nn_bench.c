@@ -0,0 +1,702 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+/**
+ *
+ * Training kernels are static, so they are benchmarked right from the
+ * engine source, that is compiled into this file instead of being linked
+ *
+ **/
+#include "nn_impl.c"
+
+/**
+ *
+ * Usage: nn_bench [-j results.json]
+ *
+ * Benchmark of the training kernels
+ *
+ *  - ns/call, GFLOP/s, GB/s and examples/s of every kernel of an iteration
+ *    and of a whole iteration, for every layer shape and batch size below,
+ *    with batch size > 1 the batch_*_ kernel of the same pass is timed;
+ *  - the same results are written to results.json with -j, 
+ *    so that they could be diffed between builds
+ *
+ * Benchmark of the approximate sigmoid against the exact one
+ *
+ *  - throughput of both kernels for every SIMD variant of the CPU;
+ *  - max absolute error of the approximation over [-SIGM_RANGE,SIGM_RANGE];
+ *  - final cost of two networks trained from the same initial weights,
+ *    one with exact and one with approximate sigmoid
+ *
+ * Benchmark of int8 inference against double_ one (see nn_quantize())
+ *
+ *  - examples/s of both for every layer shape and SIMD variant of the CPU,
+ *    QUANT_NBATCH examples are propagated together;
+ *  - size of both models, max |dh| and the fraction of examples with
+ *    the same most likely output
+ *
+ * Benchmark of pruned networks against the dense one (see nn_prune())
+ *
+ *  - examples/s of inference and of training for every layer shape 
+ *    and every sparsity of PRUNE_SPARSITIES, the network is pruned 
+ *    further at every sparsity, the weights are not fine-tuned
+ *
+ **/
+
+#define SIGM_N                1024        /* vector length */
+#define SIGM_REPS             80000       /* # of kernel calls to time */
+#define SIGM_RANGE            40.0        /* inputs are in [-range,range] */
+#define SIGM_ERR_N            (1 << 22)   /* # of points to measure error */
+
+#define TRAIN_NEXAMPLES       2000
+#define TRAIN_NFEATURES       20*20
+#define TRAIN_NLABELS         10
+#define TRAIN_NHIDUNITS       25
+#define TRAIN_NITERS          100
+#define TRAIN_NBATCH          64
+#define TRAIN_LEARN_PARAM     0.1
+#define TRAIN_REGUR_PARAM     1
+
+#define QUANT_NEXAMPLES       4096
+#define QUANT_NBATCH          64
+
+#define PRUNE_NITERS          2           /* # of timed training iterations */
+#define PRUNE_LEARN_PARAM     0.1
+
+/* Fractions of weight blocks to prune, 0 - dense */
+static const double PRUNE_SPARSITIES[] = { 0.0, 0.5, 0.75, 0.9 };
+
+#define KERN_NRUNS            5           /* best of n timed runs */
+#define KERN_MIN_TIME         0.05        /* secs of one timed run at least */
+#define KERN_NEXAMPLES        512         /* # of examples of an iteration */
+#define KERN_NKERNELS         8           /* # of kernels of kern_bench_ () */
+
+/* Layer shapes, # of input, hidden and output units of the network */
+static const size_t KERN_SHAPES[][3] = 
+  { 
+    {  400,   75, 10 }, 
+    {  784,  256, 10 }, 
+    { 1024, 1024, 10 } 
+  };
+
+/* Batch sizes, 1 - examples are propagated one by one */
+static const size_t KERN_NBATCH[] = { 1, 16, 64, 256 };
+
+static void bench_exit_ (void)
+{
+  fprintf (stderr, "nn_bench(): %s\n", "Could not allocate memory ...");
+  exit (1);
+}
+
+static double now_ (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Equally spaced points of [-SIGM_RANGE,SIGM_RANGE] */
+static void sigm_inputs_ (double_ *x, const size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    x[i] = -SIGM_RANGE + 2 * SIGM_RANGE * i / (n - 1);
+}
+
+/* Nanoseconds per element of one sigmoid kernel */
+static double
+sigm_time_ (void (*sigmoid)(double_ *, const size_t),
+            const double_ *x, double_ *y)
+{
+  /* Kernel works in-place, so inputs are restored before every call,
+     the copy is timed separately and subtracted */
+  double t0 = now_ ();
+  for (size_t r = 0; r < SIGM_REPS; r++)
+    memcpy (y, x, SIGM_N * sizeof *y);
+  double tcopy = now_ () - t0;
+
+  t0 = now_ ();
+  for (size_t r = 0; r < SIGM_REPS; r++)
+    {
+      memcpy (y, x, SIGM_N * sizeof *y);
+      sigmoid (y, SIGM_N);
+    }
+  const double t = now_ () - t0 - tcopy;
+
+  return 1e9 * t / ((double) SIGM_REPS * SIGM_N);
+}
+
+/* Max |sigmoid_fast (x) - exact sigmoid (x)| of one variant */
+static double sigm_maxerr_ (const nnsimd_ *v, double_ *x, double_ *y)
+{
+  sigm_inputs_ (x, SIGM_ERR_N);
+  memcpy (y, x, SIGM_ERR_N * sizeof *y);
+  v->sigmoid_fast (y, SIGM_ERR_N);
+
+  double err = 0;
+  for (size_t i = 0; i < SIGM_ERR_N; i++)
+    {
+      const double e = fabs (y[i] - 1 / (1 + exp (-(double) x[i])));
+      if (e > err)
+        err = e;
+    }
+  return err;
+}
+
+static void bench_sigmoid_ (void)
+{
+  size_t nvars;
+  const nnsimd_ *const *vars = simd_variants (&nvars);
+
+  double_ *x = alloc_slab (SIGM_ERR_N, 0),
+          *y = alloc_slab (SIGM_ERR_N, 0);
+  if (x == NULL || y == NULL)
+    bench_exit_();
+
+  printf ("%-10s %12s %12s %8s %12s\n",
+          "simd", "exact ns/el", "fast ns/el", "speedup", "max error");
+
+  for (size_t v = 0; v < nvars; v++)
+    {
+      sigm_inputs_ (x, SIGM_N);
+      const double texact = sigm_time_ (vars[v]->sigmoid,      x, y),
+                   tfast  = sigm_time_ (vars[v]->sigmoid_fast, x, y),
+                   err    = sigm_maxerr_ (vars[v], x, y);
+
+      printf ("%-10s %12.3f %12.3f %7.2fx %12.3g%s\n", vars[v]->name,
+              texact, tfast, texact / tfast, err,
+              err < SIGMOID_FAST_MAXERR ? "" : " (above bound)");
+    }
+
+  free_slab (x);
+  free_slab (y);
+}
+
+/* Un([-0.5,0.5]) weights for every layer of the benchmark network */
+static void train_weights_ (nnmtx *ws, const size_t *nunits)
+{
+  for (size_t i = 0; i < 2; i++)
+    {
+      if ((ws[i] = alloc_mtx (nunits[i+1], nunits[i] + 1, 0)) == NULL)
+        bench_exit_();
+
+      rnd_mtx_gen (ws[i]);
+      for (size_t r = 0; r < ws[i]->nrows; r++)
+        for (size_t c = 0; c < ws[i]->ncols; c++)
+          MTX_ROW (ws[i], r)[c] -= 0.5;
+    }
+}
+
+static void bench_train_ (void)
+{
+  const size_t nhidunits[1] = { TRAIN_NHIDUNITS };
+  const size_t    nunits[3] =
+    { TRAIN_NFEATURES, TRAIN_NHIDUNITS, TRAIN_NLABELS };
+
+  nnmtx inps  = alloc_mtx (TRAIN_NEXAMPLES, TRAIN_NFEATURES, 0),
+        outps = alloc_mtx (TRAIN_NEXAMPLES, TRAIN_NLABELS,   0);
+  if (inps == NULL || outps == NULL)
+    bench_exit_();
+
+  rnd_mtx_gen (inps);
+  rnd_mtx_gen (outps);
+
+  nnmtx ws[2];
+  train_weights_ (ws, nunits);
+
+  nnparams ps = nn_alloc_nparams (TRAIN_NEXAMPLES, TRAIN_NITERS,
+    TRAIN_LEARN_PARAM, TRAIN_REGUR_PARAM, sqdist);
+  nn_set_nbatch     (ps, TRAIN_NBATCH);
+  nn_set_cost_every (ps, 0);
+
+  printf ("\n%-8s %10s %14s %14s\n",
+          "sigmoid", "train s", "cost (own)", "cost (exact)");
+
+  for (int fast = 0; fast < 2; fast++)
+    {
+      nnetwork netw = nn_alloc (fast, TRAIN_NFEATURES, TRAIN_NLABELS,
+                                1, nhidunits);
+      if (nn_weights_init (netw, ws))
+        bench_exit_();
+
+      nn_set_fast_sigmoid (netw, fast);
+      const double t0 = now_ ();
+      nn_backprop (netw, inps, outps, ps);
+      const double t  = now_ () - t0;
+
+      /* Cost with the sigmoid the network was trained with
+         and with the exact one */
+      const double cown = nn_costfunc (netw, inps, outps, ps);
+      nn_set_fast_sigmoid (netw, 0);
+      const double cexact = nn_costfunc (netw, inps, outps, ps);
+
+      printf ("%-8s %10.3f %14.8f %14.8f\n",
+              fast ? "fast" : "exact", t, cown, cexact);
+      nn_destroy (netw);
+    }
+
+  nn_destroy_nparams (ps);
+  free_mtx (ws[0]);
+  free_mtx (ws[1]);
+  free_mtx (inps);
+  free_mtx (outps);
+}
+
+/* Examples/s of one predict function, best of KERN_NRUNS */
+static double 
+quant_rate_ (nnetwork netw, nnqnet qnet, nnwork work, nnmtx inps, nnmtx outps)
+{
+  double best = 0.0;
+  for (size_t r = 0; r < KERN_NRUNS; r++)
+    {
+      const double t0 = now_ ();
+      if (qnet != NULL)
+        nn_qpredict_batch (qnet, work, inps, outps);
+      else
+        nn_predict_batch (netw, work, inps, outps);
+      const double rate = inps->nrows / (now_ () - t0);
+      best = rate > best ? rate : best;
+    }
+  return best;
+}
+
+static void bench_quant_ (void)
+{
+  const size_t nshapes = sizeof KERN_SHAPES / sizeof KERN_SHAPES[0];
+  size_t nvars;
+  const nnsimd_ *const *vars = simd_variants (&nvars);
+  const nnsimd_ *simd = SIMD;
+
+  printf ("\n%-10s %14s %12s %12s %8s %9s %9s %7s\n", "simd", "shape", 
+          "double ex/s", "int8 ex/s", "speedup", "size", "max |dh|", "agree");
+
+  for (size_t s = 0; s < nshapes; s++)
+    {
+      const size_t *shape = KERN_SHAPES[s];
+      nnmtx inps  = alloc_mtx (QUANT_NEXAMPLES, shape[0], 0),
+            outps = alloc_mtx (QUANT_NEXAMPLES, shape[2], 0);
+      if (inps == NULL || outps == NULL)
+        bench_exit_();
+      rnd_mtx_gen (inps);
+
+      nnmtx ws[2];
+      train_weights_ (ws, shape);
+      nnetwork netw = nn_alloc (0, shape[0], shape[2], 1, &shape[1]);
+      if (nn_weights_init (netw, ws))
+        bench_exit_();
+
+      nnqnet  qnet = nn_quantize (netw, inps);
+      nnwork  work = nn_alloc_work (netw, QUANT_NBATCH);
+      nnqerr_ err;
+      nn_qnet_error (netw, qnet, work, inps, &err);
+
+      for (size_t v = 0; v < nvars; v++)
+        {
+          SIMD = vars[v];
+          const double rd = quant_rate_ (netw, NULL, work, inps, outps),
+                       rq = quant_rate_ (netw, qnet, work, inps, outps);
+          printf ("%-10s %4ld/%4ld/%4ld %12.0f %12.0f %7.2fx %8.1fx "
+                  "%9.2g %7.4f\n", vars[v]->name, shape[0], shape[1], 
+                  shape[2], rd, rq, rq / rd, (double) err.fbytes / err.bytes,
+                  err.maxerr, err.agree);
+        }
+      SIMD = simd;
+
+      nn_destroy_work (work);
+      nn_destroy_qnet (qnet);
+      nn_destroy (netw);
+      free_mtx (ws[0]);
+      free_mtx (ws[1]);
+      free_mtx (inps);
+      free_mtx (outps);
+    }
+}
+
+/* Examples/s of training for PRUNE_NITERS iterations */
+static double prune_train_rate_ (nnetwork netw, nnmtx inps, nnmtx outps)
+{
+  nnparams ps = nn_alloc_nparams (inps->nrows, PRUNE_NITERS,
+    PRUNE_LEARN_PARAM, 0.0, sqdist);
+  nn_set_nbatch     (ps, QUANT_NBATCH);
+  nn_set_cost_every (ps, 0);
+
+  double best = 0.0;
+  for (size_t r = 0; r < KERN_NRUNS; r++)
+    {
+      const double t0 = now_ ();
+      nn_backprop (netw, inps, outps, ps);
+      const double rate = PRUNE_NITERS * inps->nrows / (now_ () - t0);
+      best = rate > best ? rate : best;
+    }
+  nn_destroy_nparams (ps);
+  return best;
+}
+
+static void bench_prune_ (void)
+{
+  const size_t nshapes = sizeof KERN_SHAPES / sizeof KERN_SHAPES[0];
+  const size_t nsparse = sizeof PRUNE_SPARSITIES / sizeof *PRUNE_SPARSITIES;
+
+  printf ("\n%-10s %14s %9s %12s %8s %12s %8s\n", "simd", "shape", 
+          "sparsity", "infer ex/s", "speedup", "train ex/s", "speedup");
+
+  for (size_t s = 0; s < nshapes; s++)
+    {
+      const size_t *shape = KERN_SHAPES[s];
+      nnmtx inps  = alloc_mtx (QUANT_NEXAMPLES, shape[0], 0),
+            outps = alloc_mtx (QUANT_NEXAMPLES, shape[2], 0);
+      if (inps == NULL || outps == NULL)
+        bench_exit_();
+      rnd_mtx_gen (inps);
+      rnd_mtx_gen (outps);
+
+      nnmtx ws[2];
+      train_weights_ (ws, shape);
+      nnetwork netw = nn_alloc (0, shape[0], shape[2], 1, &shape[1]);
+      if (nn_weights_init (netw, ws))
+        bench_exit_();
+      nnwork work = nn_alloc_work (netw, QUANT_NBATCH);
+
+      double ri0 = 0.0, rt0 = 0.0;
+      for (size_t p = 0; p < nsparse; p++)
+        {
+          nn_prune (netw, PRUNE_SPARSITIES[p]);
+          const double ri = quant_rate_ (netw, NULL, work, inps, outps),
+                       rt = prune_train_rate_ (netw, inps, outps);
+          ri0 = p == 0 ? ri : ri0;
+          rt0 = p == 0 ? rt : rt0;
+          printf ("%-10s %4ld/%4ld/%4ld %9.3f %12.0f %7.2fx %12.0f %7.2fx\n",
+                  SIMD->name, shape[0], shape[1], shape[2], 
+                  nn_sparsity (netw), ri, ri / ri0, rt, rt / rt0);
+        }
+
+      nn_destroy_work (work);
+      nn_destroy (netw);
+      free_mtx (ws[0]);
+      free_mtx (ws[1]);
+      free_mtx (inps);
+      free_mtx (outps);
+    }
+}
+
+/* ========================== KERNEL SUITE ============================ */
+
+/**
+ *
+ * @struct nnkern
+ * @brief Network and buffers the kernels run on
+ *
+ * @var netw          network with one hidden layer of the benchmarked shape
+ * @var ps            training parameters of an iteration
+ * @var inps          KERN_NEXAMPLES inputs
+ * @var outps         KERN_NEXAMPLES expected outputs
+ * @var x             first nb rows of inps
+ * @var y             first nb rows of outps
+ * @var acts          nb x s_k+1 activations
+ * @var deltas        nb x s_k+1 delta values
+ * @var dweights      gradient
+ * @var optim         moments of momentum and Adam updates
+ * @var nb            batch size
+ *
+ **/
+typedef struct nnkern_
+{
+  nnetwork_   *netw;
+  nnparams_     *ps;
+  nnmtx        inps;
+  nnmtx       outps;
+  nnmtx_          x;
+  nnmtx_          y;
+  nnmtx_      *acts;
+  nnmtx_    *deltas;
+  nnmtx_  *dweights;
+  nnoptim_    optim;
+  size_t         nb;
+
+} nnkern_;
+
+/**
+ *
+ * @struct nnkres
+ * @brief Result of one kernel, flops and bytes are counted per call
+ *        (bytes - weights, activations and deltas read and written once)
+ *
+ **/
+typedef struct nnkres_
+{
+  const char *kernel;
+  const size_t *shape;
+  size_t     nbatch;
+  double         ns;
+  double      flops;
+  double      bytes;
+  double  nexamples;
+
+} nnkres_;
+
+typedef void (*kern_f_)(nnkern_ *k);
+
+static void kern_linear_ (nnkern_ *k)
+{
+  if (k->nb == 1)
+    linear_prop_ (k->netw->inp->next);
+  else
+    batch_feedforward_ (k->netw, k->netw->inp->next, &k->x, NULL, 
+                        &k->acts[0], k->nb);
+}
+
+static void kern_sigmoid_ (nnkern_ *k)
+{
+  sigmoid_map_ (k->netw, k->acts[0].data, k->nb * k->acts[0].ld);
+}
+
+static void kern_deltas_ (nnkern_ *k)
+{
+  if (k->nb == 1)
+    compute_deltas_ (k->netw, k->deltas);
+  else
+    batch_deltas_ (k->netw, &k->y, NULL, k->acts, k->deltas, k->nb);
+}
+
+static void kern_dweights_ (nnkern_ *k)
+{
+  if (k->nb == 1)
+    acc_dweights_ (k->netw, k->deltas, k->dweights);
+  else
+    batch_acc_dweights_ (k->netw, &k->x, NULL, k->acts, k->deltas, 
+                         k->dweights, k->nb);
+}
+
+static void kern_update_ (nnkern_ *k, const nnopt opt)
+{
+  nn_set_optimizer (k->ps, opt, 0.9, 0.999);
+  reset_weights_ (k->netw, k->dweights, &k->optim, k->ps, 0,
+                  KERN_NEXAMPLES);
+}
+
+static void kern_reset_ (nnkern_ *k)
+{
+  kern_update_ (k, NN_OPT_SGD);
+}
+
+static void kern_momentum_ (nnkern_ *k)
+{
+  kern_update_ (k, NN_OPT_MOMENTUM);
+}
+
+static void kern_adam_ (nnkern_ *k)
+{
+  kern_update_ (k, NN_OPT_ADAM);
+}
+
+/* The loop body of nn_backprop (), without cost */
+static void kern_iter_ (nnkern_ *k)
+{
+  if (k->nb == 1)
+    backprop_iter_ (k->netw, k->inps, k->outps, k->ps, k->deltas, 
+                    k->dweights, NULL);
+  else
+    backprop_batch_iter_ (k->netw, k->inps, k->outps, NULL, NULL, 0, 
+                          KERN_NEXAMPLES, k->nb, k->acts, k->deltas, 
+                          k->dweights, NULL);
+  kern_update_ (k, NN_OPT_SGD);
+}
+
+/* Best of KERN_NRUNS runs, each long enough for clock resolution, ns/call */
+static double kern_time_ (kern_f_ f, nnkern_ *k)
+{
+  size_t reps = 1;
+  double t;
+  for (;;)
+    {
+      double t0 = now_ ();
+      for (size_t r = 0; r < reps; r++)
+        f (k);
+      if ((t = now_ () - t0) >= KERN_MIN_TIME)
+        break;
+      reps *= 2;
+    }
+
+  for (size_t run = 1; run < KERN_NRUNS; run++)
+    {
+      double t0 = now_ ();
+      for (size_t r = 0; r < reps; r++)
+        f (k);
+      double tr = now_ () - t0;
+      if (tr < t)
+        t = tr;
+    }
+  return 1e9 * t / reps;
+}
+
+static void kern_alloc_ (nnkern_ *k, const size_t *shape, const size_t nb)
+{
+  const size_t nhidunits[1] = { shape[1] };
+  k->netw = nn_alloc (0, shape[0], shape[2], 1, nhidunits);
+  k->ps   = nn_alloc_nparams (KERN_NEXAMPLES, 1, TRAIN_LEARN_PARAM, 0, sqdist);
+  k->nb   = nb;
+
+  k->inps  = alloc_mtx (KERN_NEXAMPLES, shape[0], 0);
+  k->outps = alloc_mtx (KERN_NEXAMPLES, shape[2], 0);
+  if (k->inps == NULL || k->outps == NULL)
+    bench_exit_();
+  rnd_mtx_gen (k->inps);
+  rnd_mtx_gen (k->outps);
+
+  k->x = (nnmtx_) { k->inps->data,  nb, k->inps->ncols,  k->inps->ld  };
+  k->y = (nnmtx_) { k->outps->data, nb, k->outps->ncols, k->outps->ld };
+  k->acts     = alloc_units_mtx_ (k->netw, nb);
+  k->deltas   = alloc_units_mtx_ (k->netw, nb);
+  k->dweights = alloc_dweights_  (k->netw);
+
+  /* Adam state holds moments of momentum too */
+  nn_set_optimizer (k->ps, NN_OPT_ADAM, 0.9, 0.999);
+  k->optim = alloc_optim_ (k->netw, k->ps);
+
+  /* Activations of the first example or block, kernels start from them */
+  nn_example_prop_ (k->netw, MTX_ROW (k->inps, 0), MTX_ROW (k->outps, 0));
+  if (nb == 1)
+    compute_hypotheses_ (k->netw);
+  else
+    batch_hypotheses_ (k->netw, &k->x, NULL, k->acts, nb);
+}
+
+static void kern_free_ (nnkern_ *k)
+{
+  free_units_mtx_ (k->acts);
+  free_units_mtx_ (k->deltas);
+  free_dweights_  (k->dweights);
+  free_optim_ (&k->optim);
+  free_mtx (k->inps);
+  free_mtx (k->outps);
+  nn_destroy_nparams (k->ps);
+  nn_destroy (k->netw);
+}
+
+static void kern_print_ (FILE *f, const nnkres_ *r, const int json)
+{
+  const double s = r->ns * 1e-9;
+  if (! json)
+    {
+      printf ("%-15s %4ld-%4ld-%2ld %6ld %14.1f %9.2f %9.2f %14.0f\n",
+              r->kernel, r->shape[0], r->shape[1], r->shape[2], r->nbatch,
+              r->ns, r->flops / s * 1e-9, r->bytes / s * 1e-9, 
+              r->nexamples / s);
+      return;
+    }
+
+  fprintf (f, "    { \"kernel\": \"%s\", \"shape\": [%ld, %ld, %ld], "
+              "\"nbatch\": %ld, \"ns_per_call\": %.1f, \"gflops\": %.3f, "
+              "\"gbps\": %.3f, \"examples_per_s\": %.0f }",
+           r->kernel, r->shape[0], r->shape[1], r->shape[2], r->nbatch,
+           r->ns, r->flops / s * 1e-9, r->bytes / s * 1e-9, r->nexamples / s);
+}
+
+/* Results of all kernels for one shape and batch size */
+static size_t kern_bench_ (const size_t *shape, const size_t nb, nnkres_ *rs)
+{
+  nnkern_ k;
+  kern_alloc_ (&k, shape, nb);
+
+  const double in = shape[0], hid = shape[1], out = shape[2], 
+               fs = sizeof (double_),
+               nweights = hid * (in + 1) + out * (hid + 1);
+
+  /* Per example flops of the forward, deltas and dweights passes */
+  const double ffwd = 2 * (in * hid + hid * out),
+               fdel = 2 * hid * out + out + 3 * hid,
+               fdw  = 2 * nweights;
+
+  const struct { const char *name; kern_f_ f; double flops, bytes, nex; }
+    ks[] = 
+    {
+      { "linear_prop",    kern_linear_,   2 * nb * in * hid,
+        fs * (hid * (in + 1) + nb * (in + hid)),                 nb },
+      { "sigmoid_map",    kern_sigmoid_,  0,
+        fs * 2 * nb * mtx_ld (hid),                              nb },
+      { "compute_deltas", kern_deltas_,   nb * fdel,
+        fs * (out * (hid + 1) + nb * (2 * out + 3 * hid)),       nb },
+      { "acc_dweights",   kern_dweights_, nb * fdw,
+        fs * (2 * nweights + nb * (in + 2 * hid + out)),         nb },
+      { "reset_weights",  kern_reset_,    4 * nweights,
+        fs * 4 * nweights,                                       0  },
+      { "momentum_update", kern_momentum_, 6 * nweights,
+        fs * 6 * nweights,                                       0  },
+      { "adam_update",    kern_adam_,     12 * nweights,
+        fs * 8 * nweights,                                       0  },
+      { "iteration",      kern_iter_,     KERN_NEXAMPLES * (ffwd + fdel + fdw)
+                                        + 4 * nweights,
+        fs * (KERN_NEXAMPLES * (in + out) + 4 * nweights),       KERN_NEXAMPLES }
+    };
+
+  const size_t nks = sizeof ks / sizeof ks[0];
+  for (size_t i = 0; i < nks; i++)
+    rs[i] = (nnkres_) { ks[i].name, shape, nb, kern_time_ (ks[i].f, &k),
+                        ks[i].flops, ks[i].bytes, ks[i].nex };
+
+  kern_free_ (&k);
+  return nks;
+}
+
+static void bench_kernels_ (const char *json)
+{
+  const size_t nshapes = sizeof KERN_SHAPES / sizeof KERN_SHAPES[0],
+               nnbatch = sizeof KERN_NBATCH / sizeof KERN_NBATCH[0];
+
+  FILE *f = NULL;
+  if (json != NULL && (f = fopen (json, "w")) == NULL)
+    {
+      fprintf (stderr, "nn_bench(): could not open %s\n", json);
+      exit (1);
+    }
+  if (f != NULL)
+    fprintf (f, "{\n  \"simd\": \"%s\",\n  \"double_\": \"%s\",\n"
+                "  \"nexamples\": %d,\n  \"results\": [\n", SIMD->name, 
+             sizeof (double_) == sizeof (float) ? "float" : "double",
+             KERN_NEXAMPLES);
+
+  /* Network messages are printed while kernels run, results after them */
+  nnkres_ rs[nshapes * nnbatch * KERN_NKERNELS];
+  size_t nrs = 0;
+  for (size_t s = 0; s < nshapes; s++)
+    for (size_t b = 0; b < nnbatch; b++)
+      nrs += kern_bench_ (KERN_SHAPES[s], KERN_NBATCH[b], rs + nrs);
+
+  printf ("\n%-15s %14s %6s %14s %9s %9s %14s\n", "kernel", "shape", 
+          "nbatch", "ns/call", "GFLOP/s", "GB/s", "examples/s");
+  for (size_t i = 0; i < nrs; i++)
+    {
+      kern_print_ (NULL, &rs[i], 0);
+      if (f != NULL)
+        {
+          fputs (i > 0 ? ",\n" : "", f);
+          kern_print_ (f, &rs[i], 1);
+        }
+    }
+
+  if (f != NULL)
+    {
+      fputs ("\n  ]\n}\n", f);
+      fclose (f);
+    }
+}
+
+int main (int argc, char **argv)
+{
+  const char *json = NULL;
+  if (argc == 3 && strcmp (argv[1], "-j") == 0)
+    json = argv[2];
+  else if (argc != 1)
+    {
+      fprintf (stderr, "usage: %s [-j results.json]\n", argv[0]);
+      return 1;
+    }
+
+  bench_kernels_ (json);
+  bench_sigmoid_();
+  bench_train_();
+  bench_quant_();
+  bench_prune_();
+}
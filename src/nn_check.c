@@ -0,0 +1,609 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+
+#include "nn_impl.c"
+
+/**
+ *
+ * Usage: nn_check [-s parity_file | -p parity_file]
+ *
+ * Correctness checks of the engine, every failed check is reported
+ * and the exit status is 1 if any of them failed
+ *
+ * Agreement of the SIMD variants with the scalar reference
+ *
+ *  - every kernel of every variant the CPU supports is run on the same
+ *    random inputs as the scalar one, for every length 0..CHECK_MAXN,
+ *    so that all tails are covered; every result should be within
+ *    CHECK_RTOL of the scalar one, relative to max (1, |scalar|),
+ *    uint8 steps within 1, int32 sums exactly the same
+ *
+ * Round trip of quantized inputs (see qmtx_from_mtx())
+ *
+ *  - a matrix with columns of different ranges, one of them constant,
+ *    is quantized to 8 and 16 bits per column and globally; every element
+ *    should come back within half a step and QMTX_ULPS rounding errors
+ *    of double_, the steps should be the range
+ *    of the column, or of the whole matrix, over 2^bits - 1
+ *
+ * Agreement of float and double builds (see -DNN_FLOAT32)
+ *
+ *  - a small network is trained from the same fixed-seed data and weights,
+ *    -s saves the final cost and weights of the double build as doubles,
+ *    -p trains the float build and compares them with the saved ones,
+ *    both should be within PARITY_RTOL relative to max (1, |double|)
+ *
+ **/
+
+#define CHECK_MAXN            300
+#define CHECK_SEED            1
+#define CHECK_BC              16          /* block width of block kernels */
+
+#ifdef NN_FLOAT32
+  #define CHECK_RTOL          1e-5
+  #define CHECK_EPS           FLT_EPSILON
+#else
+  #define CHECK_RTOL          1e-12
+  #define CHECK_EPS           DBL_EPSILON
+#endif
+
+#define QMTX_NROWS            50
+#define QMTX_NCOLS            37
+#define QMTX_ULPS             4           /* rounding of dequantization */
+
+#define PARITY_NEXAMPLES      256
+#define PARITY_NFEATURES      32
+#define PARITY_NHIDUNITS      16
+#define PARITY_NLABELS        4
+#define PARITY_NITERS         100
+#define PARITY_NBATCH         16
+#define PARITY_LEARN_PARAM    0.5
+#define PARITY_REGUR_PARAM    0.1
+#define PARITY_RTOL           1e-4
+
+static void check_exit_ (void)
+{
+  fprintf (stderr, "nn_check(): %s\n", "Could not allocate memory ...");
+  exit (1);
+}
+
+/* ============================ SIMD KERNELS ============================ */
+
+typedef enum
+{
+  KERN_DOT,
+  KERN_AXPY,
+  KERN_AXPY4,
+  KERN_SIGMOID,
+  KERN_SIGMOID_FAST,
+  KERN_DSIGMOID,
+  KERN_UPDATE,
+  KERN_MOMENTUM,
+  KERN_NESTEROV,
+  KERN_ADAM,
+  KERN_QUANTIZE,
+  KERN_QDOT4,
+  KERN_BDOT4,
+  KERN_BAXPY4,
+  KERN_BGER4,
+  KERN_NKERNELS
+
+} nnkern_;
+
+static const char *KERN_NAMES[KERN_NKERNELS] =
+  {
+    "dot", "axpy", "axpy4", "sigmoid", "sigmoid_fast", "dsigmoid",
+    "update", "momentum", "nesterov", "adam", "quantize", "qdot4",
+    "bdot4", "baxpy4", "bger4"
+  };
+
+/**
+ *
+ * @struct nnkstate
+ * @brief Inputs and outputs of one kernel call
+ *
+ * @var x             four input vectors, or rows of block kernels
+ * @var y             output vector, weights of updates
+ * @var dw            gradient of updates
+ * @var m             first moment, momentum
+ * @var v             second moment
+ * @var s             sums of dot kernels
+ * @var is            sums of qdot4
+ * @var q             uint8 steps, quantize output and qdot4 input
+ * @var qw            int8 rows of qdot4
+ * @var cols          kept blocks of block kernels
+ * @var nblocks       # of kept blocks
+ *
+ **/
+typedef struct nnkstate_
+{
+  double_   *x[4];
+  double_      *y;
+  double_     *dw;
+  double_      *m;
+  double_      *v;
+  double_    s[4];
+  int32_t   is[4];
+  uint8_t      *q;
+  int8_t   *qw[4];
+  uint32_t  *cols;
+  size_t  nblocks;
+
+} nnkstate_;
+
+static void kstate_alloc_ (nnkstate_ *st)
+{
+  const size_t n = CHECK_MAXN + 1;
+  for (size_t k = 0; k < 4; k++)
+    if ((st->x[k]  = alloc_slab (n, 0)) == NULL
+     || (st->qw[k] = malloc (n * sizeof *st->qw[k])) == NULL)
+      check_exit_();
+  if ((st->y    = alloc_slab (n, 0)) == NULL
+   || (st->dw   = alloc_slab (n, 0)) == NULL
+   || (st->m    = alloc_slab (n, 0)) == NULL
+   || (st->v    = alloc_slab (n, 0)) == NULL
+   || (st->q    = malloc (n * sizeof *st->q))    == NULL
+   || (st->cols = malloc (n * sizeof *st->cols)) == NULL)
+    check_exit_();
+}
+
+static void kstate_free_ (nnkstate_ *st)
+{
+  for (size_t k = 0; k < 4; k++)
+    {
+      free_slab (st->x[k]);
+      free (st->qw[k]);
+    }
+  free_slab (st->y);
+  free_slab (st->dw);
+  free_slab (st->m);
+  free_slab (st->v);
+  free (st->q);
+  free (st->cols);
+}
+
+/* Un([-1,1)) values, the same for the same n */
+static void kstate_fill_ (nnkstate_ *st, const size_t n)
+{
+  nnrng_ rng;
+  rnd_init (&rng, CHECK_SEED, n);
+
+  double_ *vs[8] = { st->x[0], st->x[1], st->x[2], st->x[3],
+                     st->y, st->dw, st->m, st->v };
+  for (size_t k = 0; k < 8; k++)
+    {
+      rnd_vec_fill (&rng, vs[k], n);
+      for (size_t i = 0; i < n; i++)
+        vs[k][i] = 2 * vs[k][i] - 1;
+    }
+  for (size_t i = 0; i < n; i++)
+    {
+      st->v[i] *= st->v[i];
+      st->q[i]  = rnd_u64 (&rng);
+      for (size_t k = 0; k < 4; k++)
+        st->qw[k][i] = (int) (rnd_u64 (&rng) % 255) - 127;
+    }
+
+  /* Every block but each third one, so that gaps are skipped */
+  st->nblocks = 0;
+  for (size_t c = 0; c * CHECK_BC < n; c++)
+    if (c % 3 != 1)
+      st->cols[st->nblocks++] = c;
+
+  memset (st->s,  0, sizeof st->s);
+  memset (st->is, 0, sizeof st->is);
+}
+
+static void
+kstate_run_ (const nnsimd_ *v, const nnkern_ k, nnkstate_ *st,
+             const size_t n)
+{
+  const double_ a[4] = { 0.3, -0.7, 1.1, -0.2 };
+  const double_ *x[4] = { st->x[0], st->x[1], st->x[2], st->x[3] };
+  const int8_t *qw[4] = { st->qw[0], st->qw[1], st->qw[2], st->qw[3] };
+  const nnadamk_ adam = { 0.5, 0.01, 0.9, 0.999, 0.001, 1e-8, 0.99 };
+
+  switch (k)
+    {
+    case KERN_DOT:
+      st->s[0] = v->dot (st->x[0], st->x[1], n);
+      break;
+    case KERN_AXPY:
+      v->axpy (st->y, a[0], st->x[0], n);
+      break;
+    case KERN_AXPY4:
+      v->axpy4 (st->y, a, x, n);
+      break;
+    case KERN_SIGMOID:
+    case KERN_SIGMOID_FAST:
+      /* Both tails of the sigmoid, and clamped exp arguments */
+      for (size_t i = 0; i < n; i++)
+        st->y[i] *= i % 17 == 0 ? 1000.0 : 40.0;
+      (k == KERN_SIGMOID ? v->sigmoid : v->sigmoid_fast) (st->y, n);
+      break;
+    case KERN_DSIGMOID:
+      for (size_t i = 0; i < n; i++)
+        st->x[0][i] = (st->x[0][i] + 1) / 2;
+      v->dsigmoid (st->y, st->x[0], n);
+      break;
+    case KERN_UPDATE:
+      v->update (st->y, st->dw, 0.1, 0.999, n);
+      break;
+    case KERN_MOMENTUM:
+    case KERN_NESTEROV:
+      v->momentum (st->y, st->dw, st->m, 0.1, 0.001, 0.9,
+                   k == KERN_NESTEROV, n);
+      break;
+    case KERN_ADAM:
+      v->adam (st->y, st->dw, st->m, st->v, &adam, n);
+      break;
+    case KERN_QUANTIZE:
+      /* Steps past 0..255 are clamped */
+      v->quantize (st->q, st->x[0], -0.9, 150.0, n);
+      break;
+    case KERN_QDOT4:
+      v->qdot4 (st->is, st->q, qw, n);
+      break;
+    case KERN_BDOT4:
+      v->bdot4 (st->s, st->y, x, st->cols, st->nblocks, CHECK_BC, n);
+      break;
+    case KERN_BAXPY4:
+      v->baxpy4 (st->y, a, x, st->cols, st->nblocks, CHECK_BC, n);
+      break;
+    case KERN_BGER4:
+      v->bger4 (st->x, a, st->y, st->cols, st->nblocks, CHECK_BC, n);
+      break;
+    default:
+      break;
+    }
+}
+
+/* The larger error, NaN if any of them is NaN */
+static inline double maxerr_ (const double e, const double err)
+{
+  return e > err || isnan (e) ? e : err;
+}
+
+static double
+relerr_ (const double_ *r, const double_ *x, const size_t n)
+{
+  double err = 0.0;
+  for (size_t i = 0; i < n; i++)
+    err = maxerr_ (fabs ((double) x[i] - r[i]) / fmax (1.0, fabs (r[i])),
+                   err);
+  return err;
+}
+
+/**
+ *
+ * Max relative error of every double_ output of v against reference r,
+ * integer outputs that differ more than allowed count as HUGE_VAL
+ *
+ **/
+static double
+kstate_err_ (const nnkstate_ *r, const nnkstate_ *x, const size_t n)
+{
+  double err = relerr_ (r->s, x->s, 4);
+  err = maxerr_ (relerr_ (r->y,  x->y,  n), err);
+  err = maxerr_ (relerr_ (r->dw, x->dw, n), err);
+  err = maxerr_ (relerr_ (r->m,  x->m,  n), err);
+  err = maxerr_ (relerr_ (r->v,  x->v,  n), err);
+  for (size_t k = 0; k < 4; k++)
+    {
+      err = maxerr_ (relerr_ (r->x[k], x->x[k], n), err);
+      if (r->is[k] != x->is[k])
+        err = HUGE_VAL;
+    }
+  for (size_t i = 0; i < n; i++)
+    if (abs (r->q[i] - x->q[i]) > 1)
+      err = HUGE_VAL;
+  return err;
+}
+
+/* # of kernels of variants that don't agree with the scalar ones */
+static size_t check_simd_ (void)
+{
+  size_t nvars, nfailed = 0;
+  const nnsimd_ *const *vars = simd_variants (&nvars);
+
+  nnkstate_ r, x;
+  kstate_alloc_ (&r);
+  kstate_alloc_ (&x);
+
+  printf ("%-10s %-12s %10s\n", "simd", "kernel", "max error");
+  for (size_t v = 1; v < nvars; v++)
+    for (nnkern_ k = 0; k < KERN_NKERNELS; k++)
+      {
+        double err = 0.0;
+        for (size_t n = 0; n <= CHECK_MAXN; n++)
+          {
+            kstate_fill_ (&r, n);
+            kstate_fill_ (&x, n);
+            kstate_run_ (vars[0], k, &r, n);
+            kstate_run_ (vars[v], k, &x, n);
+            err = maxerr_ (kstate_err_ (&r, &x, n), err);
+          }
+
+        int ok = err <= CHECK_RTOL;  /* false for NaN */
+        nfailed += ! ok;
+        printf ("%-10s %-12s %10.2g %s\n", vars[v]->name, KERN_NAMES[k],
+                err, ok ? "" : "FAILED");
+      }
+
+  kstate_free_ (&r);
+  kstate_free_ (&x);
+  return nfailed;
+}
+
+/* ========================== QUANTIZED INPUTS ========================== */
+
+/**
+ *
+ * Max error of the round trip in steps, without the rounding of double_,
+ * HUGE_VAL if an offset or a step is wrong
+ *
+ **/
+static double
+qmtx_err_ (nnmtx mtx, nnqmtx qmtx, const int bits, const int global)
+{
+  const double qmax = (1 << bits) - 1;
+
+  double glo = HUGE_VAL, ghi = -HUGE_VAL;
+  for (size_t i = 0; i < mtx->nrows; i++)
+    for (size_t j = 0; j < mtx->ncols; j++)
+      {
+        glo = fmin (glo, MTX_ROW (mtx, i)[j]);
+        ghi = fmax (ghi, MTX_ROW (mtx, i)[j]);
+      }
+
+  double err = 0.0;
+  for (size_t j = 0; j < mtx->ncols; j++)
+    {
+      double lo = glo, hi = ghi;
+      for (size_t i = 0; ! global && i < mtx->nrows; i++)
+        {
+          lo = i == 0 ? MTX_ROW (mtx, i)[j] : fmin (lo, MTX_ROW (mtx, i)[j]);
+          hi = i == 0 ? MTX_ROW (mtx, i)[j] : fmax (hi, MTX_ROW (mtx, i)[j]);
+        }
+      if (fabs (qmtx->offset[j] - lo) > CHECK_RTOL * fmax (1.0, fabs (lo))
+       || fabs (qmtx->scale[j] - (hi - lo) / qmax) > CHECK_RTOL)
+        return HUGE_VAL;
+    }
+
+  double_ *row;
+  if ((row = malloc (mtx->ncols * sizeof *row)) == NULL)
+    check_exit_();
+  for (size_t i = 0; i < mtx->nrows; i++)
+    {
+      qmtx_row (qmtx, i, row);
+      for (size_t j = 0; j < mtx->ncols; j++)
+        {
+          /* Constant columns come back exactly, up to the rounding */
+          double x = MTX_ROW (mtx, i)[j],
+                 e = fabs ((double) row[j] - x)
+                   - QMTX_ULPS * CHECK_EPS * fmax (1.0, fabs (x));
+          e = e > 0.0 ? e : 0.0;
+          err = maxerr_ (qmtx->scale[j] > 0.0 ? e / qmtx->scale[j]
+                                              : e > 0.0 ? HUGE_VAL : 0.0,
+                         err);
+        }
+    }
+  free (row);
+  return err;
+}
+
+/* # of quantization modes that don't round trip */
+static size_t check_qmtx_ (void)
+{
+  nnmtx mtx;
+  if ((mtx = alloc_mtx (QMTX_NROWS, QMTX_NCOLS, 0)) == NULL)
+    check_exit_();
+
+  /* Column j is within [-j, j^2 / 4), column 1 is constant */
+  nnrng_ rng;
+  rnd_init (&rng, CHECK_SEED, 0);
+  for (size_t i = 0; i < mtx->nrows; i++)
+    {
+      double_ *row = MTX_ROW (mtx, i);
+      rnd_vec_fill (&rng, row, mtx->ncols);
+      for (size_t j = 0; j < mtx->ncols; j++)
+        row[j] = j == 1 ? 0.25 : -(double) j + row[j] * (j + j * j / 4.0);
+    }
+
+  size_t nfailed = 0;
+  printf ("\n%-10s %-12s %10s\n", "qmtx", "mode", "max steps");
+  for (int bits = 8; bits <= 16; bits += 8)
+    for (int global = 0; global < 2; global++)
+      {
+        nnqmtx qmtx;
+        if ((qmtx = qmtx_from_mtx (mtx, bits, global)) == NULL)
+          check_exit_();
+
+        /* Rounding to the nearest step is half a step off at most */
+        double err = qmtx_err_ (mtx, qmtx, bits, global);
+        int ok = err <= 0.5;
+        nfailed += ! ok;
+        printf ("%-10d %-12s %10.2g %s\n", bits,
+                global ? "global" : "per column", err, ok ? "" : "FAILED");
+        free_qmtx (qmtx);
+      }
+
+  free_mtx (mtx);
+  return nfailed;
+}
+
+/* ============================ FLOAT PARITY ============================ */
+
+/**
+ *
+ * @brief Train the parity network, data set and initial weights are
+ *        drawn as doubles from a fixed seed, so that both builds start
+ *        from the same values up to rounding; one worker keeps the order
+ *        of sums the same on every machine
+ *
+ * @return vector of the final cost followed by all weights,
+ *         row by row from the input layer, *n is its length
+ *
+ **/
+static double *parity_train_ (size_t *n)
+{
+  const size_t nhidunits[1] = { PARITY_NHIDUNITS };
+  const size_t    nunits[3] =
+    { PARITY_NFEATURES, PARITY_NHIDUNITS, PARITY_NLABELS };
+
+  nnrng_ rng;
+  rnd_init (&rng, CHECK_SEED, 0);
+
+  nnmtx inps  = alloc_mtx (PARITY_NEXAMPLES, PARITY_NFEATURES, 0),
+        outps = alloc_mtx (PARITY_NEXAMPLES, PARITY_NLABELS,   1),
+        ws[2] = { alloc_mtx (nunits[1], nunits[0] + 1, 0),
+                  alloc_mtx (nunits[2], nunits[1] + 1, 0) };
+  if (inps == NULL || outps == NULL || ws[0] == NULL || ws[1] == NULL)
+    check_exit_();
+
+  /* Label of an example is the largest of its first inputs */
+  for (size_t i = 0; i < inps->nrows; i++)
+    {
+      double_ *x = MTX_ROW (inps, i);
+      size_t label = 0;
+      for (size_t j = 0; j < inps->ncols; j++)
+        x[j] = (double) rnd_u64 (&rng) / UINT64_MAX;
+      for (size_t j = 1; j < PARITY_NLABELS; j++)
+        label = x[j] > x[label] ? j : label;
+      MTX_ROW (outps, i)[label] = 1;
+    }
+  for (size_t k = 0; k < 2; k++)
+    for (size_t i = 0; i < ws[k]->nrows; i++)
+      for (size_t j = 0; j < ws[k]->ncols; j++)
+        MTX_ROW (ws[k], i)[j] = (double) rnd_u64 (&rng) / UINT64_MAX - 0.5;
+
+  nnetwork netw = nn_alloc (0, PARITY_NFEATURES, PARITY_NLABELS,
+                            1, nhidunits);
+  nnparams ps = nn_alloc_nparams (PARITY_NEXAMPLES, PARITY_NITERS,
+    PARITY_LEARN_PARAM, PARITY_REGUR_PARAM, sqdist);
+  if (netw == NULL || ps == NULL || nn_weights_init (netw, ws))
+    check_exit_();
+
+  nn_set_nbatch     (ps, PARITY_NBATCH);
+  nn_set_nworkers   (ps, 1);
+  nn_set_cost_every (ps, 0);
+  nn_set_seed       (ps, CHECK_SEED);
+  nn_backprop (netw, inps, outps, ps);
+
+  *n = 1;
+  for (nnlayer_ *l = netw->inp; l->next != NULL; l = l->next)
+    *n += l->weights.nrows * l->weights.ncols;
+
+  double *res = malloc (*n * sizeof *res);
+  if (res == NULL)
+    check_exit_();
+
+  size_t k = 0;
+  res[k++] = nn_costfunc (netw, inps, outps, ps);
+  for (nnlayer_ *l = netw->inp; l->next != NULL; l = l->next)
+    for (size_t i = 0; i < l->weights.nrows; i++)
+      for (size_t j = 0; j < l->weights.ncols; j++)
+        res[k++] = MTX_ROW (&l->weights, i)[j];
+
+  nn_destroy (netw);
+  nn_destroy_nparams (ps);
+  free_mtx (ws[0]);
+  free_mtx (ws[1]);
+  free_mtx (inps);
+  free_mtx (outps);
+  return res;
+}
+
+/* Save the parity results of this build, 0 on success */
+static int parity_save_ (const char *path)
+{
+  size_t n;
+  double *res = parity_train_ (&n);
+
+  FILE *f = fopen (path, "wb");
+  int err = f == NULL
+         || fwrite (&n, sizeof n, 1, f) != 1
+         || fwrite (res, sizeof *res, n, f) != n;
+  if (f != NULL && fclose (f))
+    err = 1;
+  if (err)
+    fprintf (stderr, "parity_save_(): Could not write %s\n", path);
+  else
+    printf ("Saved cost %.10g and %ld weights to %s\n", res[0], n - 1, path);
+
+  free (res);
+  return err;
+}
+
+/* # of failed checks of this build against the saved results */
+static size_t parity_check_ (const char *path)
+{
+  size_t n, nsaved = 0;
+  double *res = parity_train_ (&n), *saved = NULL;
+
+  FILE *f = fopen (path, "rb");
+  if (f == NULL
+   || fread (&nsaved, sizeof nsaved, 1, f) != 1
+   || nsaved != n
+   || (saved = malloc (n * sizeof *saved)) == NULL
+   || fread (saved, sizeof *saved, n, f) != n)
+    {
+      fprintf (stderr, "parity_check_(): %s is not a parity file "
+                       "of this network\n", path);
+      if (f != NULL)
+        fclose (f);
+      free (saved);
+      free (res);
+      return 1;
+    }
+  fclose (f);
+
+  double werr = 0.0;
+  for (size_t i = 1; i < n; i++)
+    werr = maxerr_ (fabs (res[i] - saved[i]) / fmax (1.0, fabs (saved[i])),
+                    werr);
+  double cerr = fabs (res[0] - saved[0]) / fmax (1.0, fabs (saved[0]));
+  int cok = cerr <= PARITY_RTOL, wok = werr <= PARITY_RTOL;
+
+  printf ("\n%-10s %14s %14s %10s\n", "parity", "this build", "saved",
+          "max error");
+  printf ("%-10s %14.10g %14.10g %10.2g %s\n", "cost", res[0], saved[0],
+          cerr, cok ? "" : "FAILED");
+  printf ("%-10s %14ld %14ld %10.2g %s\n", "weights", n - 1, nsaved - 1,
+          werr, wok ? "" : "FAILED");
+
+  free (saved);
+  free (res);
+  return ! cok + ! wok;
+}
+
+int main (int argc, char **argv)
+{
+  const int save = argc == 3 && strcmp (argv[1], "-s") == 0,
+            load = argc == 3 && strcmp (argv[1], "-p") == 0;
+  if (argc != 1 && ! save && ! load)
+    {
+      fprintf (stderr, "usage: %s [-s parity_file | -p parity_file]\n",
+               argv[0]);
+      return 1;
+    }
+
+  if (save)
+    return parity_save_ (argv[2]);
+
+  size_t nfailed = check_simd_ ();
+  nfailed += check_qmtx_ ();
+  if (load)
+    nfailed += parity_check_ (argv[2]);
+
+  if (nfailed > 0)
+    {
+      printf ("%ld checks FAILED\n", nfailed);
+      return 1;
+    }
+  puts ("All checks passed");
+  return 0;
+}
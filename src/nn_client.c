@@ -0,0 +1,163 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "nn_impl.h"
+#include "nn_rnd.h"
+#include "nn_serve.h"
+
+/**
+ *
+ * Load generator for the local inference server (see nn_serve.c)
+ *
+ * Usage: nn_client socket [nconns [nreqs]]
+ *
+ * Each of nconns connections sends nreqs random examples one after
+ * another, waiting for every response before sending the next request,
+ * so nconns is the # of requests in flight the server could batch;
+ * round-trip latency p50/p99 and throughput over all requests are reported
+ *
+ **/
+
+#define CLIENT_NCONNS         8
+#define CLIENT_NREQS          10000
+
+typedef struct nnclient_
+{
+  const char  *path;
+  size_t      nreqs;
+  double      *lats;      /* round-trip latency of every request */
+  int           err;
+
+} nnclient_;
+
+static void client_exit_ (const char *msg)
+{
+  fprintf (stderr, "nn_client(): %s\n", msg);
+  exit (1);
+}
+
+static double now_ (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int connect_ (const char *path)
+{
+  struct sockaddr_un addr;
+  memset (&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strncpy (addr.sun_path, path, sizeof addr.sun_path - 1);
+
+  int fd;
+  if ((fd = socket (AF_UNIX, SOCK_STREAM, 0)) < 0)
+    return -1;
+  if (connect (fd, (struct sockaddr *) &addr, sizeof addr) != 0)
+    {
+      close (fd);
+      return -1;
+    }
+  return fd;
+}
+
+static void *client_run_ (void *arg)
+{
+  nnclient_ *cl = (nnclient_ *)arg;
+  cl->err = 1;
+
+  int fd;
+  nnhello_ hello;
+  if ((fd = connect_ (cl->path)) < 0)
+    return NULL;
+  if (serve_read (fd, &hello, sizeof hello) != 0
+   || hello.fsize != sizeof (double_))
+    {
+      close (fd);
+      return NULL;
+    }
+
+  double_ *inp, *outp;
+  if ((inp  = malloc (hello.ninps  * sizeof *inp))  == NULL
+   || (outp = malloc (hello.noutps * sizeof *outp)) == NULL)
+    client_exit_ ("Could not allocate memory ...");
+
+  size_t i = 0;
+  for (; i < cl->nreqs; i++)
+    {
+      rnd_vec_gen (inp, hello.ninps);
+
+      double t0 = now_ ();
+      if (serve_write (fd, inp,  hello.ninps  * sizeof *inp)  != 0
+       || serve_read  (fd, outp, hello.noutps * sizeof *outp) != 0)
+        break;
+      cl->lats[i] = now_ () - t0;
+    }
+  cl->err = i < cl->nreqs;
+
+  free (inp);
+  free (outp);
+  close (fd);
+  return NULL;
+}
+
+static int cmp_double_ (const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+int main (int argc, char **argv)
+{
+  if (argc < 2)
+    {
+      fprintf (stderr, "usage: %s socket [nconns [nreqs]]\n", argv[0]);
+      return 1;
+    }
+
+  const size_t nconns = argc > 2 ? atol (argv[2]) : CLIENT_NCONNS,
+               nreqs  = argc > 3 ? atol (argv[3]) : CLIENT_NREQS;
+  if (nconns == 0 || nreqs == 0)
+    client_exit_ ("nconns and nreqs should be positive");
+
+  double    *lats = malloc (nconns * nreqs * sizeof *lats);
+  nnclient_ *cls  = malloc (nconns * sizeof *cls);
+  pthread_t *ths  = malloc (nconns * sizeof *ths);
+  if (lats == NULL || cls == NULL || ths == NULL)
+    client_exit_ ("Could not allocate memory ...");
+
+  double t0 = now_ ();
+  for (size_t c = 0; c < nconns; c++)
+    {
+      cls[c] = (nnclient_) { argv[1], nreqs, lats + c * nreqs, 0 };
+      if (pthread_create (&ths[c], NULL, client_run_, &cls[c]) != 0)
+        client_exit_ ("could not create thread ...");
+    }
+
+  int err = 0;
+  for (size_t c = 0; c < nconns; c++)
+    {
+      pthread_join (ths[c], NULL);
+      err |= cls[c].err;
+    }
+  double dt = now_ () - t0;
+
+  if (err)
+    client_exit_ ("could not talk to the server");
+
+  const size_t n = nconns * nreqs;
+  qsort (lats, n, sizeof *lats, cmp_double_);
+  printf ("%ld conns x %ld reqs | %8.0f req/s | p50 %8.1f us | p99 %8.1f us\n",
+          nconns, nreqs, n / dt, 1e6 * lats[n / 2], 1e6 * lats[n * 99 / 100]);
+
+  free (lats);
+  free (cls);
+  free (ths);
+  return 0;
+}
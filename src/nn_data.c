@@ -0,0 +1,635 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "nn_impl.h"
+#include "nn_alloc.h"
+#include "nn_data.h"
+
+#define DATA_MAGIC        "NNDATA"
+#define DATA_VERSION      1
+#define DATA_BYTEORDER    0x01020304
+
+#define IDX_IMAGES        0x00000803    /* unsigned byte, 3 dimensions */
+#define IDX_LABELS        0x00000801    /* unsigned byte, 1 dimension  */
+
+typedef struct nndatahdr_
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t byteorder;
+  uint32_t fsize;         /* sizeof (double_) */
+  uint32_t align;         /* MTX_ALIGN, rows padding depends on it */
+  uint64_t nexamples;
+  uint64_t ninps;
+  uint64_t noutps;
+  uint64_t inps_offset;   /* blocks offsets from the file start */
+  uint64_t outps_offset;
+
+} nndatahdr_;
+
+static void data_exit_ (void)
+{
+  fprintf (stderr, "data_exit(): %s\n", "Could not allocate memory ...");
+  exit (1);
+}
+
+static size_t data_align_ (const size_t size)
+{
+  return (size + MTX_ALIGN - 1) / MTX_ALIGN * MTX_ALIGN;
+}
+
+/* ============================ BINARY ============================== */
+
+static int data_write_ (FILE *f, nnmtx inps, nnmtx outps)
+{
+  nndatahdr_ hdr;
+  memset (&hdr, 0, sizeof hdr);
+  memcpy (hdr.magic, DATA_MAGIC, sizeof DATA_MAGIC);
+  hdr.version      = DATA_VERSION;
+  hdr.byteorder    = DATA_BYTEORDER;
+  hdr.fsize        = sizeof (double_);
+  hdr.align        = MTX_ALIGN;
+  hdr.nexamples    = inps->nrows;
+  hdr.ninps        = inps->ncols;
+  hdr.noutps       = outps->ncols;
+  hdr.inps_offset  = data_align_ (sizeof hdr);
+  hdr.outps_offset = hdr.inps_offset
+                   + inps->nrows * mtx_ld (inps->ncols) * sizeof (double_);
+
+  static const char pad[MTX_ALIGN];
+  if (fwrite (&hdr, sizeof hdr, 1, f) != 1
+   || fwrite (pad, 1, hdr.inps_offset - sizeof hdr, f)
+                   != hdr.inps_offset - sizeof hdr)
+    return 1;
+
+  /* Rows are written with zeroed padding, whatever the source ld is */
+  nnmtx mtxs[2] = { inps, outps };
+  for (size_t k = 0; k < 2; k++)
+    {
+      const size_t ld = mtx_ld (mtxs[k]->ncols);
+      for (size_t i = 0; i < mtxs[k]->nrows; i++)
+        if (fwrite (MTX_ROW (mtxs[k], i), sizeof (double_), mtxs[k]->ncols, f)
+                != mtxs[k]->ncols
+         || fwrite (pad, sizeof (double_), ld - mtxs[k]->ncols, f)
+                != ld - mtxs[k]->ncols)
+          return 1;
+    }
+
+  return 0;
+}
+
+int data_save (const char *path, nnmtx inps, nnmtx outps)
+{
+  if (inps->nrows != outps->nrows)
+    {
+      fprintf (stderr, "data_save(): # of inputs and outputs differ\n");
+      return 1;
+    }
+
+  FILE *f;
+  if ((f = fopen (path, "wb")) == NULL)
+    {
+      fprintf (stderr, "data_save(): could not open %s\n", path);
+      return 1;
+    }
+
+  int err = data_write_ (f, inps, outps);
+  err |= fclose (f) != 0;
+  if (err)
+    fprintf (stderr, "data_save(): could not write %s\n", path);
+  return err;
+}
+
+/**
+ *
+ * Size in bytes of a block of nrows padded rows of ncols into *bytes,
+ * 1 if it is larger than size, before any product could overflow
+ *
+ **/
+static int
+data_block_size_ (const uint64_t nrows, const uint64_t ncols, 
+                  const size_t size, uint64_t *bytes)
+{
+  if (ncols > size / sizeof (double_))
+    return 1;
+
+  const uint64_t row = mtx_ld (ncols) * sizeof (double_);
+  if (row > 0 && nrows > size / row)
+    return 1;
+  *bytes = nrows * row;
+  return 0;
+}
+
+/* Check header of the mapped file, 0 if it is a valid data set */
+static int data_check_ (const nndatahdr_ *hdr, const size_t size)
+{
+  if (size < sizeof *hdr || memcmp (hdr->magic, DATA_MAGIC, sizeof DATA_MAGIC))
+    return 1;
+  if (hdr->version != DATA_VERSION || hdr->byteorder != DATA_BYTEORDER)
+    return 1;
+  if (hdr->fsize != sizeof (double_) || hdr->align != MTX_ALIGN)
+    return 1;
+
+  /* Both blocks fit the file alone first, so that the sums of offsets 
+     and sizes below can't overflow */
+  uint64_t inps_size, outps_size;
+  if (data_block_size_ (hdr->nexamples, hdr->ninps,  size, &inps_size)
+   || data_block_size_ (hdr->nexamples, hdr->noutps, size, &outps_size))
+    return 1;
+  if (hdr->inps_offset  != data_align_ (sizeof *hdr)
+   || hdr->outps_offset != hdr->inps_offset + inps_size
+   || hdr->outps_offset > size
+   || outps_size > size - hdr->outps_offset)
+    return 1;
+  return 0;
+}
+
+nndata_ *data_load (const char *path)
+{
+  int fd;
+  if ((fd = open (path, O_RDONLY)) < 0)
+    {
+      fprintf (stderr, "data_load(): could not open %s\n", path);
+      return NULL;
+    }
+
+  /* Data sets are never modified, so the mapping is read-only */
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat (fd, &st) == 0 && st.st_size > 0)
+    map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+
+  if (map == MAP_FAILED)
+    {
+      fprintf (stderr, "data_load(): could not map %s\n", path);
+      return NULL;
+    }
+
+  const nndatahdr_ *hdr = map;
+  if (data_check_ (hdr, st.st_size))
+    {
+      fprintf (stderr, "data_load(): %s is not a valid data set\n", path);
+      munmap (map, st.st_size);
+      return NULL;
+    }
+
+  nndata_ *data;
+  if ((data = malloc (sizeof *data)) == NULL)
+    data_exit_();
+
+  mtx_view (&data->inps, (double_ *) ((char *) map + hdr->inps_offset),
+            hdr->nexamples, hdr->ninps);
+  mtx_view (&data->outps, (double_ *) ((char *) map + hdr->outps_offset),
+            hdr->nexamples, hdr->noutps);
+  data->map     = map;
+  data->mapsize = st.st_size;
+  data->refs    = 1;
+
+  return data;
+}
+
+nndata_ *data_alloc (const size_t nexamples, const size_t ninps, 
+                     const size_t noutps)
+{
+  nndata_ *data;
+  nnmtx inps, outps;
+  if ((data  = malloc (sizeof *data)) == NULL
+   || (inps  = alloc_mtx (nexamples, ninps,  0)) == NULL
+   || (outps = alloc_mtx (nexamples, noutps, 1)) == NULL)
+    data_exit_();
+
+  data->inps    = *inps;
+  data->outps   = *outps;
+  data->map     = NULL;
+  data->mapsize = 0;
+  data->refs    = 1;
+  free (inps);
+  free (outps);
+
+  return data;
+}
+
+nndata_ *data_ref (nndata_ *data)
+{
+  __atomic_add_fetch (&data->refs, 1, __ATOMIC_RELAXED);
+  return data;
+}
+
+void data_free (nndata_ *data)
+{
+  if (data == NULL)
+    return;
+
+  /* Last reference frees, the data set was not written by anyone */
+  if (__atomic_sub_fetch (&data->refs, 1, __ATOMIC_ACQ_REL) > 0)
+    return;
+
+  if (data->map != NULL)
+    munmap (data->map, data->mapsize);
+  else
+    {
+      free_slab (data->inps.data);
+      free_slab (data->outps.data);
+    }
+  free (data);
+}
+
+/* =========================== STREAMING ============================ */
+
+/**
+ *
+ * @struct nnslot
+ * @brief Buffer of one chunk in the ring
+ *
+ * @var inps          inputs of the chunk
+ * @var outps         expected outputs of the chunk
+ * @var n             # of examples read into the buffer,
+ *                    0 if it marks the end of a pass
+ *
+ **/
+typedef struct nnslot_
+{
+  nnmtx_   inps;
+  nnmtx_  outps;
+  size_t      n;
+
+} nnslot_;
+
+/**
+ *
+ * @struct nnstream
+ * @brief Streamed data set
+ *
+ * Slot k % nslots is filled by I/O thread for k = nfilled, 
+ * taken by trainer for k = ntaken and returned to I/O thread 
+ * when k < nfreed, so that nfreed <= ntaken <= nfilled <= nfreed + nslots
+ *
+ * @var src           source of examples, passed to nn_backprop_stream()
+ * @var fd            data set file
+ * @var hdr           data set file header
+ * @var nchunk        # of examples in a chunk
+ * @var slots         ring of nslots = depth + 1 chunk buffers
+ * @var held          1 if trainer holds slot ntaken - 1
+ * @var stop          1 to stop I/O thread
+ * @var stall         time that trainer spent waiting for chunks, seconds
+ * @var nchunks       # of chunks taken by trainer, end of pass marks aside
+ *
+ **/
+typedef struct nnstream_
+{
+  nnsource_       src;
+  int              fd;
+  nndatahdr_      hdr;
+  size_t       nchunk;
+  nnslot_      *slots;
+  size_t       nslots;
+  size_t      nfilled;
+  size_t       ntaken;
+  size_t       nfreed;
+  int            held;
+  int            stop;
+  double        stall;
+  size_t      nchunks;
+  pthread_t        io;
+  pthread_mutex_t mtx;
+  pthread_cond_t filled;
+  pthread_cond_t  freed;
+
+} nnstream_;
+
+static double now_ (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int pread_full_ (int fd, void *buf, size_t size, off_t off)
+{
+  while (size > 0)
+    {
+      ssize_t n = pread (fd, buf, size, off);
+      if (n <= 0)
+        return 1;
+      buf   = (char *) buf + n;
+      size -= n;
+      off  += n;
+    }
+  return 0;
+}
+
+/* Read examples [m, m + n) into the slot, rows are stored as in the file */
+static void stream_read_ (nnstream_ *st, nnslot_ *slot, size_t m, size_t n)
+{
+  const size_t ldi = slot->inps.ld, ldo = slot->outps.ld;
+
+  if (pread_full_ (st->fd, slot->inps.data, n * ldi * sizeof (double_),
+                   st->hdr.inps_offset  + m * ldi * sizeof (double_))
+   || pread_full_ (st->fd, slot->outps.data, n * ldo * sizeof (double_),
+                   st->hdr.outps_offset + m * ldo * sizeof (double_)))
+    {
+      /* Trainer would wait for the chunk forever */
+      fprintf (stderr, "data_stream(): %s\n", "Could not read data set ...");
+      exit (1);
+    }
+
+  slot->inps.nrows = slot->outps.nrows = slot->n = n;
+}
+
+static void *stream_io_ (void *arg)
+{
+  nnstream_ *st = (nnstream_ *)arg;
+  size_t m = 0;     /* first example of the next chunk */
+
+  pthread_mutex_lock (&st->mtx);
+  for (;;)
+    {
+      while (! st->stop && st->nfilled - st->nfreed == st->nslots)
+        pthread_cond_wait (&st->freed, &st->mtx);
+      if (st->stop)
+        break;
+
+      nnslot_ *slot = &st->slots[st->nfilled % st->nslots];
+      pthread_mutex_unlock (&st->mtx);
+
+      /* Slot is owned by I/O thread until nfilled is advanced */
+      size_t n = st->hdr.nexamples - m < st->nchunk 
+               ? st->hdr.nexamples - m : st->nchunk;
+      stream_read_ (st, slot, m, n);
+      m = n > 0 ? m + n : 0;
+
+      pthread_mutex_lock (&st->mtx);
+      st->nfilled++;
+      pthread_cond_signal (&st->filled);
+    }
+  pthread_mutex_unlock (&st->mtx);
+  return NULL;
+}
+
+static size_t stream_next_ (void *ctx, nnmtx_ *inps, nnmtx_ *outps)
+{
+  nnstream_ *st = (nnstream_ *)ctx;
+
+  pthread_mutex_lock (&st->mtx);
+
+  /* Previous chunk is no longer used, it could be refilled */
+  if (st->held)
+    {
+      st->nfreed++;
+      st->held = 0;
+      pthread_cond_signal (&st->freed);
+    }
+
+  if (st->ntaken == st->nfilled)
+    {
+      double t0 = now_ ();
+      while (st->ntaken == st->nfilled)
+        pthread_cond_wait (&st->filled, &st->mtx);
+      st->stall += now_ () - t0;
+    }
+
+  nnslot_ *slot = &st->slots[st->ntaken++ % st->nslots];
+  size_t n = slot->n;
+  if (n == 0)
+    {
+      /* End of pass marker is not held */
+      st->nfreed++;
+      pthread_cond_signal (&st->freed);
+    }
+  else
+    {
+      *inps  = slot->inps;
+      *outps = slot->outps;
+      st->held = 1;
+      st->nchunks++;
+    }
+
+  pthread_mutex_unlock (&st->mtx);
+  return n;
+}
+
+nnstream_ *
+data_stream_open (const char *path, const size_t nchunk, const size_t depth)
+{
+  int fd;
+  if ((fd = open (path, O_RDONLY)) < 0)
+    {
+      fprintf (stderr, "data_stream_open(): could not open %s\n", path);
+      return NULL;
+    }
+
+  struct stat sb;
+  nndatahdr_ hdr;
+  if (fstat (fd, &sb) != 0 
+   || pread_full_ (fd, &hdr, sizeof hdr, 0)
+   || data_check_ (&hdr, sb.st_size) || nchunk == 0 || depth == 0)
+    {
+      fprintf (stderr, "data_stream_open(): %s is not a valid data set "
+                       "or nchunk/depth is 0\n", path);
+      close (fd);
+      return NULL;
+    }
+
+  /* Chunks are read once in order */
+  posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  nnstream_ *st;
+  if ((st = malloc (sizeof *st)) == NULL)
+    data_exit_();
+
+  st->src     = (nnsource_) { stream_next_, st };
+  st->fd      = fd;
+  st->hdr     = hdr;
+  st->nchunk  = nchunk;
+  st->nslots  = depth + 1;
+  st->nfilled = st->ntaken = st->nfreed = 0;
+  st->held    = 0;
+  st->stop    = 0;
+  st->stall   = 0.0;
+  st->nchunks = 0;
+
+  if ((st->slots = malloc (st->nslots * sizeof *st->slots)) == NULL)
+    data_exit_();
+
+  for (size_t k = 0; k < st->nslots; k++)
+    {
+      nnslot_ *slot = &st->slots[k];
+      double_ *inps, *outps;
+      if ((inps  = alloc_slab (nchunk * mtx_ld (hdr.ninps),  0)) == NULL
+       || (outps = alloc_slab (nchunk * mtx_ld (hdr.noutps), 0)) == NULL)
+        data_exit_();
+      mtx_view (&slot->inps,  inps,  nchunk, hdr.ninps);
+      mtx_view (&slot->outps, outps, nchunk, hdr.noutps);
+    }
+
+  pthread_mutex_init (&st->mtx, NULL);
+  pthread_cond_init  (&st->filled, NULL);
+  pthread_cond_init  (&st->freed,  NULL);
+  if (pthread_create (&st->io, NULL, stream_io_, st) != 0)
+    {
+      fprintf (stderr, "data_stream_open(): %s\n", "Could not create thread ...");
+      exit (1);
+    }
+
+  return st;
+}
+
+nnsource_ *data_stream_source (nnstream_ *st)
+{
+  return &st->src;
+}
+
+void data_stream_shape (nnstream_ *st, size_t *nexamples, 
+                        size_t *ninps, size_t *noutps)
+{
+  *nexamples = st->hdr.nexamples;
+  *ninps     = st->hdr.ninps;
+  *noutps    = st->hdr.noutps;
+}
+
+double data_stream_stall (nnstream_ *st, size_t *nchunks)
+{
+  pthread_mutex_lock (&st->mtx);
+  double stall = st->stall;
+  *nchunks = st->nchunks;
+  pthread_mutex_unlock (&st->mtx);
+  return stall;
+}
+
+void data_stream_close (nnstream_ *st)
+{
+  if (st == NULL)
+    return;
+
+  pthread_mutex_lock (&st->mtx);
+  st->stop = 1;
+  pthread_cond_signal (&st->freed);
+  pthread_mutex_unlock (&st->mtx);
+  pthread_join (st->io, NULL);
+
+  for (size_t k = 0; k < st->nslots; k++)
+    {
+      free_slab (st->slots[k].inps.data);
+      free_slab (st->slots[k].outps.data);
+    }
+  free (st->slots);
+
+  pthread_cond_destroy  (&st->filled);
+  pthread_cond_destroy  (&st->freed);
+  pthread_mutex_destroy (&st->mtx);
+  close (st->fd);
+  free (st);
+}
+
+/* ============================== IDX =============================== */
+
+/* IDX header fields are big-endian 32-bit integers */
+static int idx_read_u32_ (FILE *f, uint32_t *v)
+{
+  unsigned char b[4];
+  if (fread (b, 1, 4, f) != 4)
+    return 1;
+  *v = (uint32_t) b[0] << 24 | (uint32_t) b[1] << 16
+     | (uint32_t) b[2] <<  8 | (uint32_t) b[3];
+  return 0;
+}
+
+/* Open IDX file and read its header, NULL on failure */
+static FILE *
+idx_open_ (const char *path, const uint32_t magic,
+           uint32_t *dims, const size_t ndims)
+{
+  FILE *f;
+  if ((f = fopen (path, "rb")) == NULL)
+    {
+      fprintf (stderr, "data_load_idx(): could not open %s\n", path);
+      return NULL;
+    }
+
+  uint32_t m;
+  int err = idx_read_u32_ (f, &m) || m != magic;
+  for (size_t i = 0; i < ndims && ! err; i++)
+    err = idx_read_u32_ (f, &dims[i]);
+
+  if (err)
+    {
+      fprintf (stderr, "data_load_idx(): %s is not a valid IDX file\n", path);
+      fclose (f);
+      return NULL;
+    }
+  return f;
+}
+
+static int
+idx_read_ (FILE *fimgs, FILE *flabs, nnmtx inps, nnmtx outps)
+{
+  unsigned char *row;
+  if ((row = malloc (inps->ncols)) == NULL)
+    data_exit_();
+
+  int err = 0;
+  for (size_t i = 0; i < inps->nrows && ! err; i++)
+    {
+      int lab;
+      if (fread (row, 1, inps->ncols, fimgs) != inps->ncols
+       || (lab = fgetc (flabs)) == EOF || (size_t) lab >= outps->ncols)
+        {
+          err = 1;
+          break;
+        }
+
+      double_ *x = MTX_ROW (inps, i);
+      for (size_t j = 0; j < inps->ncols; j++)
+        x[j] = row[j] / (double_) 255;
+
+      MTX_ROW (outps, i)[lab] = 1;
+    }
+
+  free (row);
+  return err;
+}
+
+nndata_ *
+data_load_idx (const char *images, const char *labels, const size_t nlabels)
+{
+  uint32_t idims[3], ldims[1];
+  FILE *fimgs, *flabs;
+
+  if ((fimgs = idx_open_ (images, IDX_IMAGES, idims, 3)) == NULL)
+    return NULL;
+  if ((flabs = idx_open_ (labels, IDX_LABELS, ldims, 1)) == NULL)
+    {
+      fclose (fimgs);
+      return NULL;
+    }
+
+  nndata_ *data = NULL;
+  if (idims[0] != ldims[0])
+    fprintf (stderr, "data_load_idx(): # of images and labels differ\n");
+  else
+    {
+      const size_t n = idims[0], m = (size_t) idims[1] * idims[2];
+
+      data = data_alloc (n, m, nlabels);
+      if (idx_read_ (fimgs, flabs, &data->inps, &data->outps))
+        {
+          fprintf (stderr, "data_load_idx(): %s or %s is truncated "
+                           "or has labels >= %ld\n", images, labels, nlabels);
+          data_free (data);
+          data = NULL;
+        }
+    }
+
+  fclose (fimgs);
+  fclose (flabs);
+  return data;
+}
@@ -0,0 +1,170 @@
+#ifndef _NN_DATA_
+#define _NN_DATA_
+
+/**
+ *
+ * Data sets: inputs and expected outputs of a training set
+ *
+ * Binary data set file layout (all fields in host byte order):
+ *
+ *   header                     magic, version, byte order,
+ *                              sizeof (double_), MTX_ALIGN,
+ *                              # of examples, inputs and outputs,
+ *                              offsets of inputs and outputs blocks
+ *   double_ inps[n][ld]        inputs, rows padded with zeros to mtx_ld ()
+ *   double_ outps[n][ld]       expected outputs, padded the same way
+ *
+ * Both blocks start at MTX_ALIGN boundary, so that they are laid out
+ * exactly as nnmtx in memory and could be used right from the mapping
+ *
+ **/
+
+/**
+ *
+ * @struct nndata
+ * @brief Training set
+ *
+ * @var inps          inputs, one example per row
+ * @var outps         expected outputs, one example per row
+ * @var map           file mapping that inps and outps point into,
+ *                    NULL if they are allocated
+ * @var mapsize       size of the mapping in bytes
+ * @var refs          # of references, see data_ref()
+ *
+ **/
+typedef struct nndata_
+{
+  nnmtx_    inps;
+  nnmtx_   outps;
+  void      *map;
+  size_t mapsize;
+  size_t    refs;
+
+} nndata_;
+
+typedef nndata_* nndata;
+
+/**
+ *
+ * @brief Map binary data set file to memory, rows of inps and outps
+ *        point straight into the mapping, nothing is read or copied
+ *        until the pages are touched
+ *
+ * @param path      data set file (see data_save())
+ *
+ * @return data set, NULL if the file is not a valid data set of this
+ *         build (version, precision and alignment must match)
+ *
+ **/
+nndata data_load (const char *path);
+
+/**
+ *
+ * @brief Read MNIST-like data set in IDX format,
+ *        pixels are scaled to [0,1] and labels are one-hot encoded,
+ *        so unlike data_load() the examples are converted into
+ *        allocated matrices; convert once with data_save() to map them
+ *
+ * @param images    IDX file of unsigned byte images (magic 0x00000803)
+ * @param labels    IDX file of unsigned byte labels (magic 0x00000801)
+ * @param nlabels   # of possible labels (# of outputs)
+ *
+ * @return data set, NULL if files could not be read or don't match
+ *
+ **/
+nndata data_load_idx (const char *images, const char *labels,
+                      const size_t nlabels);
+
+/**
+ *
+ * @brief Write inputs and expected outputs to binary data set file
+ *
+ * @return 0 on success, 1 if the file could not be written
+ *
+ **/
+int data_save (const char *path, nnmtx inps, nnmtx outps);
+
+/**
+ *
+ * @brief Allocate data set of nexamples examples to be filled in,
+ *        expected outputs are set to 0.0
+ *
+ * @return data set, exits if it could not be allocated
+ *
+ **/
+nndata data_alloc (const size_t nexamples, const size_t ninps, 
+                   const size_t noutps);
+
+/**
+ *
+ * @brief Share data set, f.e. between networks trained on it at the
+ *        same time; data set is never modified once loaded or filled,
+ *        so it is read by any # of threads without locking
+ *
+ * @return the same data set, each data_ref() is undone by data_free()
+ *
+ **/
+nndata data_ref (nndata data);
+
+/**
+ *
+ * @brief Drop a reference to data set, 
+ *        it is unmapped or freed with the last one
+ *
+ **/
+void data_free (nndata data);
+
+/**
+ *
+ * Streamed data set: binary data set file is read chunk by chunk 
+ * into a ring of buffers by a background I/O thread, that keeps up to 
+ * depth chunks ready ahead of the one being trained on, and wraps around 
+ * to the first chunk after the last one, so the next pass is prefetched too
+ *
+ **/
+typedef struct nnstream_* nnstream;
+
+/**
+ *
+ * @brief Open binary data set file (see data_save()) for streaming 
+ *        and start prefetching its first chunks
+ *
+ * @param path      data set file
+ * @param nchunk    # of examples in a chunk
+ * @param depth     # of chunks read ahead, at least 1
+ *
+ * @return stream, NULL if the file is not a valid data set of this build
+ *
+ **/
+nnstream data_stream_open (const char *path, const size_t nchunk, 
+                           const size_t depth);
+
+/**
+ *
+ * @brief Source of examples to train on (see nn_backprop_stream())
+ *
+ **/
+nnsource data_stream_source (nnstream stream);
+
+/* # of examples in the data set, # of inputs and outputs per example */
+void data_stream_shape (nnstream stream, size_t *nexamples, 
+                        size_t *ninps, size_t *noutps);
+
+/**
+ *
+ * @brief Total time spent waiting for chunks that were not read yet,
+ *        if it is not close to 0, depth or nchunk should be increased
+ *
+ * @return stall time in seconds and # of chunks taken in nchunks
+ *
+ **/
+double data_stream_stall (nnstream stream, size_t *nchunks);
+
+/**
+ *
+ * @brief Stop I/O thread and free stream buffers
+ *
+ **/
+void data_stream_close (nnstream stream);
+
+#endif
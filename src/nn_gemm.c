@@ -0,0 +1,329 @@
+#include <stdlib.h>
+
+#include "nn_impl.h"
+#include "nn_gemm.h"
+#include "nn_simd.h"
+
+/**
+ *
+ * Tile sizes are chosen so that a KB x NB tile of B
+ * (KB * NB * 8 bytes = 32KB for doubles) stays in L1 while it is reused
+ * by all MB rows of A
+ *
+ **/
+#define GEMM_MB     64    /* rows of A (examples in a block) per tile */
+#define GEMM_NB     32    /* rows/columns of B per tile */
+#define GEMM_KB     128   /* reduction length per tile */
+
+#define MIN(a, b)   ((a) < (b) ? (a) : (b))
+
+/**
+ *
+ * c[j] += a0 * b0[j] + a1 * b1[j] + a2 * b2[j] + a3 * b3[j], j = j0..j1-1
+ *
+ * Four rows are folded in at once, so that c is loaded and stored
+ * once per four multiply-adds (see SIMD->axpy4)
+ *
+ **/
+static inline void
+axpy4_ (double_ *c, const size_t j0, const size_t j1,
+        const double_ a0, const double_ *b0,
+        const double_ a1, const double_ *b1,
+        const double_ a2, const double_ *b2,
+        const double_ a3, const double_ *b3)
+{
+  const double_ a[4] = { a0, a1, a2, a3 };
+  const double_ *b[4] = { b0 + j0, b1 + j0, b2 + j0, b3 + j0 };
+  SIMD->axpy4 (c + j0, a, b, j1 - j0);
+}
+
+static inline void
+axpy1_ (double_ *c, const size_t j0, const size_t j1,
+        const double_ a0, const double_ *b0)
+{
+  SIMD->axpy (c + j0, a0, b0 + j0, j1 - j0);
+}
+
+/**
+ *
+ * A * B^T is computed as A * P, where P is a transposed copy
+ * of the current KB x NB tile of B, so that the innermost loop
+ * runs over contiguous memory in both P and C
+ *
+ **/
+void gemm_nt (const size_t m, const size_t n, const size_t k,
+              const double_ *a, const size_t lda,
+              const double_ *b, const size_t ldb,
+              double_       *c, const size_t ldc)
+{
+  double_ pack[GEMM_KB * GEMM_NB];
+
+  for (size_t j0 = 0; j0 < n; j0 += GEMM_NB)
+    for (size_t p0 = 0; p0 < k; p0 += GEMM_KB)
+      {
+        size_t j1 = MIN (j0 + GEMM_NB, n), nj = j1 - j0;
+        size_t p1 = MIN (p0 + GEMM_KB, k), np = p1 - p0;
+
+        /* pack[p][j] = b[j0+j][p0+p] */
+        for (size_t j = 0; j < nj; j++)
+          for (size_t p = 0; p < np; p++)
+            pack[p * GEMM_NB + j] = b[(j0 + j) * ldb + p0 + p];
+
+        for (size_t i = 0; i < m; i++)
+          {
+            const double_ *a_i = a + i * lda + p0;
+            double_       *c_i = c + i * ldc + j0;
+            size_t p = 0;
+            for (; p + 4 <= np; p += 4)
+              axpy4_ (c_i, 0, nj,
+                      a_i[p],   pack +  p    * GEMM_NB,
+                      a_i[p+1], pack + (p+1) * GEMM_NB,
+                      a_i[p+2], pack + (p+2) * GEMM_NB,
+                      a_i[p+3], pack + (p+3) * GEMM_NB);
+            for (; p < np; p++)
+              axpy1_ (c_i, 0, nj, a_i[p], pack + p * GEMM_NB);
+          }
+      }
+}
+
+void gemm_nn (const size_t m, const size_t n, const size_t k,
+              const double_ *a, const size_t lda,
+              const double_ *b, const size_t ldb,
+              double_       *c, const size_t ldc)
+{
+  for (size_t j0 = 0; j0 < n; j0 += GEMM_KB)
+    for (size_t p0 = 0; p0 < k; p0 += GEMM_NB)
+      for (size_t i0 = 0; i0 < m; i0 += GEMM_MB)
+        {
+          size_t j1 = MIN (j0 + GEMM_KB, n);
+          size_t p1 = MIN (p0 + GEMM_NB, k);
+          size_t i1 = MIN (i0 + GEMM_MB, m);
+
+          for (size_t i = i0; i < i1; i++)
+            {
+              const double_ *a_i = a + i * lda;
+              double_       *c_i = c + i * ldc;
+              size_t p = p0;
+              for (; p + 4 <= p1; p += 4)
+                axpy4_ (c_i, j0, j1,
+                        a_i[p],   b +  p    * ldb,
+                        a_i[p+1], b + (p+1) * ldb,
+                        a_i[p+2], b + (p+2) * ldb,
+                        a_i[p+3], b + (p+3) * ldb);
+              for (; p < p1; p++)
+                axpy1_ (c_i, j0, j1, a_i[p], b + p * ldb);
+            }
+        }
+}
+
+void gemm_tn (const size_t m, const size_t n, const size_t k,
+              const double_ *a, const size_t lda,
+              const double_ *b, const size_t ldb,
+              double_       *c, const size_t ldc)
+{
+  for (size_t i0 = 0; i0 < m; i0 += GEMM_NB)
+    for (size_t j0 = 0; j0 < n; j0 += GEMM_KB)
+      for (size_t p0 = 0; p0 < k; p0 += GEMM_MB)
+        {
+          size_t i1 = MIN (i0 + GEMM_NB, m);
+          size_t j1 = MIN (j0 + GEMM_KB, n);
+          size_t p1 = MIN (p0 + GEMM_MB, k);
+
+          for (size_t i = i0; i < i1; i++)
+            {
+              double_ *c_i = c + i * ldc;
+              size_t p = p0;
+              for (; p + 4 <= p1; p += 4)
+                axpy4_ (c_i, j0, j1,
+                        a[ p    * lda + i], b +  p    * ldb,
+                        a[(p+1) * lda + i], b + (p+1) * ldb,
+                        a[(p+2) * lda + i], b + (p+2) * ldb,
+                        a[(p+3) * lda + i], b + (p+3) * ldb);
+              for (; p < p1; p++)
+                axpy1_ (c_i, j0, j1, a[p * lda + i], b + p * ldb);
+            }
+        }
+}
+
+/* Nonzero elements [*k0, *k1) of i'th row of block X */
+static inline void 
+csr_row_ (const nncsr_ *x, const size_t m0, const size_t *rows, 
+          const size_t i, size_t *k0, size_t *k1)
+{
+  size_t r = rows != NULL ? rows[m0 + i] : m0 + i;
+  *k0 = x->rowptr[r];
+  *k1 = x->rowptr[r + 1];
+}
+
+void csrmm_nn (const size_t m, const size_t n, 
+               const nncsr_ *x, const size_t m0, const size_t *rows,
+               const double_ *b, const size_t ldb,
+               double_       *c, const size_t ldc)
+{
+  for (size_t i = 0; i < m; i++)
+    {
+      size_t k0, k1;
+      csr_row_ (x, m0, rows, i, &k0, &k1);
+      double_ *c_i = c + i * ldc;
+      for (size_t k = k0; k < k1; k++)
+        SIMD->axpy (c_i, x->vals[k], b + x->cols[k] * ldb, n);
+    }
+}
+
+void csrmm_tn (const size_t m, const size_t n, 
+               const nncsr_ *x, const size_t m0, const size_t *rows,
+               const double_ *a, const size_t lda,
+               double_       *c, const size_t ldc)
+{
+  for (size_t i = 0; i < m; i++)
+    {
+      size_t k0, k1;
+      csr_row_ (x, m0, rows, i, &k0, &k1);
+      const double_ *a_i = a + i * lda;
+      for (size_t k = k0; k < k1; k++)
+        SIMD->axpy (c + x->cols[k] * ldc, x->vals[k], a_i, n);
+    }
+}
+
+void csrmm_nt (const size_t m, const size_t n, 
+               const nncsr_ *x, const size_t m0, const size_t *rows,
+               const double_ *b, const size_t ldb,
+               double_       *c, const size_t ldc)
+{
+  for (size_t i = 0; i < m; i++)
+    {
+      size_t k0, k1;
+      csr_row_ (x, m0, rows, i, &k0, &k1);
+      double_ *c_i = c + i * ldc;
+      for (size_t l = 0; l < n; l++)
+        {
+          const double_ *b_l = b + l * ldb;
+          double_ sum = 0.0;
+          for (size_t k = k0; k < k1; k++)
+            sum += x->vals[k] * b_l[x->cols[k]];
+          c_i[l] += sum;
+        }
+    }
+}
+
+void csrmm_tnt (const size_t m, const size_t n, 
+                const nncsr_ *x, const size_t m0, const size_t *rows,
+                const double_ *a, const size_t lda,
+                double_       *c, const size_t ldc)
+{
+  for (size_t i = 0; i < m; i++)
+    {
+      size_t k0, k1;
+      csr_row_ (x, m0, rows, i, &k0, &k1);
+      const double_ *a_i = a + i * lda;
+      for (size_t l = 0; l < n; l++)
+        {
+          double_ *c_l = c + l * ldc;
+          for (size_t k = k0; k < k1; k++)
+            c_l[x->cols[k]] += a_i[l] * x->vals[k];
+        }
+    }
+}
+
+/**
+ *
+ * Four rows of block row r of B (of C), rows past n repeat the last one,
+ * so that kernels need no tails; their results are discarded, 
+ * or their factors are 0
+ *
+ **/
+static inline size_t
+bsr_rows_ (const size_t r, const size_t n, size_t *rows)
+{
+  size_t i0 = r * BSR_ROWS, nr = MIN (BSR_ROWS, n - i0);
+  for (size_t k = 0; k < BSR_ROWS; k++)
+    rows[k] = i0 + MIN (k, nr - 1);
+  return nr;
+}
+
+/**
+ *
+ * Block row outer, so that the kept blocks of four rows of B stay 
+ * in L1 while all rows of A are streamed past them
+ *
+ **/
+void bsrmm_nt (const size_t m, const size_t n, const size_t k,
+               const nnbsr_ *bsr,
+               const double_ *a, const size_t lda,
+               const double_ *b, const size_t ldb,
+               double_       *c, const size_t ldc)
+{
+  for (size_t r = 0; r < bsr->nbrows; r++)
+    {
+      size_t rows[BSR_ROWS], nr = bsr_rows_ (r, n, rows);
+      const double_ *b_r[BSR_ROWS] = { b + rows[0] * ldb, b + rows[1] * ldb,
+                                       b + rows[2] * ldb, b + rows[3] * ldb };
+      size_t k0 = bsr->rowptr[r], nblocks = bsr->rowptr[r+1] - k0;
+      if (nblocks == 0)
+        continue;
+
+      for (size_t i = 0; i < m; i++)
+        {
+          double_ s[BSR_ROWS];
+          SIMD->bdot4 (s, a + i * lda, b_r, bsr->cols + k0, nblocks, 
+                       BSR_COLS, k);
+          double_ *c_i = c + i * ldc + r * BSR_ROWS;
+          for (size_t j = 0; j < nr; j++)
+            c_i[j] += s[j];
+        }
+    }
+}
+
+void bsrmm_nn (const size_t m, const size_t n, const size_t k,
+               const nnbsr_ *bsr,
+               const double_ *a, const size_t lda,
+               const double_ *b, const size_t ldb,
+               double_       *c, const size_t ldc)
+{
+  for (size_t r = 0; r < bsr->nbrows; r++)
+    {
+      size_t rows[BSR_ROWS], nr = bsr_rows_ (r, k, rows);
+      const double_ *b_r[BSR_ROWS] = { b + rows[0] * ldb, b + rows[1] * ldb,
+                                       b + rows[2] * ldb, b + rows[3] * ldb };
+      size_t k0 = bsr->rowptr[r], nblocks = bsr->rowptr[r+1] - k0;
+      if (nblocks == 0)
+        continue;
+
+      for (size_t i = 0; i < m; i++)
+        {
+          const double_ *a_i = a + i * lda + r * BSR_ROWS;
+          double_ f[BSR_ROWS] = { 0.0 };
+          for (size_t j = 0; j < nr; j++)
+            f[j] = a_i[j];
+          SIMD->baxpy4 (c + i * ldc, f, b_r, bsr->cols + k0, nblocks, 
+                        BSR_COLS, n);
+        }
+    }
+}
+
+void bsrmm_tn (const size_t m, const size_t n, const size_t k,
+               const nnbsr_ *bsr,
+               const double_ *a, const size_t lda,
+               const double_ *b, const size_t ldb,
+               double_       *c, const size_t ldc)
+{
+  for (size_t r = 0; r < bsr->nbrows; r++)
+    {
+      size_t rows[BSR_ROWS], nr = bsr_rows_ (r, m, rows);
+      double_ *c_r[BSR_ROWS] = { c + rows[0] * ldc, c + rows[1] * ldc,
+                                 c + rows[2] * ldc, c + rows[3] * ldc };
+      size_t k0 = bsr->rowptr[r], nblocks = bsr->rowptr[r+1] - k0;
+      if (nblocks == 0)
+        continue;
+
+      for (size_t p = 0; p < k; p++)
+        {
+          const double_ *a_p = a + p * lda + r * BSR_ROWS;
+          double_ f[BSR_ROWS] = { 0.0 };
+          for (size_t j = 0; j < nr; j++)
+            f[j] = a_p[j];
+          SIMD->bger4 (c_r, f, b + p * ldb, 
+                       bsr->cols + k0, nblocks, BSR_COLS, n);
+        }
+    }
+}
@@ -0,0 +1,206 @@
+#ifndef _NN_GEMM_
+#define _NN_GEMM_
+
+/**
+ *
+ * Cache-tiled dense matrix products used by the mini-batch
+ * forward and backward passes
+ *
+ * All matrices are row-major, ld* is the distance between rows
+ * (see nnmtx), so that a matrix could also be a sub-block of another one,
+ * f.e. weights without the bias column: w->data + N_BIAS, w->ld
+ *
+ * All functions accumulate into c, it should be initialized by the caller
+ *
+ **/
+
+/**
+ *
+ * @brief C += A * B^T
+ *
+ * @param m     # of rows in A and C
+ * @param n     # of rows in B and columns in C
+ * @param k     # of columns in A and B
+ *
+ **/
+void gemm_nt (const size_t m, const size_t n, const size_t k,
+              const double_ *a, const size_t lda,
+              const double_ *b, const size_t ldb,
+              double_       *c, const size_t ldc);
+
+/**
+ *
+ * @brief C += A * B
+ *
+ * @param m     # of rows in A and C
+ * @param n     # of columns in B and C
+ * @param k     # of columns in A and rows in B
+ *
+ **/
+void gemm_nn (const size_t m, const size_t n, const size_t k,
+              const double_ *a, const size_t lda,
+              const double_ *b, const size_t ldb,
+              double_       *c, const size_t ldc);
+
+/**
+ *
+ * @brief C += A^T * B
+ *
+ * @param m     # of columns in A and rows in C
+ * @param n     # of columns in B and C
+ * @param k     # of rows in A and B
+ *
+ **/
+void gemm_tn (const size_t m, const size_t n, const size_t k,
+              const double_ *a, const size_t lda,
+              const double_ *b, const size_t ldb,
+              double_       *c, const size_t ldc);
+
+/**
+ *
+ * Products with a block X of m rows of sparse matrix x (see nncsr),
+ * i'th row of X is row rows[m0 + i] of x, or m0 + i if rows is NULL,
+ * so a block of shuffled rows needs no copy; csrmm_nn() and csrmm_tn()
+ * use one contiguous row of B (of C) per nonzero element of X, 
+ * csrmm_nt() and csrmm_tnt() one column of B (of C) that is strided
+ *
+ **/
+
+/**
+ *
+ * @brief C += X * B
+ *
+ * @param m     # of rows in X and C
+ * @param n     # of columns in B and C, B has x->ncols rows
+ *
+ **/
+void csrmm_nn (const size_t m, const size_t n, 
+               const nncsr_ *x, const size_t m0, const size_t *rows,
+               const double_ *b, const size_t ldb,
+               double_       *c, const size_t ldc);
+
+/**
+ *
+ * @brief C += X^T * A
+ *
+ * @param m     # of rows in X and A
+ * @param n     # of columns in A and C, C has x->ncols rows
+ *
+ **/
+void csrmm_tn (const size_t m, const size_t n, 
+               const nncsr_ *x, const size_t m0, const size_t *rows,
+               const double_ *a, const size_t lda,
+               double_       *c, const size_t ldc);
+
+/**
+ *
+ * @brief C += X * B^T
+ *
+ * @param m     # of rows in X and C
+ * @param n     # of rows in B and columns in C, B has x->ncols columns
+ *
+ **/
+void csrmm_nt (const size_t m, const size_t n, 
+               const nncsr_ *x, const size_t m0, const size_t *rows,
+               const double_ *b, const size_t ldb,
+               double_       *c, const size_t ldc);
+
+/**
+ *
+ * @brief C += A^T * X
+ *
+ * @param m     # of rows in X and A
+ * @param n     # of columns in A and rows in C, C has x->ncols columns
+ *
+ **/
+void csrmm_tnt (const size_t m, const size_t n, 
+                const nncsr_ *x, const size_t m0, const size_t *rows,
+                const double_ *a, const size_t lda,
+                double_       *c, const size_t ldc);
+
+/**
+ *
+ * @struct nnbsr
+ * @brief Index of the nonzero blocks of a dense matrix in block sparse
+ *        row format, a block is BSR_ROWS rows by BSR_COLS columns,
+ *        the last block row and column could be partial; the values
+ *        stay in the dense matrix, zeros in the blocks that are not
+ *        indexed (see nn_prune())
+ *
+ * @var cols          block column of every kept block, block row by row
+ * @var rowptr        nbrows + 1 offsets, kept blocks of block row r are 
+ *                    cols[rowptr[r]], ..., cols[rowptr[r+1] - 1]
+ * @var keep          nbrows x nbcols, 1 if the block is kept
+ * @var nbrows        # of block rows
+ * @var nbcols        # of block columns
+ * @var nblocks       # of kept blocks
+ *
+ **/
+#define BSR_ROWS    4     /* rows per block, one SIMD->bdot4 */
+#define BSR_COLS    16    /* columns per block, whole cache lines */
+
+typedef struct nnbsr_
+{
+  uint32_t   *cols;
+  size_t   *rowptr;
+  uint8_t    *keep;
+  size_t    nbrows;
+  size_t    nbcols;
+  size_t   nblocks;
+
+} nnbsr_;
+
+/**
+ *
+ * Products with a matrix B (of C) whose zero blocks are skipped,
+ * bsr is the index of its kept blocks, four rows of a block are 
+ * folded in at once, like in gemm_*() above
+ *
+ **/
+
+/**
+ *
+ * @brief C += A * B^T
+ *
+ * @param m     # of rows in A and C
+ * @param n     # of rows in B and columns in C
+ * @param k     # of columns in A and B
+ *
+ **/
+void bsrmm_nt (const size_t m, const size_t n, const size_t k,
+               const nnbsr_ *bsr,
+               const double_ *a, const size_t lda,
+               const double_ *b, const size_t ldb,
+               double_       *c, const size_t ldc);
+
+/**
+ *
+ * @brief C += A * B
+ *
+ * @param m     # of rows in A and C
+ * @param n     # of columns in B and C
+ * @param k     # of columns in A and rows in B
+ *
+ **/
+void bsrmm_nn (const size_t m, const size_t n, const size_t k,
+               const nnbsr_ *bsr,
+               const double_ *a, const size_t lda,
+               const double_ *b, const size_t ldb,
+               double_       *c, const size_t ldc);
+
+/**
+ *
+ * @brief C += A^T * B, only the kept blocks of C are accumulated
+ *
+ * @param m     # of columns in A and rows in C
+ * @param n     # of columns in B and C
+ * @param k     # of rows in A and B
+ *
+ **/
+void bsrmm_tn (const size_t m, const size_t n, const size_t k,
+               const nnbsr_ *bsr,
+               const double_ *a, const size_t lda,
+               const double_ *b, const size_t ldb,
+               double_       *c, const size_t ldc);
+
+#endif
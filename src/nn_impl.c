@@ -1,10 +1,20 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "nn_impl.h"
 #include "nn_rnd.h"
 #include "nn_alloc.h"
+#include "nn_gemm.h"
+#include "nn_simd.h"
 
 #define BIAS_ACTIVATION   1.0   /* static bias unit activation value */
 
@@ -12,6 +22,17 @@
 #define N_OUTP_LAYERS     1     /* # of output layers */
 #define N_BIAS            1     /* # of bias units in each layer */
 
+#define ADAM_EPS          1e-8  /* added to sqrt of Adam second moment */
+#define SPARSE_TRANSPOSE  1.0   /* nonzeros per update per input, see below */
+#define QNET_ALIGN        64    /* int8 row padding, one VNNI vector */
+#define QNET_UMAX         255   /* largest uint8 step of layer inputs */
+#define QNET_WMAX         127   /* largest |int8| step of weights */
+#define BSR_DENSITY_MAX   0.75  /* largest fraction of kept blocks for
+                                   block sparse products, see below */
+
+/* Stream of the order of examples, streams 0, 1, ... are networks weights */
+#define SHUFFLE_STREAM(id)  ((id) | UINT64_C(1) << 63)
+
 
 /* ========================== STRUCTURES ============================= */
 
@@ -33,7 +54,10 @@
  * @var units         non-bias units activation values
  * @var nunits        # of units in layer
  * @var weights       outcoming weights from units in this layer
- *                                        to units in next layer
+ *                                        to units in next layer,
+ *                    view into the network weights slab
+ * @var bsr           kept blocks of weights without bias, 
+ *                    NULL unless pruned (see nn_prune())
  *
  **/
 typedef struct nnlayer_ 
@@ -42,7 +66,8 @@ typedef struct nnlayer_
   struct nnlayer_ *next;
   double_        *units;
   size_t         nunits;
-  double_     **weights;
+  nnmtx_        weights;
+  nnbsr_           *bsr;
 
 } nnlayer_;
 
@@ -56,6 +81,12 @@ typedef struct nnlayer_
  * @var outp          output layer
  * @var expoutp       expected result for particular input
  * @var nhid          # of hidden layers
+ * @var wslab         single slab with weights of all layers
+ * @var uslab         single slab with units of hidden and output layers
+ * @var map           checkpoint mapping that wslab points into,
+ *                    NULL if wslab is allocated (see nn_load())
+ * @var mapsize       size of the mapping in bytes
+ * @var fast_sigmoid  1 to use approximate sigmoid (see nn_set_fast_sigmoid())
  *
  **/
 typedef struct nnetwork_ 
@@ -65,6 +96,11 @@ typedef struct nnetwork_
   nnlayer_   *outp;
   double_ *expoutp;
   size_t      nhid;
+  double_   *wslab;
+  double_   *uslab;
+  void        *map;
+  size_t   mapsize;
+  int fast_sigmoid;
 
 } nnetwork_;
 
@@ -78,6 +114,28 @@ typedef struct nnetwork_
  * @var learn_p       learning parameter
  * @var regur_p       regularization parameter, 0 if non-regularized
  * @var dist          distance function
+ * @var nbatch        # of examples propagated together, 1 if one by one
+ * @var minibatch     # of examples per weights update, 0 - all of them
+ * @var nworkers      # of threads that share examples, 0 - one per core
+ * @var cost_every_n  report cost every n'th iteration, 0 - never
+ * @var seed          seed of random numbers, network id is the stream
+ * @var opt           weights update rule
+ * @var beta1         momentum, decay of Adam first moment
+ * @var beta2         decay of Adam second moment
+ * @var lr_sched      learning rate schedule
+ * @var warmup        # of warm-up iterations
+ * @var period        # of iterations between learning rate steps
+ * @var gamma         learning rate step factor, final fraction for cosine
+ * @var report        receiver of per-iteration records
+ * @var report_ctx    passed to report
+ * @var vinps         validation inputs, NULL if none
+ * @var voutps        validation expected outputs
+ * @var valid_every   validate every n'th iteration, 0 - only at the end
+ * @var patience      # of validations without improvement to stop after
+ * @var min_delta     least decrease of validation cost to improve
+ * @var target        validation cost to stop at, 0 - never
+ * @var labels        class index of every example, NULL if outputs are rows
+ * @var vlabels       class index of every validation example, the same way
  *
  **/
 typedef struct nnparams_ 
@@ -87,33 +145,75 @@ typedef struct nnparams_
   double_  learn_p;
   double_  regur_p;
   dist_f      dist;
+  size_t    nbatch;
+  size_t minibatch;
+  size_t  nworkers;
+  size_t cost_every_n;
+  uint64_t    seed;
+  nnopt        opt;
+  double_    beta1;
+  double_    beta2;
+  nnlr    lr_sched;
+  size_t    warmup;
+  size_t    period;
+  double_    gamma;
+  report_f  report;
+  void *report_ctx;
+  nnmtx      vinps;
+  nnmtx     voutps;
+  size_t valid_every;
+  size_t  patience;
+  double_ min_delta;
+  double_   target;
+  const uint32_t *labels;
+  const uint32_t *vlabels;
 
 } nnparams_;
 
 /* ====================== NETWORK INITIALIZATION ======================== */
 
-void nn_destroy (nnetwork_ *netw_p)
+static void free_bsr_ (nnbsr_ *bsr)
+{
+  if (bsr == NULL)
+    return;
+  free (bsr->cols);
+  free (bsr->rowptr);
+  free (bsr->keep);
+  free (bsr);
+}
+
+static void nn_free_ (nnetwork_ *netw_p)
 {
   /* Destroy input layer */
   nnlayer_ *inp  = netw_p->inp;
   nnlayer_ *next = inp->next;
-  free_mtx (inp->weights, inp->next->nunits);
+  free_bsr_ (inp->bsr);
   free (inp);
 
   /* Destroy hidden layers */
   for (nnlayer_ *hid = next; hid != netw_p->outp; hid = next)
     {
-      free_mtx (hid->weights, hid->next->nunits);
-      free (hid->units);
       next = hid->next;
+      free_bsr_ (hid->bsr);
       free (hid);
     }
 
   /* Destroy output layer */
-  free (netw_p->outp->units);
   free (netw_p->outp);
 
+  /* Destroy weights and units of all layers */
+  if (netw_p->map != NULL)
+    munmap (netw_p->map, netw_p->mapsize);
+  else
+    free_slab (netw_p->wslab);
+  free_slab (netw_p->uslab);
+
   free (netw_p);
+}
+
+void nn_destroy (nnetwork_ *netw_p)
+{
+  nn_free_ (netw_p);
   puts ("Network successfully destroyed");
 }
 
@@ -130,7 +230,7 @@ static void nn_exit_ (nnetwork_ *netw_p)
   exit (1);
 }
 
-static int nn_example_prop_ (nnetwork_ *netw_p, double *inp, double *outp)
+static int nn_example_prop_ (nnetwork_ *netw_p, double_ *inp, double_ *outp)
 {
   if (inp == NULL || outp == NULL)
     {
@@ -144,26 +244,49 @@ static int nn_example_prop_ (nnetwork_ *netw_p, double *inp, double *outp)
 
 static void nn_alloc_layers_units_ (nnetwork_ *netw_p)
 {
+  size_t nunits = 0;
+  for (nnlayer_ *curr = netw_p->inp; curr != netw_p->outp; curr = curr->next)
+    nunits += mtx_ld (curr->next->nunits);
+
+  double_ *units;
+  if ((units = netw_p->uslab = alloc_slab (nunits, 1)) == NULL)
+    nn_exit_ (netw_p);
+
   for (nnlayer_ *curr = netw_p->inp; curr != netw_p->outp; curr = curr->next)
     {
-      double_ *units;
-      if ((units = malloc (curr->next->nunits * sizeof *units)) == NULL)
-        nn_exit_ (netw_p);
       curr->next->units = units;
+      units += mtx_ld (curr->next->nunits);
     }
 }
 
-static void nn_alloc_layers_weights_ (nnetwork_ *netw_p)
+/* # of elements in the weights slab of all layers, including row padding */
+static size_t nn_layers_nweights_ (nnetwork_ *netw_p)
 {
+  size_t nweights = 0;
   for (nnlayer_ *curr = netw_p->inp; curr != netw_p->outp; curr = curr->next)
-    {
-      double_ **ws;
-      size_t ncurr = curr->nunits;
-      size_t nnext = curr->next->nunits;
-      if ((ws = alloc_mtx (nnext, N_BIAS + ncurr, 0)) == NULL)
-        nn_exit_ (netw_p);
-      curr->weights = ws;
-    }
+    nweights += curr->next->nunits * mtx_ld (N_BIAS + curr->nunits);
+  return nweights;
+}
+
+/* Point weights of all layers into consecutive blocks of slab ws */
+static void nn_view_layers_weights_ (nnetwork_ *netw_p, double_ *ws)
+{
+  netw_p->wslab = ws;
+  for (nnlayer_ *curr = netw_p->inp; curr != netw_p->outp; curr = curr->next)
+    ws = mtx_view (&curr->weights, ws, curr->next->nunits, N_BIAS + curr->nunits);
+
+  /* Output layer has no outcoming weights */
+  mtx_view (&netw_p->outp->weights, NULL, 0, 0);
+}
+
+static void nn_alloc_layers_weights_ (nnetwork_ *netw_p)
+{
+  /* Zeroed, so that padding between rows is safe to read */
+  double_ *ws;
+  if ((ws = alloc_slab (nn_layers_nweights_ (netw_p), 1)) == NULL)
+    nn_exit_ (netw_p);
+
+  nn_view_layers_weights_ (netw_p, ws);
 }
 
 static void 
@@ -178,6 +301,7 @@ nn_alloc_layers_ (nnetwork_ *netw_p,
     nn_exit_ (netw_p);
   inp->prev = NULL;
   inp->nunits = ninpunits;
+  inp->bsr = NULL;
 
   nnlayer_ *prev = netw_p->inp = inp;
 
@@ -190,6 +314,7 @@ nn_alloc_layers_ (nnetwork_ *netw_p,
       prev->next = curr;
       curr->prev = prev;
       curr->nunits = nhidunits[i];
+      curr->bsr = NULL;
       prev = curr;
     }
 
@@ -199,35 +324,103 @@ nn_alloc_layers_ (nnetwork_ *netw_p,
     nn_exit_ (netw_p);
 
   outp->prev = prev;
+  outp->next = NULL;
   outp->nunits = noutpunits;
+  outp->bsr = NULL;
   prev->next = netw_p->outp = outp;
 
   /* Alocate units for hidden and output layers */
   nn_alloc_layers_units_ (netw_p);
+}
 
-  /* Allocate weights for input and hidden layers */
-  nn_alloc_layers_weights_ (netw_p);
+/* Network of the same id and topology, with zeroed weights */
+static nnetwork_ *nn_alloc_like_ (nnetwork_ *netw_p)
+{
+  size_t nhidunits[netw_p->nhid + 1], k = 0;
+  for (nnlayer_ *hid = netw_p->inp->next; hid != netw_p->outp; hid = hid->next)
+    nhidunits[k++] = hid->nunits;
+
+  nnetwork_ *like;
+  if ((like = malloc (sizeof *like)) == NULL)
+    nn_exit_ (NULL);
+
+  like->id   = netw_p->id;
+  like->nhid = netw_p->nhid;
+  like->map  = NULL;
+  like->fast_sigmoid = netw_p->fast_sigmoid;
+
+  nn_alloc_layers_ (like, netw_p->inp->nunits, nhidunits, 
+                    netw_p->outp->nunits);
+  nn_alloc_layers_weights_ (like);
+  return like;
 }
 
-static void nn_rnd_weights_alloc_ (nnetwork_ *netw_p)
+static void nn_rnd_weights_alloc_ (nnetwork_ *netw_p, const uint64_t seed)
 {
+  /* Own stream of the network, independent of the calling thread */
+  nnrng_ rng;
+  rnd_init (&rng, seed, netw_p->id);
+
   /* Generate for input layer */
   nnlayer_ *inp = netw_p->inp;
-  rnd_mtx_gen (inp->weights, inp->next->nunits, N_BIAS + inp->nunits);
+  rnd_mtx_fill (&rng, &inp->weights);
 
   /* Generate for hidden layers */
   for (nnlayer_ *hid = inp->next; hid != netw_p->outp; hid = hid->next)
-    rnd_mtx_gen (hid->weights, hid->next->nunits, N_BIAS + hid->nunits);
+    rnd_mtx_fill (&rng, &hid->weights);
 }
 
-void nn_weights_init (nnetwork_ *netw_p, double_ ***ws)
+size_t nn_ninps (nnetwork_ *netw_p)
+{
+  return netw_p->inp->nunits;
+}
+
+size_t nn_noutps (nnetwork_ *netw_p)
+{
+  return netw_p->outp->nunits;
+}
+
+void nn_set_fast_sigmoid (nnetwork_ *netw_p, const int fast)
+{
+  netw_p->fast_sigmoid = fast;
+}
+
+/* New weights are dense, blocks pruned before are multiplied again */
+static void unprune_ (nnetwork_ *netw_p)
 {
-  /* Input and hidden layers weights */
   for (nnlayer_ *curr = netw_p->inp; curr != netw_p->outp; curr = curr->next)
-    curr->weights = *ws++;
+    {
+      free_bsr_ (curr->bsr);
+      curr->bsr = NULL;
+    }
+}
+
+void nn_weights_rnd (nnetwork_ *netw_p, nnparams_ *nparams_p)
+{
+  unprune_ (netw_p);
+  nn_rnd_weights_alloc_ (netw_p, nparams_p->seed);
+}
+
+int nn_weights_init (nnetwork_ *netw_p, nnmtx *ws)
+{
+  unprune_ (netw_p);
 
-  /* Output layer weights */
-  netw_p->outp->weights = NULL;
+  /* Input and hidden layers weights */
+  for (nnlayer_ *curr = netw_p->inp; curr != netw_p->outp; curr = curr->next)
+    {
+      nnmtx_ *w = &curr->weights;
+      nnmtx  src = *ws++;
+      if (src->nrows != w->nrows || src->ncols != w->ncols)
+        {
+          fprintf (stderr, "nn_weights_init(): weights shape mismatch "
+                           "(%ldx%ld, expected %ldx%ld)\n",
+                   src->nrows, src->ncols, w->nrows, w->ncols);
+          return 1;
+        }
+      for (size_t i = 0; i < w->nrows; i++)
+        memcpy (MTX_ROW (w, i), MTX_ROW (src, i), w->ncols * sizeof *w->data);
+    }
+  return 0;
 }
 
 nnetwork_ *
@@ -241,12 +434,17 @@ nn_alloc (const size_t id,
 
   netw_p->id   = id;
   netw_p->nhid = nhid;
+  netw_p->map  = NULL;
+  netw_p->fast_sigmoid = 0;
 
   /* Allocate and define layers */
   nn_alloc_layers_ (netw_p, ninpunits, nhidunits, noutpunits);
 
-  /* Set random Un([0,1]) weights */
-  nn_rnd_weights_alloc_ (netw_p);
+  /* Allocate weights for input and hidden layers */
+  nn_alloc_layers_weights_ (netw_p);
+
+  /* Set random Un([0,1)) weights */
+  nn_rnd_weights_alloc_ (netw_p, RND_SEED);
 
   return netw_p;
 }
@@ -262,262 +460,3229 @@ nn_alloc_nparams (const size_t nexamples, const size_t niters,
   ps->learn_p   = learn_p;
   ps->regur_p   = regur_p;
   ps->dist      = dist;
+  ps->nbatch    = 1;
+  ps->minibatch = 0;
+  ps->nworkers  = 1;
+  ps->cost_every_n = 1;
+  ps->seed      = RND_SEED;
+  ps->opt       = NN_OPT_SGD;
+  ps->beta1     = 0.9;
+  ps->beta2     = 0.999;
+  ps->lr_sched  = NN_LR_CONST;
+  ps->warmup    = 0;
+  ps->period    = 0;
+  ps->gamma     = 1.0;
+  ps->report    = nn_report_print;
+  ps->report_ctx = NULL;
+  ps->vinps     = NULL;
+  ps->voutps    = NULL;
+  ps->valid_every = 0;
+  ps->patience  = 0;
+  ps->min_delta = 0.0;
+  ps->target    = 0.0;
+  ps->labels    = NULL;
+  ps->vlabels   = NULL;
   return ps;
 }
 
-/* ========================= COST FUNCTION ============================ */
+void nn_set_nbatch (nnparams_ *nparams_p, const size_t nbatch)
+{
+  nparams_p->nbatch = nbatch > 0 ? nbatch : 1;
+}
 
-static const double_ sigmoid_ (const double_ x)
+void nn_set_minibatch (nnparams_ *nparams_p, const size_t minibatch)
 {
-  return 1 / (1 + exp (-x));
+  nparams_p->minibatch = minibatch;
 }
 
-static const double_ sigmoid_grad_ (const double_ s)
+void nn_set_nworkers (nnparams_ *nparams_p, const size_t nworkers)
 {
-  return s * (1 - s);
+  nparams_p->nworkers = nworkers;
 }
 
-static void sigmoid_map_ (double_ *a_i, const size_t n)
+void nn_set_cost_every (nnparams_ *nparams_p, const size_t cost_every_n)
 {
-  for (size_t j = 0; j < n; j++)
-    a_i[j] = sigmoid_ (a_i[j]);
+  nparams_p->cost_every_n = cost_every_n;
 }
 
-/**
- *
- * gsl/gsl_blas matrix multiplication alternative solution doesn't provide 
- * better performance when compared to straightforward multiplication
- *
- **/
-static void linear_prop_ (nnlayer_ *lay)
+void nn_set_seed (nnparams_ *nparams_p, const uint64_t seed)
 {
-  nnlayer_ *prev = lay->prev;
+  nparams_p->seed = seed;
+}
 
-  for (size_t i = 0; i < lay->nunits; i++)
-    {
-      double_ unit_i = BIAS_ACTIVATION * prev->weights[i][0];
-      for (size_t j = N_BIAS; j < lay->nunits; j++)
-        unit_i += prev->units[j-1] * prev->weights[i][j];
-      lay->units[i] = unit_i;
-    }
+void 
+nn_set_optimizer (nnparams_ *nparams_p, const nnopt opt, 
+                  const double_ beta1, const double_ beta2)
+{
+  nparams_p->opt   = opt;
+  nparams_p->beta1 = beta1;
+  nparams_p->beta2 = beta2;
 }
 
-static void feedforward_ (nnlayer_ *lay)
+void 
+nn_set_lr_schedule (nnparams_ *nparams_p, const nnlr sched, 
+                    const size_t warmup, const size_t period, 
+                    const double_ gamma)
 {
-  linear_prop_ (lay);
-  sigmoid_map_ (lay->units, lay->nunits);
+  nparams_p->lr_sched = sched;
+  nparams_p->warmup   = warmup;
+  nparams_p->period   = period;
+  nparams_p->gamma    = gamma;
 }
 
-static void compute_hypotheses_ (nnetwork_ *netw_p)
+void nn_set_report (nnparams_ *nparams_p, report_f report, void *ctx)
 {
-  for (nnlayer_ *curr = netw_p->inp; curr != netw_p->outp; curr = curr->next)
-    feedforward_ (curr->next);
+  nparams_p->report     = report;
+  nparams_p->report_ctx = ctx;
 }
 
-static const double_ costfunc_example_ (nnetwork_ *netw_p, dist_f dist)
+void 
+nn_set_validation (nnparams_ *nparams_p, nnmtx vinps, nnmtx voutps, 
+                   const size_t every_n)
 {
-  /* Feedforward propagation: set output layer units activations */
-  compute_hypotheses_ (netw_p);
+  /* Empty validation set is no validation set */
+  int none = vinps == NULL || vinps->nrows == 0;
+  nparams_p->vinps       = none ? NULL : vinps;
+  nparams_p->voutps      = none ? NULL : voutps;
+  nparams_p->valid_every = every_n;
+}
 
-  double_ cost = 0.0;
-  for (size_t k = 0; k < netw_p->outp->nunits; k++)
+void 
+nn_set_early_stop (nnparams_ *nparams_p, const size_t patience, 
+                   const double_ min_delta, const double_ target)
+{
+  nparams_p->patience  = patience;
+  nparams_p->min_delta = min_delta;
+  nparams_p->target    = target;
+}
+
+void 
+nn_set_labels (nnparams_ *nparams_p, const uint32_t *labels, 
+               const uint32_t *vlabels)
+{
+  nparams_p->labels  = labels;
+  nparams_p->vlabels = vlabels;
+}
+
+/* ========================== CHECKPOINT ============================ */
+
+/**
+ *
+ * Checkpoint file layout (all fields in host byte order):
+ *
+ *   nnckpt_ header
+ *   uint64_t nunits[nlayers]         # of units in each layer, input first
+ *   zero padding up to offset        offset is a multiple of MTX_ALIGN
+ *   double_  weights[nweights]       network weights slab as is, layer by
+ *                                    layer, rows padded to mtx_ld ()
+ *
+ * so that the weights block of a mapped file is a valid weights slab
+ *
+ **/
+#define CKPT_MAGIC        "NNCKPT"
+#define CKPT_VERSION      1
+#define CKPT_BYTEORDER    0x01020304
+
+typedef struct nnckpt_
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t byteorder;
+  uint32_t fsize;         /* sizeof (double_) */
+  uint32_t align;         /* MTX_ALIGN, rows padding depends on it */
+  uint64_t nlayers;
+  uint64_t offset;        /* weights block offset from the file start */
+  uint64_t nweights;      /* # of elements in weights block */
+
+} nnckpt_;
+
+static size_t ckpt_offset_ (const size_t nlayers)
+{
+  size_t size = sizeof (nnckpt_) + nlayers * sizeof (uint64_t);
+  return (size + MTX_ALIGN - 1) / MTX_ALIGN * MTX_ALIGN;
+}
+
+static int ckpt_write_ (nnetwork_ *netw_p, FILE *f)
+{
+  nnckpt_ hdr;
+  memset (&hdr, 0, sizeof hdr);
+  memcpy (hdr.magic, CKPT_MAGIC, sizeof CKPT_MAGIC);
+  hdr.version   = CKPT_VERSION;
+  hdr.byteorder = CKPT_BYTEORDER;
+  hdr.fsize     = sizeof (double_);
+  hdr.align     = MTX_ALIGN;
+  hdr.nlayers   = N_INP_LAYERS + netw_p->nhid + N_OUTP_LAYERS;
+  hdr.offset    = ckpt_offset_ (hdr.nlayers);
+  hdr.nweights  = nn_layers_nweights_ (netw_p);
+
+  if (fwrite (&hdr, sizeof hdr, 1, f) != 1)
+    return 1;
+
+  for (nnlayer_ *curr = netw_p->inp; curr != NULL; curr = curr->next)
     {
-      double_ y_k = netw_p->expoutp[k];
-      double_ h_k = netw_p->outp->units[k];
-      cost += dist (y_k, h_k);
+      uint64_t nunits = curr->nunits;
+      if (fwrite (&nunits, sizeof nunits, 1, f) != 1)
+        return 1;
     }
-  return cost;
+
+  static const char pad[MTX_ALIGN];
+  size_t npad = hdr.offset - sizeof hdr - hdr.nlayers * sizeof (uint64_t);
+  if (npad > 0 && fwrite (pad, 1, npad, f) != npad)
+    return 1;
+
+  if (fwrite (netw_p->wslab, sizeof (double_), hdr.nweights, f) != hdr.nweights)
+    return 1;
+
+  return 0;
 }
 
-static const double_ nn_regur_ (nnetwork_ *netw_p)
+int nn_save (nnetwork_ *netw_p, const char *path)
 {
-  int regur = 0.0;
+  /* Write to a temporary file and rename it, 
+     so that a reader never maps a half-written checkpoint */
+  char *tmp;
+  if ((tmp = malloc (strlen (path) + sizeof ".tmp")) == NULL)
+    nn_exit_ (NULL);
+  strcpy (tmp, path);
+  strcat (tmp, ".tmp");
+
+  FILE *f;
+  if ((f = fopen (tmp, "wb")) == NULL)
+    {
+      fprintf (stderr, "nn_save(): could not open %s\n", tmp);
+      free (tmp);
+      return 1;
+    }
 
-  for (nnlayer_ *curr = netw_p->inp; curr != netw_p->outp; curr = curr->next)
+  int err = ckpt_write_ (netw_p, f);
+  err |= fclose (f) != 0;
+  if (! err)
+    err = rename (tmp, path) != 0;
+
+  if (err)
     {
-      size_t ncurr = curr->nunits;
-      size_t nnext = curr->next->nunits;
-      for (size_t i = 0; i < nnext; i++)   
-        /* don't regularize bias unit */
-        for (size_t j = N_BIAS; j < N_BIAS + ncurr; j++)
-          {
-            double_ weight_ij = curr->weights[i][j];
-            regur += weight_ij * weight_ij;
-          }
+      fprintf (stderr, "nn_save(): could not write %s\n", path);
+      remove (tmp);
     }
-  return regur;
+  free (tmp);
+  return err;
 }
 
-const double_ sqdist (const double_ x, const double_ y)
+/* Check header of the mapped file, 0 if it is a valid checkpoint */
+static int ckpt_check_ (const nnckpt_ *hdr, const size_t size)
 {
-  return (x-y)*(x-y);
+  if (size < sizeof *hdr || memcmp (hdr->magic, CKPT_MAGIC, sizeof CKPT_MAGIC))
+    return 1;
+  if (hdr->version != CKPT_VERSION || hdr->byteorder != CKPT_BYTEORDER)
+    return 1;
+  if (hdr->fsize != sizeof (double_) || hdr->align != MTX_ALIGN)
+    return 1;
+  /* # of layers is bounded by the file first, so that the offset
+     can't overflow and the units of all layers are mapped */
+  if (hdr->nlayers < N_INP_LAYERS + N_OUTP_LAYERS
+   || hdr->nlayers > (size - sizeof *hdr) / sizeof (uint64_t)
+   || hdr->offset != ckpt_offset_ (hdr->nlayers))
+    return 1;
+  if (hdr->offset > size 
+   || hdr->nweights > (size - hdr->offset) / sizeof (double_))
+    return 1;
+  return 0;
 }
 
-const double_ logdist (const double_ x, const double_ y)
+/**
+ *
+ * Check that units of every layer of the header make exactly 
+ * hdr->nweights weights (see nn_layers_nweights_()), without overflow 
+ * and before anything is allocated, 0 if they do
+ *
+ **/
+static int ckpt_check_topology_ (const nnckpt_ *hdr)
 {
-  return x * log (y) + (1-x) * log (1-y);
+  const uint64_t *nunits = (const uint64_t *) (hdr + 1);
+  const size_t maxw = hdr->nweights;
+
+  size_t nweights = 0;
+  for (size_t i = 0; i + 1 < hdr->nlayers; i++)
+    {
+      /* A layer with more units than weights can't match */
+      if (nunits[i] == 0 || nunits[i + 1] == 0 
+       || nunits[i] >= maxw || nunits[i + 1] > maxw)
+        return 1;
+
+      size_t ld = mtx_ld (N_BIAS + nunits[i]);
+      if (ld > maxw / nunits[i + 1] 
+       || ld * nunits[i + 1] > maxw - nweights)
+        return 1;
+      nweights += ld * nunits[i + 1];
+    }
+  return nweights != maxw;
 }
 
-const double_ 
-nn_costfunc (nnetwork_ *netw_p, double_ **inps, double_ **outps, 
-             nnparams_ *nparams_p)
+nnetwork_ *nn_load (const size_t id, const char *path)
 {
-  double_ cost = 0.0;
-  double_ lambda = nparams_p->regur_p;
-  size_t       m = nparams_p->nexamples;
+  int fd;
+  if ((fd = open (path, O_RDONLY)) < 0)
+    {
+      fprintf (stderr, "nn_load(): could not open %s\n", path);
+      return NULL;
+    }
+
+  /* Private mapping, so that weights could still be trained in place
+     without touching the file (pages are copied on first write only) */
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat (fd, &st) == 0 && st.st_size > 0)
+    map = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close (fd);
 
-  for (size_t i = 0; i < m; i++)
+  if (map == MAP_FAILED)
     {
-      if (nn_example_prop_ (netw_p, inps[i], outps[i]) != 0)
-        continue;
-      cost -= costfunc_example_ (netw_p, nparams_p->dist);
+      fprintf (stderr, "nn_load(): could not map %s\n", path);
+      return NULL;
     }
 
-  if (lambda > 0)
-    cost += lambda * nn_regur_ (netw_p) / 2;
+  const nnckpt_ *hdr = map;
+  if (ckpt_check_ (hdr, st.st_size))
+    {
+      fprintf (stderr, "nn_load(): %s is not a valid checkpoint\n", path);
+      munmap (map, st.st_size);
+      return NULL;
+    }
+
+  if (ckpt_check_topology_ (hdr))
+    {
+      fprintf (stderr, "nn_load(): %s weights don't match topology\n", path);
+      munmap (map, st.st_size);
+      return NULL;
+    }
+
+  const uint64_t *nunits = (const uint64_t *) (hdr + 1);
+  const size_t nhid = hdr->nlayers - N_INP_LAYERS - N_OUTP_LAYERS;
+
+  size_t *nhidunits;
+  if ((nhidunits = malloc ((nhid ? nhid : 1) * sizeof *nhidunits)) == NULL)
+    nn_exit_ (NULL);
+  for (size_t i = 0; i < nhid; i++)
+    nhidunits[i] = nunits[N_INP_LAYERS + i];
+
+  nnetwork_ *netw_p;
+  if ((netw_p = malloc (sizeof *netw_p)) == NULL)
+    nn_exit_ (netw_p);
+
+  netw_p->id   = id;
+  netw_p->nhid = nhid;
+  netw_p->map  = NULL;
+  netw_p->fast_sigmoid = 0;
+
+  nn_alloc_layers_ (netw_p, nunits[0], nhidunits, nunits[hdr->nlayers - 1]);
+  free (nhidunits);
 
-  return cost / m;
+  /* Weights of all layers point straight into the mapping */
+  nn_view_layers_weights_ (netw_p, (double_ *) ((char *) map + hdr->offset));
+  netw_p->map     = map;
+  netw_p->mapsize = st.st_size;
+
+  return netw_p;
 }
 
-/* =================== BACKPROPAGATION AND GRADIENT ==================== */
+/* ============================ TELEMETRY ============================== */
 
-static void compute_deltas_ (nnetwork_ *netw, double_ **deltas)
+/**
+ *
+ * With -DNN_TELEMETRY every thread charges the time it spends in phases
+ * to its own counters: TEL_START () starts a lap and TEL_LAP (phase) adds
+ * the time since the previous lap to the phase, so consecutive phases
+ * take one clock read each; counters are moved into the shard the thread
+ * worked on (see tel_collect_()) and summed into the record of the
+ * iteration (see report_()); without it the laps compile to nothing
+ *
+ **/
+static double tel_now_ (void)
 {
-  size_t ndeltas = netw->nhid + N_OUTP_LAYERS;
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
 
-  /* Set delta vector for output layer */
-  for (size_t i = 0; i < netw->outp->nunits; i++)
-    deltas[ndeltas-1][i] = netw->outp->units[i] - netw->expoutp[i];
+#ifdef NN_TELEMETRY
 
-  /* Set delta vectors for all hidden layers */
-  nnlayer_ *curr = netw->outp->prev;
-  for (size_t k = ndeltas-1; k > 0; k--, curr = curr->prev)
-    for (size_t i = 0; i < curr->nunits; i++)
-      {
-        double_ deltas_ki = 0.0;
-        for (size_t j = 0; j < curr->next->nunits; j++)
-          deltas_ki += curr->weights[j][N_BIAS+i] * deltas[k][j];
-        deltas[k-1][i] = deltas_ki * sigmoid_grad_ (curr->units[i]);
-      }
+static __thread double TEL_PHASES_[NN_NPHASES];
+static __thread double TEL_LAST_;
+
+  #define TEL_START()     (TEL_LAST_ = tel_now_ ())
+  #define TEL_LAP(phase)                                    \
+    do                                                      \
+      {                                                     \
+        double t_ = tel_now_ ();                            \
+        TEL_PHASES_[phase] += t_ - TEL_LAST_;               \
+        TEL_LAST_ = t_;                                     \
+      }                                                     \
+    while (0)
+
+#else
+  #define TEL_START()     ((void) 0)
+  #define TEL_LAP(phase)  ((void) 0)
+#endif
+
+/* Add counters of the calling thread to phases and zero them */
+static void tel_collect_ (double *phases)
+{
+#ifdef NN_TELEMETRY
+  for (size_t p = 0; p < NN_NPHASES; p++)
+    {
+      phases[p]     += TEL_PHASES_[p];
+      TEL_PHASES_[p] = 0.0;
+    }
+#else
+  (void) phases;
+#endif
 }
 
+static const char *PHASE_NAMES_[NN_NPHASES] = 
+  { "forward", "deltas", "acc", "update", "cost" };
+
+/* Deliver record of i'th iteration, tlast is the time of the previous one */
 static void 
-acc_dweights_ (nnetwork_ *netw, nnparams_ *nparams_p,
-             double_ **deltas, double_ ***dweights)
+report_ (nnetwork_ *netw_p, nnparams_ *nparams_p, const size_t i, 
+         const double cost, const double *phases, double *tlast)
 {
-  size_t ndweights = N_INP_LAYERS + netw->nhid;
-  double_ lambda = nparams_p->regur_p;
-  size_t       m = nparams_p->nexamples;
+  double t = tel_now_ ();
+  nnstats_ st;
+  st.id        = netw_p->id;
+  st.iter      = i + 1;
+  st.nexamples = nparams_p->nexamples;
+  st.secs      = t - *tlast;
+  st.examples_per_s = st.secs > 0 ? st.nexamples / st.secs : 0.0;
+  st.cost      = cost;
+  st.valid_cost = NAN;
+  memcpy (st.phases, phases, sizeof st.phases);
+  *tlast = t;
+
+  nparams_p->report (&st, nparams_p->report_ctx);
+}
 
-  nnlayer_ *curr = netw->inp;
-  for (size_t k = 0; k < ndweights; k++, curr = curr->next)
-    for (size_t i = 0; i < curr->next->nunits; i++)
-      for (size_t j = 0; j < curr->nunits; j++)
-        {
-          double_ dweight_kij = deltas[k][i] * curr->units[j];
-          if (lambda > 0)
-            dweight_kij += lambda * curr->weights[i][N_BIAS+j];
-          dweights[k][i][j] += dweight_kij / m;
-        }
+void nn_report_print (const nnstats_ *st, void *ctx)
+{
+  (void) ctx;
+  if (! isnan (st->cost))
+    printf ("[%ld]: Iteration %4ld | cost = %g\n", st->id, st->iter, st->cost);
+  if (! isnan (st->valid_cost))
+    printf ("[%ld]: Iteration %4ld | validation cost = %g\n", 
+            st->id, st->iter, st->valid_cost);
 }
 
-static void 
-backprop_iter_ (nnetwork_ *netw_p, double_ **inps, double_ **outps,
-               nnparams_ *nparams_p, double_ **deltas, double_ ***dweights)
+void nn_report_jsonl (const nnstats_ *st, void *ctx)
 {
-  /* Backpropagation */
-  for (size_t m = 0; m < nparams_p->nexamples; m++)
-    {
-      // printf ("[%ld]: m=%ld\n", netw_p->id, m);
-      if (nn_example_prop_ (netw_p, inps[m], outps[m]) != 0)
-        continue;
+  FILE *f = (FILE *)ctx;
+
+  /* The whole line is written under the stream lock */
+  flockfile (f);
+  fprintf (f, "{\"id\": %ld, \"iter\": %ld, \"nexamples\": %ld, "
+              "\"secs\": %.9g, \"examples_per_s\": %.6g, ",
+           st->id, st->iter, st->nexamples, st->secs, st->examples_per_s);
+  if (isnan (st->cost))
+    fprintf (f, "\"cost\": null, ");
+  else
+    fprintf (f, "\"cost\": %.9g, ", st->cost);
+  if (isnan (st->valid_cost))
+    fprintf (f, "\"valid_cost\": null, \"phases\": {");
+  else
+    fprintf (f, "\"valid_cost\": %.9g, \"phases\": {", st->valid_cost);
+  for (size_t p = 0; p < NN_NPHASES; p++)
+    fprintf (f, "%s\"%s\": %.9g", p > 0 ? ", " : "", 
+             PHASE_NAMES_[p], st->phases[p]);
+  fprintf (f, "}}\n");
+  funlockfile (f);
+}
 
-      /* Feedforward propagation: set output layer units activations */
-      compute_hypotheses_ (netw_p);
+/* ======================= TRAINING WORKSPACE ========================= */
 
-      /* Set delta values for all hidden and output layers */
-      compute_deltas_ (netw_p, deltas);
+/**
+ *
+ * @brief Allocate nrows x s_k+1 matrix for every non-input layer l_k+1,
+ *        all in one slab (used for both deltas and batch activations)
+ *
+ **/
+static nnmtx_ *alloc_units_mtx_ (nnetwork_ *netw_p, const size_t nrows)
+{
+  size_t nlayers = netw_p->nhid + N_OUTP_LAYERS;
+  nnmtx_ *mtxs;
+  if ((mtxs = malloc (nlayers * sizeof *mtxs)) == NULL)
+    nn_exit_ (netw_p);
 
-      /* Accumulate dweights matrices according to computed deltas */
-      acc_dweights_ (netw_p, nparams_p, deltas, dweights);
-    }
-}
+  size_t nunits = 0;
+  for (nnlayer_ *curr = netw_p->inp; curr != netw_p->outp; curr = curr->next)
+    nunits += nrows * mtx_ld (curr->next->nunits);
 
-static double_ **alloc_deltas_ (nnetwork_ *netw_p)
-{
-  size_t ndeltas = netw_p->nhid + N_OUTP_LAYERS;
-  double_ **deltas = malloc (ndeltas * sizeof *deltas);
-  size_t i = 0;
+  double_ *us;
+  if ((us = alloc_slab (nunits, 1)) == NULL)
+    nn_exit_ (netw_p);
 
+  size_t i = 0;
   for (nnlayer_ *curr = netw_p->inp; curr != netw_p->outp; curr = curr->next)
-    if ((deltas[i++] = malloc (curr->nunits * sizeof *deltas[i])) == NULL)
-      nn_exit_ (netw_p);
-  return deltas;
+    us = mtx_view (&mtxs[i++], us, nrows, curr->next->nunits);
+  return mtxs;
 }
 
-static void free_deltas_ (nnetwork_ *netw_p, double_ **deltas)
+static void free_units_mtx_ (nnmtx_ *mtxs)
 {
-  free_mtx (deltas, netw_p->nhid + N_OUTP_LAYERS);
+  if (mtxs == NULL)
+    return;
+  free_slab (mtxs[0].data);
+  free (mtxs);
 }
 
-static double_ ***alloc_dweights_ (nnetwork_ *netw_p)
+static nnmtx_ *alloc_dweights_ (nnetwork_ *netw_p)
 {
-  size_t    ndweights = N_INP_LAYERS + netw_p->nhid;
-  double_ ***dweights = malloc (ndweights * sizeof *dweights);
-  size_t i = 0;
+  size_t ndweights = N_INP_LAYERS + netw_p->nhid;
+  nnmtx_ *dweights;
+  if ((dweights = malloc (ndweights * sizeof *dweights)) == NULL)
+    nn_exit_ (netw_p);
 
+  size_t nweights = 0;
   for (nnlayer_ *curr = netw_p->inp; curr != netw_p->outp; curr = curr->next)
-    {
-      size_t nnext = curr->next->nunits;
-      size_t ncurr = curr->nunits;
-      if ((dweights[i++] = alloc_mtx (nnext, ncurr + N_BIAS, 1)) == NULL)
-        nn_exit_ (netw_p);
-    }
-  return dweights;
-}
+    nweights += curr->weights.nrows * curr->weights.ld;
 
-static void free_dweights_ (nnetwork_ *netw_p, double_ ***dweights)
-{
-  double_ ***dweights_p = dweights;
+  double_ *dws;
+  if ((dws = alloc_slab (nweights, 1)) == NULL)
+    nn_exit_ (netw_p);
+
+  size_t i = 0;
   for (nnlayer_ *curr = netw_p->inp; curr != netw_p->outp; curr = curr->next)
-    free_mtx (*dweights_p++, curr->next->nunits);
+    dws = mtx_view (&dweights[i++], dws, curr->next->nunits, N_BIAS + curr->nunits);
+  return dweights;
 }
 
-static void reset_weights_ (nnetwork_ *netw_p, double_ ***dweights, double_ alpha)
+static void free_dweights_ (nnmtx_ *dweights)
 {
-  size_t k = 0;
-  for (nnlayer_ *curr = netw_p->inp; curr != netw_p->outp; curr = curr->next)
-    {
-      size_t ncurr = curr->nunits;
-      size_t nnext = curr->next->nunits;
-      for (size_t i = 0; i < nnext; i++)
-        for (size_t j = 0; j < N_BIAS + ncurr; j++)
-          curr->weights[i][j] -= alpha * dweights[k][i][j];
-      k++;
-    }
+  if (dweights == NULL)
+    return;
+  free_slab (dweights[0].data);
+  free (dweights);
 }
 
-void
-nn_backprop (nnetwork_ *netw_p, double_ **inps, double_ **outps,
-             nnparams_ *nparams_p)
+/**
+ *
+ * @struct nnoptim
+ * @brief Optimizer state, moments of every weight, zeroed slabs 
+ *        of the same layout as dweights
+ *
+ * @var m             first moment (velocity), NULL for NN_OPT_SGD
+ * @var v             second moment, NULL unless Adam
+ * @var t             # of updates done
+ *
+ **/
+typedef struct nnoptim_
 {
-  double_  **deltas   = alloc_deltas_   (netw_p);
-  double_ ***dweights = alloc_dweights_ (netw_p);
+  nnmtx_ *m;
+  nnmtx_ *v;
+  size_t  t;
 
-  printf ("[%ld]: Training neural network ...\n", netw_p->id);
-  for (size_t i = 0; i < nparams_p->niters; i++)
-    {
-      printf ("[%ld]: Iteration %4ld | cost = %g\n",
-               netw_p->id, i+1, nn_costfunc (netw_p, inps, outps, nparams_p));
+} nnoptim_;
 
-      /* Feedforward and then backpropagate to find dweights */
-      backprop_iter_ (netw_p, inps, outps, nparams_p, deltas, dweights);
+static nnoptim_ alloc_optim_ (nnetwork_ *netw_p, nnparams_ *nparams_p)
+{
+  nnoptim_ optim = { NULL, NULL, 0 };
+  nnopt opt = nparams_p->opt;
+  if (opt != NN_OPT_SGD)
+    optim.m = alloc_dweights_ (netw_p);
+  if (opt == NN_OPT_ADAM || opt == NN_OPT_ADAMW)
+    optim.v = alloc_dweights_ (netw_p);
+  return optim;
+}
 
-      /* Modify network weights according to computed dweights */
-      reset_weights_ (netw_p, dweights, nparams_p->learn_p);
-    }
+static void free_optim_ (nnoptim_ *optim)
+{
+  free_dweights_ (optim->m);
+  free_dweights_ (optim->v);
+}
 
-  /* Free memory from delta vectors and dweights matrices */
-  free_deltas_  (netw_p, deltas);
-  free_dweights_ (netw_p, dweights);
+/**
+ *
+ * @struct nninps
+ * @brief Block of input rows, that are not a dense matrix: sparse rows 
+ *        and transposed l_0 matrices, that they are propagated with 
+ *        (see csrmm_nn()), or quantized rows and the buffer they are
+ *        widened into (see block_())
+ *
+ * @var csr           sparse inputs, NULL if they are quantized
+ * @var m0            first row of the block, in rows if it is not NULL
+ * @var rows          rows of inputs in shuffled order, NULL if consecutive
+ * @var wt            s_0 x s_1 weights of l_0 without bias, transposed,
+ *                    NULL if l_0 is propagated in place
+ * @var dwt           s_0 x s_1 gradient of wt, NULL if only cost is needed
+ *                    or wt is NULL
+ * @var q             quantized inputs, NULL if they are sparse
+ * @var x             nbatch x s_0 buffer of widened rows
+ *
+ **/
+typedef struct nninps_
+{
+  const nncsr_  *csr;
+  size_t          m0;
+  const size_t *rows;
+  const nnmtx_   *wt;
+  nnmtx_        *dwt;
+  const nnqmtx_   *q;
+  nnmtx            x;
+
+} nninps_;
+
+/**
+ *
+ * @struct nnshard
+ * @brief Buffers of one worker thread, that propagates its own
+ *        contiguous range of examples (shard)
+ *
+ * @var acts          nbatch x s_k+1 activations
+ * @var deltas        nbatch x s_k+1 delta values, NULL if only cost is needed
+ * @var dweights      gradient over the shard,  NULL if only cost is needed
+ * @var x             nbatch rows of inputs gathered in shuffled order,
+ *                    NULL unless mini-batch (see backprop_idx_iter_())
+ * @var y             nbatch rows of expected outputs, the same way,
+ *                    NULL with class indices
+ * @var lab           nbatch class indices, the same way, NULL without them
+ * @var dwt           transposed gradient of l_0, NULL unless inputs 
+ *                    are sparse and l_0 is transposed (see sparse_fold_())
+ * @var cost          cost over the shard
+ * @var phases        secs spent in every phase by threads that ran
+ *                    the shard (see tel_collect_())
+ *
+ **/
+typedef struct nnshard_
+{
+  nnmtx_     *acts;
+  nnmtx_   *deltas;
+  nnmtx_ *dweights;
+  nnmtx          x;
+  nnmtx          y;
+  uint32_t    *lab;
+  nnmtx        dwt;
+  double_     cost;
+  double    phases[NN_NPHASES];
+
+} nnshard_;
+
+/**
+ *
+ * @struct nnvalid
+ * @brief Validation of copies of the weights, that runs concurrently
+ *        with training (see valid_start_())
+ *
+ * @var netw          network of the same topology, its weights are 
+ *                    the copy being validated
+ * @var best          weights slab with the lowest validation cost
+ * @var acts          activations of every task
+ * @var cost          cost over the share of every task
+ * @var tasks         argument of the task of every share
+ * @var ntasks        # of shares of the validation set
+ * @var nleft         # of tasks of the validation that are not done
+ * @var iter          iteration of the copy, starting with 1, 0 if none
+ * @var t0            time the copy was taken
+ * @var parked        1 if training waits for the validation to be done
+ * @var best_cost     lowest validation cost, INFINITY if none yet
+ * @var best_iter     iteration of the best weights, 0 if none yet
+ * @var nbad          # of validations since the best one
+ * @var stop          set to 1 when training should stop
+ * @var lock          protects busy, parked and trained
+ * @var busy          1 while tasks of the validation run
+ * @var trained       1 once the last iteration is done
+ *
+ **/
+typedef struct nnvalid_
+{
+  nnetwork_         *netw;
+  double_           *best;
+  nnmtx_           **acts;
+  double_           *cost;
+  struct worker_arg_ *tasks;
+  size_t           ntasks;
+  size_t            nleft;
+  size_t             iter;
+  double               t0;
+  double_       best_cost;
+  size_t        best_iter;
+  size_t             nbad;
+  int                stop;
+  pthread_mutex_t    lock;
+  int                busy;
+  int              parked;
+  int             trained;
+
+} nnvalid_;
+
+/**
+ *
+ * @struct nntrain
+ * @brief State shared by worker threads of one network
+ *
+ * @var netw          neural network, weights are read-only for workers
+ * @var inps          inputs in training set
+ * @var outps         expected outputs for each input
+ * @var nparams       training parameters
+ * @var nworkers      # of worker threads
+ * @var shards        per-worker buffers
+ * @var barrier       synchronizes workers between phases of an iteration
+ * @var src           source of examples chunks, NULL if all are resident
+ * @var chunk_inps    inputs of the current chunk, inps points to it
+ * @var chunk_outps   expected outputs of the current chunk, outps points to it
+ * @var nchunk        # of examples in the current chunk, 0 at the end of pass
+ * @var sched         scheduler that runs the tasks, NULL for worker threads
+ * @var tasks         argument of the task of every shard
+ * @var iter          current iteration
+ * @var dist          distance function if cost is due on iter, NULL if not
+ * @var nleft         # of tasks of the current phase that are not done
+ * @var tlast         time of the previous record (see report_())
+ * @var optim         optimizer state
+ * @var perm          order of rows of the current chunk, NULL unless 
+ *                    mini-batch (see shuffle_())
+ * @var nperm         # of elements perm is allocated for
+ * @var mb0           first row of the current mini-batch in perm
+ * @var mb1           row after the last one of the current mini-batch
+ * @var rng           generator of the order of rows
+ * @var valid         validation state, NULL without validation set
+ * @var csr           sparse inputs, NULL if inputs are dense
+ * @var wt            transposed weights of l_0, NULL unless csr is set
+ * @var labels        class indices of the examples, NULL if outps is used
+ * @var q             quantized inputs, NULL if inputs are not quantized
+ *
+ **/
+typedef struct nntrain_
+{
+  nnetwork_         *netw;
+  nnmtx              inps;
+  nnmtx             outps;
+  nnparams_      *nparams;
+  size_t         nworkers;
+  nnshard_        *shards;
+  pthread_barrier_t barrier;
+  nnsource_          *src;
+  nnmtx_       chunk_inps;
+  nnmtx_      chunk_outps;
+  size_t           nchunk;
+  nnsched           sched;
+  struct worker_arg_ *tasks;
+  size_t             iter;
+  dist_f             dist;
+  size_t            nleft;
+  double            tlast;
+  nnoptim_          optim;
+  size_t            *perm;
+  size_t            nperm;
+  size_t              mb0;
+  size_t              mb1;
+  nnrng_              rng;
+  nnvalid_         *valid;
+  nncsr_             *csr;
+  nnmtx                wt;
+  const uint32_t  *labels;
+  nnqmtx_              *q;
+
+} nntrain_;
+
+typedef void (*worker_f_)(nntrain_ *, const size_t);
+
+typedef struct worker_arg_
+{
+  worker_f_       f;
+  nntrain_      *tr;
+  size_t          w;
+
+} worker_arg_;
+
+static size_t nworkers_ (nnparams_ *nparams_p)
+{
+  size_t nworkers = nparams_p->nworkers;
+  if (nworkers == 0)
+    {
+      long ncores = sysconf (_SC_NPROCESSORS_ONLN);
+      nworkers = ncores > 0 ? ncores : 1;
+    }
+
+  /* One worker at least, an empty data set has one empty shard */
+  size_t m = nparams_p->nexamples;
+  return nworkers < m ? nworkers : (m > 0 ? m : 1);
+}
+
+/* Range of examples [m0, m1) that belongs to worker w */
+static void shard_ (nntrain_ *tr, const size_t w, size_t *m0, size_t *m1)
+{
+  size_t m = tr->nparams->nexamples;
+  *m0 = m *  w      / tr->nworkers;
+  *m1 = m * (w + 1) / tr->nworkers;
+}
+
+/**
+ *
+ * With sparse inputs l_0 is propagated with transposed weights wt, so
+ * that every nonzero input adds one contiguous row of wt to the units
+ * of l_1 (see csrmm_nn()), and its gradient is accumulated into rows of
+ * transposed dwt of the shard the same way; wt is refreshed after every
+ * weights update, and dwt is folded into dweights of the shard after 
+ * every task of the shard, both once per pass over s_0 x s_1 elements
+ *
+ **/
+static void sparse_weights_ (nntrain_ *tr)
+{
+  const nnmtx_ *w  = &tr->netw->inp->weights;
+  nnmtx         wt = tr->wt;
+  for (size_t i = 0; i < w->nrows; i++)
+    {
+      const double_ *w_i = MTX_ROW (w, i) + N_BIAS;
+      for (size_t j = 0; j < wt->nrows; j++)
+        MTX_ROW (wt, j)[i] = w_i[j];
+    }
+}
+
+static void sparse_fold_ (nnshard_ *sh)
+{
+  nnmtx   dwt = sh->dwt;
+  nnmtx_ *dw  = &sh->dweights[0];
+  for (size_t j = 0; j < dwt->nrows; j++)
+    {
+      double_ *dwt_j = MTX_ROW (dwt, j);
+      for (size_t i = 0; i < dwt->ncols; i++)
+        MTX_ROW (dw, i)[N_BIAS + j] += dwt_j[i];
+      memset (dwt_j, 0, dwt->ncols * sizeof *dwt_j);
+    }
+}
+
+/**
+ *
+ * Train or evaluate on sparse inputs, grad - 1 if dwt is needed
+ *
+ * Transposing pays off once there are at least SPARSE_TRANSPOSE nonzeros
+ * per input unit between updates; with fewer, f.e. small mini-batches,
+ * l_0 is propagated in place, a strided column of weights per nonzero,
+ * and wt and dwt are not allocated (see csrmm_nt())
+ *
+ **/
+static void sparse_alloc_ (nntrain_ *tr, nncsr_ *csr, const int grad)
+{
+  size_t ninps = tr->netw->inp->nunits, nunits = tr->netw->inp->next->nunits,
+         nrows = csr->nrows, nupd  = tr->nparams->minibatch;
+  tr->csr  = csr;
+  tr->inps = NULL;
+
+  if (! grad || nupd == 0 || nupd > nrows)
+    nupd = nrows;
+  if (nrows == 0 
+   || (double) csr->rowptr[nrows] * nupd / nrows < SPARSE_TRANSPOSE * ninps)
+    return;
+
+  if ((tr->wt = alloc_mtx (ninps, nunits, 0)) == NULL)
+    nn_exit_ (tr->netw);
+  sparse_weights_ (tr);
+
+  for (size_t w = 0; grad && w < tr->nworkers; w++)
+    if ((tr->shards[w].dwt = alloc_mtx (ninps, nunits, 1)) == NULL)
+      nn_exit_ (tr->netw);
+}
+
+/* Train or evaluate on quantized inputs, widened into x of every shard */
+static void quant_alloc_ (nntrain_ *tr, nnqmtx_ *q)
+{
+  tr->q    = q;
+  tr->inps = NULL;
+  for (size_t w = 0; w < tr->nworkers; w++)
+    if ((tr->shards[w].x = alloc_mtx (tr->nparams->nbatch, q->ncols, 0)) 
+        == NULL)
+      nn_exit_ (tr->netw);
+}
+
+/* Sparse or quantized rows of shard w, NULL if inputs are dense */
+static const nninps_ *
+shard_inps_ (nntrain_ *tr, const size_t w, nninps_ *sp)
+{
+  if (tr->csr == NULL && tr->q == NULL)
+    return NULL;
+  *sp = (nninps_) { tr->csr, 0, NULL, tr->wt, tr->shards[w].dwt, 
+                    tr->q, tr->shards[w].x };
+  return sp;
+}
+
+/* Validation set is split into one share per shard */
+static nnvalid_ *alloc_valid_ (nntrain_ *tr)
+{
+  nnetwork_ *netw_p    = tr->netw;
+  nnparams_ *nparams_p = tr->nparams;
+  size_t     nvalid    = nparams_p->vinps->nrows;
+
+  nnvalid_ *v;
+  if ((v = malloc (sizeof *v)) == NULL)
+    nn_exit_ (netw_p);
+
+  v->ntasks = tr->nworkers < nvalid ? tr->nworkers : nvalid;
+  v->netw   = nn_alloc_like_ (netw_p);
+  if ((v->best  = alloc_slab (nn_layers_nweights_ (netw_p), 1))   == NULL
+   || (v->acts  = malloc (v->ntasks * sizeof *v->acts))  == NULL
+   || (v->cost  = malloc (v->ntasks * sizeof *v->cost))  == NULL
+   || (v->tasks = malloc (v->ntasks * sizeof *v->tasks)) == NULL)
+    nn_exit_ (netw_p);
+
+  for (size_t w = 0; w < v->ntasks; w++)
+    {
+      v->acts[w]  = alloc_units_mtx_ (netw_p, nparams_p->nbatch);
+      v->tasks[w] = (worker_arg_) { NULL, tr, w };
+    }
+
+  v->iter      = 0;
+  v->best_cost = INFINITY;
+  v->best_iter = 0;
+  v->nbad      = 0;
+  v->stop      = 0;
+  v->busy      = 0;
+  v->parked    = 0;
+  v->trained   = 0;
+  pthread_mutex_init (&v->lock, NULL);
+  return v;
+}
+
+static void free_valid_ (nnvalid_ *v)
+{
+  if (v == NULL)
+    return;
+  for (size_t w = 0; w < v->ntasks; w++)
+    free_units_mtx_ (v->acts[w]);
+  nn_free_ (v->netw);
+  free_slab (v->best);
+  pthread_mutex_destroy (&v->lock);
+  free (v->acts);
+  free (v->cost);
+  free (v->tasks);
+  free (v);
+}
+
+static nntrain_ *
+alloc_train_ (nnetwork_ *netw_p, nnmtx inps, nnmtx outps, 
+              nnparams_ *nparams_p, const size_t nworkers, const int grad)
+{
+  nntrain_ *tr;
+  if ((tr = malloc (sizeof *tr)) == NULL)
+    nn_exit_ (netw_p);
+
+  tr->netw     = netw_p;
+  tr->inps     = inps;
+  tr->outps    = outps;
+  tr->nparams  = nparams_p;
+  tr->nworkers = nworkers;
+  tr->src      = NULL;
+  tr->sched    = NULL;
+  tr->tasks    = NULL;
+  tr->perm     = NULL;
+  tr->nperm    = 0;
+  tr->valid    = NULL;
+  tr->csr      = NULL;
+  tr->q        = NULL;
+  tr->wt       = NULL;
+  tr->labels   = nparams_p->labels;
+  tr->tlast    = tel_now_ ();
+  tr->optim    = grad ? alloc_optim_ (netw_p, nparams_p) 
+                      : (nnoptim_) { NULL, NULL, 0 };
+
+  if ((tr->shards = calloc (tr->nworkers, sizeof *tr->shards)) == NULL)
+    nn_exit_ (netw_p);
+
+  for (size_t w = 0; w < tr->nworkers; w++)
+    {
+      nnshard_ *sh = &tr->shards[w];
+      sh->acts = alloc_units_mtx_ (netw_p, nparams_p->nbatch);
+      if (grad)
+        {
+          sh->deltas   = alloc_units_mtx_ (netw_p, nparams_p->nbatch);
+          sh->dweights = alloc_dweights_  (netw_p);
+        }
+    }
+
+  pthread_barrier_init (&tr->barrier, NULL, tr->nworkers);
+  return tr;
+}
+
+static void free_train_ (nntrain_ *tr)
+{
+  for (size_t w = 0; w < tr->nworkers; w++)
+    {
+      free_units_mtx_ (tr->shards[w].acts);
+      free_units_mtx_ (tr->shards[w].deltas);
+      free_dweights_  (tr->shards[w].dweights);
+      free_mtx (tr->shards[w].x);
+      free_mtx (tr->shards[w].y);
+      free (tr->shards[w].lab);
+      free_mtx (tr->shards[w].dwt);
+    }
+  free_mtx (tr->wt);
+  free_optim_ (&tr->optim);
+  free_valid_ (tr->valid);
+  pthread_barrier_destroy (&tr->barrier);
+  free (tr->shards);
+  free (tr->tasks);
+  free (tr->perm);
+  free (tr);
+}
+
+static void *worker_run_ (void *arg)
+{
+  worker_arg_ *wa = (worker_arg_ *)arg;
+  wa->f (wa->tr, wa->w);
+  return NULL;
+}
+
+/**
+ *
+ * @brief Run f (tr, w) for w = 0,1,...,nworkers-1 concurrently,
+ *        worker 0 runs in the calling thread
+ *
+ **/
+static void par_run_ (nntrain_ *tr, worker_f_ f)
+{
+  size_t nthreads = tr->nworkers - 1;
+  pthread_t   ths[nthreads + 1];
+  worker_arg_ was[nthreads + 1];
+
+  for (size_t w = 1; w <= nthreads; w++)
+    {
+      was[w] = (worker_arg_) { f, tr, w };
+      if (pthread_create (&ths[w], NULL, worker_run_, &was[w]) != 0)
+        {
+          /* Workers synchronize on a barrier, so all of them are required */
+          fprintf (stderr, "par_run(): %s\n", "Could not create thread ...");
+          exit (1);
+        }
+    }
+
+  f (tr, 0);
+
+  for (size_t w = 1; w <= nthreads; w++)
+    pthread_join (ths[w], NULL);
+}
+
+/* ========================= COST FUNCTION ============================ */
+
+/* Vectorized kernels are in nn_simd.c, scalar ones are the reference */
+static void sigmoid_map_ (const nnetwork_ *netw_p, double_ *a_i, const size_t n)
+{
+  if (netw_p->fast_sigmoid)
+    SIMD->sigmoid_fast (a_i, n);
+  else
+    SIMD->sigmoid (a_i, n);
+}
+
+/**
+ *
+ * gsl/gsl_blas matrix multiplication alternative solution doesn't provide 
+ * better performance when compared to straightforward multiplication
+ *
+ **/
+static void linear_prop_ (nnlayer_ *lay)
+{
+  nnlayer_ *prev = lay->prev;
+
+  for (size_t i = 0; i < lay->nunits; i++)
+    {
+      const double_ *w_i = MTX_ROW (&prev->weights, i);
+      lay->units[i] = BIAS_ACTIVATION * w_i[0]
+                    + SIMD->dot (prev->units, w_i + N_BIAS, prev->nunits);
+    }
+}
+
+static void feedforward_ (const nnetwork_ *netw_p, nnlayer_ *lay)
+{
+  linear_prop_ (lay);
+  sigmoid_map_ (netw_p, lay->units, lay->nunits);
+}
+
+static void compute_hypotheses_ (nnetwork_ *netw_p)
+{
+  for (nnlayer_ *curr = netw_p->inp; curr != netw_p->outp; curr = curr->next)
+    feedforward_ (netw_p, curr->next);
+}
+
+/**
+ *
+ * Kept blocks of pruned weights of curr, NULL if there are too many
+ * of them for block sparse products to be faster than dense ones,
+ * zeros of the pruned blocks are then multiplied as well
+ *
+ **/
+static inline const nnbsr_ *kept_blocks_ (const nnlayer_ *curr)
+{
+  const nnbsr_ *bsr = curr->bsr;
+  if (bsr == NULL 
+   || bsr->nblocks > BSR_DENSITY_MAX * bsr->nbrows * bsr->nbcols)
+    return NULL;
+  return bsr;
+}
+
+/**
+ *
+ * Same as above, but a block of nb examples is propagated together,
+ * so that every layer is a cache-tiled matrix-matrix product (see nn_gemm.h)
+ * and the weights are streamed from memory once per block, not per example;
+ * nothing is written to the network, so blocks could be propagated
+ * concurrently by several threads, each with its own acts
+ *
+ * x         - nb x s_0   block of input rows, viewed in place
+ * acts[k]   - nb x s_k+1 activations of layer l_k+1
+ *
+ **/
+static void 
+batch_feedforward_ (const nnetwork_ *netw_p, nnlayer_ *lay, 
+                    const nnmtx_ *a_prev, const nninps_ *sx, 
+                    nnmtx_ *a, const size_t nb)
+{
+  const nnmtx_ *w = &lay->prev->weights;
+  const nnbsr_ *bsr = kept_blocks_ (lay->prev);
+
+  for (size_t b = 0; b < nb; b++)
+    {
+      double_ *a_b = MTX_ROW (a, b);
+      for (size_t i = 0; i < lay->nunits; i++)
+        a_b[i] = BIAS_ACTIVATION * MTX_ROW (w, i)[0];
+    }
+
+  if (sx != NULL && sx->wt != NULL)
+    csrmm_nn (nb, lay->nunits, sx->csr, sx->m0, sx->rows,
+              sx->wt->data, sx->wt->ld,
+              a->data,      a->ld);
+  else if (sx != NULL)
+    csrmm_nt (nb, lay->nunits, sx->csr, sx->m0, sx->rows,
+              w->data + N_BIAS, w->ld,
+              a->data,          a->ld);
+  else if (bsr != NULL)
+    bsrmm_nt (nb, lay->nunits, lay->prev->nunits, bsr,
+              a_prev->data,     a_prev->ld,
+              w->data + N_BIAS, w->ld,
+              a->data,          a->ld);
+  else
+    gemm_nt (nb, lay->nunits, lay->prev->nunits,
+             a_prev->data,    a_prev->ld,
+             w->data + N_BIAS, w->ld,
+             a->data,          a->ld);
+
+  for (size_t b = 0; b < nb; b++)
+    sigmoid_map_ (netw_p, MTX_ROW (a, b), lay->nunits);
+}
+
+/* Inputs are dense rows x, or sparse rows sx if it is not NULL */
+static void 
+batch_hypotheses_ (nnetwork_ *netw_p, const nnmtx_ *x, const nninps_ *sx,
+                   nnmtx_ *acts, const size_t nb)
+{
+  const nnmtx_ *a_prev = x;
+  size_t k = 0;
+  for (nnlayer_ *curr = netw_p->inp; curr != netw_p->outp; curr = curr->next)
+    {
+      batch_feedforward_ (netw_p, curr->next, a_prev, k == 0 ? sx : NULL,
+                          &acts[k], nb);
+      a_prev = &acts[k++];
+    }
+}
+
+/**
+ *
+ * Block of nb input rows starting with m'th, viewed in place: 
+ * dense x if sp is NULL, or sparse sx, then it is returned;
+ * quantized rows are widened into sp->x, that x is a view of then,
+ * so from here on they are dense
+ *
+ **/
+static const nninps_ *
+block_ (nnmtx inps, const nninps_ *sp, const size_t m, const size_t nb,
+        nnmtx_ *x, nninps_ *sx)
+{
+  if (sp == NULL)
+    {
+      *x = (nnmtx_) { MTX_ROW (inps, m), nb, inps->ncols, inps->ld };
+      return NULL;
+    }
+  if (sp->q != NULL)
+    {
+      for (size_t b = 0; b < nb; b++)
+        {
+          size_t r = sp->m0 + m + b;
+          qmtx_row (sp->q, sp->rows != NULL ? sp->rows[r] : r, 
+                    MTX_ROW (sp->x, b));
+        }
+      *x = (nnmtx_) { sp->x->data, nb, sp->x->ncols, sp->x->ld };
+      return NULL;
+    }
+  *sx    = *sp;
+  sx->m0 = sp->m0 + m;
+  return sx;
+}
+
+/* Sum of distances between expected results y and hypotheses h */
+static const double_ 
+outp_cost_ (dist_f dist, const double_ *y, const double_ *h, const size_t n)
+{
+  double_ cost = 0.0;
+  for (size_t k = 0; k < n; k++)
+    cost += dist (y[k], h[k]);
+  return cost;
+}
+
+/* 0 if all n class indices are outputs of the network */
+static int 
+labels_check_ (nnetwork_ *netw_p, const uint32_t *labels, const size_t n)
+{
+  for (size_t m = 0; m < n; m++)
+    if (labels[m] >= netw_p->outp->nunits)
+      return 1;
+  return 0;
+}
+
+/* The same, expected result is 1.0 for output l and 0.0 for the others */
+static const double_ 
+label_cost_ (dist_f dist, const uint32_t l, const double_ *h, const size_t n)
+{
+  double_ cost = 0.0;
+  for (size_t k = 0; k < n; k++)
+    cost += dist (k == l, h[k]);
+  return cost;
+}
+
+/**
+ *
+ * Expected results of nb rows starting with m'th: block y of outps
+ * viewed in place if labels is NULL, or their class indices, then 
+ * they are returned and y is empty
+ *
+ **/
+static const uint32_t *
+targets_ (nnmtx outps, const uint32_t *labels, const size_t m, 
+          const size_t nb, nnmtx_ *y)
+{
+  if (labels != NULL)
+    {
+      *y = (nnmtx_) { NULL, nb, 0, 0 };
+      return labels + m;
+    }
+  *y = (nnmtx_) { MTX_ROW (outps, m), nb, outps->ncols, outps->ld };
+  return NULL;
+}
+
+/* Sum of distances over a block of nb hypotheses h (see targets_()) */
+static const double_ 
+batch_cost_ (dist_f dist, const nnmtx_ *y, const uint32_t *lab, 
+             const nnmtx_ *h, const size_t nb)
+{
+  double_ cost = 0.0;
+  for (size_t b = 0; b < nb; b++)
+    cost += lab != NULL 
+          ? label_cost_ (dist, lab[b], MTX_ROW (h, b), h->ncols)
+          : outp_cost_  (dist, MTX_ROW (y, b), MTX_ROW (h, b), h->ncols);
+  return cost;
+}
+
+static const double_ costfunc_example_ (nnetwork_ *netw_p, dist_f dist)
+{
+  /* Feedforward propagation: set output layer units activations */
+  compute_hypotheses_ (netw_p);
+
+  return outp_cost_ (dist, netw_p->expoutp, netw_p->outp->units, 
+                     netw_p->outp->nunits);
+}
+
+/**
+ *
+ * Sum of distances over examples [m0, m1), propagated in blocks of nbatch,
+ * inputs are sparse if sp is not NULL, expected results are class 
+ * indices if labels is not NULL
+ *
+ **/
+static const double_ 
+costfunc_batch_ (nnetwork_ *netw_p, nnmtx inps, nnmtx outps, 
+                 const nninps_ *sp, const uint32_t *labels, dist_f dist,
+                 const size_t m0, const size_t m1, 
+                 nnmtx_ *acts, const size_t nbatch)
+{
+  double_ cost = 0.0;
+
+  for (size_t m = m0; m < m1; m += nbatch)
+    {
+      size_t nb = m1 - m < nbatch ? m1 - m : nbatch;
+      nnmtx_    x, y;
+      nninps_ sx;
+      const nninps_ *px  = block_   (inps, sp, m, nb, &x, &sx);
+      const uint32_t  *lab = targets_ (outps, labels, m, nb, &y);
+
+      batch_hypotheses_ (netw_p, &x, px, acts, nb);
+      cost += batch_cost_ (dist, &y, lab, &acts[netw_p->nhid], nb);
+    }
+  return cost;
+}
+
+static void costfunc_worker_ (nntrain_ *tr, const size_t w)
+{
+  size_t m0, m1;
+  shard_ (tr, w, &m0, &m1);
+  nninps_ sp;
+  tr->shards[w].cost = costfunc_batch_ (tr->netw, tr->inps, tr->outps,
+                                        shard_inps_ (tr, w, &sp),
+                                        tr->labels, tr->nparams->dist, 
+                                        m0, m1, tr->shards[w].acts, 
+                                        tr->nparams->nbatch);
+}
+
+static const double_ nn_regur_ (nnetwork_ *netw_p)
+{
+  double_ regur = 0.0;
+
+  for (nnlayer_ *curr = netw_p->inp; curr != netw_p->outp; curr = curr->next)
+    {
+      size_t ncurr = curr->nunits;
+      size_t nnext = curr->next->nunits;
+      for (size_t i = 0; i < nnext; i++)   
+        {
+          const double_ *w_i = MTX_ROW (&curr->weights, i);
+          /* don't regularize bias unit */
+          for (size_t j = N_BIAS; j < N_BIAS + ncurr; j++)
+            regur += w_i[j] * w_i[j];
+        }
+    }
+  return regur;
+}
+
+/* Regularize and average cost summed over all examples */
+static const double_ 
+costfunc_total_ (nnetwork_ *netw_p, nnparams_ *nparams_p, double_ cost)
+{
+  double_ lambda = nparams_p->regur_p;
+
+  if (lambda > 0)
+    cost += lambda * nn_regur_ (netw_p) / 2;
+
+  return cost / nparams_p->nexamples;
+}
+
+const double_ sqdist (const double_ x, const double_ y)
+{
+  return (x-y)*(x-y);
+}
+
+const double_ logdist (const double_ x, const double_ y)
+{
+  return x * NN_LOG (y) + (1-x) * NN_LOG (1-y);
+}
+
+const double_ 
+nn_costfunc (nnetwork_ *netw_p, nnmtx inps, nnmtx outps, 
+             nnparams_ *nparams_p)
+{
+  if (nparams_p->labels != NULL 
+   && labels_check_ (netw_p, nparams_p->labels, nparams_p->nexamples))
+    {
+      fprintf (stderr, "nn_costfunc(): class indices don't match "
+                       "the network\n");
+      return NAN;
+    }
+
+  double_ cost = 0.0;
+  size_t    m = nparams_p->nexamples;
+
+  if (nparams_p->nbatch > 1 || nworkers_ (nparams_p) > 1 
+   || nparams_p->labels != NULL)
+    {
+      /* Split examples between worker threads */
+      nntrain_ *tr = alloc_train_ (netw_p, inps, outps, nparams_p, 
+                                   nworkers_ (nparams_p), 0);
+      par_run_ (tr, costfunc_worker_);
+      for (size_t w = 0; w < tr->nworkers; w++)
+        cost -= tr->shards[w].cost;
+      free_train_ (tr);
+    }
+  else
+    for (size_t i = 0; i < m; i++)
+      {
+        if (nn_example_prop_ (netw_p, MTX_ROW (inps, i), MTX_ROW (outps, i)) != 0)
+          continue;
+        cost -= costfunc_example_ (netw_p, nparams_p->dist);
+      }
+
+  return costfunc_total_ (netw_p, nparams_p, cost);
+}
+
+const double_ 
+nn_costfunc_sparse (nnetwork_ *netw_p, nncsr_ *inps, nnmtx outps, 
+                    nnparams_ *nparams_p)
+{
+  if (inps->ncols != netw_p->inp->nunits)
+    {
+      fprintf (stderr, "nn_costfunc_sparse(): inputs don't match "
+                       "the network\n");
+      return NAN;
+    }
+  if (nparams_p->labels != NULL 
+   && labels_check_ (netw_p, nparams_p->labels, nparams_p->nexamples))
+    {
+      fprintf (stderr, "nn_costfunc_sparse(): class indices don't match "
+                       "the network\n");
+      return NAN;
+    }
+
+  double_ cost = 0.0;
+  nntrain_ *tr = alloc_train_ (netw_p, NULL, outps, nparams_p, 
+                               nworkers_ (nparams_p), 0);
+  sparse_alloc_ (tr, inps, 0);
+  par_run_ (tr, costfunc_worker_);
+  for (size_t w = 0; w < tr->nworkers; w++)
+    cost -= tr->shards[w].cost;
+  free_train_ (tr);
+
+  return costfunc_total_ (netw_p, nparams_p, cost);
+}
+
+const double_ 
+nn_costfunc_quant (nnetwork_ *netw_p, nnqmtx_ *inps, nnmtx outps, 
+                   nnparams_ *nparams_p)
+{
+  if (inps->ncols != netw_p->inp->nunits)
+    {
+      fprintf (stderr, "nn_costfunc_quant(): inputs don't match "
+                       "the network\n");
+      return NAN;
+    }
+  if (nparams_p->labels != NULL 
+   && labels_check_ (netw_p, nparams_p->labels, nparams_p->nexamples))
+    {
+      fprintf (stderr, "nn_costfunc_quant(): class indices don't match "
+                       "the network\n");
+      return NAN;
+    }
+
+  double_ cost = 0.0;
+  nntrain_ *tr = alloc_train_ (netw_p, NULL, outps, nparams_p, 
+                               nworkers_ (nparams_p), 0);
+  quant_alloc_ (tr, inps);
+  par_run_ (tr, costfunc_worker_);
+  for (size_t w = 0; w < tr->nworkers; w++)
+    cost -= tr->shards[w].cost;
+  free_train_ (tr);
+
+  return costfunc_total_ (netw_p, nparams_p, cost);
+}
+
+/* =================== BACKPROPAGATION AND GRADIENT ==================== */
+
+/**
+ *
+ * deltas[k] - 1 x s_k+1 matrix, delta values of layer l_k+1
+ *
+ **/
+static void compute_deltas_ (nnetwork_ *netw, nnmtx_ *deltas)
+{
+  size_t ndeltas = netw->nhid + N_OUTP_LAYERS;
+
+  /* Set delta vector for output layer */
+  double_ *deltas_outp = deltas[ndeltas-1].data;
+  for (size_t i = 0; i < netw->outp->nunits; i++)
+    deltas_outp[i] = netw->outp->units[i] - netw->expoutp[i];
+
+  /* Set delta vectors for all hidden layers */
+  nnlayer_ *curr = netw->outp->prev;
+  for (size_t k = ndeltas-1; k > 0; k--, curr = curr->prev)
+    {
+      /* deltas_prev = W^T * deltas_k, one contiguous row of W at a time */
+      const double_ *deltas_k = deltas[k].data;
+      double_ *deltas_prev    = deltas[k-1].data;
+      memset (deltas_prev, 0, curr->nunits * sizeof *deltas_prev);
+      for (size_t j = 0; j < curr->next->nunits; j++)
+        SIMD->axpy (deltas_prev, deltas_k[j], 
+                    MTX_ROW (&curr->weights, j) + N_BIAS, curr->nunits);
+      SIMD->dsigmoid (deltas_prev, curr->units, curr->nunits);
+    }
+}
+
+/**
+ *
+ * dweights[k] - gradient of l_k weights summed over examples,
+ *               it is averaged and regularized in reset_weights_()
+ *
+ **/
+static void 
+acc_dweights_ (nnetwork_ *netw, nnmtx_ *deltas, nnmtx_ *dweights)
+{
+  size_t ndweights = N_INP_LAYERS + netw->nhid;
+
+  nnlayer_ *curr = netw->inp;
+  for (size_t k = 0; k < ndweights; k++, curr = curr->next)
+    {
+      const double_ *deltas_k = deltas[k].data;
+      for (size_t i = 0; i < curr->next->nunits; i++)
+        {
+          double_ *dw_i = MTX_ROW (&dweights[k], i);
+          dw_i[0] += deltas_k[i] * BIAS_ACTIVATION;
+          SIMD->axpy (dw_i + N_BIAS, deltas_k[i], curr->units, curr->nunits);
+        }
+    }
+}
+
+/**
+ *
+ * If dist is not NULL, the sum of distances between expected results
+ * and hypotheses is taken from activations of the same forward pass
+ * and returned, so that cost needs no extra pass over examples
+ *
+ **/
+static const double_ 
+backprop_iter_ (nnetwork_ *netw_p, nnmtx inps, nnmtx outps,
+                nnparams_ *nparams_p, nnmtx_ *deltas, nnmtx_ *dweights,
+                dist_f dist)
+{
+  double_ cost = 0.0;
+  TEL_START ();
+
+  /* Backpropagation */
+  for (size_t m = 0; m < nparams_p->nexamples; m++)
+    {
+      // printf ("[%ld]: m=%ld\n", netw_p->id, m);
+      if (nn_example_prop_ (netw_p, MTX_ROW (inps, m), MTX_ROW (outps, m)) != 0)
+        continue;
+
+      /* Feedforward propagation: set output layer units activations */
+      compute_hypotheses_ (netw_p);
+      TEL_LAP (NN_PHASE_FORWARD);
+
+      if (dist != NULL)
+        {
+          cost += outp_cost_ (dist, netw_p->expoutp, netw_p->outp->units,
+                              netw_p->outp->nunits);
+          TEL_LAP (NN_PHASE_COST);
+        }
+
+      /* Set delta values for all hidden and output layers */
+      compute_deltas_ (netw_p, deltas);
+      TEL_LAP (NN_PHASE_DELTAS);
+
+      /* Accumulate dweights matrices according to computed deltas */
+      acc_dweights_ (netw_p, deltas, dweights);
+      TEL_LAP (NN_PHASE_ACC);
+    }
+  return cost;
+}
+
+/* ====================== MINI-BATCH PROPAGATION ======================= */
+
+/**
+ *
+ * Same as above, but a block of nb examples is propagated together
+ * (see batch_hypotheses_()), y - nb x s_n+1 block of expected output rows,
+ * or lab - their class indices if it is not NULL (see targets_()),
+ * deltas[k] - nb x s_k+1 delta values of layer l_k+1
+ *
+ **/
+
+static void 
+batch_deltas_ (nnetwork_ *netw, const nnmtx_ *y, const uint32_t *lab,
+               nnmtx_ *acts, nnmtx_ *deltas, const size_t nb)
+{
+  size_t ndeltas = netw->nhid + N_OUTP_LAYERS;
+
+  /* Set delta vectors for output layer, 
+     with class indices only the labelled output differs from h */
+  for (size_t b = 0; b < nb; b++)
+    {
+      const double_ *h_b = MTX_ROW (&acts[ndeltas-1], b);
+      double_       *d_b = MTX_ROW (&deltas[ndeltas-1], b);
+      if (lab != NULL)
+        {
+          memcpy (d_b, h_b, netw->outp->nunits * sizeof *d_b);
+          d_b[lab[b]] -= 1.0;
+          continue;
+        }
+
+      const double_ *y_b = MTX_ROW (y, b);
+      for (size_t i = 0; i < netw->outp->nunits; i++)
+        d_b[i] = h_b[i] - y_b[i];
+    }
+
+  /* Set delta vectors for all hidden layers */
+  nnlayer_ *curr = netw->outp->prev;
+  for (size_t k = ndeltas-1; k > 0; k--, curr = curr->prev)
+    {
+      nnmtx_ *d_prev = &deltas[k-1];
+      for (size_t b = 0; b < nb; b++)
+        memset (MTX_ROW (d_prev, b), 0, curr->nunits * sizeof *d_prev->data);
+
+      const nnbsr_ *bsr = kept_blocks_ (curr);
+      if (bsr != NULL)
+        bsrmm_nn (nb, curr->nunits, curr->next->nunits, bsr,
+                  deltas[k].data,                 deltas[k].ld,
+                  curr->weights.data + N_BIAS,    curr->weights.ld,
+                  d_prev->data,                   d_prev->ld);
+      else
+        gemm_nn (nb, curr->nunits, curr->next->nunits,
+                 deltas[k].data,                 deltas[k].ld,
+                 curr->weights.data + N_BIAS,    curr->weights.ld,
+                 d_prev->data,                   d_prev->ld);
+
+      for (size_t b = 0; b < nb; b++)
+        SIMD->dsigmoid (MTX_ROW (d_prev, b), MTX_ROW (&acts[k-1], b), 
+                        curr->nunits);
+    }
+}
+
+static void 
+batch_acc_dweights_ (nnetwork_ *netw, const nnmtx_ *x, const nninps_ *sx,
+                     nnmtx_ *acts, nnmtx_ *deltas, nnmtx_ *dweights, 
+                     const size_t nb)
+{
+  size_t ndweights = N_INP_LAYERS + netw->nhid;
+
+  const nnmtx_ *a_prev = x;
+  nnlayer_ *curr = netw->inp;
+  for (size_t k = 0; k < ndweights; k++, curr = curr->next)
+    {
+      nnmtx_ *dw = &dweights[k];
+      const nnbsr_ *bsr = kept_blocks_ (curr);
+
+      /* Bias column */
+      for (size_t b = 0; b < nb; b++)
+        {
+          const double_ *d_b = MTX_ROW (&deltas[k], b);
+          for (size_t i = 0; i < curr->next->nunits; i++)
+            MTX_ROW (dw, i)[0] += d_b[i] * BIAS_ACTIVATION;
+        }
+
+      if (k == 0 && sx != NULL && sx->dwt != NULL)
+        csrmm_tn (nb, curr->next->nunits, sx->csr, sx->m0, sx->rows,
+                  deltas[k].data,  deltas[k].ld,
+                  sx->dwt->data,   sx->dwt->ld);
+      else if (k == 0 && sx != NULL)
+        csrmm_tnt (nb, curr->next->nunits, sx->csr, sx->m0, sx->rows,
+                   deltas[k].data,     deltas[k].ld,
+                   dw->data + N_BIAS,  dw->ld);
+      else if (bsr != NULL)
+        bsrmm_tn (curr->next->nunits, curr->nunits, nb, bsr,
+                  deltas[k].data,     deltas[k].ld,
+                  a_prev->data,       a_prev->ld,
+                  dw->data + N_BIAS,  dw->ld);
+      else
+        gemm_tn (curr->next->nunits, curr->nunits, nb,
+                 deltas[k].data,     deltas[k].ld,
+                 a_prev->data,       a_prev->ld,
+                 dw->data + N_BIAS,  dw->ld);
+
+      a_prev = &acts[k];
+    }
+}
+
+static const double_ 
+backprop_batch_iter_ (nnetwork_ *netw_p, nnmtx inps, nnmtx outps,
+                      const nninps_ *sp, const uint32_t *labels,
+                      const size_t m0, const size_t m1, const size_t nbatch,
+                      nnmtx_ *acts, nnmtx_ *deltas, nnmtx_ *dweights,
+                      dist_f dist)
+{
+  double_ cost = 0.0;
+  TEL_START ();
+
+  for (size_t m = m0; m < m1; m += nbatch)
+    {
+      size_t nb = m1 - m < nbatch ? m1 - m : nbatch;
+
+      /* Blocks of input/expected output rows, no copies are made */
+      nnmtx_    x, y;
+      nninps_ sx;
+      const nninps_ *px  = block_   (inps, sp, m, nb, &x, &sx);
+      const uint32_t  *lab = targets_ (outps, labels, m, nb, &y);
+
+      /* Feedforward propagation: set activations of the block */
+      batch_hypotheses_ (netw_p, &x, px, acts, nb);
+      TEL_LAP (NN_PHASE_FORWARD);
+
+      if (dist != NULL)
+        {
+          cost += batch_cost_ (dist, &y, lab, &acts[netw_p->nhid], nb);
+          TEL_LAP (NN_PHASE_COST);
+        }
+
+      /* Set delta values for all hidden and output layers */
+      batch_deltas_ (netw_p, &y, lab, acts, deltas, nb);
+      TEL_LAP (NN_PHASE_DELTAS);
+
+      /* Accumulate dweights matrices according to computed deltas */
+      batch_acc_dweights_ (netw_p, &x, px, acts, deltas, dweights, nb);
+      TEL_LAP (NN_PHASE_ACC);
+    }
+  return cost;
+}
+
+/**
+ *
+ * Same as backprop_batch_iter_(), but rows idx[m0], ..., idx[m1-1] are 
+ * propagated: each block of them is gathered into x and y of nbatch rows 
+ * first, so the training set itself is never reordered; sparse inputs
+ * are not gathered, the block refers to their rows in idx, and class
+ * indices are gathered into lab instead of y
+ *
+ **/
+static const double_ 
+backprop_idx_iter_ (nnetwork_ *netw_p, nnmtx inps, nnmtx outps,
+                    const nninps_ *sp, const uint32_t *labels,
+                    const size_t *idx, const size_t m0, const size_t m1,
+                    const size_t nbatch, nnmtx x, nnmtx y, uint32_t *lab,
+                    nnmtx_ *acts, nnmtx_ *deltas, nnmtx_ *dweights, 
+                    dist_f dist)
+{
+  double_ cost = 0.0;
+
+  for (size_t m = m0; m < m1; m += nbatch)
+    {
+      size_t nb = m1 - m < nbatch ? m1 - m : nbatch;
+      for (size_t b = 0; b < nb; b++)
+        {
+          if (sp == NULL)
+            memcpy (MTX_ROW (x, b), MTX_ROW (inps, idx[m + b]), 
+                    inps->ncols * sizeof *x->data);
+          if (labels != NULL)
+            lab[b] = labels[idx[m + b]];
+          else
+            memcpy (MTX_ROW (y, b), MTX_ROW (outps, idx[m + b]),
+                    outps->ncols * sizeof *y->data);
+        }
+
+      nninps_ sx;
+      if (sp != NULL)
+        {
+          sx      = *sp;
+          sx.rows = idx;
+          sx.m0   = m;
+        }
+      cost += backprop_batch_iter_ (netw_p, x, y, sp != NULL ? &sx : NULL,
+                                    labels != NULL ? lab : NULL, 0, nb, 
+                                    nbatch, acts, deltas, dweights, dist);
+    }
+  return cost;
+}
+
+/* Learning rate of iter'th iteration (see nn_set_lr_schedule()) */
+static double_ learn_rate_ (nnparams_ *nparams_p, const size_t iter)
+{
+  double_ lr     = nparams_p->learn_p;
+  size_t  warmup = nparams_p->warmup;
+  if (iter < warmup)
+    return lr * (iter + 1) / warmup;
+
+  size_t  t      = iter - warmup;
+  size_t  niters = nparams_p->niters - warmup;
+  double_ gamma  = nparams_p->gamma;
+  if (nparams_p->lr_sched == NN_LR_STEP && nparams_p->period > 0)
+    return lr * pow (gamma, t / nparams_p->period);
+  if (nparams_p->lr_sched == NN_LR_COSINE)
+    return lr * (gamma + (1 - gamma) * (1 + cos (M_PI * t / niters)) / 2);
+  return lr;
+}
+
+/**
+ *
+ * Zero the gradient of i'th row of pruned weights in the blocks that 
+ * are not kept, moments of a training start at 0, so the weights 
+ * stay 0 there with every update rule (see nn_prune())
+ *
+ **/
+static inline void 
+mask_pruned_ (const nnbsr_ *bsr, double_ *dw_i, const size_t i, 
+              const size_t n)
+{
+  const uint8_t *keep = bsr->keep + i / BSR_ROWS * bsr->nbcols;
+  for (size_t c = 0; c < bsr->nbcols; c++)
+    if (! keep[c])
+      {
+        size_t j0 = c * BSR_COLS, j1 = j0 + BSR_COLS < n ? j0 + BSR_COLS : n;
+        memset (dw_i + j0, 0, (j1 - j0) * sizeof *dw_i);
+      }
+}
+
+/**
+ *
+ * W := W - alpha * (dW / n + lambda * W / m), n - # of examples dW is 
+ * summed over, m = n unless mini-batch (see nn_set_minibatch()); 
+ * bias weights are not regularized, dweights are zeroed for the next 
+ * update; with momentum or Adam the moments of a row are updated 
+ * in the same pass over it (see nn_set_optimizer())
+ *
+ **/
+static void 
+reset_weights_ (nnetwork_ *netw_p, nnmtx_ *dweights, nnoptim_ *optim,
+                nnparams_ *nparams_p, const size_t iter, const size_t n)
+{
+  double_ alpha  = learn_rate_ (nparams_p, iter);
+  double_ lambda = nparams_p->regur_p;
+  double_ scale  = 1.0 / n;
+  double_ rscale = 1.0 / nparams_p->nexamples;
+  nnopt   opt    = nparams_p->opt;
+  int     nest   = opt == NN_OPT_NESTEROV;
+  size_t  t      = ++optim->t;
+
+  /* Adam steps of weights and of bias weights, moments are unbiased */
+  nnadamk_ adam, adam_bias;
+  if (opt == NN_OPT_ADAM || opt == NN_OPT_ADAMW)
+    {
+      double_ b1 = 1 - pow (nparams_p->beta1, t);
+      double_ b2 = 1 - pow (nparams_p->beta2, t);
+      adam.c     = scale;
+      adam.l     = opt == NN_OPT_ADAM ? lambda * rscale : 0.0;
+      adam.beta1 = nparams_p->beta1;
+      adam.beta2 = nparams_p->beta2;
+      adam.lr    = alpha * sqrt (b2) / b1;
+      adam.eps   = ADAM_EPS;
+      adam.decay = opt == NN_OPT_ADAMW ? 1 - alpha * lambda * rscale : 1.0;
+
+      adam_bias       = adam;
+      adam_bias.l     = 0.0;
+      adam_bias.decay = 1.0;
+    }
+
+  size_t k = 0;
+  for (nnlayer_ *curr = netw_p->inp; curr != netw_p->outp; curr = curr->next)
+    {
+      size_t ncurr = curr->nunits;
+      size_t nnext = curr->next->nunits;
+      for (size_t i = 0; i < nnext; i++)
+        {
+          double_ *w_i  = MTX_ROW (&curr->weights, i);
+          double_ *dw_i = MTX_ROW (&dweights[k], i);
+          if (curr->bsr != NULL)
+            mask_pruned_ (curr->bsr, dw_i + N_BIAS, i, ncurr);
+          if (opt == NN_OPT_SGD)
+            {
+              w_i[0] -= alpha * scale * dw_i[0];
+              dw_i[0] = 0.0;
+              SIMD->update (w_i + N_BIAS, dw_i + N_BIAS, alpha * scale, 
+                            1 - alpha * rscale * lambda, ncurr);
+              continue;
+            }
+
+          double_ *m_i = MTX_ROW (&optim->m[k], i);
+          if (opt == NN_OPT_MOMENTUM || opt == NN_OPT_NESTEROV)
+            {
+              SIMD->momentum (w_i, dw_i, m_i, alpha * scale, 0.0, 
+                              nparams_p->beta1, nest, N_BIAS);
+              SIMD->momentum (w_i + N_BIAS, dw_i + N_BIAS, m_i + N_BIAS, 
+                              alpha * scale, alpha * rscale * lambda, 
+                              nparams_p->beta1, nest, ncurr);
+              continue;
+            }
+
+          double_ *v_i = MTX_ROW (&optim->v[k], i);
+          SIMD->adam (w_i, dw_i, m_i, v_i, &adam_bias, N_BIAS);
+          SIMD->adam (w_i + N_BIAS, dw_i + N_BIAS, m_i + N_BIAS, 
+                      v_i + N_BIAS, &adam, ncurr);
+        }
+      k++;
+    }
+}
+
+/* Cost is reported on the 1st iteration and then on every n'th one */
+static int cost_due_ (nnparams_ *nparams_p, const size_t i)
+{
+  size_t n = nparams_p->cost_every_n;
+  return n > 0 && i % n == 0;
+}
+
+/* ====================== DATA-PARALLEL TRAINING ======================= */
+
+/**
+ *
+ * Each worker accumulates the gradient over its own shard into its own
+ * dweights, then the dweights slab is cut into nworkers contiguous slices
+ * and every worker sums one slice over all shards into shard 0 buffers,
+ * so the reduction is done in parallel in a single pass over the weights
+ *
+ **/
+static void reduce_dweights_ (nntrain_ *tr, const size_t w)
+{
+  /* dweights slab has the same layout as network weights slab */
+  size_t nweights = nn_layers_nweights_ (tr->netw);
+  size_t lo = mtx_ld (nweights * w / tr->nworkers);
+  size_t hi = w + 1 < tr->nworkers 
+            ? mtx_ld (nweights * (w + 1) / tr->nworkers) : nweights;
+
+  double_ *dst = tr->shards[0].dweights[0].data;
+  for (size_t s = 1; s < tr->nworkers; s++)
+    {
+      double_ *src = tr->shards[s].dweights[0].data;
+      SIMD->axpy (dst + lo, 1.0, src + lo, hi - lo);
+      memset (src + lo, 0, (hi - lo) * sizeof *src);
+    }
+}
+
+/**
+ *
+ * @brief Sum cost and phases of all shards, phases of shards are zeroed
+ *
+ * @return cost function if dist is not NULL, NAN if it is
+ *
+ **/
+static double shards_cost_ (nntrain_ *tr, dist_f dist, double *phases)
+{
+  double_ cost = 0.0;
+  for (size_t s = 0; s < tr->nworkers; s++)
+    {
+      nnshard_ *sh = &tr->shards[s];
+      cost -= sh->cost;
+      for (size_t p = 0; p < NN_NPHASES; p++)
+        {
+          phases[p]    += sh->phases[p];
+          sh->phases[p] = 0.0;
+        }
+    }
+  if (dist == NULL)
+    return NAN;
+
+  TEL_START ();
+  cost = costfunc_total_ (tr->netw, tr->nparams, cost);
+  TEL_LAP (NN_PHASE_COST);
+  return cost;
+}
+
+/* Modify weights with dweights of n examples reduced into shard 0 */
+static void step_ (nntrain_ *tr, const size_t i, const size_t n)
+{
+  TEL_START ();
+  reset_weights_ (tr->netw, tr->shards[0].dweights, &tr->optim, 
+                  tr->nparams, i, n);
+  if (tr->wt != NULL)
+    sparse_weights_ (tr);
+  TEL_LAP (NN_PHASE_UPDATE);
+}
+
+/* Modify weights with reduced dweights and report i'th iteration */
+static void update_ (nntrain_ *tr, const size_t i, dist_f dist)
+{
+  /* Cost with weights, that were used to find dweights */
+  double phases[NN_NPHASES] = { 0.0 };
+  double cost = shards_cost_ (tr, dist, phases);
+
+  step_ (tr, i, tr->nparams->nexamples);
+
+  tel_collect_ (phases);
+  report_ (tr->netw, tr->nparams, i, cost, phases, &tr->tlast);
+}
+
+/**
+ *
+ * @brief Reduce dweights of all shards and modify network weights,
+ *        finishes i'th iteration of every worker
+ *
+ **/
+static void 
+update_worker_ (nntrain_ *tr, const size_t w, const size_t i, dist_f dist)
+{
+  pthread_barrier_wait (&tr->barrier);
+  TEL_START ();
+  reduce_dweights_ (tr, w);
+  TEL_LAP (NN_PHASE_UPDATE);
+  tel_collect_ (tr->shards[w].phases);
+  pthread_barrier_wait (&tr->barrier);
+
+  if (w == 0)
+    update_ (tr, i, dist);
+  pthread_barrier_wait (&tr->barrier);
+}
+
+static void backprop_worker_ (nntrain_ *tr, const size_t w)
+{
+  nnetwork_ *netw_p    = tr->netw;
+  nnparams_ *nparams_p = tr->nparams;
+  nnshard_  *sh        = &tr->shards[w];
+
+  size_t m0, m1;
+  shard_ (tr, w, &m0, &m1);
+
+  for (size_t i = 0; i < nparams_p->niters; i++)
+    {
+      dist_f dist = cost_due_ (nparams_p, i) ? nparams_p->dist : NULL;
+
+      /* Feedforward and then backpropagate to find shard dweights */
+      sh->cost = backprop_batch_iter_ (netw_p, tr->inps, tr->outps, NULL,
+                                       NULL, m0, m1, nparams_p->nbatch, 
+                                       sh->acts, sh->deltas, sh->dweights, 
+                                       dist);
+
+      update_worker_ (tr, w, i, dist);
+    }
+}
+
+static void 
+sched_backprop_ (nnetwork_ *netw_p, nnmtx inps, nnmtx outps, nncsr_ *csr,
+                 nnqmtx_ *q, nnsource_ *src, nnparams_ *nparams_p);
+
+/* Mini-batches, validation and class indices are done by tasks 
+   of the scheduler */
+static int sched_only_ (nnparams_ *nparams_p)
+{
+  return nparams_p->minibatch > 0 || nparams_p->vinps != NULL
+      || nparams_p->labels != NULL;
+}
+
+void
+nn_backprop (nnetwork_ *netw_p, nnmtx inps, nnmtx outps,
+             nnparams_ *nparams_p)
+{
+  if (sched_only_ (nparams_p))
+    {
+      sched_backprop_ (netw_p, inps, outps, NULL, NULL, NULL, nparams_p);
+      return;
+    }
+
+  printf ("[%ld]: Training neural network ...\n", netw_p->id);
+
+  if (nworkers_ (nparams_p) > 1)
+    {
+      /* Split examples between worker threads */
+      nntrain_ *tr = alloc_train_ (netw_p, inps, outps, nparams_p, 
+                                   nworkers_ (nparams_p), 1);
+      par_run_ (tr, backprop_worker_);
+      free_train_ (tr);
+      return;
+    }
+
+  size_t  nbatch   = nparams_p->nbatch;
+  nnmtx_ *acts     = nbatch > 1 ? alloc_units_mtx_ (netw_p, nbatch) : NULL;
+  nnmtx_ *deltas   = alloc_units_mtx_ (netw_p, nbatch);
+  nnmtx_ *dweights = alloc_dweights_  (netw_p);
+  nnoptim_ optim   = alloc_optim_ (netw_p, nparams_p);
+  double   tlast   = tel_now_ ();
+
+  for (size_t i = 0; i < nparams_p->niters; i++)
+    {
+      dist_f  dist = cost_due_ (nparams_p, i) ? nparams_p->dist : NULL;
+      double_ cost;
+      double  phases[NN_NPHASES] = { 0.0 };
+
+      /* Feedforward and then backpropagate to find dweights */
+      if (nbatch > 1)
+        cost = backprop_batch_iter_ (netw_p, inps, outps, NULL, NULL, 0, 
+                                     nparams_p->nexamples, nbatch, 
+                                     acts, deltas, dweights, dist);
+      else
+        cost = backprop_iter_ (netw_p, inps, outps, nparams_p, 
+                               deltas, dweights, dist);
+
+      /* Cost with weights, that were used to find dweights */
+      TEL_START ();
+      if (dist != NULL)
+        cost = costfunc_total_ (netw_p, nparams_p, -cost);
+      TEL_LAP (NN_PHASE_COST);
+
+      /* Modify network weights according to computed dweights */
+      reset_weights_ (netw_p, dweights, &optim, nparams_p, i, 
+                      nparams_p->nexamples);
+      TEL_LAP (NN_PHASE_UPDATE);
+
+      tel_collect_ (phases);
+      report_ (netw_p, nparams_p, i, dist != NULL ? cost : NAN, phases, 
+               &tlast);
+    }
+
+  /* Free memory from activations, delta vectors and dweights matrices */
+  free_units_mtx_ (acts);
+  free_units_mtx_ (deltas);
+  free_dweights_  (dweights);
+  free_optim_ (&optim);
+}
+
+void 
+nn_backprop_sparse (nnetwork_ *netw_p, nncsr_ *inps, nnmtx outps, 
+                    nnparams_ *nparams_p)
+{
+  sched_backprop_ (netw_p, NULL, outps, inps, NULL, NULL, nparams_p);
+}
+
+void 
+nn_backprop_quant (nnetwork_ *netw_p, nnqmtx_ *inps, nnmtx outps, 
+                   nnparams_ *nparams_p)
+{
+  sched_backprop_ (netw_p, NULL, outps, NULL, inps, NULL, nparams_p);
+}
+
+/* ======================== STREAMING TRAINING ========================= */
+
+/**
+ *
+ * Worker 0 takes the next chunk from the source, then every worker
+ * propagates its own share of the chunk rows; the chunk is released
+ * only after all workers are done with it, since it is taken again
+ * by the next call to src->next ()
+ *
+ **/
+static void stream_worker_ (nntrain_ *tr, const size_t w)
+{
+  nnetwork_ *netw_p    = tr->netw;
+  nnparams_ *nparams_p = tr->nparams;
+  nnshard_  *sh        = &tr->shards[w];
+
+  for (size_t i = 0; i < nparams_p->niters; i++)
+    {
+      dist_f dist = cost_due_ (nparams_p, i) ? nparams_p->dist : NULL;
+      sh->cost = 0.0;
+
+      for (;;)
+        {
+          if (w == 0)
+            tr->nchunk = tr->src->next (tr->src->ctx, 
+                                        &tr->chunk_inps, &tr->chunk_outps);
+          pthread_barrier_wait (&tr->barrier);
+
+          if (tr->nchunk == 0)
+            break;
+
+          size_t m0 = tr->nchunk *  w      / tr->nworkers;
+          size_t m1 = tr->nchunk * (w + 1) / tr->nworkers;
+          sh->cost += backprop_batch_iter_ (netw_p, tr->inps, tr->outps, 
+                                            NULL, NULL, m0, m1, 
+                                            nparams_p->nbatch, 
+                                            sh->acts, sh->deltas, 
+                                            sh->dweights, dist);
+          pthread_barrier_wait (&tr->barrier);
+        }
+
+      update_worker_ (tr, w, i, dist);
+    }
+}
+
+void nn_backprop_stream (nnetwork_ *netw_p, nnsource_ *src, 
+                         nnparams_ *nparams_p)
+{
+  if (sched_only_ (nparams_p))
+    {
+      sched_backprop_ (netw_p, NULL, NULL, NULL, NULL, src, nparams_p);
+      return;
+    }
+
+  printf ("[%ld]: Training neural network ...\n", netw_p->id);
+
+  /* Workers propagate rows of the current chunk */
+  nntrain_ *tr = alloc_train_ (netw_p, NULL, NULL, nparams_p, 
+                               nworkers_ (nparams_p), 1);
+  tr->src   = src;
+  tr->inps  = &tr->chunk_inps;
+  tr->outps = &tr->chunk_outps;
+
+  par_run_ (tr, stream_worker_);
+  free_train_ (tr);
+}
+
+/* ============================ VALIDATION ============================= */
+
+/**
+ *
+ * At the end of every valid_every'th iteration the weights are copied 
+ * into the network of the validation, and its tasks propagate shares 
+ * of the validation set while the next iterations are trained, so that
+ * threads idle between phases of training take them; the copy is never
+ * overwritten while it is validated: if the previous validation is not
+ * done when the next one is due, training is parked and the last task
+ * of the validation resumes it, so validation lags by valid_every 
+ * iterations at most, even when no thread is idle
+ *
+ * The last task of a validation reports the cost, keeps the copy if it
+ * is the best one so far and decides whether to stop; whichever of the
+ * last iteration and the last validation is done later validates the 
+ * final weights, if they were not, and then restores the best ones
+ * (see sched_done_())
+ *
+ **/
+static void sched_next_ (nntrain_ *tr);
+static void sched_done_ (nntrain_ *tr);
+
+static void valid_task_ (void *arg);
+
+/* Early stopping is on, so the best weights are kept */
+static int valid_keep_ (nnparams_ *nparams_p)
+{
+  return nparams_p->patience > 0 || nparams_p->target > 0;
+}
+
+static int valid_stop_ (nntrain_ *tr)
+{
+  return tr->valid != NULL 
+      && __atomic_load_n (&tr->valid->stop, __ATOMIC_ACQUIRE);
+}
+
+/* Copy weights after iter'th iteration and spawn tasks, busy is set */
+static void valid_start_ (nntrain_ *tr, const size_t iter)
+{
+  nnvalid_ *v = tr->valid;
+  memcpy (v->netw->wslab, tr->netw->wslab, 
+          nn_layers_nweights_ (tr->netw) * sizeof *v->best);
+  v->iter = iter;
+  v->t0   = tel_now_ ();
+
+  /* tr could be freed by the last task before the loop ends */
+  nnsched      sched = tr->sched;
+  worker_arg_ *tasks = v->tasks;
+  size_t           n = v->ntasks;
+
+  v->nleft = n;
+  for (size_t w = 0; w < n; w++)
+    sched_spawn (sched, valid_task_, &tasks[w]);
+}
+
+/**
+ *
+ * @brief Validate weights at the end of the iteration, if it is due
+ *
+ * @return 1 if training is parked until the previous validation is done
+ *
+ **/
+static int valid_iter_ (nntrain_ *tr)
+{
+  nnvalid_ *v     = tr->valid;
+  size_t    every = tr->nparams->valid_every;
+  size_t    iter  = tr->iter + 1;
+  if (every == 0 || iter % every != 0 || valid_stop_ (tr))
+    return 0;
+
+  pthread_mutex_lock (&v->lock);
+  int busy  = v->busy;
+  v->busy   = 1;
+  v->parked = busy;
+  pthread_mutex_unlock (&v->lock);
+
+  if (busy)
+    return 1;
+  valid_start_ (tr, iter);
+  return 0;
+}
+
+/* Report cost of the copy, keep it if it is the best one, decide to stop */
+static void valid_done_ (nntrain_ *tr)
+{
+  nnvalid_  *v         = tr->valid;
+  nnparams_ *nparams_p = tr->nparams;
+  size_t     nvalid    = nparams_p->vinps->nrows;
+
+  double_ cost = 0.0;
+  for (size_t w = 0; w < v->ntasks; w++)
+    cost -= v->cost[w];
+  cost /= nvalid;
+
+  nnstats_ st = { 0 };
+  st.id         = tr->netw->id;
+  st.iter       = v->iter;
+  st.nexamples  = nvalid;
+  st.secs       = tel_now_ () - v->t0;
+  st.examples_per_s = st.secs > 0 ? st.nexamples / st.secs : 0.0;
+  st.cost       = NAN;
+  st.valid_cost = cost;
+  nparams_p->report (&st, nparams_p->report_ctx);
+
+  if (cost < v->best_cost - nparams_p->min_delta)
+    {
+      /* The next copy is taken into the previous best weights */
+      double_ *ws = v->best;
+      v->best = v->netw->wslab;
+      nn_view_layers_weights_ (v->netw, ws);
+      v->best_cost = cost;
+      v->best_iter = v->iter;
+      v->nbad      = 0;
+    }
+  else
+    v->nbad++;
+
+  if ((nparams_p->patience > 0 && v->nbad >= nparams_p->patience)
+   || cost <= nparams_p->target)
+    __atomic_store_n (&v->stop, 1, __ATOMIC_RELEASE);
+
+  pthread_mutex_lock (&v->lock);
+  v->busy     = 0;
+  int parked  = v->parked;
+  int trained = v->trained;
+  v->parked   = 0;
+  pthread_mutex_unlock (&v->lock);
+
+  if (parked)
+    sched_next_ (tr);
+  else if (trained)
+    sched_done_ (tr);
+}
+
+static void valid_task_ (void *arg)
+{
+  worker_arg_ *wa        = (worker_arg_ *)arg;
+  nntrain_    *tr        = wa->tr;
+  nnvalid_    *v         = tr->valid;
+  nnparams_   *nparams_p = tr->nparams;
+
+  size_t n  = nparams_p->vinps->nrows;
+  size_t m0 = n *  wa->w      / v->ntasks;
+  size_t m1 = n * (wa->w + 1) / v->ntasks;
+  v->cost[wa->w] = costfunc_batch_ (v->netw, nparams_p->vinps, 
+                                    nparams_p->voutps, NULL, 
+                                    nparams_p->vlabels, nparams_p->dist, 
+                                    m0, m1, v->acts[wa->w], 
+                                    nparams_p->nbatch);
+
+  if (__atomic_sub_fetch (&v->nleft, 1, __ATOMIC_ACQ_REL) == 0)
+    valid_done_ (tr);
+}
+
+/* ======================== SCHEDULED TRAINING ========================= */
+
+/**
+ *
+ * An iteration is split into tasks of the scheduler, that never wait:
+ *
+ *   chunk    take the next chunk (the whole training set if it is resident)
+ *            and spawn one shard task per share of its rows
+ *   shard    propagate the share, the last shard task of the chunk 
+ *            takes the next chunk, or spawns the reduce tasks at the end
+ *            of the pass
+ *   reduce   sum one slice of dweights over all shards, the last reduce
+ *            task modifies the weights and starts the next iteration
+ *
+ * Shards are summed in the same order whichever thread ran them, so the
+ * results are the same as of nn_backprop() with nworkers = # of shards
+ *
+ * With mini-batches (see nn_set_minibatch()) rows of every chunk are 
+ * shuffled when it is taken, and shard and reduce tasks are spawned for 
+ * each mini-batch of the shuffled rows: the last reduce task modifies 
+ * the weights and spawns shards of the next mini-batch, or takes 
+ * the next chunk; the iteration ends with the pass
+ *
+ **/
+static void sched_shard_  (void *arg);
+static void sched_reduce_ (void *arg);
+static void sched_minibatch_ (nntrain_ *tr);
+
+/* 1 if the task is the last one of the current phase */
+static int sched_last_ (nntrain_ *tr)
+{
+  return __atomic_sub_fetch (&tr->nleft, 1, __ATOMIC_ACQ_REL) == 0;
+}
+
+static void sched_spawn_all_ (nntrain_ *tr, task_f f)
+{
+  /* tr could be freed by the last task before the loop ends */
+  nnsched      sched = tr->sched;
+  worker_arg_ *tasks = tr->tasks;
+  size_t           n = tr->nworkers;
+
+  tr->nleft = n;
+  for (size_t w = 0; w < n; w++)
+    sched_spawn (sched, f, &tasks[w]);
+}
+
+/* Fisher-Yates shuffle of the order of rows of the current chunk */
+static void shuffle_ (nntrain_ *tr)
+{
+  size_t n = tr->nchunk;
+  if (n > tr->nperm)
+    {
+      free (tr->perm);
+      if ((tr->perm = malloc (n * sizeof *tr->perm)) == NULL)
+        nn_exit_ (tr->netw);
+      tr->nperm = n;
+    }
+
+  size_t *perm = tr->perm;
+  for (size_t m = 0; m < n; m++)
+    perm[m] = m;
+  for (size_t m = n; m > 1; m--)
+    {
+      size_t j   = rnd_u64 (&tr->rng) % m;
+      size_t tmp = perm[m-1];
+      perm[m-1]  = perm[j];
+      perm[j]    = tmp;
+    }
+}
+
+static void sched_chunk_ (nntrain_ *tr)
+{
+  /* Resident training set is a single chunk */
+  if (tr->src != NULL)
+    tr->nchunk = tr->src->next (tr->src->ctx, 
+                                &tr->chunk_inps, &tr->chunk_outps);
+  else
+    tr->nchunk = tr->nchunk == 0 ? tr->nparams->nexamples : 0;
+
+  if (tr->nparams->minibatch > 0)
+    {
+      if (tr->nchunk > 0)
+        shuffle_ (tr);
+      tr->mb1 = 0;
+      sched_minibatch_ (tr);
+      return;
+    }
+
+  sched_spawn_all_ (tr, tr->nchunk > 0 ? sched_shard_ : sched_reduce_);
+}
+
+static void sched_iter_ (nntrain_ *tr)
+{
+  nnparams_ *nparams_p = tr->nparams;
+  tr->dist = cost_due_ (nparams_p, tr->iter) ? nparams_p->dist : NULL;
+  for (size_t w = 0; w < tr->nworkers; w++)
+    tr->shards[w].cost = 0.0;
+
+  sched_chunk_ (tr);
+}
+
+/* Start the next iteration, or finish training after the last */
+static void sched_next_ (nntrain_ *tr)
+{
+  if (tr->valid != NULL && valid_iter_ (tr) != 0)
+    return;
+
+  if (++tr->iter < tr->nparams->niters && ! valid_stop_ (tr))
+    sched_iter_ (tr);
+  else
+    sched_done_ (tr);
+}
+
+/**
+ *
+ * Spawn shards of the next mini-batch of the chunk, take the next chunk 
+ * after the last one, or report the iteration at the end of the pass,
+ * the weights are already modified by then
+ *
+ **/
+static void sched_minibatch_ (nntrain_ *tr)
+{
+  if (tr->nchunk == 0)
+    {
+      double phases[NN_NPHASES] = { 0.0 };
+      double cost = shards_cost_ (tr, tr->dist, phases);
+      tel_collect_ (phases);
+      report_ (tr->netw, tr->nparams, tr->iter, cost, phases, &tr->tlast);
+      sched_next_ (tr);
+      return;
+    }
+
+  if (tr->mb1 == tr->nchunk)
+    {
+      sched_chunk_ (tr);
+      return;
+    }
+
+  size_t minibatch = tr->nparams->minibatch;
+  tr->mb0 = tr->mb1;
+  tr->mb1 = tr->nchunk - tr->mb0 < minibatch ? tr->nchunk 
+                                             : tr->mb0 + minibatch;
+  sched_spawn_all_ (tr, sched_shard_);
+}
+
+static void sched_shard_ (void *arg)
+{
+  worker_arg_ *wa = (worker_arg_ *)arg;
+  nntrain_    *tr = wa->tr;
+  nnshard_    *sh = &tr->shards[wa->w];
+  int  minibatch  = tr->nparams->minibatch > 0;
+  nninps_    sp;
+  const nninps_ *psp = shard_inps_ (tr, wa->w, &sp);
+
+  if (minibatch)
+    {
+      /* Share of the mini-batch rows in shuffled order */
+      size_t n  = tr->mb1 - tr->mb0;
+      size_t m0 = tr->mb0 + n *  wa->w      / tr->nworkers;
+      size_t m1 = tr->mb0 + n * (wa->w + 1) / tr->nworkers;
+      sh->cost += backprop_idx_iter_ (tr->netw, tr->inps, tr->outps, psp,
+                                      tr->labels, tr->perm, m0, m1, 
+                                      tr->nparams->nbatch, sh->x, sh->y, 
+                                      sh->lab, sh->acts, sh->deltas, 
+                                      sh->dweights, tr->dist);
+    }
+  else
+    {
+      size_t m0 = tr->nchunk *  wa->w      / tr->nworkers;
+      size_t m1 = tr->nchunk * (wa->w + 1) / tr->nworkers;
+      sh->cost += backprop_batch_iter_ (tr->netw, tr->inps, tr->outps, psp,
+                                        tr->labels, m0, m1, 
+                                        tr->nparams->nbatch, 
+                                        sh->acts, sh->deltas, 
+                                        sh->dweights, tr->dist);
+    }
+  if (sh->dwt != NULL)
+    {
+      TEL_START ();
+      sparse_fold_ (sh);
+      TEL_LAP (NN_PHASE_ACC);
+    }
+  tel_collect_ (sh->phases);
+
+  if (! sched_last_ (tr))
+    return;
+  if (minibatch)
+    sched_spawn_all_ (tr, sched_reduce_);
+  else
+    sched_chunk_ (tr);
+}
+
+static void sched_reduce_ (void *arg)
+{
+  worker_arg_ *wa = (worker_arg_ *)arg;
+  nntrain_    *tr = wa->tr;
+
+  TEL_START ();
+  reduce_dweights_ (tr, wa->w);
+  TEL_LAP (NN_PHASE_UPDATE);
+  tel_collect_ (tr->shards[wa->w].phases);
+  if (! sched_last_ (tr))
+    return;
+
+  if (tr->nparams->minibatch > 0)
+    {
+      /* Every task of the mini-batch is done, so is shard 0 */
+      step_ (tr, tr->iter, tr->mb1 - tr->mb0);
+      tel_collect_ (tr->shards[0].phases);
+      sched_minibatch_ (tr);
+      return;
+    }
+
+  update_ (tr, tr->iter, tr->dist);
+  sched_next_ (tr);
+}
+
+/**
+ *
+ * Called after the last iteration, and again after the last validation
+ * if it was running then; the final weights are validated unless they 
+ * were or training stopped early, then the best weights are restored 
+ * and the training state is freed
+ *
+ **/
+static void sched_done_ (nntrain_ *tr)
+{
+  nnvalid_ *v = tr->valid;
+  if (v == NULL)
+    {
+      free_train_ (tr);
+      return;
+    }
+
+  int final = v->iter != tr->iter && ! valid_stop_ (tr);
+  pthread_mutex_lock (&v->lock);
+  int busy   = v->busy;
+  v->busy    = busy || final;
+  v->trained = 1;
+  pthread_mutex_unlock (&v->lock);
+
+  if (busy)
+    return;
+  if (final)
+    {
+      valid_start_ (tr, tr->iter);
+      return;
+    }
+
+  nnetwork_ *netw_p = tr->netw;
+  if (valid_stop_ (tr))
+    printf ("[%ld]: Stopped early after %ld iterations\n", 
+            netw_p->id, tr->iter);
+  if (valid_keep_ (tr->nparams) && v->best_iter > 0)
+    {
+      memcpy (netw_p->wslab, v->best, 
+              nn_layers_nweights_ (netw_p) * sizeof *v->best);
+      printf ("[%ld]: Kept weights of iteration %ld, validation cost = %g\n",
+              netw_p->id, v->best_iter, v->best_cost);
+    }
+  free_train_ (tr);
+}
+
+static void 
+sched_train_ (nnsched sched, nnetwork_ *netw_p, nnmtx inps, nnmtx outps, 
+              nncsr_ *csr, nnqmtx_ *q, nnsource_ *src, nnparams_ *nparams_p)
+{
+  if (csr != NULL && csr->ncols != netw_p->inp->nunits)
+    {
+      fprintf (stderr, "nn_backprop_sparse(): inputs don't match "
+                       "the network\n");
+      return;
+    }
+  if (q != NULL && q->ncols != netw_p->inp->nunits)
+    {
+      fprintf (stderr, "nn_backprop_quant(): inputs don't match "
+                       "the network\n");
+      return;
+    }
+
+  const uint32_t *labels = src == NULL ? nparams_p->labels : NULL;
+  if (labels != NULL 
+   && labels_check_ (netw_p, labels, nparams_p->nexamples))
+    {
+      fprintf (stderr, "nn_backprop(): class indices don't match "
+                       "the network\n");
+      return;
+    }
+  if (src != NULL && nparams_p->labels != NULL)
+    fprintf (stderr, "nn_backprop_stream(): class indices are not used "
+                     "with streamed data sets\n");
+
+  printf ("[%ld]: Training neural network ...\n", netw_p->id);
+  if (nparams_p->niters == 0)
+    return;
+
+  /* One shard per scheduler thread, idle threads steal shards */
+  size_t nshards = sched_nthreads (sched);
+  nntrain_ *tr = alloc_train_ (netw_p, inps, outps, nparams_p, nshards, 1);
+  tr->sched  = sched;
+  tr->iter   = 0;
+  tr->nchunk = 0;
+  tr->labels = labels;
+  if (src != NULL)
+    {
+      tr->src   = src;
+      tr->inps  = &tr->chunk_inps;
+      tr->outps = &tr->chunk_outps;
+    }
+
+  if ((tr->tasks = malloc (nshards * sizeof *tr->tasks)) == NULL)
+    nn_exit_ (netw_p);
+  for (size_t w = 0; w < nshards; w++)
+    tr->tasks[w] = (worker_arg_) { NULL, tr, w };
+
+  nnmtx vinps = nparams_p->vinps, voutps = nparams_p->voutps;
+  const uint32_t *vlabels = nparams_p->vlabels;
+  if (vinps != NULL)
+    {
+      int bad = vinps->ncols != netw_p->inp->nunits;
+      if (vlabels != NULL)
+        bad |= labels_check_ (netw_p, vlabels, vinps->nrows);
+      else
+        bad |= voutps == NULL || voutps->ncols != netw_p->outp->nunits 
+                              || voutps->nrows != vinps->nrows;
+      if (bad)
+        fprintf (stderr, "nn_backprop(): validation set doesn't match "
+                         "the network, it is not used\n");
+      else
+        tr->valid = alloc_valid_ (tr);
+    }
+
+  if (csr != NULL)
+    sparse_alloc_ (tr, csr, 1);
+  if (q != NULL)
+    quant_alloc_ (tr, q);
+
+  /* Blocks of shuffled rows are gathered into shard buffers */
+  if (nparams_p->minibatch > 0)
+    {
+      rnd_init (&tr->rng, nparams_p->seed, SHUFFLE_STREAM (netw_p->id));
+      for (size_t w = 0; w < nshards; w++)
+        {
+          nnshard_ *sh = &tr->shards[w];
+          if (tr->inps != NULL
+           && (sh->x = alloc_mtx (nparams_p->nbatch, netw_p->inp->nunits, 0))
+              == NULL)
+            nn_exit_ (netw_p);
+          if (labels != NULL)
+            sh->lab = malloc (nparams_p->nbatch * sizeof *sh->lab);
+          else
+            sh->y = alloc_mtx (nparams_p->nbatch, netw_p->outp->nunits, 0);
+          if (sh->lab == NULL && sh->y == NULL)
+            nn_exit_ (netw_p);
+        }
+    }
+
+  sched_iter_ (tr);
+}
+
+void nn_backprop_async (nnsched sched, nnetwork_ *netw_p, 
+                        nnmtx inps, nnmtx outps, nnparams_ *nparams_p)
+{
+  sched_train_ (sched, netw_p, inps, outps, NULL, NULL, NULL, nparams_p);
+}
+
+void nn_backprop_stream_async (nnsched sched, nnetwork_ *netw_p, 
+                               nnsource_ *src, nnparams_ *nparams_p)
+{
+  sched_train_ (sched, netw_p, NULL, NULL, NULL, NULL, src, nparams_p);
+}
+
+void nn_backprop_sparse_async (nnsched sched, nnetwork_ *netw_p, 
+                               nncsr_ *inps, nnmtx outps, nnparams_ *nparams_p)
+{
+  sched_train_ (sched, netw_p, NULL, outps, inps, NULL, NULL, nparams_p);
+}
+
+void nn_backprop_quant_async (nnsched sched, nnetwork_ *netw_p, 
+                              nnqmtx_ *inps, nnmtx outps, nnparams_ *nparams_p)
+{
+  sched_train_ (sched, netw_p, NULL, outps, NULL, inps, NULL, nparams_p);
+}
+
+/* nn_backprop() with mini-batches, validation, sparse or quantized
+   inputs, on a scheduler of its own */
+static void 
+sched_backprop_ (nnetwork_ *netw_p, nnmtx inps, nnmtx outps, nncsr_ *csr,
+                 nnqmtx_ *q, nnsource_ *src, nnparams_ *nparams_p)
+{
+  nnsched sched = sched_alloc (nworkers_ (nparams_p));
+  sched_train_ (sched, netw_p, inps, outps, csr, q, src, nparams_p);
+  sched_wait (sched);
+  sched_destroy (sched);
+}
+
+/* ============================ INFERENCE ============================== */
+
+/**
+ *
+ * @struct nnwork
+ * @brief Inference workspace, everything a forward pass writes to,
+ *        so that the network itself is only read
+ *
+ * @var nbatch        max # of examples propagated together
+ * @var acts          nbatch x s_k+1 activations of layer l_k+1
+ * @var qx            nbatch rows of uint8 inputs of one layer,
+ *                    used by quantized networks (see nn_quantize())
+ *
+ **/
+typedef struct nnwork_
+{
+  size_t  nbatch;
+  nnmtx_   *acts;
+  uint8_t    *qx;
+
+} nnwork_;
+
+static size_t qnet_ld_ (const size_t n)
+{
+  return (n + QNET_ALIGN - 1) / QNET_ALIGN * QNET_ALIGN;
+}
+
+nnwork_ *nn_alloc_work (nnetwork_ *netw_p, const size_t nbatch)
+{
+  nnwork_ *work;
+  if ((work = malloc (sizeof *work)) == NULL)
+    nn_exit_ (NULL);
+
+  work->nbatch = nbatch > 0 ? nbatch : 1;
+  work->acts   = alloc_units_mtx_ (netw_p, work->nbatch);
+
+  /* qx is shared by all layers, SIMD->quantize writes only ninps bytes
+     of every ql->ld wide row, so the padding holds stale steps of wider
+     layers; sums are right only because quantize_layer_() callocs the
+     padding of int8 weights, which is 0 */
+  size_t ld = 0;
+  for (nnlayer_ *curr = netw_p->inp; curr != netw_p->outp; curr = curr->next)
+    ld = qnet_ld_ (curr->nunits) > ld ? qnet_ld_ (curr->nunits) : ld;
+  if ((work->qx = calloc (work->nbatch * ld, sizeof *work->qx)) == NULL)
+    nn_exit_ (netw_p);
+  return work;
+}
+
+void nn_destroy_work (nnwork_ *work)
+{
+  if (work == NULL)
+    return;
+  free_units_mtx_ (work->acts);
+  free (work->qx);
+  free (work);
+}
+
+void 
+nn_predict (nnetwork_ *netw_p, nnwork_ *work, 
+            const double_ *inp, double_ *outp)
+{
+  /* One row block, the input is only read */
+  nnmtx_ x = { (double_ *) inp, 1, netw_p->inp->nunits, 
+               mtx_ld (netw_p->inp->nunits) };
+
+  batch_hypotheses_ (netw_p, &x, NULL, work->acts, 1);
+  memcpy (outp, work->acts[netw_p->nhid].data, 
+          netw_p->outp->nunits * sizeof *outp);
+}
+
+int 
+nn_predict_batch (nnetwork_ *netw_p, nnwork_ *work, nnmtx inps, nnmtx outps)
+{
+  if (inps->ncols != netw_p->inp->nunits 
+   || outps->ncols != netw_p->outp->nunits || inps->nrows != outps->nrows)
+    {
+      fprintf (stderr, "nn_predict_batch(): inps or outps shape mismatch\n");
+      return 1;
+    }
+
+  const nnmtx_ *h = &work->acts[netw_p->nhid];
+  for (size_t m = 0; m < inps->nrows; m += work->nbatch)
+    {
+      size_t nb = inps->nrows - m < work->nbatch 
+                ? inps->nrows - m : work->nbatch;
+
+      nnmtx_ x = { MTX_ROW (inps, m), nb, inps->ncols, inps->ld };
+      batch_hypotheses_ (netw_p, &x, NULL, work->acts, nb);
+
+      for (size_t b = 0; b < nb; b++)
+        memcpy (MTX_ROW (outps, m + b), MTX_ROW (h, b), 
+                outps->ncols * sizeof *outps->data);
+    }
+  return 0;
+}
+
+/* ========================= QUANTIZED INFERENCE ======================= */
+
+/**
+ *
+ * @struct nnqlayer
+ * @brief Quantized weights of layer l_k+1, inputs of the layer are 
+ *        lo + step * q, q = 0..QNET_UMAX, and weights of unit i are
+ *        wstep_i * wq_i, so that 
+ *
+ *          w_i . x = wstep_i * step * (wq_i . q) + wstep_i * lo * sum (wq_i)
+ *
+ * @var ninps         # of inputs, s_k
+ * @var nunits        # of units, s_k+1
+ * @var ld            distance between rows of w, s_k rounded up 
+ *                    to QNET_ALIGN, padding is 0
+ * @var w             s_k+1 rounded up to 4 rows of int8 weights
+ * @var scale         wstep_i * step of every unit
+ * @var bias          bias with wstep_i * lo * sum (wq_i) of every unit
+ * @var lo            the smallest calibrated input
+ * @var inv_step      1 / step
+ *
+ **/
+typedef struct nnqlayer_
+{
+  size_t    ninps;
+  size_t   nunits;
+  size_t       ld;
+  int8_t       *w;
+  double_  *scale;
+  double_   *bias;
+  double_      lo;
+  double_ inv_step;
+
+} nnqlayer_;
+
+/**
+ *
+ * @struct nnqnet
+ * @brief Quantized network (see nn_quantize())
+ *
+ * @var nlayers       # of non-input layers
+ * @var layers        quantized weights of every non-input layer
+ * @var fast_sigmoid  sigmoid of the network it was quantized from
+ * @var bytes         size of weights, scales and biases
+ *
+ **/
+typedef struct nnqnet_
+{
+  size_t       nlayers;
+  nnqlayer_    *layers;
+  int     fast_sigmoid;
+  size_t         bytes;
+
+} nnqnet_;
+
+void nn_destroy_qnet (nnqnet_ *qnet)
+{
+  if (qnet == NULL)
+    return;
+  for (size_t k = 0; k < qnet->nlayers; k++)
+    {
+      free (qnet->layers[k].w);
+      free_slab (qnet->layers[k].scale);
+      free_slab (qnet->layers[k].bias);
+    }
+  free (qnet->layers);
+  free (qnet);
+}
+
+/* Range of the inputs of every layer over nb rows of x, see calibrate_() */
+static void 
+qrange_ (const nnmtx_ *x, const size_t nb, double_ *lo, double_ *hi)
+{
+  for (size_t b = 0; b < nb; b++)
+    {
+      const double_ *x_b = MTX_ROW (x, b);
+      for (size_t j = 0; j < x->ncols; j++)
+        {
+          *lo = x_b[j] < *lo ? x_b[j] : *lo;
+          *hi = x_b[j] > *hi ? x_b[j] : *hi;
+        }
+    }
+}
+
+/* Float feedforward of calibration rows, one [lo,hi] per layer */
+static void 
+calibrate_ (nnetwork_ *netw_p, nnmtx calib, double_ *lo, double_ *hi)
+{
+  size_t nlayers = netw_p->nhid + N_OUTP_LAYERS, 
+         nbatch  = 64;
+  for (size_t k = 0; k < nlayers; k++)
+    {
+      lo[k] = INFINITY;
+      hi[k] = -INFINITY;
+    }
+
+  nnwork_ *work = nn_alloc_work (netw_p, nbatch);
+  for (size_t m = 0; m < calib->nrows; m += nbatch)
+    {
+      size_t nb = calib->nrows - m < nbatch ? calib->nrows - m : nbatch;
+      nnmtx_ x  = { MTX_ROW (calib, m), nb, calib->ncols, calib->ld };
+      batch_hypotheses_ (netw_p, &x, NULL, work->acts, nb);
+
+      qrange_ (&x, nb, &lo[0], &hi[0]);
+      for (size_t k = 1; k < nlayers; k++)
+        qrange_ (&work->acts[k-1], nb, &lo[k], &hi[k]);
+    }
+  nn_destroy_work (work);
+}
+
+static void 
+quantize_layer_ (nnetwork_ *netw_p, nnlayer_ *curr, nnqlayer_ *ql,
+                 const double_ lo, const double_ hi)
+{
+  const nnmtx_ *w = &curr->weights;
+  size_t nrows = (curr->next->nunits + 3) / 4 * 4;
+
+  ql->ninps  = curr->nunits;
+  ql->nunits = curr->next->nunits;
+  ql->ld     = qnet_ld_ (ql->ninps);
+
+  /* Padding has to be 0, padding of inputs is not (see nn_alloc_work()) */
+  if ((ql->w     = calloc (nrows * ql->ld, sizeof *ql->w)) == NULL
+   || (ql->scale = alloc_slab (ql->nunits, 0)) == NULL
+   || (ql->bias  = alloc_slab (ql->nunits, 0)) == NULL)
+    nn_exit_ (netw_p);
+
+  /* Constant inputs, or no calibration rows, are all q = 0 */
+  double_ step = hi > lo ? (hi - lo) / QNET_UMAX : 1.0;
+  ql->lo       = lo <= hi ? lo : 0.0;
+  ql->inv_step = 1 / step;
+
+  for (size_t i = 0; i < ql->nunits; i++)
+    {
+      const double_ *w_i = MTX_ROW (w, i);
+      double_ wmax = 0.0;
+      for (size_t j = 0; j < ql->ninps; j++)
+        wmax = fabs (w_i[N_BIAS + j]) > wmax ? fabs (w_i[N_BIAS + j]) : wmax;
+      double_ wstep = wmax > 0.0 ? wmax / QNET_WMAX : 1.0;
+
+      int8_t *wq_i = ql->w + i * ql->ld;
+      int32_t sum  = 0;
+      for (size_t j = 0; j < ql->ninps; j++)
+        sum += wq_i[j] = lrint (w_i[N_BIAS + j] / wstep);
+
+      ql->scale[i] = wstep * step;
+      ql->bias[i]  = BIAS_ACTIVATION * w_i[0] + wstep * ql->lo * sum;
+    }
+}
+
+nnqnet_ *nn_quantize (nnetwork_ *netw_p, nnmtx calib)
+{
+  if (calib->ncols != netw_p->inp->nunits)
+    {
+      fprintf (stderr, "nn_quantize(): calibration inputs don't match "
+                       "the network\n");
+      return NULL;
+    }
+
+  nnqnet_ *qnet;
+  size_t nlayers = netw_p->nhid + N_OUTP_LAYERS;
+  if ((qnet = malloc (sizeof *qnet)) == NULL
+   || (qnet->layers = malloc (nlayers * sizeof *qnet->layers)) == NULL)
+    nn_exit_ (netw_p);
+  qnet->nlayers      = nlayers;
+  qnet->fast_sigmoid = netw_p->fast_sigmoid;
+  qnet->bytes        = 0;
+
+  double_ lo[nlayers], hi[nlayers];
+  calibrate_ (netw_p, calib, lo, hi);
+
+  size_t k = 0;
+  for (nnlayer_ *curr = netw_p->inp; curr != netw_p->outp; curr = curr->next)
+    {
+      nnqlayer_ *ql = &qnet->layers[k];
+      quantize_layer_ (netw_p, curr, ql, lo[k], hi[k]);
+      qnet->bytes += (ql->nunits + 3) / 4 * 4 * ql->ld * sizeof *ql->w
+                   + 2 * ql->nunits * sizeof *ql->scale;
+      k++;
+    }
+  return qnet;
+}
+
+/* Inputs of the layer as uint8 steps, rows of qx are ql->ld apart */
+static void 
+qinputs_ (const nnqlayer_ *ql, const nnmtx_ *x, const size_t nb, uint8_t *qx)
+{
+  for (size_t b = 0; b < nb; b++)
+    SIMD->quantize (qx + b * ql->ld, MTX_ROW (x, b), ql->lo, ql->inv_step,
+                    ql->ninps);
+}
+
+/**
+ *
+ * Feedforward of nb rows of x, every unit is 4 rows of w at a time,
+ * so that every input row is read once per 4 units
+ *
+ **/
+static void 
+qbatch_hypotheses_ (const nnqnet_ *qnet, const nnmtx_ *x, nnwork_ *work, 
+                    const size_t nb)
+{
+  const nnmtx_ *a_prev = x;
+  for (size_t k = 0; k < qnet->nlayers; k++)
+    {
+      const nnqlayer_ *ql = &qnet->layers[k];
+      nnmtx_ *a = &work->acts[k];
+      qinputs_ (ql, a_prev, nb, work->qx);
+
+      for (size_t b = 0; b < nb; b++)
+        {
+          const uint8_t *qx_b = work->qx + b * ql->ld;
+          double_       *a_b  = MTX_ROW (a, b);
+          for (size_t i = 0; i < ql->nunits; i += 4)
+            {
+              const int8_t *w[4] = { ql->w +  i      * ql->ld, 
+                                     ql->w + (i + 1) * ql->ld,
+                                     ql->w + (i + 2) * ql->ld, 
+                                     ql->w + (i + 3) * ql->ld };
+              int32_t s[4];
+              SIMD->qdot4 (s, qx_b, w, ql->ld);
+              for (size_t r = 0; r < 4 && i + r < ql->nunits; r++)
+                a_b[i+r] = ql->scale[i+r] * s[r] + ql->bias[i+r];
+            }
+
+          if (qnet->fast_sigmoid)
+            SIMD->sigmoid_fast (a_b, ql->nunits);
+          else
+            SIMD->sigmoid (a_b, ql->nunits);
+        }
+      a_prev = a;
+    }
+}
+
+int 
+nn_qpredict_batch (nnqnet_ *qnet, nnwork_ *work, nnmtx inps, nnmtx outps)
+{
+  const nnqlayer_ *inp  = &qnet->layers[0], 
+                  *outp = &qnet->layers[qnet->nlayers-1];
+  if (inps->ncols != inp->ninps
+   || outps->ncols != outp->nunits || inps->nrows != outps->nrows)
+    {
+      fprintf (stderr, "nn_qpredict_batch(): inps or outps shape mismatch\n");
+      return 1;
+    }
+
+  const nnmtx_ *h = &work->acts[qnet->nlayers-1];
+  for (size_t m = 0; m < inps->nrows; m += work->nbatch)
+    {
+      size_t nb = inps->nrows - m < work->nbatch 
+                ? inps->nrows - m : work->nbatch;
+
+      nnmtx_ x = { MTX_ROW (inps, m), nb, inps->ncols, inps->ld };
+      qbatch_hypotheses_ (qnet, &x, work, nb);
+
+      for (size_t b = 0; b < nb; b++)
+        memcpy (MTX_ROW (outps, m + b), MTX_ROW (h, b), 
+                outps->ncols * sizeof *outps->data);
+    }
+  return 0;
+}
+
+static size_t argmax_ (const double_ *h, const size_t n)
+{
+  size_t k = 0;
+  for (size_t i = 1; i < n; i++)
+    k = h[i] > h[k] ? i : k;
+  return k;
+}
+
+int nn_qnet_error (nnetwork_ *netw_p, nnqnet_ *qnet, nnwork_ *work, 
+                   nnmtx inps, nnqerr_ *err)
+{
+  if (inps->ncols != netw_p->inp->nunits)
+    {
+      fprintf (stderr, "nn_qnet_error(): inputs don't match the network\n");
+      return 1;
+    }
+
+  /* Float hypotheses of a block, acts are overwritten by qnet then */
+  size_t noutps = netw_p->outp->nunits, nsame = 0;
+  nnmtx  hf;
+  if ((hf = alloc_mtx (work->nbatch, noutps, 0)) == NULL)
+    nn_exit_ (netw_p);
+
+  *err = (nnqerr_) { 0.0, 0.0, 0.0, qnet->bytes, 
+                     nn_layers_nweights_ (netw_p) * sizeof (double_) };
+
+  const nnmtx_ *h = &work->acts[netw_p->nhid];
+  for (size_t m = 0; m < inps->nrows; m += work->nbatch)
+    {
+      size_t nb = inps->nrows - m < work->nbatch 
+                ? inps->nrows - m : work->nbatch;
+
+      nnmtx_ x = { MTX_ROW (inps, m), nb, inps->ncols, inps->ld };
+      batch_hypotheses_ (netw_p, &x, NULL, work->acts, nb);
+      for (size_t b = 0; b < nb; b++)
+        memcpy (MTX_ROW (hf, b), MTX_ROW (h, b), noutps * sizeof *hf->data);
+
+      qbatch_hypotheses_ (qnet, &x, work, nb);
+      for (size_t b = 0; b < nb; b++)
+        {
+          const double_ *hf_b = MTX_ROW (hf, b), *hq_b = MTX_ROW (h, b);
+          for (size_t i = 0; i < noutps; i++)
+            {
+              double e = fabs (hq_b[i] - hf_b[i]);
+              err->maxerr   = e > err->maxerr ? e : err->maxerr;
+              err->meanerr += e;
+            }
+          nsame += argmax_ (hf_b, noutps) == argmax_ (hq_b, noutps);
+        }
+    }
+
+  if (inps->nrows > 0)
+    {
+      err->meanerr /= inps->nrows * noutps;
+      err->agree    = (double) nsame / inps->nrows;
+    }
+  free_mtx (hf);
+  return 0;
+}
+
+/* ============================== PRUNING ============================== */
+
+typedef struct nnblock_
+{
+  double  norm;
+  size_t     b;
+
+} nnblock_;
+
+/* Smaller norm first, blocks of equal norms in index order */
+static int cmp_block_ (const void *p, const void *q)
+{
+  const nnblock_ *x = p, *y = q;
+  if (x->norm != y->norm)
+    return x->norm < y->norm ? -1 : 1;
+  return (x->b > y->b) - (x->b < y->b);
+}
+
+/* Kept blocks of keep, NULL if all of them are kept */
+static nnbsr_ *
+index_blocks_ (nnetwork_ *netw_p, uint8_t *keep, const size_t nbrows, 
+               const size_t nbcols)
+{
+  size_t nblocks = 0;
+  for (size_t b = 0; b < nbrows * nbcols; b++)
+    nblocks += keep[b];
+  if (nblocks == nbrows * nbcols)
+    {
+      free (keep);
+      return NULL;
+    }
+
+  nnbsr_ *bsr;
+  if ((bsr = malloc (sizeof *bsr)) == NULL
+   || (bsr->cols   = malloc ((nblocks + 1) * sizeof *bsr->cols))   == NULL
+   || (bsr->rowptr = malloc ((nbrows + 1)  * sizeof *bsr->rowptr)) == NULL)
+    nn_exit_ (netw_p);
+
+  bsr->keep    = keep;
+  bsr->nbrows  = nbrows;
+  bsr->nbcols  = nbcols;
+  bsr->nblocks = nblocks;
+
+  size_t k = 0;
+  for (size_t r = 0; r < nbrows; r++)
+    {
+      bsr->rowptr[r] = k;
+      for (size_t c = 0; c < nbcols; c++)
+        if (keep[r * nbcols + c])
+          bsr->cols[k++] = c;
+    }
+  bsr->rowptr[nbrows] = k;
+  return bsr;
+}
+
+/**
+ *
+ * Blocks of weights without bias are ranked by their L2 norm, the weakest
+ * ceil (sparsity * # of blocks) of them are zeroed, as well as all blocks
+ * that are zero already, so pruning never revives a block; the weights 
+ * are written only where a nonzero block is pruned, a loaded checkpoint
+ * is not copied for nothing (see nn_load())
+ *
+ **/
+static void 
+prune_layer_ (nnetwork_ *netw_p, nnlayer_ *curr, const double sparsity)
+{
+  nnmtx_ *w      = &curr->weights;
+  size_t  nrows  = curr->next->nunits, ncols = curr->nunits;
+  size_t  nbrows = (nrows + BSR_ROWS - 1) / BSR_ROWS;
+  size_t  nbcols = (ncols + BSR_COLS - 1) / BSR_COLS;
+  size_t  nb     = nbrows * nbcols;
+
+  nnblock_ *blocks;
+  uint8_t    *keep;
+  if ((blocks = malloc (nb * sizeof *blocks)) == NULL
+   || (keep   = malloc (nb * sizeof *keep))   == NULL)
+    nn_exit_ (netw_p);
+
+  for (size_t b = 0; b < nb; b++)
+    blocks[b] = (nnblock_) { 0.0, b };
+  for (size_t i = 0; i < nrows; i++)
+    {
+      const double_ *w_i = MTX_ROW (w, i) + N_BIAS;
+      nnblock_      *b_i = blocks + i / BSR_ROWS * nbcols;
+      for (size_t j = 0; j < ncols; j++)
+        b_i[j / BSR_COLS].norm += (double) w_i[j] * w_i[j];
+    }
+
+  size_t nzero = 0;
+  for (size_t b = 0; b < nb; b++)
+    nzero += blocks[b].norm == 0.0;
+  size_t npruned = ceil (sparsity * nb);
+  npruned = npruned > nzero ? npruned : nzero;
+
+  qsort (blocks, nb, sizeof *blocks, cmp_block_);
+  memset (keep, 1, nb * sizeof *keep);
+  for (size_t p = 0; p < npruned; p++)
+    {
+      size_t b = blocks[p].b, r = b / nbcols, c = b % nbcols;
+      keep[b] = 0;
+      if (blocks[p].norm == 0.0)
+        continue;
+
+      size_t i1 = (r + 1) * BSR_ROWS < nrows ? (r + 1) * BSR_ROWS : nrows;
+      size_t j0 = c * BSR_COLS;
+      size_t j1 = j0 + BSR_COLS < ncols ? j0 + BSR_COLS : ncols;
+      for (size_t i = r * BSR_ROWS; i < i1; i++)
+        memset (MTX_ROW (w, i) + N_BIAS + j0, 0, (j1 - j0) * sizeof *w->data);
+    }
+  free (blocks);
+
+  free_bsr_ (curr->bsr);
+  curr->bsr = index_blocks_ (netw_p, keep, nbrows, nbcols);
+}
+
+int nn_prune (nnetwork_ *netw_p, const double sparsity)
+{
+  if (! (sparsity >= 0.0 && sparsity < 1.0))
+    {
+      fprintf (stderr, "nn_prune(): sparsity should be in [0, 1)\n");
+      return 1;
+    }
+
+  for (nnlayer_ *curr = netw_p->inp; curr != netw_p->outp; curr = curr->next)
+    prune_layer_ (netw_p, curr, sparsity);
+  return 0;
+}
+
+double nn_sparsity (nnetwork_ *netw_p)
+{
+  size_t npruned = 0, nweights = 0;
+  for (nnlayer_ *curr = netw_p->inp; curr != netw_p->outp; curr = curr->next)
+    {
+      size_t nrows = curr->next->nunits, ncols = curr->nunits;
+      nweights += nrows * ncols;
+      if (curr->bsr == NULL)
+        continue;
+
+      const nnbsr_ *bsr = curr->bsr;
+      for (size_t b = 0; b < bsr->nbrows * bsr->nbcols; b++)
+        {
+          if (bsr->keep[b])
+            continue;
+          size_t r = b / bsr->nbcols, c = b % bsr->nbcols;
+          size_t i1 = (r + 1) * BSR_ROWS < nrows ? (r + 1) * BSR_ROWS : nrows;
+          size_t j1 = (c + 1) * BSR_COLS < ncols ? (c + 1) * BSR_COLS : ncols;
+          npruned += (i1 - r * BSR_ROWS) * (j1 - c * BSR_COLS);
+        }
+    }
+  return nweights > 0 ? (double) npruned / nweights : 0.0;
 }
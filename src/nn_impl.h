@@ -25,9 +25,138 @@
  *
  **/
 
+#include <stdint.h>
+
+#include "nn_sched.h"
+
 typedef struct nnetwork_* nnetwork;
 typedef struct nnparams_* nnparams;
-typedef double double_;
+typedef struct nnwork_* nnwork;
+typedef struct nnqnet_* nnqnet;
+
+/**
+ *
+ * Floating point type of weights, activations and data sets,
+ * compile with -DNN_FLOAT32 to use single precision everywhere
+ *
+ **/
+#ifdef NN_FLOAT32
+  typedef float double_;
+  #define NN_EXP    expf
+  #define NN_LOG    logf
+  #define NN_SQRT   sqrtf
+#else
+  typedef double double_;
+  #define NN_EXP    exp
+  #define NN_LOG    log
+  #define NN_SQRT   sqrt
+#endif
+
+/**
+ *
+ * @struct nnmtx
+ * @brief Dense row-major matrix stored in one contiguous 64-byte aligned slab
+ *
+ * @var data          matrix elements, row i starts at data + i*ld
+ * @var nrows         # of rows
+ * @var ncols         # of columns
+ * @var ld            leading dimension (distance between rows), ld >= ncols,
+ *                    rounded up so that every row is 64-byte aligned
+ *
+ **/
+typedef struct nnmtx_
+{
+  double_ *data;
+  size_t  nrows;
+  size_t  ncols;
+  size_t     ld;
+
+} nnmtx_;
+
+typedef nnmtx_* nnmtx;
+
+/* Pointer to the first element of i'th row of matrix mtx */
+#define MTX_ROW(mtx, i)       ((mtx)->data + (i) * (mtx)->ld)
+
+/**
+ *
+ * @struct nncsr
+ * @brief Sparse matrix in compressed sparse row format, only nonzero
+ *        elements are stored (see csr_from_mtx() in nn_alloc.h)
+ *
+ * @var vals          nonzero elements, row by row
+ * @var cols          column of every element of vals
+ * @var rowptr        nrows + 1 offsets, elements of row i are 
+ *                    vals[rowptr[i]], ..., vals[rowptr[i+1] - 1]
+ * @var nrows         # of rows
+ * @var ncols         # of columns
+ *
+ **/
+typedef struct nncsr_
+{
+  double_   *vals;
+  uint32_t  *cols;
+  size_t  *rowptr;
+  size_t    nrows;
+  size_t    ncols;
+
+} nncsr_;
+
+typedef nncsr_* nncsr;
+
+/**
+ *
+ * @struct nnqmtx
+ * @brief Quantized matrix, every element is stored as an unsigned 
+ *        integer q of bits bits, that stands for offset[j] + scale[j] * q
+ *        in its column j (see qmtx_from_mtx() in nn_alloc.h)
+ *
+ * @var data          rows of uint8_t or uint16_t elements
+ * @var nrows         # of rows
+ * @var ncols         # of columns
+ * @var ld            # of elements between rows, rows are MTX_ALIGN-aligned
+ * @var bits          8 or 16
+ * @var scale         step of every column
+ * @var offset        value of q = 0 of every column
+ *
+ **/
+typedef struct nnqmtx_
+{
+  void       *data;
+  size_t     nrows;
+  size_t     ncols;
+  size_t        ld;
+  int         bits;
+  double_   *scale;
+  double_  *offset;
+
+} nnqmtx_;
+
+typedef nnqmtx_* nnqmtx;
+
+/**
+ *
+ * @struct nnsource
+ * @brief Source of training examples, that are delivered in chunks,
+ *        so that the whole training set never has to be in memory
+ *        (see data_stream_open() in nn_data.h)
+ *
+ * @var next          set inps and outps to the next chunk of examples,
+ *                    they stay valid until the next call;
+ *                    return # of examples in the chunk, 0 after the last
+ *                    chunk of the training set, the following call
+ *                    starts the next pass from the first chunk
+ * @var ctx           source state, passed to next
+ *
+ **/
+typedef struct nnsource_
+{
+  size_t (*next) (void *ctx, nnmtx_ *inps, nnmtx_ *outps);
+  void    *ctx;
+
+} nnsource_;
+
+typedef nnsource_* nnsource;
 
 /**
  *
@@ -37,6 +166,107 @@ typedef double double_;
  **/
 typedef const double_ (*dist_f)(const double_, const double_);
 
+/**
+ *
+ * Phases of a training iteration, the time spent in each of them 
+ * is measured when the library is compiled with -DNN_TELEMETRY:
+ *
+ *   NN_PHASE_FORWARD     feedforward propagation of examples
+ *   NN_PHASE_DELTAS      delta values of hidden and output layers
+ *   NN_PHASE_ACC         accumulation of dweights
+ *   NN_PHASE_UPDATE      reduction of dweights and weights update
+ *   NN_PHASE_COST        cost function, only on iterations it is due
+ *
+ **/
+enum 
+{ 
+  NN_PHASE_FORWARD, 
+  NN_PHASE_DELTAS, 
+  NN_PHASE_ACC, 
+  NN_PHASE_UPDATE, 
+  NN_PHASE_COST, 
+  NN_NPHASES 
+};
+
+/**
+ *
+ * @struct nnstats
+ * @brief Record of one training iteration (see nn_set_report()),
+ *        or of one validation (see nn_set_validation()), then iter is 
+ *        the iteration of the validated weights, nexamples and secs
+ *        are these of the validation, cost is NAN and phases are 0
+ *
+ * @var id              network id
+ * @var iter            iteration, starting with 1
+ * @var nexamples       # of examples propagated
+ * @var secs            wall time since the previous record
+ * @var examples_per_s  nexamples / secs
+ * @var cost            cost function, NAN if it was not due 
+ *                      (see nn_set_cost_every())
+ * @var valid_cost      validation cost, NAN unless it is a validation
+ * @var phases          secs spent in every phase, summed over threads, 
+ *                      all 0 without -DNN_TELEMETRY
+ *
+ **/
+typedef struct nnstats_
+{
+  size_t            id;
+  size_t          iter;
+  size_t     nexamples;
+  double          secs;
+  double examples_per_s;
+  double          cost;
+  double    valid_cost;
+  double        phases[NN_NPHASES];
+
+} nnstats_;
+
+/**
+ *
+ * Weight update rules (see nn_set_optimizer()), g - gradient of the
+ * cost averaged over examples, L2 regularization is added to g except
+ * for AdamW, where weights are decayed separately:
+ *
+ *   NN_OPT_SGD         w -= lr * g
+ *   NN_OPT_MOMENTUM    v  = beta1 * v + lr * g,  w -= v
+ *   NN_OPT_NESTEROV    v  = beta1 * v + lr * g,  w -= beta1 * v + lr * g
+ *   NN_OPT_ADAM        m, v - moving averages of g and g^2 (beta1, beta2),
+ *                      w -= lr * m / (sqrt (v) + eps), with bias corrections
+ *   NN_OPT_ADAMW       the same as Adam, w -= lr * regur_p / nexamples * w
+ *
+ **/
+typedef enum 
+{ 
+  NN_OPT_SGD, 
+  NN_OPT_MOMENTUM, 
+  NN_OPT_NESTEROV, 
+  NN_OPT_ADAM, 
+  NN_OPT_ADAMW 
+
+} nnopt;
+
+/**
+ *
+ * Learning rate schedules (see nn_set_lr_schedule()), lr is learn_p
+ * after warm-up, t - iteration after warm-up, T - # of such iterations:
+ *
+ *   NN_LR_CONST        lr
+ *   NN_LR_STEP         lr * gamma^(t / period)
+ *   NN_LR_COSINE       lr * (gamma + (1 - gamma) * (1 + cos (pi * t / T)) / 2),
+ *                      from lr down to gamma * lr
+ *
+ **/
+typedef enum 
+{ 
+  NN_LR_CONST, 
+  NN_LR_STEP, 
+  NN_LR_COSINE 
+
+} nnlr;
+
+/* Receiver of training records, ctx is passed as is */
+typedef void (*report_f)(const nnstats_ *st, void *ctx);
+
 /**
  *
  * @brief Initialize neural network with random Un([0,1]) weights
@@ -57,6 +287,23 @@ nn_alloc (const size_t id,
           const size_t ninpunits, const size_t noutpunits,
           const size_t nhid,      const size_t *nhidunits);
 
+/* # of units in input/output layer of the network */
+size_t nn_ninps  (nnetwork netw);
+size_t nn_noutps (nnetwork netw);
+
+/**
+ *
+ * @brief Use approximate sigmoid in all forward passes of the network,
+ *        it is evaluated with a low degree polynomial instead of exp ()
+ *        and differs from the exact one by less than 1e-6 
+ *        (see SIGMOID_FAST_MAXERR in nn_simd.h)
+ *
+ * @param netw      neural network
+ * @param fast      1 to use approximate sigmoid, 0 (default) - exact one
+ *
+ **/
+void nn_set_fast_sigmoid (nnetwork netw, const int fast);
+
 /**
  *
  * @brief Initialize neural network parameters
@@ -77,27 +324,276 @@ nn_alloc_nparams (const size_t nexamples, const size_t niters,
 
 /**
  *
- * @brief Initialize network with already computed params
+ * @brief Propagate blocks of nbatch examples together when training,
+ *        so that each layer is a matrix-matrix product
+ *
+ * @param ps        training parameters (see nn_alloc_nparams())
+ * @param nbatch    # of examples in a block, 1 (default) to propagate
+ *                  examples one by one
+ *
+ **/
+void nn_set_nbatch (nnparams ps, const size_t nbatch);
+
+/**
+ *
+ * @brief Modify weights after every mini-batch of examples instead of 
+ *        once per pass; an iteration is still one pass (epoch) over 
+ *        the examples, they are visited in a new random order on every 
+ *        pass (rows of every chunk, if streamed), drawn from the seed 
+ *        of ps; the rows are not moved, blocks of nbatch shuffled rows 
+ *        are gathered into buffers of the workers
+ *
+ * Mini-batch training runs on the scheduler, nn_backprop() and
+ * nn_backprop_stream() use one of nworkers threads; the reported cost
+ * is averaged over the pass, each example with the weights before 
+ * the update of its mini-batch, regularization with the weights after 
+ * the pass
+ *
+ * @param ps          training parameters (see nn_alloc_nparams())
+ * @param minibatch   # of examples per weights update, 
+ *                    0 (default) - all examples of the pass
+ *
+ **/
+void nn_set_minibatch (nnparams ps, const size_t minibatch);
+
+/**
+ *
+ * @brief Split examples of one network between worker threads,
+ *        each with its own activations, deltas and dweights,
+ *        the dweights are reduced in parallel before the weights update;
+ *        nn_costfunc() is split the same way
+ *
+ * @param ps        training parameters (see nn_alloc_nparams())
+ * @param nworkers  # of threads, 1 (default) to train in calling thread,
+ *                  0 to use one thread per online core
+ *
+ **/
+void nn_set_nworkers (nnparams ps, const size_t nworkers);
+
+/**
+ *
+ * @brief Set how often nn_backprop() reports cost, the cost is taken
+ *        from the same forward pass that is used to find the gradient
+ *
+ * @param ps            training parameters (see nn_alloc_nparams())
+ * @param cost_every_n  report cost on iterations 1, n+1, 2n+1, ...,
+ *                      1 (default) - every iteration, 0 - never
+ *
+ **/
+void nn_set_cost_every (nnparams ps, const size_t cost_every_n);
+
+/**
+ *
+ * @brief Set seed of the random numbers used in training,
+ *        same seed gives same weights and same results between runs
+ *
+ * @param ps        training parameters (see nn_alloc_nparams())
+ * @param seed      seed, RND_SEED (default) (see nn_rnd.h)
+ *
+ **/
+void nn_set_seed (nnparams ps, const uint64_t seed);
+
+/**
+ *
+ * @brief Set the rule of weights update, its state (one or two moments
+ *        of every weight) is allocated with the dweights when training
+ *        starts and is not kept between nn_backprop() calls
+ *
+ * @param ps        training parameters (see nn_alloc_nparams())
+ * @param opt       update rule, NN_OPT_SGD (default)
+ * @param beta1     momentum, or decay of the first moment of Adam (0.9)
+ * @param beta2     decay of the second moment of Adam (0.999)
+ *
+ **/
+void 
+nn_set_optimizer (nnparams ps, const nnopt opt, 
+                  const double_ beta1, const double_ beta2);
+
+/**
+ *
+ * @brief Set schedule of the learning rate, learn_p of nn_alloc_nparams()
+ *        is the rate at the end of warm-up
+ *
+ * @param ps        training parameters (see nn_alloc_nparams())
+ * @param sched     schedule, NN_LR_CONST (default)
+ * @param warmup    # of first iterations, the rate grows linearly 
+ *                  from learn_p / warmup to learn_p, 0 - no warm-up
+ * @param period    # of iterations between steps of NN_LR_STEP
+ * @param gamma     step factor of NN_LR_STEP, 
+ *                  final fraction of learn_p of NN_LR_COSINE
+ *
+ **/
+void 
+nn_set_lr_schedule (nnparams ps, const nnlr sched, const size_t warmup,
+                    const size_t period, const double_ gamma);
+
+/**
+ *
+ * @brief Evaluate cost over a held-out validation set every n'th 
+ *        iteration, concurrently with training: the weights are copied
+ *        and the copy is propagated by tasks of the scheduler, that 
+ *        threads idle between phases of training take; the cost is 
+ *        averaged over the validation examples without regularization 
+ *        and delivered in a record of its own (see nnstats_)
+ *
+ * Training with a validation set runs on the scheduler, nn_backprop()
+ * and nn_backprop_stream() use one of nworkers threads; if the previous
+ * validation is not done when the next one is due, training waits for it
+ * without blocking a thread, so validation lags by n iterations at most;
+ * the final weights are always validated
+ *
+ * @param ps        training parameters (see nn_alloc_nparams())
+ * @param vinps     validation inputs, one example per row, NULL - none
+ * @param voutps    expected outputs for each validation input,
+ *                  NULL with validation labels (see nn_set_labels())
+ * @param every_n   validate after iterations n, 2n, ..., 
+ *                  0 - only the final weights
+ *
+ **/
+void 
+nn_set_validation (nnparams ps, nnmtx vinps, nnmtx voutps, 
+                   const size_t every_n);
+
+/**
+ *
+ * @brief Stop training once the validation cost (see nn_set_validation())
+ *        stops improving or reaches the target, the network is left 
+ *        with the weights of the lowest validation cost; a network that
+ *        stops on a shared scheduler spawns no more tasks, so threads
+ *        take tasks of the other networks
+ *
+ * @param ps          training parameters (see nn_alloc_nparams())
+ * @param patience    stop after n validations without improvement,
+ *                    0 (default) - never
+ * @param min_delta   cost must be lower than the best one by more 
+ *                    than min_delta to be an improvement
+ * @param target      stop once the cost is not above target, 0 - never
+ *
+ **/
+void 
+nn_set_early_stop (nnparams ps, const size_t patience, 
+                   const double_ min_delta, const double_ target);
+
+/**
+ *
+ * @brief Train on class indices instead of expected output rows: 
+ *        expected output of m'th example is 1.0 for output labels[m] 
+ *        and 0.0 for the others, output deltas and cost are found from 
+ *        the index alone, so a few bytes per example are read instead 
+ *        of a row of s_n+1 double_ values
+ *
+ * With labels, outps of nn_backprop(), nn_backprop_sparse(), 
+ * nn_backprop_quant() and nn_costfunc*() are not used and could be NULL;
+ * training runs on the scheduler, as with a validation set; streamed 
+ * data sets keep their expected output rows, labels are not used with them
+ *
+ * @param ps        training parameters (see nn_alloc_nparams())
+ * @param labels    nexamples class indices, each below the # of 
+ *                  outputs, NULL (default) - expected output rows
+ * @param vlabels   class indices of the validation examples
+ *                  (see nn_set_validation()), NULL - voutps rows
+ *
+ **/
+void 
+nn_set_labels (nnparams ps, const uint32_t *labels, const uint32_t *vlabels);
+
+/**
+ *
+ * @brief Set the receiver of per-iteration training records, it is called
+ *        once at the end of every iteration, from whichever thread 
+ *        finished it, and once per validation, possibly at the same time, 
+ *        so it should be short and thread-safe
+ *
+ * @param ps        training parameters (see nn_alloc_nparams())
+ * @param report    receiver, nn_report_print (default) or nn_report_jsonl
+ * @param ctx       passed to report as is
+ *
+ **/
+void nn_set_report (nnparams ps, report_f report, void *ctx);
+
+/**
+ *
+ * @brief Receivers of training records
+ *
+ *   nn_report_print    prints cost to stdout when it is due, 
+ *                      and validation cost, ctx is unused
+ *   nn_report_jsonl    writes every record as one JSON line to the 
+ *                      FILE * ctx, lines of many networks don't mix
+ *
+ **/
+void nn_report_print (const nnstats_ *st, void *ctx);
+void nn_report_jsonl (const nnstats_ *st, void *ctx);
+
+/**
+ *
+ * @brief Reinitialize weights with Un([0,1)) random values from
+ *        the stream of the network id seeded with seed of ps,
+ *        nn_alloc() does the same with RND_SEED; pruning of the network
+ *        is dropped (see nn_prune())
  *
  * @param netw      neural network
- * @param ws        matrices of weights for all hidden layers
+ * @param ps        training parameters (see nn_set_seed())
+ *
+ **/
+void nn_weights_rnd (nnetwork netw, nnparams ps);
+
+/**
+ *
+ * @brief Initialize network with already computed params,
+ *        pruning of the network is dropped (see nn_prune())
+ *
+ * @param netw      neural network
+ * @param ws        matrices of weights for input and hidden layers,
+ *                  they are copied into the network own weights slab
  *
  * Assuming, l_i   - i'th layer, i = 0,1,2,...,n
  *           s_i   - # of (non-bias) units in i'th layer
  *           b_i   - i'th layer bias unit
  *           u_i_j - j'th unit in i'th layer, j = 1,2,...,s_i
  *
- * ws[i]      - matrix of s_i+1 rows and s_i + 1 columns
- * ws[i]      - matrix of weights between layers l_i and l_i+1
- * ws[i][j-1] - vector of weights between layer  l_i and u_i+1_j
+ * ws[i]                  - matrix of s_i+1 rows and s_i + 1 columns
+ * ws[i]                  - matrix of weights between layers l_i and l_i+1
+ * MTX_ROW (ws[i], j-1)   - vector of weights between layer  l_i and u_i+1_j
+ *
+ * F.e. ws[2]                 - matrix of weights that connects l_2 with l_3
+ *      MTX_ROW (ws[2], 3)    - vector of weights that connects l_2 with u_3_4
+ *      MTX_ROW (ws[2], 3)[0] -        weight  that connects b_2   with u_3_4
+ *      MTX_ROW (ws[2], 3)[4] -        weight  that connects u_2_4 with u_3_4
+ *
+ * @return 0 on success, 1 if some ws[i] doesn't match the network topology
+ *
+ **/
+int nn_weights_init (nnetwork netw, nnmtx *ws);
+
+/**
+ *
+ * @brief Save network topology and weights to a binary checkpoint,
+ *        the file is written next to path and renamed when complete
+ *
+ * @param netw      neural network
+ * @param path      checkpoint file
+ *
+ * @return 0 on success, 1 if the file could not be written
+ *
+ **/
+int nn_save (nnetwork netw, const char *path);
+
+/**
+ *
+ * @brief Load network saved with nn_save (),
+ *        the file is mapped to memory and the network weights point 
+ *        straight into the mapping, nothing is parsed or copied;
+ *        the mapping is private, so training the loaded network 
+ *        doesn't modify the file
+ *
+ * @param id        network id
+ * @param path      checkpoint file
  *
- * F.e. ws[2]       - matrix of weights that connects l_2   with l_3
- *      ww[2][3]    - vector of weights that connects l_2   with u_3_4
- *      ws[2][3][0] -           weights  that connects b_2   with u_3_4
- *      ws[2][3][4] -           weights  that connects u_2_4 with u_3_4
+ * @return nnetwork struct, NULL if the file is not a valid checkpoint
+ *         of this build (version, precision and alignment must match)
  *
  **/
-void nn_weights_init (nnetwork netw, double_ ***ws);
+nnetwork nn_load (const size_t id, const char *path);
 
 /**
  *
@@ -146,16 +642,26 @@ void nn_destroy_nparams (nnparams ps);
  *   hypof (W, x) = sigmoid (W*x) = 1 / (1 + exp (-W*x))
  *
  * @param netw      neural network
- * @param inps      inputs in training set
- * @param outps     expected outputs for each input
+ * @param inps      inputs in training set, one example per row
+ * @param outps     expected outputs for each input, one example per row
  * @param distf     distance function
  * @param ps        training parameters (see nn_alloc_params)
  *
- * @return cost function value for the network current wights
+ * @return cost function value for the network current wights,
+ *         NAN if class indices of ps (see nn_set_labels()) aren't 
+ *         outputs of the network
  *
  **/
 const double_ 
-nn_costfunc (nnetwork netw, double_ **inps, double_ **outps, nnparams ps);
+nn_costfunc (nnetwork netw, nnmtx inps, nnmtx outps, nnparams ps);
+
+/* The same as nn_costfunc(), with sparse inputs (see nn_backprop_sparse()) */
+const double_ 
+nn_costfunc_sparse (nnetwork netw, nncsr inps, nnmtx outps, nnparams ps);
+
+/* The same as nn_costfunc(), with quantized inputs (see nn_backprop_quant()) */
+const double_ 
+nn_costfunc_quant (nnetwork netw, nnqmtx inps, nnmtx outps, nnparams ps);
 
 /**
  *
@@ -175,12 +681,222 @@ const double_ logdist (const double_ x, const double_ y);
  *        and backpropgation method
  *
  * @param netw      neural network
- * @param inps      inputs in training set
- * @param outps     expected outputs for each input
+ * @param inps      inputs in training set, one example per row
+ * @param outps     expected outputs for each input, one example per row
  * @param ps        training parameters (see nn_alloc_nparams())
  *
  **/
 void 
-nn_backprop (nnetwork netw, double_ **inps, double_ **outps, nnparams ps);
+nn_backprop (nnetwork netw, nnmtx inps, nnmtx outps, nnparams ps);
+
+/**
+ * @brief The same as nn_backprop(), but examples are taken chunk by chunk
+ *        from the source on every iteration; rows of each chunk are split 
+ *        between worker threads (see nn_set_nworkers())
+ *
+ * @param netw      neural network
+ * @param src       source of examples
+ * @param ps        training parameters, nexamples must be the # of 
+ *                  examples in one pass over the source
+ *
+ **/
+void 
+nn_backprop_stream (nnetwork netw, nnsource src, nnparams ps);
+
+/**
+ *
+ * @brief The same as nn_backprop(), but inputs are sparse, so that 
+ *        the input layer, usually the widest one, is propagated 
+ *        and its gradient accumulated over nonzero inputs only:
+ *        one contiguous row of transposed l_0 weights per nonzero,
+ *        the transposed copy is refreshed after every weights update,
+ *        or one strided column of l_0 weights in place if there are 
+ *        fewer nonzeros than inputs between updates
+ *
+ * Training with sparse inputs runs on the scheduler, on one of nworkers
+ * threads; validation sets (see nn_set_validation()) stay dense
+ *
+ * @param netw      neural network
+ * @param inps      sparse inputs, one example per row
+ * @param outps     expected outputs for each input, one example per row
+ * @param ps        training parameters (see nn_alloc_nparams())
+ *
+ **/
+void 
+nn_backprop_sparse (nnetwork netw, nncsr inps, nnmtx outps, nnparams ps);
+
+/**
+ *
+ * @brief The same as nn_backprop(), but inputs are quantized, so that 
+ *        the training set takes 1/8 (1/4 with 16 bits) of the memory
+ *        of double_ rows: every block of nbatch rows is widened into 
+ *        a buffer of the shard right before it is propagated, and the 
+ *        widened block is used by both the forward pass and the gradient 
+ *        of the input layer while it is still in cache
+ *
+ * Training with quantized inputs runs on the scheduler, on one of 
+ * nworkers threads; validation sets (see nn_set_validation()) stay dense
+ *
+ * @param netw      neural network
+ * @param inps      quantized inputs, one example per row
+ * @param outps     expected outputs for each input, one example per row
+ * @param ps        training parameters (see nn_alloc_nparams())
+ *
+ **/
+void 
+nn_backprop_quant (nnetwork netw, nnqmtx inps, nnmtx outps, nnparams ps);
+
+/**
+ *
+ * @brief The same as nn_backprop(), nn_backprop_stream(), 
+ *        nn_backprop_sparse() and nn_backprop_quant(), but training
+ *        is split into tasks of the scheduler and these return at once;
+ *        examples are split into one shard per scheduler thread, so that
+ *        threads idle on other networks steal shards of this one, 
+ *        nworkers of ps is not used
+ *
+ * Training is done when sched_wait() returns, until then the network, 
+ * the examples or the source and ps must not be used or freed
+ *
+ * @param sched     scheduler (see nn_sched.h)
+ *
+ **/
+void nn_backprop_async (nnsched sched, nnetwork netw, 
+                        nnmtx inps, nnmtx outps, nnparams ps);
+void nn_backprop_stream_async (nnsched sched, nnetwork netw, 
+                               nnsource src, nnparams ps);
+void nn_backprop_sparse_async (nnsched sched, nnetwork netw, 
+                               nncsr inps, nnmtx outps, nnparams ps);
+void nn_backprop_quant_async (nnsched sched, nnetwork netw, 
+                              nnqmtx inps, nnmtx outps, nnparams ps);
+
+/**
+ *
+ * @brief Allocate/free inference workspace, it holds activations 
+ *        of all layers, so that nn_predict() and nn_predict_batch()
+ *        only read the network: any # of threads could evaluate 
+ *        one network at once, each with its own workspace
+ *
+ * @param netw      neural network (or any other of the same topology)
+ * @param nbatch    max # of examples propagated together
+ *
+ **/
+nnwork nn_alloc_work (nnetwork netw, const size_t nbatch);
+void nn_destroy_work (nnwork work);
+
+/**
+ *
+ * @brief Compute hypothesis for one example
+ *
+ * @param netw      neural network
+ * @param work      workspace (see nn_alloc_work())
+ * @param inp       input, s_0 values
+ * @param outp      set to hypothesis, s_n+1 values
+ *
+ **/
+void 
+nn_predict (nnetwork netw, nnwork work, const double_ *inp, double_ *outp);
+
+/**
+ *
+ * @brief Compute hypotheses for many examples, they are propagated 
+ *        in blocks of workspace nbatch rows
+ *
+ * @param netw      neural network
+ * @param work      workspace (see nn_alloc_work())
+ * @param inps      inputs, one example per row
+ * @param outps     set to hypotheses, one example per row
+ *
+ * @return 0 on success, 1 if inps or outps don't match the network
+ *
+ **/
+int 
+nn_predict_batch (nnetwork netw, nnwork work, nnmtx inps, nnmtx outps);
+
+/**
+ *
+ * @brief Quantize trained network for inference: weights of every unit
+ *        are int8 steps of the unit's own scale, max |w| / 127, inputs 
+ *        of every layer are uint8 steps of their [min,max] range over 
+ *        calibration examples propagated through the network; products
+ *        are summed in int32 and every unit is scaled back to double_ 
+ *        before its sigmoid (see qdot4 of nn_simd.h)
+ *
+ * The quantized network doesn't refer to netw, it is 8 times smaller
+ * (4 times with -DNN_FLOAT32) and works with any workspace of netw
+ * (see nn_alloc_work()); inputs out of the calibrated range are clamped
+ *
+ * @param netw      trained neural network
+ * @param calib     calibration inputs, a sample of the inputs 
+ *                  the network will be used on, one example per row
+ *
+ * @return quantized network, NULL if calib doesn't match the network
+ *
+ **/
+nnqnet nn_quantize (nnetwork netw, nnmtx calib);
+void nn_destroy_qnet (nnqnet qnet);
+
+/* The same as nn_predict_batch(), with the quantized network */
+int 
+nn_qpredict_batch (nnqnet qnet, nnwork work, nnmtx inps, nnmtx outps);
+
+/**
+ *
+ * @struct nnqerr
+ * @brief Accuracy of quantized network against the network it was 
+ *        quantized from, over a set of examples (see nn_qnet_error())
+ *
+ * @var maxerr        max |h_q - h| over all outputs of all examples
+ * @var meanerr       mean |h_q - h| over all outputs of all examples
+ * @var agree         fraction of examples with the same output unit
+ *                    of the largest hypothesis
+ * @var bytes         size of quantized weights, scales and biases
+ * @var fbytes        size of the network weights
+ *
+ **/
+typedef struct nnqerr_
+{
+  double  maxerr;
+  double meanerr;
+  double   agree;
+  size_t   bytes;
+  size_t  fbytes;
+
+} nnqerr_;
+
+/**
+ *
+ * @brief Propagate inps through both networks and compare hypotheses
+ *
+ * @return 0 on success, 1 if inps don't match the network
+ *
+ **/
+int nn_qnet_error (nnetwork netw, nnqnet qnet, nnwork work, nnmtx inps, 
+                   nnqerr_ *err);
+
+/**
+ *
+ * @brief Prune the weakest weights: weights of every layer without bias
+ *        are cut into blocks of 4 units by 16 inputs, the given fraction
+ *        of the blocks of the smallest L2 norm is zeroed and only 
+ *        the kept blocks are multiplied by the mini-batch passes 
+ *        (see bsrmm_nt() of nn_gemm.h) while few enough are kept; 
+ *        blocks that are zero already are never kept, so a pruned 
+ *        checkpoint is pruned again by nn_prune (netw, 0.0) after nn_load()
+ *
+ * Pruning is iterative: prune some, fine-tune the kept weights with
+ * nn_backprop() and the like, which keep the pruned ones 0, prune more;
+ * must not be called while the network is trained
+ *
+ * @param netw      neural network
+ * @param sparsity  fraction of blocks of every layer to prune, [0, 1)
+ *
+ * @return 0 on success, 1 if sparsity is out of range
+ *
+ **/
+int nn_prune (nnetwork netw, const double sparsity);
+
+/* Fraction of the weights without bias that are pruned */
+double nn_sparsity (nnetwork netw);
 
 #endif
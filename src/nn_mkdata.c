@@ -0,0 +1,34 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "nn_impl.h"
+#include "nn_data.h"
+
+/**
+ *
+ * Convert MNIST-like IDX data set to binary data set file,
+ * that could be then mapped by data_load() (see nn_data.h)
+ *
+ * Usage: nn_mkdata images.idx labels.idx nlabels out.data
+ *
+ **/
+int main (int argc, char **argv)
+{
+  if (argc != 5)
+    {
+      fprintf (stderr, "usage: %s images labels nlabels out\n", argv[0]);
+      return 1;
+    }
+
+  nndata data;
+  if ((data = data_load_idx (argv[1], argv[2], atol (argv[3]))) == NULL)
+    return 1;
+
+  int err = data_save (argv[4], &data->inps, &data->outps);
+  if (! err)
+    printf ("%s: %ld examples, %ld inputs, %ld outputs\n", argv[4],
+            data->inps.nrows, data->inps.ncols, data->outps.ncols);
+
+  data_free (data);
+  return err;
+}
@@ -6,20 +6,93 @@
 /**
  *
  * Train
- *   - 1 network  in 1 thread
- *   - n networks in n threads
+ *   - 1 network
+ *   - n networks at once
  *
- * To use thread pool, copy thpool.h and thpool.c 
- * from https://github.com/Pithikos/C-Thread-Pool to ../lib
+ * on NTHREADS threads of the work-stealing scheduler (see nn_sched.h),
+ * examples of every network are split into one shard per thread,
+ * so that threads idle on cheap networks take shards of costly ones
  *
  **/
-#define WITH_THPOOL           1
+#define MULTI_NETWORKS        1
+#define NTHREADS              0           /* 0 - # of online cores */
+
+/**
+ *
+ * Per-iteration records of all networks (examples/s, cost and, when 
+ * built with -DNN_TELEMETRY, time of every phase) are written as 
+ * JSON lines to TELEMETRY file, NULL - only cost is printed
+ *
+ **/
+#define TELEMETRY             NULL
+
+/**
+ *
+ * Coefficients of weights update rules and learning rate schedules, 
+ * that are set per network by OPTIMIZER and LR_SCHEDULE
+ * (see nn_set_optimizer() and nn_set_lr_schedule())
+ *
+ **/
+#define OPT_BETA1             0.9         /* momentum, Adam first moment */
+#define OPT_BETA2             0.999       /* Adam second moment */
+#define LR_WARMUP             0           /* # of warm-up iterations */
+#define LR_PERIOD             100         /* # of iterations between steps */
+#define LR_GAMMA              0.5         /* step factor, final cosine fraction */
+
+/**
+ *
+ * Networks with VALID_SPLIT hold out the last examples of the data set
+ * (not streamed ones) and validate the weights on them every VALID_EVERY
+ * iterations; networks with PATIENCE stop after that many validations
+ * without improvement, or at VALID_TARGET cost, and keep the best weights,
+ * their threads are taken by the other networks
+ * (see nn_set_validation() and nn_set_early_stop())
+ *
+ **/
+#define VALID_EVERY           10          /* 0 - only the final weights */
+#define VALID_MIN_DELTA       0.0         /* least improvement of the cost */
+#define VALID_TARGET          0.0         /* cost to stop at, 0 - never */
+
+/**
+ *
+ * Networks with INT8_INFER are quantized once they are trained, 
+ * calibrated on the first QUANT_CALIB training examples, and accuracy
+ * of the int8 inference model against the trained one is reported over
+ * the held out examples, or the training ones (see nn_quantize())
+ *
+ **/
+#define QUANT_CALIB           1000        /* # of examples to calibrate on */
+
+/**
+ *
+ * Networks with PRUNE_SPARSITY are pruned once they are trained, in 
+ * PRUNE_STEPS steps of growing sparsity up to PRUNE_SPARSITY of weight
+ * blocks, and the kept weights are fine-tuned for PRUNE_ITERS iterations
+ * after every step, so that the network recovers (see nn_prune())
+ *
+ **/
+#define PRUNE_STEPS           4           /* # of prune/fine-tune steps */
+#define PRUNE_ITERS           20          /* # of iterations after a step */
 
 /* ========================== NEURAL NETWORK 1 ============================= */
 
 #define N1_LEARN_PARAM        0.0001
 #define N1_REGUR_PARAM        1
 #define N1_NITERS             300
+#define N1_NBATCH             64          /* 1 to propagate one by one */
+#define N1_MINIBATCH          0           /* update every n examples, 0 - every pass */
+#define N1_COST_EVERY         1           /* report cost every n iters, 0 - never */
+#define N1_FAST_SIGMOID       0           /* 1 - approximate sigmoid */
+#define N1_SEED               1           /* seed of weights and random data */
+#define N1_OPTIMIZER          NN_OPT_SGD  /* NN_OPT_MOMENTUM, NN_OPT_ADAM, ... */
+#define N1_LR_SCHEDULE        NN_LR_CONST /* NN_LR_STEP, NN_LR_COSINE */
+#define N1_VALID_SPLIT        0.0         /* fraction of examples to validate on */
+#define N1_PATIENCE           0           /* stop after n bad validations, 0 - never */
+#define N1_SPARSE             0           /* 1 - CSR inputs, first layer skips zeros */
+#define N1_LABEL_INDEX        0           /* 1 - class indices, one-hot outputs only */
+#define N1_QUANT_BITS         0           /* 8/16 - quantized inputs, 0 - dense */
+#define N1_INT8_INFER         0           /* 1 - report int8 inference model */
+#define N1_PRUNE_SPARSITY     0.0         /* fraction of blocks to prune, 0 - dense */
 
 #define N1_NEXAMPLES          10000
 #define N1_NFEATURES          20*20
@@ -30,13 +103,16 @@
 
 #define N1_NHIDLAYERS         7
 #define N1_DIST_FUNC	        logdist
+#define N1_DATASET            NULL        /* data set file, NULL - random */
+#define N1_STREAM_CHUNK       0           /* stream data set by n examples, 0 - map */
+#define N1_STREAM_DEPTH       2           /* # of chunks read ahead */
+#define N1_CHECKPOINT         NULL        /* file to save trained network to */
 
 /* If HIDL_SIZES array is empty, then NHID_LAYERS should be 0 */
 const size_t N1_NHIDUNITS[N1_NHIDLAYERS] = { 75, 65, 55, 45, 35, 25, 15 };
 
-#if WITH_THPOOL
+#if MULTI_NETWORKS
 
-  #define NTHREADS              4           /* # of logical cores */
   #define NNETWORKS             4
 
   /* ========================= NEURAL NETWORK 2 ============================ */
@@ -44,6 +120,20 @@ const size_t N1_NHIDUNITS[N1_NHIDLAYERS] = { 75, 65, 55, 45, 35, 25, 15 };
   #define N2_LEARN_PARAM        0.1
   #define N2_REGUR_PARAM        1
   #define N2_NITERS             50
+  #define N2_NBATCH             64
+  #define N2_MINIBATCH          0
+  #define N2_COST_EVERY         1
+  #define N2_FAST_SIGMOID       0
+  #define N2_SEED               1
+  #define N2_OPTIMIZER          NN_OPT_SGD
+  #define N2_LR_SCHEDULE        NN_LR_CONST
+  #define N2_VALID_SPLIT        0.0
+  #define N2_PATIENCE           0
+  #define N2_SPARSE             0
+  #define N2_LABEL_INDEX        0
+  #define N2_QUANT_BITS         0
+  #define N2_INT8_INFER         0
+  #define N2_PRUNE_SPARSITY     0.0
 
   #define N2_NEXAMPLES          10000
   #define N2_NFEATURES          20*20
@@ -54,6 +144,10 @@ const size_t N1_NHIDUNITS[N1_NHIDLAYERS] = { 75, 65, 55, 45, 35, 25, 15 };
 
   #define N2_NHIDLAYERS         7
   #define N2_DIST_FUNC		      logdist
+  #define N2_DATASET            NULL
+  #define N2_STREAM_CHUNK       0
+  #define N2_STREAM_DEPTH       2
+  #define N2_CHECKPOINT         NULL
 
   const size_t N2_NHIDUNITS[N2_NHIDLAYERS] = { 75, 65, 55, 45, 35, 25, 15 };
 
@@ -62,6 +156,20 @@ const size_t N1_NHIDUNITS[N1_NHIDLAYERS] = { 75, 65, 55, 45, 35, 25, 15 };
   #define N3_LEARN_PARAM        0.1
   #define N3_REGUR_PARAM        2
   #define N3_NITERS             50
+  #define N3_NBATCH             64
+  #define N3_MINIBATCH          0
+  #define N3_COST_EVERY         1
+  #define N3_FAST_SIGMOID       0
+  #define N3_SEED               1
+  #define N3_OPTIMIZER          NN_OPT_SGD
+  #define N3_LR_SCHEDULE        NN_LR_CONST
+  #define N3_VALID_SPLIT        0.0
+  #define N3_PATIENCE           0
+  #define N3_SPARSE             0
+  #define N3_LABEL_INDEX        0
+  #define N3_QUANT_BITS         0
+  #define N3_INT8_INFER         0
+  #define N3_PRUNE_SPARSITY     0.0
 
   #define N3_NEXAMPLES          10000
   #define N3_NFEATURES          20*20
@@ -72,6 +180,10 @@ const size_t N1_NHIDUNITS[N1_NHIDLAYERS] = { 75, 65, 55, 45, 35, 25, 15 };
 
   #define N3_NHIDLAYERS         7
   #define N3_DIST_FUNC		      logdist
+  #define N3_DATASET            NULL
+  #define N3_STREAM_CHUNK       0
+  #define N3_STREAM_DEPTH       2
+  #define N3_CHECKPOINT         NULL
 
   const size_t N3_NHIDUNITS[N3_NHIDLAYERS] = { 75, 65, 55, 45, 35, 25, 15 };
 
@@ -80,6 +192,20 @@ const size_t N1_NHIDUNITS[N1_NHIDLAYERS] = { 75, 65, 55, 45, 35, 25, 15 };
   #define N4_LEARN_PARAM        0.1
   #define N4_REGUR_PARAM        3
   #define N4_NITERS             50
+  #define N4_NBATCH             64
+  #define N4_MINIBATCH          0
+  #define N4_COST_EVERY         1
+  #define N4_FAST_SIGMOID       0
+  #define N4_SEED               1
+  #define N4_OPTIMIZER          NN_OPT_SGD
+  #define N4_LR_SCHEDULE        NN_LR_CONST
+  #define N4_VALID_SPLIT        0.0
+  #define N4_PATIENCE           0
+  #define N4_SPARSE             0
+  #define N4_LABEL_INDEX        0
+  #define N4_QUANT_BITS         0
+  #define N4_INT8_INFER         0
+  #define N4_PRUNE_SPARSITY     0.0
 
   #define N4_NEXAMPLES          10000
   #define N4_NFEATURES          20*20
@@ -90,6 +216,10 @@ const size_t N1_NHIDUNITS[N1_NHIDLAYERS] = { 75, 65, 55, 45, 35, 25, 15 };
   
   #define N4_NHIDLAYERS         7
   #define N4_DIST_FUNC		      logdist
+  #define N4_DATASET            NULL
+  #define N4_STREAM_CHUNK       0
+  #define N4_STREAM_DEPTH       2
+  #define N4_CHECKPOINT         NULL
 
   const size_t N4_NHIDUNITS[N4_NHIDLAYERS] = { 75, 65, 55, 45, 35, 25, 15 };
 
@@ -119,6 +249,118 @@ const size_t N1_NHIDUNITS[N1_NHIDLAYERS] = { 75, 65, 55, 45, 35, 25, 15 };
       N4_NITERS
     };
 
+  const size_t NBATCH[NNETWORKS] =
+    {
+      N1_NBATCH,
+      N2_NBATCH,
+      N3_NBATCH,
+      N4_NBATCH
+    };
+
+  const size_t MINIBATCH[NNETWORKS] =
+    {
+      N1_MINIBATCH,
+      N2_MINIBATCH,
+      N3_MINIBATCH,
+      N4_MINIBATCH
+    };
+
+  const size_t COST_EVERY[NNETWORKS] =
+    {
+      N1_COST_EVERY,
+      N2_COST_EVERY,
+      N3_COST_EVERY,
+      N4_COST_EVERY
+    };
+
+  const int FAST_SIGMOID[NNETWORKS] =
+    {
+      N1_FAST_SIGMOID,
+      N2_FAST_SIGMOID,
+      N3_FAST_SIGMOID,
+      N4_FAST_SIGMOID
+    };
+
+  const uint64_t SEEDS[NNETWORKS] =
+    {
+      N1_SEED,
+      N2_SEED,
+      N3_SEED,
+      N4_SEED
+    };
+
+  const nnopt OPTIMIZERS[NNETWORKS] =
+    {
+      N1_OPTIMIZER,
+      N2_OPTIMIZER,
+      N3_OPTIMIZER,
+      N4_OPTIMIZER
+    };
+
+  const nnlr LR_SCHEDULES[NNETWORKS] =
+    {
+      N1_LR_SCHEDULE,
+      N2_LR_SCHEDULE,
+      N3_LR_SCHEDULE,
+      N4_LR_SCHEDULE
+    };
+
+  const double VALID_SPLITS[NNETWORKS] =
+    {
+      N1_VALID_SPLIT,
+      N2_VALID_SPLIT,
+      N3_VALID_SPLIT,
+      N4_VALID_SPLIT
+    };
+
+  const size_t PATIENCES[NNETWORKS] =
+    {
+      N1_PATIENCE,
+      N2_PATIENCE,
+      N3_PATIENCE,
+      N4_PATIENCE
+    };
+
+  const int SPARSE[NNETWORKS] =
+    {
+      N1_SPARSE,
+      N2_SPARSE,
+      N3_SPARSE,
+      N4_SPARSE
+    };
+
+  const int LABEL_INDEX[NNETWORKS] =
+    {
+      N1_LABEL_INDEX,
+      N2_LABEL_INDEX,
+      N3_LABEL_INDEX,
+      N4_LABEL_INDEX
+    };
+
+  const int QUANT_BITS[NNETWORKS] =
+    {
+      N1_QUANT_BITS,
+      N2_QUANT_BITS,
+      N3_QUANT_BITS,
+      N4_QUANT_BITS
+    };
+
+  const int INT8_INFER[NNETWORKS] =
+    {
+      N1_INT8_INFER,
+      N2_INT8_INFER,
+      N3_INT8_INFER,
+      N4_INT8_INFER
+    };
+
+  const double PRUNE_SPARSITY[NNETWORKS] =
+    {
+      N1_PRUNE_SPARSITY,
+      N2_PRUNE_SPARSITY,
+      N3_PRUNE_SPARSITY,
+      N4_PRUNE_SPARSITY
+    };
+
   const size_t NEXAMPLES[NNETWORKS] =
     {
       N1_NEXAMPLES,
@@ -183,11 +425,59 @@ const size_t N1_NHIDUNITS[N1_NHIDLAYERS] = { 75, 65, 55, 45, 35, 25, 15 };
       N4_DIST_FUNC
     };
 
+  const char *DATASETS[NNETWORKS] =
+    {
+      N1_DATASET,
+      N2_DATASET,
+      N3_DATASET,
+      N4_DATASET
+    };
+
+  const size_t STREAM_CHUNK[NNETWORKS] =
+    {
+      N1_STREAM_CHUNK,
+      N2_STREAM_CHUNK,
+      N3_STREAM_CHUNK,
+      N4_STREAM_CHUNK
+    };
+
+  const size_t STREAM_DEPTH[NNETWORKS] =
+    {
+      N1_STREAM_DEPTH,
+      N2_STREAM_DEPTH,
+      N3_STREAM_DEPTH,
+      N4_STREAM_DEPTH
+    };
+
+  const char *CHECKPOINTS[NNETWORKS] =
+    {
+      N1_CHECKPOINT,
+      N2_CHECKPOINT,
+      N3_CHECKPOINT,
+      N4_CHECKPOINT
+    };
+
 #else
 
+  #define NNETWORKS             1
+
   const double_ LEARN_PARAMS[1] = { N1_LEARN_PARAM };
   const double_ REGUR_PARAMS[1] = { N1_REGUR_PARAM };
   const size_t        NITERS[1] = { N1_NITERS };
+  const size_t        NBATCH[1] = { N1_NBATCH };
+  const size_t     MINIBATCH[1] = { N1_MINIBATCH };
+  const size_t    COST_EVERY[1] = { N1_COST_EVERY };
+  const int     FAST_SIGMOID[1] = { N1_FAST_SIGMOID };
+  const uint64_t       SEEDS[1] = { N1_SEED };
+  const nnopt     OPTIMIZERS[1] = { N1_OPTIMIZER };
+  const nnlr    LR_SCHEDULES[1] = { N1_LR_SCHEDULE };
+  const double  VALID_SPLITS[1] = { N1_VALID_SPLIT };
+  const size_t     PATIENCES[1] = { N1_PATIENCE };
+  const int           SPARSE[1] = { N1_SPARSE };
+  const int      LABEL_INDEX[1] = { N1_LABEL_INDEX };
+  const int       QUANT_BITS[1] = { N1_QUANT_BITS };
+  const int       INT8_INFER[1] = { N1_INT8_INFER };
+  const double PRUNE_SPARSITY[1] = { N1_PRUNE_SPARSITY };
   const size_t     NEXAMPLES[1] = { N1_NEXAMPLES };
   const size_t     NFEATURES[1] = { N1_NFEATURES };
   const size_t       NLABELS[1] = { N1_NLABELS };
@@ -196,6 +486,10 @@ const size_t N1_NHIDUNITS[N1_NHIDLAYERS] = { 75, 65, 55, 45, 35, 25, 15 };
   const size_t    NHIDLAYERS[1] = { N1_NHIDLAYERS };
   const size_t    *NHIDUNITS[1] = { N1_NHIDUNITS };
   const dist_f    DIST_FUNCS[1] = { N1_DIST_FUNC };
+  const char       *DATASETS[1] = { N1_DATASET };
+  const size_t  STREAM_CHUNK[1] = { N1_STREAM_CHUNK };
+  const size_t  STREAM_DEPTH[1] = { N1_STREAM_DEPTH };
+  const char    *CHECKPOINTS[1] = { N1_CHECKPOINT };
 
 #endif
 
@@ -1,38 +1,195 @@
 #include <stdlib.h>
-#include <time.h>
+#include <string.h>
+#include <stdint.h>
 
 #include "nn_impl.h"
+#include "nn_rnd.h"
 
-#define SEED	          time (NULL)
+/* Uniform [1,2) value from the high bits of x, minus 1 */
+#ifdef NN_FLOAT32
+  #define RND_UINT          uint32_t
+  #define RND_ONE           0x3f800000u
+  #define RND_SHIFT         41
+#else
+  #define RND_UINT          uint64_t
+  #define RND_ONE           0x3ff0000000000000ull
+  #define RND_SHIFT         12
+#endif
 
-static int RNG = 0;    /* flag if rng was already initialized */
+/* Generator of every thread, for rnd_vec_gen() and rnd_mtx_gen() */
+static __thread nnrng_ RNG;
+static __thread int    RNG_INIT = 0;
 
-static void rng_init_ (void)
+/* Next unused stream of thread generators */
+static uint64_t RNG_STREAM = 0;
+
+static uint64_t splitmix64_ (uint64_t *x)
 {
-  srand (SEED);
-  RNG = 1;
+  uint64_t z = (*x += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
 }
 
-static const double_ rnd_gen_ (void)
+void rnd_init (nnrng_ *rng, const uint64_t seed, const uint64_t stream)
 {
-  return ((double_) rand() / (double_) RAND_MAX);
+  /* State of each lane is expanded from (seed, stream, lane) */
+  for (size_t l = 0; l < RND_LANES; l++)
+    {
+      uint64_t x = seed;
+      x = splitmix64_ (&x) ^ stream;
+      x = splitmix64_ (&x) ^ l;
+      for (size_t k = 0; k < 4; k++)
+        rng->s[k][l] = splitmix64_ (&x);
+    }
+  rng->nbuf = 0;
 }
 
-void rnd_vec_gen (double_ *vec, const size_t n)
+/**
+ *
+ * One xoshiro256+ step of all lanes, the lanes are independent,
+ * so the loops are vectorized
+ *
+ **/
+static inline void rnd_step_ (nnrng_ *rng, uint64_t *out)
+{
+  uint64_t *s0 = rng->s[0], *s1 = rng->s[1], *s2 = rng->s[2], *s3 = rng->s[3];
+  for (size_t l = 0; l < RND_LANES; l++)
+    {
+      out[l] = s0[l] + s3[l];
+
+      uint64_t t = s1[l] << 17;
+      s2[l] ^= s0[l];
+      s3[l] ^= s1[l];
+      s1[l] ^= s2[l];
+      s0[l] ^= s3[l];
+      s2[l] ^= t;
+      s3[l] = (s3[l] << 45) | (s3[l] >> 19);
+    }
+}
+
+uint64_t rnd_u64 (nnrng_ *rng)
+{
+  if (rng->nbuf == 0)
+    {
+      rnd_step_ (rng, rng->buf);
+      rng->nbuf = RND_LANES;
+    }
+  return rng->buf[RND_LANES - rng->nbuf--];
+}
+
+/* Uniform [0,1) value, without int to float conversion */
+static inline double_ rnd_unit_ (const uint64_t x)
+{
+  RND_UINT bits = (RND_UINT) (x >> RND_SHIFT) | RND_ONE;
+  double_ v;
+  memcpy (&v, &bits, sizeof v);
+  return v - 1;
+}
+
+/**
+ *
+ * Bulk fill keeps the state of all lanes in vector registers,
+ * it is compiled for SSE2, AVX2 and AVX-512 and the widest one
+ * supported by the CPU is selected once at startup, as in nn_simd.c
+ *
+ **/
+typedef uint64_t rndvec_ __attribute__ ((vector_size (RND_LANES * 8)));
+typedef RND_UINT rndbits_ __attribute__ ((vector_size (RND_LANES * sizeof (RND_UINT))));
+typedef double_  rndval_  __attribute__ ((vector_size (RND_LANES * sizeof (double_))));
+
+typedef void (*rndfill_f_)(nnrng_ *rng, double_ *vec, const size_t n);
+
+/* Inlined into every variant below and compiled for its instruction set */
+__attribute__ ((always_inline))
+static inline void rnd_vec_fill_ (nnrng_ *rng, double_ *vec, const size_t n)
+{
+  rndvec_ s0, s1, s2, s3;
+  memcpy (&s0, rng->s[0], sizeof s0);
+  memcpy (&s1, rng->s[1], sizeof s1);
+  memcpy (&s2, rng->s[2], sizeof s2);
+  memcpy (&s3, rng->s[3], sizeof s3);
+
+  for (size_t i = 0; i + RND_LANES <= n; i += RND_LANES)
+    {
+      rndvec_ x = s0 + s3;
+
+      rndvec_ t = s1 << 17;
+      s2 ^= s0;
+      s3 ^= s1;
+      s1 ^= s2;
+      s0 ^= s3;
+      s2 ^= t;
+      s3 = (s3 << 45) | (s3 >> 19);
+
+      rndbits_ bits = __builtin_convertvector (x >> RND_SHIFT, rndbits_) | RND_ONE;
+      rndval_ v = (rndval_) bits - 1;
+      memcpy (vec + i, &v, sizeof v);
+    }
+
+  memcpy (rng->s[0], &s0, sizeof s0);
+  memcpy (rng->s[1], &s1, sizeof s1);
+  memcpy (rng->s[2], &s2, sizeof s2);
+  memcpy (rng->s[3], &s3, sizeof s3);
+}
+
+#define RND_FILL_(name, isa)                                            \
+  __attribute__ ((target (isa)))                                        \
+  static void rnd_vec_fill_##name##_ (nnrng_ *rng, double_ *vec,        \
+                                      const size_t n)                   \
+  {                                                                     \
+    rnd_vec_fill_ (rng, vec, n);                                        \
+  }
+
+RND_FILL_ (sse2,   "sse2")
+RND_FILL_ (avx2,   "avx2")
+RND_FILL_ (avx512, "avx512f")
+
+static rndfill_f_ RND_FILL = rnd_vec_fill_sse2_;
+
+__attribute__ ((constructor))
+static void rnd_init_fill_ (void)
 {
-  if (! RNG)
-    rng_init_();
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports ("avx2"))
+    RND_FILL = rnd_vec_fill_avx2_;
+  if (__builtin_cpu_supports ("avx512f"))
+    RND_FILL = rnd_vec_fill_avx512_;
+}
 
-  for (size_t i = 0; i < n; i++)
-    vec[i] = rnd_gen_();
+void rnd_vec_fill (nnrng_ *rng, double_ *vec, const size_t n)
+{
+  size_t nbulk = n / RND_LANES * RND_LANES;
+  RND_FILL (rng, vec, nbulk);
+  for (size_t i = nbulk; i < n; i++)
+    vec[i] = rnd_unit_ (rnd_u64 (rng));
 }
 
-void rnd_mtx_gen (double_ **mtx, const size_t n, const size_t m)
+void rnd_mtx_fill (nnrng_ *rng, nnmtx mtx)
 {
-  if (! RNG)
-    rng_init_();
+  for (size_t i = 0; i < mtx->nrows; i++)
+    rnd_vec_fill (rng, MTX_ROW (mtx, i), mtx->ncols);
+}
 
-  for (size_t i = 0; i < n; i++)
-    for (size_t j = 0; j < m; j++)
-      mtx[i][j] = rnd_gen_();
+static nnrng_ *rng_ (void)
+{
+  if (! RNG_INIT)
+    rnd_seed (RND_SEED, __atomic_fetch_add (&RNG_STREAM, 1, __ATOMIC_RELAXED));
+  return &RNG;
+}
+
+void rnd_seed (const uint64_t seed, const uint64_t stream)
+{
+  rnd_init (&RNG, seed, stream);
+  RNG_INIT = 1;
+}
+
+void rnd_vec_gen (double_ *vec, const size_t n)
+{
+  rnd_vec_fill (rng_ (), vec, n);
+}
+
+void rnd_mtx_gen (nnmtx mtx)
+{
+  rnd_mtx_fill (rng_ (), mtx);
 }
@@ -1,9 +1,78 @@
 #ifndef _NN_RND_
 #define _NN_RND_
 
+#include <stdint.h>
+
+/**
+ *
+ * Random numbers: xoshiro256+ generator, that runs RND_LANES independent
+ * lanes side by side, so that bulk fills are vectorized
+ *
+ * Every generator is seeded with (seed, stream): the same pair always
+ * gives the same sequence, different streams give independent sequences,
+ * f.e. one stream per network or per thread
+ *
+ **/
+
+#define RND_LANES       8
+#define RND_SEED        1           /* default seed */
+
+/**
+ *
+ * @struct nnrng
+ * @brief Generator state, must not be shared between threads
+ *
+ * @var s             xoshiro256+ state of every lane
+ * @var buf           outputs of the last step, used by single draws
+ * @var nbuf          # of unused outputs in buf
+ *
+ **/
+typedef struct nnrng_
+{
+  uint64_t s[4][RND_LANES];
+  uint64_t buf[RND_LANES];
+  size_t   nbuf;
+
+} nnrng_;
+
+typedef nnrng_* nnrng;
+
+/**
+ *
+ * @brief Seed generator with stream of the seed
+ *
+ **/
+void rnd_init (nnrng rng, const uint64_t seed, const uint64_t stream);
+
+/* Next 64 random bits */
+uint64_t rnd_u64 (nnrng rng);
+
+/**
+ *
+ * @brief Fill vector/matrix with Un([0,1)) random values
+ *
+ * @param rng       generator
+ * @param vec       vector
+ * @param n         # of elements
+ * @param mtx       matrix, padding between rows is left untouched
+ *
+ **/
+void rnd_vec_fill (nnrng rng, double_ *vec, const size_t n);
+void rnd_mtx_fill (nnrng rng, nnmtx mtx);
+
+/**
+ *
+ * @brief Reseed generator of the calling thread, that is used by
+ *        rnd_vec_gen() and rnd_mtx_gen(); unless reseeded, each thread
+ *        starts with RND_SEED and the next unused stream
+ *
+ **/
+void rnd_seed (const uint64_t seed, const uint64_t stream);
+
 /**
  *
- * @brief Initialize vector with Un([0,1]) random values
+ * @brief Initialize vector with Un([0,1)) random values
+ *        from generator of the calling thread
  *
  * @param vec       vector
  * @param n         # of elements
@@ -13,13 +82,12 @@ void rnd_vec_gen (double_  *vec, const size_t n);
 
 /**
  *
- * @brief Initialize matrix with Un([0,1]) random values
+ * @brief Initialize matrix with Un([0,1)) random values
+ *        from generator of the calling thread
  *
- * @param mtx       matrix
- * @param n         # of rows
- * @param m         # of columns
+ * @param mtx       matrix, padding between rows is left untouched
  *
  **/
-void rnd_mtx_gen (double_ **mtx, const size_t n, const size_t m);
+void rnd_mtx_gen (nnmtx mtx);
 
 #endif
@@ -0,0 +1,298 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "nn_sched.h"
+
+#define SCHED_DEQUE_CAP     64          /* initial # of tasks in a deque */
+
+typedef struct nntask_
+{
+  task_f   f;
+  void  *arg;
+
+} nntask_;
+
+/**
+ *
+ * @struct nndeque
+ * @brief Tasks of one worker, a ring buffer that grows when full,
+ *        the owner pushes and pops at the bottom, thieves take the top
+ *
+ * @var lock          protects the deque, it is held for a few
+ *                    instructions, tasks run for much longer
+ * @var tasks         ring buffer of cap tasks
+ * @var top           index of the oldest task
+ * @var ntasks        # of tasks in the deque
+ *
+ **/
+typedef struct nndeque_
+{
+  pthread_mutex_t lock;
+  nntask_       *tasks;
+  size_t           cap;
+  size_t           top;
+  size_t        ntasks;
+
+} nndeque_;
+
+/**
+ *
+ * @struct nnsched
+ * @brief Scheduler state
+ *
+ * @var nthreads      # of worker threads
+ * @var ths           worker threads
+ * @var deques        deque of every worker
+ * @var lock          protects sleeping workers and waiters
+ * @var work          signalled when a task is queued or workers stop
+ * @var done          signalled when the last pending task is done
+ * @var nqueued       # of tasks in all deques
+ * @var npending      # of spawned tasks that are not done yet
+ * @var nsleeping     # of workers waiting for work
+ * @var next          deque for tasks spawned outside of workers
+ * @var stop          1 when workers should exit
+ *
+ **/
+typedef struct nnsched_
+{
+  size_t        nthreads;
+  pthread_t         *ths;
+  nndeque_       *deques;
+  pthread_mutex_t   lock;
+  pthread_cond_t    work;
+  pthread_cond_t    done;
+  size_t         nqueued;
+  size_t        npending;
+  size_t       nsleeping;
+  size_t            next;
+  int               stop;
+
+} nnsched_;
+
+typedef struct nnworker_
+{
+  nnsched_ *sched;
+  size_t        w;
+
+} nnworker_;
+
+/* Worker of the calling thread, NULL outside of workers */
+static __thread nnworker_ *SELF = NULL;
+
+static void sched_exit_ (const char *msg)
+{
+  fprintf (stderr, "sched(): %s\n", msg);
+  exit (1);
+}
+
+/* ============================== DEQUE =============================== */
+
+static void deque_push_ (nndeque_ *dq, const nntask_ task)
+{
+  pthread_mutex_lock (&dq->lock);
+  if (dq->ntasks == dq->cap)
+    {
+      /* Unroll the ring into a twice larger buffer */
+      nntask_ *tasks;
+      if ((tasks = malloc (2 * dq->cap * sizeof *tasks)) == NULL)
+        sched_exit_ ("Could not allocate memory ...");
+      for (size_t k = 0; k < dq->ntasks; k++)
+        tasks[k] = dq->tasks[(dq->top + k) % dq->cap];
+      free (dq->tasks);
+      dq->tasks = tasks;
+      dq->cap  *= 2;
+      dq->top   = 0;
+    }
+  dq->tasks[(dq->top + dq->ntasks++) % dq->cap] = task;
+  pthread_mutex_unlock (&dq->lock);
+}
+
+/* Newest task, for the owner, 1 if the deque was empty */
+static int deque_pop_ (nndeque_ *dq, nntask_ *task)
+{
+  int empty;
+  pthread_mutex_lock (&dq->lock);
+  if (! (empty = dq->ntasks == 0))
+    *task = dq->tasks[(dq->top + --dq->ntasks) % dq->cap];
+  pthread_mutex_unlock (&dq->lock);
+  return empty;
+}
+
+/* Oldest task, for thieves, 1 if the deque was empty */
+static int deque_steal_ (nndeque_ *dq, nntask_ *task)
+{
+  int empty;
+  pthread_mutex_lock (&dq->lock);
+  if (! (empty = dq->ntasks == 0))
+    {
+      *task   = dq->tasks[dq->top];
+      dq->top = (dq->top + 1) % dq->cap;
+      dq->ntasks--;
+    }
+  pthread_mutex_unlock (&dq->lock);
+  return empty;
+}
+
+/* ============================= WORKERS ============================== */
+
+/* Take own newest task, or steal the oldest one, starting with next worker */
+static int sched_take_ (nnsched_ *sched, const size_t w, nntask_ *task)
+{
+  if (deque_pop_ (&sched->deques[w], task) == 0)
+    goto taken;
+  for (size_t k = 1; k < sched->nthreads; k++)
+    if (deque_steal_ (&sched->deques[(w + k) % sched->nthreads], task) == 0)
+      goto taken;
+  return 1;
+
+taken:
+  __atomic_sub_fetch (&sched->nqueued, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+static void *sched_worker_ (void *arg)
+{
+  nnworker_ *self  = (nnworker_ *)arg;
+  nnsched_  *sched = self->sched;
+  SELF = self;
+
+  for (;;)
+    {
+      nntask_ task;
+      if (sched_take_ (sched, self->w, &task) == 0)
+        {
+          task.f (task.arg);
+          if (__atomic_sub_fetch (&sched->npending, 1, __ATOMIC_ACQ_REL) == 0)
+            {
+              pthread_mutex_lock (&sched->lock);
+              pthread_cond_broadcast (&sched->done);
+              pthread_mutex_unlock (&sched->lock);
+            }
+          continue;
+        }
+
+      /* Nothing to run or to steal, sleep until a task is spawned */
+      pthread_mutex_lock (&sched->lock);
+      sched->nsleeping++;
+      while (__atomic_load_n (&sched->nqueued, __ATOMIC_RELAXED) == 0
+          && ! sched->stop)
+        pthread_cond_wait (&sched->work, &sched->lock);
+      sched->nsleeping--;
+      int stop = sched->stop;
+      pthread_mutex_unlock (&sched->lock);
+
+      if (stop)
+        break;
+    }
+
+  free (self);
+  return NULL;
+}
+
+nnsched_ *sched_alloc (const size_t nthreads)
+{
+  nnsched_ *sched;
+  if ((sched = malloc (sizeof *sched)) == NULL)
+    sched_exit_ ("Could not allocate memory ...");
+
+  sched->nthreads = nthreads;
+  if (sched->nthreads == 0)
+    {
+      long ncores = sysconf (_SC_NPROCESSORS_ONLN);
+      sched->nthreads = ncores > 0 ? ncores : 1;
+    }
+  sched->nqueued   = 0;
+  sched->npending  = 0;
+  sched->nsleeping = 0;
+  sched->next      = 0;
+  sched->stop      = 0;
+  pthread_mutex_init (&sched->lock, NULL);
+  pthread_cond_init  (&sched->work, NULL);
+  pthread_cond_init  (&sched->done, NULL);
+
+  if ((sched->ths    = malloc (sched->nthreads * sizeof *sched->ths))    == NULL
+   || (sched->deques = malloc (sched->nthreads * sizeof *sched->deques)) == NULL)
+    sched_exit_ ("Could not allocate memory ...");
+
+  for (size_t w = 0; w < sched->nthreads; w++)
+    {
+      nndeque_ *dq = &sched->deques[w];
+      pthread_mutex_init (&dq->lock, NULL);
+      if ((dq->tasks = malloc (SCHED_DEQUE_CAP * sizeof *dq->tasks)) == NULL)
+        sched_exit_ ("Could not allocate memory ...");
+      dq->cap    = SCHED_DEQUE_CAP;
+      dq->top    = 0;
+      dq->ntasks = 0;
+    }
+
+  for (size_t w = 0; w < sched->nthreads; w++)
+    {
+      nnworker_ *self;
+      if ((self = malloc (sizeof *self)) == NULL)
+        sched_exit_ ("Could not allocate memory ...");
+      self->sched = sched;
+      self->w     = w;
+      if (pthread_create (&sched->ths[w], NULL, sched_worker_, self) != 0)
+        sched_exit_ ("Could not create thread ...");
+    }
+
+  return sched;
+}
+
+size_t sched_nthreads (nnsched_ *sched)
+{
+  return sched->nthreads;
+}
+
+void sched_spawn (nnsched_ *sched, task_f f, void *arg)
+{
+  /* Workers push to their own deque, other threads spread tasks */
+  size_t w = SELF != NULL && SELF->sched == sched
+           ? SELF->w
+           : __atomic_fetch_add (&sched->next, 1, __ATOMIC_RELAXED)
+             % sched->nthreads;
+
+  /* Counted before the push, so that they never go below 0 */
+  __atomic_add_fetch (&sched->npending, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch (&sched->nqueued,  1, __ATOMIC_RELAXED);
+  deque_push_ (&sched->deques[w], (nntask_) { f, arg });
+
+  pthread_mutex_lock (&sched->lock);
+  if (sched->nsleeping > 0)
+    pthread_cond_signal (&sched->work);
+  pthread_mutex_unlock (&sched->lock);
+}
+
+void sched_wait (nnsched_ *sched)
+{
+  pthread_mutex_lock (&sched->lock);
+  while (__atomic_load_n (&sched->npending, __ATOMIC_ACQUIRE) > 0)
+    pthread_cond_wait (&sched->done, &sched->lock);
+  pthread_mutex_unlock (&sched->lock);
+}
+
+void sched_destroy (nnsched_ *sched)
+{
+  pthread_mutex_lock (&sched->lock);
+  sched->stop = 1;
+  pthread_cond_broadcast (&sched->work);
+  pthread_mutex_unlock (&sched->lock);
+
+  /* Workers look into every deque until they exit */
+  for (size_t w = 0; w < sched->nthreads; w++)
+    pthread_join (sched->ths[w], NULL);
+  for (size_t w = 0; w < sched->nthreads; w++)
+    {
+      pthread_mutex_destroy (&sched->deques[w].lock);
+      free (sched->deques[w].tasks);
+    }
+
+  pthread_mutex_destroy (&sched->lock);
+  pthread_cond_destroy  (&sched->work);
+  pthread_cond_destroy  (&sched->done);
+  free (sched->ths);
+  free (sched->deques);
+  free (sched);
+}
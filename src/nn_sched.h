@@ -0,0 +1,59 @@
+#ifndef _NN_SCHED_
+#define _NN_SCHED_
+
+#include <stddef.h>
+
+/**
+ *
+ * Work-stealing scheduler: a fixed set of worker threads, each with its
+ * own deque of tasks; a worker runs the tasks it spawned last first, and
+ * once its deque is empty it steals the oldest task of another worker
+ *
+ * Tasks never wait for each other, a task that finishes some work spawns
+ * the tasks that depend on it, so several networks could be trained
+ * at once and a worker idle on one network picks up shards of another
+ * (see nn_backprop_async())
+ *
+ **/
+typedef struct nnsched_* nnsched;
+
+typedef void (*task_f)(void *arg);
+
+/**
+ *
+ * @brief Start worker threads
+ *
+ * @param nthreads  # of worker threads, 0 - one per online core
+ *
+ * @return scheduler, exits if threads could not be created
+ *
+ **/
+nnsched sched_alloc (const size_t nthreads);
+
+/* # of worker threads */
+size_t sched_nthreads (nnsched sched);
+
+/**
+ *
+ * @brief Run f (arg) on some worker thread, could be called
+ *        from a task or from any other thread
+ *
+ **/
+void sched_spawn (nnsched sched, task_f f, void *arg);
+
+/**
+ *
+ * @brief Wait until all spawned tasks, and the tasks they spawned,
+ *        are done; must not be called from a task
+ *
+ **/
+void sched_wait (nnsched sched);
+
+/**
+ *
+ * @brief Stop worker threads, all tasks should be done (see sched_wait())
+ *
+ **/
+void sched_destroy (nnsched sched);
+
+#endif
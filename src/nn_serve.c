@@ -0,0 +1,404 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "nn_impl.h"
+#include "nn_alloc.h"
+#include "nn_serve.h"
+
+/**
+ *
+ * Local inference server
+ *
+ * Usage: nn_serve model.ckpt socket [max_batch [max_wait_us [nworkers]]]
+ *
+ * Every connection is served by its own thread, that puts each request
+ * into a shared queue and waits for the response; nworkers batch threads
+ * take up to max_batch queued requests at once, waiting at most
+ * max_wait_us for the batch to fill after its first request arrived,
+ * and run them through nn_predict_batch() with their own workspace
+ *
+ * Latency (from queueing to the response being ready), throughput and
+ * average batch size are reported every SERVE_REPORT_SECS and on exit
+ *
+ **/
+
+#define SERVE_MAX_BATCH       32
+#define SERVE_MAX_WAIT_US     200
+#define SERVE_NWORKERS        1
+#define SERVE_REPORT_SECS     2
+#define SERVE_NSAMPLES        (1 << 16)   /* latencies kept per report */
+#define SERVE_BACKLOG         64
+
+/**
+ *
+ * @struct nnreq
+ * @brief Request of one connection, lives on the connection thread stack
+ *
+ * @var inp           input values
+ * @var outp          hypothesis, set by a batch thread
+ * @var t0            time the request was queued
+ * @var done          1 when outp is set
+ * @var cond          signaled when outp is set
+ * @var next          next request in the queue
+ *
+ **/
+typedef struct nnreq_
+{
+  double_          *inp;
+  double_         *outp;
+  double             t0;
+  int              done;
+  pthread_cond_t   cond;
+  struct nnreq_   *next;
+
+} nnreq_;
+
+/**
+ *
+ * @struct nnserver
+ * @brief State shared by connection and batch threads
+ *
+ * @var netw          served network, read-only
+ * @var max_batch     max # of requests in a batch
+ * @var max_wait      max time a batch waits to fill, seconds
+ * @var head/tail     queue of requests
+ * @var nqueued       # of queued requests
+ * @var lats          latencies of requests answered since last report
+ * @var nlats         # of latencies in lats (capped at SERVE_NSAMPLES)
+ * @var nreqs         # of requests answered since last report
+ * @var nbatches      # of batches run since last report
+ * @var t_report      time of the last report
+ *
+ **/
+typedef struct nnserver_
+{
+  nnetwork          netw;
+  size_t         ninps;
+  size_t        noutps;
+  size_t     max_batch;
+  double      max_wait;
+  int           listen;
+  pthread_mutex_t  mtx;
+  pthread_cond_t queued;
+  nnreq_         *head;
+  nnreq_         *tail;
+  size_t       nqueued;
+  double         *lats;
+  size_t         nlats;
+  size_t         nreqs;
+  size_t      nbatches;
+  double      t_report;
+
+} nnserver_;
+
+static void serve_exit_ (const char *msg)
+{
+  fprintf (stderr, "nn_serve(): %s\n", msg);
+  exit (1);
+}
+
+static double now_ (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* ============================= BATCHING ============================== */
+
+static void deadline_ (const double t, struct timespec *ts)
+{
+  /* Condition variables wait on CLOCK_REALTIME by default */
+  clock_gettime (CLOCK_REALTIME, ts);
+  double dt = t - now_ ();
+  if (dt <= 0)
+    return;
+  ts->tv_sec  += (time_t) dt;
+  ts->tv_nsec += (long) ((dt - (time_t) dt) * 1e9);
+  if (ts->tv_nsec >= 1000000000)
+    {
+      ts->tv_sec++;
+      ts->tv_nsec -= 1000000000;
+    }
+}
+
+/**
+ *
+ * @brief Take up to max_batch requests from the queue, waiting until
+ *        either max_batch are queued or the first of them waited max_wait
+ *
+ * @return # of requests put into reqs, mutex is held on entry and exit
+ *
+ **/
+static size_t take_batch_ (nnserver_ *srv, nnreq_ **reqs)
+{
+  while (srv->nqueued == 0)
+    pthread_cond_wait (&srv->queued, &srv->mtx);
+
+  while (srv->nqueued > 0 && srv->nqueued < srv->max_batch)
+    {
+      struct timespec ts;
+      deadline_ (srv->head->t0 + srv->max_wait, &ts);
+      if (pthread_cond_timedwait (&srv->queued, &srv->mtx, &ts) != 0)
+        break;
+    }
+
+  size_t n = 0;
+  while (srv->head != NULL && n < srv->max_batch)
+    {
+      reqs[n++] = srv->head;
+      srv->head = srv->head->next;
+    }
+  if (srv->head == NULL)
+    srv->tail = NULL;
+  srv->nqueued -= n;
+  return n;
+}
+
+static void *batch_worker_ (void *arg)
+{
+  nnserver_ *srv = (nnserver_ *)arg;
+
+  nnreq_ *reqs[srv->max_batch];
+  nnwork work = nn_alloc_work (srv->netw, srv->max_batch);
+  nnmtx  inps = alloc_mtx (srv->max_batch, srv->ninps,  1),
+        outps = alloc_mtx (srv->max_batch, srv->noutps, 1);
+  if (inps == NULL || outps == NULL)
+    serve_exit_ ("Could not allocate memory ...");
+
+  pthread_mutex_lock (&srv->mtx);
+  for (;;)
+    {
+      /* Queue is not locked while the batch is propagated */
+      size_t n = take_batch_ (srv, reqs);
+      if (n == 0)
+        continue;
+      pthread_mutex_unlock (&srv->mtx);
+
+      for (size_t b = 0; b < n; b++)
+        memcpy (MTX_ROW (inps, b), reqs[b]->inp, srv->ninps * sizeof (double_));
+
+      inps->nrows = outps->nrows = n;
+      nn_predict_batch (srv->netw, work, inps, outps);
+
+      double t1 = now_ ();
+      pthread_mutex_lock (&srv->mtx);
+      for (size_t b = 0; b < n; b++)
+        {
+          memcpy (reqs[b]->outp, MTX_ROW (outps, b),
+                  srv->noutps * sizeof (double_));
+          if (srv->nlats < SERVE_NSAMPLES)
+            srv->lats[srv->nlats++] = t1 - reqs[b]->t0;
+          reqs[b]->done = 1;
+          pthread_cond_signal (&reqs[b]->cond);
+        }
+      srv->nreqs += n;
+      srv->nbatches++;
+    }
+  return NULL;
+}
+
+/* ============================ CONNECTIONS ============================ */
+
+typedef struct nnconn_
+{
+  nnserver_ *srv;
+  int         fd;
+
+} nnconn_;
+
+static void *conn_run_ (void *arg)
+{
+  nnconn_    conn = *(nnconn_ *)arg;
+  nnserver_ *srv  = conn.srv;
+  free (arg);
+
+  nnhello_ hello = { srv->ninps, srv->noutps, sizeof (double_) };
+  double_ inp[srv->ninps], outp[srv->noutps];
+
+  nnreq_ req = { .inp = inp, .outp = outp };
+  pthread_cond_init (&req.cond, NULL);
+
+  if (serve_write (conn.fd, &hello, sizeof hello) == 0)
+    while (serve_read (conn.fd, inp, sizeof inp) == 0)
+      {
+        pthread_mutex_lock (&srv->mtx);
+        req.t0   = now_ ();
+        req.done = 0;
+        req.next = NULL;
+        if (srv->tail != NULL)
+          srv->tail->next = &req;
+        else
+          srv->head = &req;
+        srv->tail = &req;
+        srv->nqueued++;
+        pthread_cond_signal (&srv->queued);
+
+        while (! req.done)
+          pthread_cond_wait (&req.cond, &srv->mtx);
+        pthread_mutex_unlock (&srv->mtx);
+
+        if (serve_write (conn.fd, outp, sizeof outp) != 0)
+          break;
+      }
+
+  pthread_cond_destroy (&req.cond);
+  close (conn.fd);
+  return NULL;
+}
+
+static void *accept_run_ (void *arg)
+{
+  nnserver_ *srv = (nnserver_ *)arg;
+
+  for (;;)
+    {
+      int fd;
+      if ((fd = accept (srv->listen, NULL, NULL)) < 0)
+        continue;
+
+      nnconn_ *conn;
+      if ((conn = malloc (sizeof *conn)) == NULL)
+        serve_exit_ ("Could not allocate memory ...");
+      conn->srv = srv;
+      conn->fd  = fd;
+
+      pthread_t th;
+      if (pthread_create (&th, NULL, conn_run_, conn) != 0)
+        {
+          fprintf (stderr, "nn_serve(): could not create thread ...\n");
+          close (fd);
+          free (conn);
+          continue;
+        }
+      pthread_detach (th);
+    }
+  return NULL;
+}
+
+/* ============================ STATISTICS ============================= */
+
+static int cmp_double_ (const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/* Print and reset statistics of requests answered since last report */
+static void report_ (nnserver_ *srv)
+{
+  pthread_mutex_lock (&srv->mtx);
+  double t = now_ (), dt = t - srv->t_report;
+  size_t nreqs = srv->nreqs, nbatches = srv->nbatches, nlats = srv->nlats;
+
+  if (nreqs > 0)
+    {
+      qsort (srv->lats, nlats, sizeof *srv->lats, cmp_double_);
+      printf ("%8.0f req/s | batch %5.1f | p50 %8.1f us | p99 %8.1f us\n",
+              nreqs / dt, (double) nreqs / nbatches,
+              1e6 * srv->lats[nlats / 2], 1e6 * srv->lats[nlats * 99 / 100]);
+      fflush (stdout);
+    }
+
+  srv->nreqs = srv->nbatches = srv->nlats = 0;
+  srv->t_report = t;
+  pthread_mutex_unlock (&srv->mtx);
+}
+
+/* ================================ MAIN =============================== */
+
+static int listen_ (const char *path)
+{
+  struct sockaddr_un addr;
+  if (strlen (path) >= sizeof addr.sun_path)
+    serve_exit_ ("socket path is too long");
+
+  memset (&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, path);
+
+  int fd;
+  unlink (path);
+  if ((fd = socket (AF_UNIX, SOCK_STREAM, 0)) < 0
+   || bind (fd, (struct sockaddr *) &addr, sizeof addr) != 0
+   || listen (fd, SERVE_BACKLOG) != 0)
+    serve_exit_ ("could not listen on the socket");
+  return fd;
+}
+
+int main (int argc, char **argv)
+{
+  if (argc < 3)
+    {
+      fprintf (stderr, "usage: %s model socket "
+                       "[max_batch [max_wait_us [nworkers]]]\n", argv[0]);
+      return 1;
+    }
+
+  nnserver_ srv;
+  if ((srv.netw = nn_load (0, argv[1])) == NULL)
+    return 1;
+
+  /* Zero blocks of a pruned model are skipped, see nn_prune() */
+  nn_prune (srv.netw, 0.0);
+  if (nn_sparsity (srv.netw) > 0.0)
+    printf ("%.1f%% of weights are pruned\n", 
+            100 * nn_sparsity (srv.netw));
+
+  size_t nworkers;
+  srv.max_batch = argc > 3 ? atol (argv[3]) : SERVE_MAX_BATCH;
+  srv.max_wait  = argc > 4 ? atol (argv[4]) * 1e-6 : SERVE_MAX_WAIT_US * 1e-6;
+  nworkers      = argc > 5 ? atol (argv[5]) : SERVE_NWORKERS;
+  if (srv.max_batch == 0 || nworkers == 0)
+    serve_exit_ ("max_batch and nworkers should be positive");
+
+  srv.ninps  = nn_ninps  (srv.netw);
+  srv.noutps = nn_noutps (srv.netw);
+  srv.listen = listen_ (argv[2]);
+  srv.head = srv.tail = NULL;
+  srv.nqueued  = 0;
+  srv.nreqs    = srv.nbatches = srv.nlats = 0;
+  srv.t_report = now_ ();
+  if ((srv.lats = malloc (SERVE_NSAMPLES * sizeof *srv.lats)) == NULL)
+    serve_exit_ ("Could not allocate memory ...");
+  pthread_mutex_init (&srv.mtx, NULL);
+  pthread_cond_init  (&srv.queued, NULL);
+
+  /* Signals are only taken by main thread with sigtimedwait () */
+  sigset_t sigs;
+  sigemptyset (&sigs);
+  sigaddset (&sigs, SIGINT);
+  sigaddset (&sigs, SIGTERM);
+  pthread_sigmask (SIG_BLOCK, &sigs, NULL);
+  signal (SIGPIPE, SIG_IGN);
+
+  pthread_t th;
+  for (size_t w = 0; w < nworkers; w++)
+    if (pthread_create (&th, NULL, batch_worker_, &srv) != 0)
+      serve_exit_ ("could not create thread ...");
+  if (pthread_create (&th, NULL, accept_run_, &srv) != 0)
+    serve_exit_ ("could not create thread ...");
+
+  printf ("Serving %s on %s: %ld inputs, %ld outputs, "
+          "batch <= %ld, wait <= %.0f us, %ld workers\n",
+          argv[1], argv[2], srv.ninps, srv.noutps, 
+          srv.max_batch, srv.max_wait * 1e6, nworkers);
+  fflush (stdout);
+
+  const struct timespec period = { SERVE_REPORT_SECS, 0 };
+  while (sigtimedwait (&sigs, NULL, &period) < 0)
+    report_ (&srv);
+
+  /* Report requests since the last period and quit, 
+     connection and batch threads are stopped with the process */
+  report_ (&srv);
+  unlink (argv[2]);
+  return 0;
+}
@@ -0,0 +1,67 @@
+#ifndef _NN_SERVE_
+#define _NN_SERVE_
+
+#include <stdint.h>
+#include <unistd.h>
+
+/**
+ *
+ * Protocol of the local inference server (nn_serve.c),
+ * over a Unix domain stream socket, all fields in host byte order:
+ *
+ *   server -> client   nnhello_ once the connection is accepted
+ *   client -> server   ninps  double_ values of one example
+ *   server -> client   noutps double_ values of its hypothesis
+ *   ...                requests and responses alternate until the client
+ *                      closes the connection
+ *
+ * Requests of all connections are coalesced into batches by the server
+ *
+ **/
+
+/**
+ *
+ * @struct nnhello
+ * @brief Shape of the served network
+ *
+ * @var ninps         # of inputs per request
+ * @var noutps        # of outputs per response
+ * @var fsize         sizeof (double_) of the server build
+ *
+ **/
+typedef struct nnhello_
+{
+  uint32_t  ninps;
+  uint32_t noutps;
+  uint32_t  fsize;
+
+} nnhello_;
+
+/* Read/write exactly size bytes, 0 on success, 1 on error or EOF */
+static inline int serve_read (int fd, void *buf, size_t size)
+{
+  while (size > 0)
+    {
+      ssize_t n = read (fd, buf, size);
+      if (n <= 0)
+        return 1;
+      buf   = (char *) buf + n;
+      size -= n;
+    }
+  return 0;
+}
+
+static inline int serve_write (int fd, const void *buf, size_t size)
+{
+  while (size > 0)
+    {
+      ssize_t n = write (fd, buf, size);
+      if (n <= 0)
+        return 1;
+      buf   = (const char *) buf + n;
+      size -= n;
+    }
+  return 0;
+}
+
+#endif
@@ -0,0 +1,359 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "nn_impl.h"
+#include "nn_simd.h"
+
+/* Layout of double_ used by exp approximations (see nn_simd_kern.h) */
+#ifdef NN_FLOAT32
+  #define SIMD_INT            int32_t
+  #define SIMD_EXP_MAX        87.0
+  #define SIMD_EXP_SHIFTER    0x1.8p23
+  #define SIMD_EXP_BIAS       127
+  #define SIMD_EXP_MANT       23
+  #define SIMD_EXP_DEG        7
+  #define SIMD_LN2_HI         0x1.62e4p-1
+  #define SIMD_LN2_LO         0x1.7f7d1cf79abcap-20
+#else
+  #define SIMD_INT            int64_t
+  #define SIMD_EXP_MAX        708.0
+  #define SIMD_EXP_SHIFTER    0x1.8p52
+  #define SIMD_EXP_BIAS       1023
+  #define SIMD_EXP_MANT       52
+  #define SIMD_EXP_DEG        11
+  #define SIMD_LN2_HI         0x1.62e42fefa3800p-1
+  #define SIMD_LN2_LO         0x1.ef35793c76730p-45
+#endif
+
+#define SIMD_FEXP_DEG         5     /* exp degree used by sigmoid_fast */
+
+/* ======================= SCALAR REFERENCE ========================== */
+
+static double_ dot_scalar_ (const double_ *x, const double_ *y, const size_t n)
+{
+  double_ s = 0.0;
+  for (size_t i = 0; i < n; i++)
+    s += x[i] * y[i];
+  return s;
+}
+
+static void 
+axpy_scalar_ (double_ *y, const double_ a, const double_ *x, const size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    y[i] += a * x[i];
+}
+
+static void 
+axpy4_scalar_ (double_ *y, const double_ *a, const double_ *const *x, 
+               const size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    y[i] += a[0] * x[0][i] + a[1] * x[1][i] + a[2] * x[2][i] + a[3] * x[3][i];
+}
+
+static void sigmoid_scalar_ (double_ *x, const size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    x[i] = 1 / (1 + NN_EXP (-x[i]));
+}
+
+/**
+ *
+ * Scalar version of the vectorized approximation (see nn_simd_kern.h),
+ * it is also used for the tails that don't fill a whole vector
+ *
+ **/
+static inline double_ sigmoid_fast_1_ (double_ x)
+{
+  static const double_ coefs[] = 
+    { 1.0 / 120, 1.0 / 24, 1.0 / 6, 0.5, 1.0, 1.0 };   /* SIMD_FEXP_DEG */
+
+  /* exp (-x) = 2^n * exp (r), |r| <= ln2 / 2 */
+  x = x > SIMD_EXP_MAX ? SIMD_EXP_MAX : x < -SIMD_EXP_MAX ? -SIMD_EXP_MAX : x;
+  double_ n = -x * (double_) 1.4426950408889634 + (double_) SIMD_EXP_SHIFTER;
+  n -= (double_) SIMD_EXP_SHIFTER;
+  double_ r = -x - n * (double_) SIMD_LN2_HI - n * (double_) SIMD_LN2_LO;
+
+  double_ p = coefs[0];
+  for (size_t c = 1; c <= SIMD_FEXP_DEG; c++)
+    p = p * r + coefs[c];
+
+  /* 2^n is built directly in the exponent bits, no ldexp () call */
+  double_ e;
+  SIMD_INT ebits = ((SIMD_INT) n + SIMD_EXP_BIAS) << SIMD_EXP_MANT;
+  memcpy (&e, &ebits, sizeof e);
+
+  return 1 / (1 + p * e);
+}
+
+static void sigmoid_fast_scalar_ (double_ *x, const size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    x[i] = sigmoid_fast_1_ (x[i]);
+}
+
+static void dsigmoid_scalar_ (double_ *d, const double_ *s, const size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    d[i] *= s[i] * (1 - s[i]);
+}
+
+static void 
+update_scalar_ (double_ *w, double_ *dw, const double_ c, const double_ decay,
+                const size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    {
+      w[i] = decay * w[i] - c * dw[i];
+      dw[i] = 0.0;
+    }
+}
+
+static void 
+momentum_scalar_ (double_ *w, double_ *dw, double_ *v, const double_ c, 
+                  const double_ l, const double_ mu, const int nesterov, 
+                  const size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    {
+      double_ g = c * dw[i] + l * w[i];
+      v[i]  = mu * v[i] + g;
+      w[i] -= nesterov ? mu * v[i] + g : v[i];
+      dw[i] = 0.0;
+    }
+}
+
+static void 
+adam_scalar_ (double_ *w, double_ *dw, double_ *m, double_ *v, 
+              const nnadamk_ *k, const size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    {
+      double_ g = k->c * dw[i] + k->l * w[i];
+      m[i]  = k->beta1 * m[i] + (1 - k->beta1) * g;
+      v[i]  = k->beta2 * v[i] + (1 - k->beta2) * g * g;
+      w[i]  = k->decay * w[i] - k->lr * m[i] / (NN_SQRT (v[i]) + k->eps);
+      dw[i] = 0.0;
+    }
+}
+
+static inline uint8_t quantize_1_ (double_ x, const double_ lo, 
+                                   const double_ s)
+{
+  x = (x - lo) * s + (double_) 0.5;
+  x = x > 0   ? x : 0;
+  return x < 255 ? x : 255;
+}
+
+static void 
+quantize_scalar_ (uint8_t *q, const double_ *x, const double_ lo, 
+                  const double_ s, const size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    q[i] = quantize_1_ (x[i], lo, s);
+}
+
+static void 
+qdot4_scalar_ (int32_t *s, const uint8_t *x, const int8_t *const *w, 
+               const size_t n)
+{
+  for (size_t k = 0; k < 4; k++)
+    {
+      int32_t s_k = 0;
+      for (size_t i = 0; i < n; i++)
+        s_k += x[i] * w[k][i];
+      s[k] = s_k;
+    }
+}
+
+/* Elements [*i0, *i1) of b'th block of cols */
+static inline void 
+block_range_ (const uint32_t *cols, const size_t b, const size_t bc, 
+              const size_t n, size_t *i0, size_t *i1)
+{
+  *i0 = cols[b] * bc;
+  *i1 = *i0 + bc < n ? *i0 + bc : n;
+}
+
+static void 
+bdot4_scalar_ (double_ *s, const double_ *x, const double_ *const *w,
+               const uint32_t *cols, const size_t nblocks, const size_t bc, 
+               const size_t n)
+{
+  s[0] = s[1] = s[2] = s[3] = 0.0;
+  for (size_t b = 0; b < nblocks; b++)
+    {
+      size_t i0, i1;
+      block_range_ (cols, b, bc, n, &i0, &i1);
+      for (size_t i = i0; i < i1; i++)
+        for (size_t k = 0; k < 4; k++)
+          s[k] += x[i] * w[k][i];
+    }
+}
+
+static void 
+baxpy4_scalar_ (double_ *y, const double_ *a, const double_ *const *w,
+                const uint32_t *cols, const size_t nblocks, const size_t bc, 
+                const size_t n)
+{
+  for (size_t b = 0; b < nblocks; b++)
+    {
+      size_t i0, i1;
+      block_range_ (cols, b, bc, n, &i0, &i1);
+      for (size_t i = i0; i < i1; i++)
+        y[i] += a[0] * w[0][i] + a[1] * w[1][i] + a[2] * w[2][i] 
+              + a[3] * w[3][i];
+    }
+}
+
+static void 
+bger4_scalar_ (double_ *const *w, const double_ *a, const double_ *x,
+               const uint32_t *cols, const size_t nblocks, const size_t bc, 
+               const size_t n)
+{
+  for (size_t b = 0; b < nblocks; b++)
+    {
+      size_t i0, i1;
+      block_range_ (cols, b, bc, n, &i0, &i1);
+      for (size_t k = 0; k < 4; k++)
+        for (size_t i = i0; i < i1; i++)
+          w[k][i] += a[k] * x[i];
+    }
+}
+
+static const nnsimd_ simd_scalar_ =
+  {
+    .name     = "scalar",
+    .dot      = dot_scalar_,
+    .axpy     = axpy_scalar_,
+    .axpy4    = axpy4_scalar_,
+    .sigmoid  = sigmoid_scalar_,
+    .sigmoid_fast = sigmoid_fast_scalar_,
+    .dsigmoid = dsigmoid_scalar_,
+    .update   = update_scalar_,
+    .momentum = momentum_scalar_,
+    .adam     = adam_scalar_,
+    .quantize = quantize_scalar_,
+    .qdot4    = qdot4_scalar_,
+    .bdot4    = bdot4_scalar_,
+    .baxpy4   = baxpy4_scalar_,
+    .bger4    = bger4_scalar_
+  };
+
+/* ======================== VECTOR VARIANTS ========================== */
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+#define HAVE_X86_SIMD_    1
+
+#pragma GCC push_options
+#pragma GCC target ("sse2")
+#define SIMD_NAME         sse2
+#define SIMD_STR          "sse2"
+#define SIMD_BYTES        16
+#include "nn_simd_kern.h"
+#undef SIMD_NAME
+#undef SIMD_STR
+#undef SIMD_BYTES
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target ("avx2,fma")
+#define SIMD_NAME         avx2
+#define SIMD_STR          "avx2"
+#define SIMD_BYTES        32
+#include "nn_simd_kern.h"
+#undef SIMD_NAME
+#undef SIMD_STR
+#undef SIMD_BYTES
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target ("avx512f")
+#define SIMD_NAME         avx512
+#define SIMD_STR          "avx512"
+#define SIMD_BYTES        64
+#include "nn_simd_kern.h"
+#undef SIMD_NAME
+#undef SIMD_STR
+#undef SIMD_BYTES
+#pragma GCC pop_options
+
+/* The same as avx512, int8 products are summed by VNNI instructions */
+#pragma GCC push_options
+#pragma GCC target ("avx512f,avx512bw,avx512vnni")
+#define SIMD_NAME         avx512vnni
+#define SIMD_STR          "avx512vnni"
+#define SIMD_BYTES        64
+#include "nn_simd_kern.h"
+#undef SIMD_NAME
+#undef SIMD_STR
+#undef SIMD_BYTES
+#pragma GCC pop_options
+
+#endif
+
+/* =========================== DISPATCH ============================== */
+
+#define SIMD_MAX_VARIANTS   5
+
+static const nnsimd_ *VARIANTS[SIMD_MAX_VARIANTS];
+static size_t        NVARIANTS = 0;
+
+const nnsimd_ *SIMD = &simd_scalar_;
+
+const nnsimd_ *const *simd_variants (size_t *n)
+{
+  *n = NVARIANTS;
+  return VARIANTS;
+}
+
+int simd_select (const char *name)
+{
+  for (size_t i = 0; i < NVARIANTS; i++)
+    if (strcmp (VARIANTS[i]->name, name) == 0)
+      {
+        SIMD = VARIANTS[i];
+        return 0;
+      }
+  return 1;
+}
+
+/**
+ *
+ * Runs before main(), so that the kernels never change
+ * while networks are trained
+ *
+ **/
+__attribute__ ((constructor))
+static void simd_init_ (void)
+{
+  VARIANTS[NVARIANTS++] = &simd_scalar_;
+
+#ifdef HAVE_X86_SIMD_
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports ("sse2"))
+    VARIANTS[NVARIANTS++] = &simd_sse2_;
+  if (__builtin_cpu_supports ("avx2") && __builtin_cpu_supports ("fma"))
+    VARIANTS[NVARIANTS++] = &simd_avx2_;
+  if (__builtin_cpu_supports ("avx512f"))
+    VARIANTS[NVARIANTS++] = &simd_avx512_;
+  if (__builtin_cpu_supports ("avx512f") && __builtin_cpu_supports ("avx512bw")
+   && __builtin_cpu_supports ("avx512vnni"))
+    VARIANTS[NVARIANTS++] = &simd_avx512vnni_;
+#endif
+
+  /* The widest one goes last */
+  SIMD = VARIANTS[NVARIANTS-1];
+
+  const char *name = getenv ("NN_SIMD");
+  if (name != NULL && simd_select (name) != 0)
+    fprintf (stderr, "simd_init(): %s kernels are not supported, using %s\n",
+             name, SIMD->name);
+}
@@ -0,0 +1,132 @@
+#ifndef _NN_SIMD_
+#define _NN_SIMD_
+
+/**
+ *
+ * Vector kernels of the layer hot loops
+ *
+ * Every kernel has a scalar reference implementation and explicitly
+ * vectorized SSE2, AVX2 (+FMA), AVX-512 and AVX-512 VNNI variants; the
+ * widest variant supported by the CPU is selected once at startup (CPUID),
+ * it can be overridden with NN_SIMD=scalar|sse2|avx2|avx512|avx512vnni
+ * environment variable
+ *
+ * @var name        variant name
+ * @var dot         sum (i, x[i] * y[i])
+ * @var axpy        y[i] += a * x[i]
+ * @var axpy4       y[i] += a[0] * x[0][i] + ... + a[3] * x[3][i]
+ * @var sigmoid     x[i]  = 1 / (1 + exp (-x[i]))
+ * @var sigmoid_fast  the same with a degree 5 polynomial exp,
+ *                    max absolute error < 1e-6 (SIGMOID_FAST_MAXERR)
+ * @var dsigmoid    d[i] *= s[i] * (1 - s[i]), s[i] - sigmoid activation
+ * @var update      w[i]  = decay * w[i] - c * dw[i], dw[i] = 0
+ * @var momentum    g     = c * dw[i] + l * w[i],
+ *                  v[i]  = mu * v[i] + g,
+ *                  w[i] -= nesterov ? mu * v[i] + g : v[i], dw[i] = 0
+ * @var adam        g     = k->c * dw[i] + k->l * w[i],
+ *                  m[i]  = beta1 * m[i] + (1 - beta1) * g,
+ *                  v[i]  = beta2 * v[i] + (1 - beta2) * g^2,
+ *                  w[i]  = decay * w[i] - lr * m[i] / (sqrt (v[i]) + eps),
+ *                  dw[i] = 0
+ * @var quantize    q[i]  = (x[i] - lo) * s, rounded to the nearest 
+ *                  uint8, out of range values are clamped to 0..255
+ * @var qdot4       s[k]  = sum (i, x[i] * w[k][i]), k = 0..3, 
+ *                  uint8 x, int8 w[k], int32 sums (see nn_quantize())
+ *
+ * Block kernels only touch blocks c of cols, i = c * bc .. c * bc + bc - 1
+ * and i < n, of the vectors (see bsrmm_nt() of nn_gemm.h)
+ *
+ * @var bdot4       s[k]  = sum (i, x[i] * w[k][i]), k = 0..3
+ * @var baxpy4      y[i] += a[0] * w[0][i] + ... + a[3] * w[3][i]
+ * @var bger4       w[k][i] += a[k] * x[i], k = 0..3
+ *
+ * Weight updates are done in a single pass over w, dw and the state
+ *
+ **/
+
+/**
+ *
+ * @struct nnadamk
+ * @brief Coefficients of one Adam step (see adam kernel above)
+ *
+ * @var c             scale of summed gradient
+ * @var l             L2 regularization added to gradient, 0 for AdamW
+ * @var beta1         decay of the first moment
+ * @var beta2         decay of the second moment
+ * @var lr            step size, with bias corrections of the moments
+ * @var eps           added to sqrt (v[i])
+ * @var decay         decoupled weight decay of AdamW, 1 for Adam
+ *
+ **/
+typedef struct nnadamk_
+{
+  double_     c;
+  double_     l;
+  double_ beta1;
+  double_ beta2;
+  double_    lr;
+  double_   eps;
+  double_ decay;
+
+} nnadamk_;
+
+typedef struct nnsimd_
+{
+  const char *name;
+  double_ (*dot)      (const double_ *x, const double_ *y, const size_t n);
+  void    (*axpy)     (double_ *y, const double_ a, const double_ *x,
+                       const size_t n);
+  void    (*axpy4)    (double_ *y, const double_ *a, const double_ *const *x,
+                       const size_t n);
+  void    (*sigmoid)  (double_ *x, const size_t n);
+  void    (*sigmoid_fast) (double_ *x, const size_t n);
+  void    (*dsigmoid) (double_ *d, const double_ *s, const size_t n);
+  void    (*update)   (double_ *w, double_ *dw, const double_ c,
+                       const double_ decay, const size_t n);
+  void    (*momentum) (double_ *w, double_ *dw, double_ *v, 
+                       const double_ c, const double_ l, const double_ mu,
+                       const int nesterov, const size_t n);
+  void    (*adam)     (double_ *w, double_ *dw, double_ *m, double_ *v,
+                       const nnadamk_ *k, const size_t n);
+  void    (*quantize) (uint8_t *q, const double_ *x, const double_ lo,
+                       const double_ s, const size_t n);
+  void    (*qdot4)    (int32_t *s, const uint8_t *x, const int8_t *const *w,
+                       const size_t n);
+  void    (*bdot4)    (double_ *s, const double_ *x, const double_ *const *w,
+                       const uint32_t *cols, const size_t nblocks, 
+                       const size_t bc, const size_t n);
+  void    (*baxpy4)   (double_ *y, const double_ *a, const double_ *const *w,
+                       const uint32_t *cols, const size_t nblocks, 
+                       const size_t bc, const size_t n);
+  void    (*bger4)    (double_ *const *w, const double_ *a, const double_ *x,
+                       const uint32_t *cols, const size_t nblocks, 
+                       const size_t bc, const size_t n);
+
+} nnsimd_;
+
+/* Bound of |sigmoid_fast (x) - sigmoid (x)| for all x */
+#define SIGMOID_FAST_MAXERR     1e-6
+
+/* Kernels selected at startup */
+extern const nnsimd_ *SIMD;
+
+/**
+ *
+ * @brief All kernel variants supported by the CPU,
+ *        the scalar reference variant goes first
+ *
+ * @param n       set to # of variants
+ *
+ **/
+const nnsimd_ *const *simd_variants (size_t *n);
+
+/**
+ *
+ * @brief Select kernel variant by name
+ *
+ * @return 0 on success, 1 if variant is unknown or not supported by the CPU
+ *
+ **/
+int simd_select (const char *name);
+
+#endif
@@ -0,0 +1,472 @@
+/**
+ *
+ * Vector kernels template, included by nn_simd.c once per instruction set
+ * with SIMD_NAME and SIMD_BYTES defined and the matching target enabled
+ *
+ * GCC vector extensions are used, so that the same code is compiled
+ * to SSE2, AVX2 or AVX-512 instructions depending on SIMD_BYTES
+ *
+ **/
+
+#define KERN3_(f, isa)    f ## _ ## isa ## _
+#define KERN2_(f, isa)    KERN3_(f, isa)
+#define KERN_(f)          KERN2_(f, SIMD_NAME)
+
+#define NL                (SIMD_BYTES / sizeof (double_))   /* # of lanes */
+
+typedef double_ KERN_(vec)  __attribute__ ((vector_size (SIMD_BYTES)));
+typedef SIMD_INT KERN_(ivec) __attribute__ ((vector_size (SIMD_BYTES)));
+typedef double_ KERN_(uvec) __attribute__ ((vector_size (SIMD_BYTES),
+                                            aligned (sizeof (double_)),
+                                            may_alias));
+typedef int32_t KERN_(ivec32) __attribute__ ((vector_size (NL * 4)));
+typedef uint8_t KERN_(qvec)   __attribute__ ((vector_size (NL), aligned (1),
+                                              may_alias));
+
+#define VEC               KERN_(vec)
+#define IVEC              KERN_(ivec)
+#define LOAD(p)           ((VEC) *(const KERN_(uvec) *)(p))
+#define STORE(p, v)       (*(KERN_(uvec) *)(p) = (v))
+
+static inline VEC KERN_(splat) (const double_ a)
+{
+  VEC v = { 0 };
+  return v + a;
+}
+
+/* m ? a : b, m - result of vector comparison */
+static inline VEC KERN_(select) (const IVEC m, const VEC a, const VEC b)
+{
+  return (VEC) ((m & (IVEC) a) | (~m & (IVEC) b));
+}
+
+static inline double_ KERN_(hsum) (const VEC v)
+{
+  double_ s = 0.0;
+  for (size_t l = 0; l < NL; l++)
+    s += v[l];
+  return s;
+}
+
+/**
+ *
+ * exp (x) = 2^n * exp (r), n = round (x / ln2), |r| <= ln2 / 2,
+ * exp (r) is a Taylor polynomial of degree deg (see SIMD_EXP_DEG)
+ *
+ **/
+static inline VEC KERN_(exp) (VEC x, const size_t deg)
+{
+  const VEC hi = KERN_(splat) ( SIMD_EXP_MAX);
+  const VEC lo = KERN_(splat) (-SIMD_EXP_MAX);
+  x = KERN_(select) (x > hi, hi, x);
+  x = KERN_(select) (x < lo, lo, x);
+
+  /* Round x / ln2 to the nearest integer using 1.5*2^mantissa shifter */
+  const VEC shifter = KERN_(splat) (SIMD_EXP_SHIFTER);
+  VEC t = x * KERN_(splat) (1.4426950408889634) + shifter;
+  VEC n = t - shifter;
+  IVEC ni = (IVEC) t - (IVEC) shifter;
+
+  /* ln2 is split in two, so that n * ln2 is exact in the first term */
+  VEC r = x - n * KERN_(splat) (SIMD_LN2_HI);
+  r     = r - n * KERN_(splat) (SIMD_LN2_LO);
+
+  static const double_ coefs[] = 
+    {
+      1.0 / 39916800, 1.0 / 3628800, 1.0 / 362880, 1.0 / 40320,
+      1.0 / 5040, 1.0 / 720, 1.0 / 120, 1.0 / 24, 1.0 / 6, 0.5, 1.0, 1.0
+    };
+  const size_t ncoefs = sizeof coefs / sizeof *coefs;
+
+  VEC p = KERN_(splat) (coefs[ncoefs - deg - 1]);
+  for (size_t c = ncoefs - deg; c < ncoefs; c++)
+    p = p * r + coefs[c];
+
+  return p * (VEC) ((ni + SIMD_EXP_BIAS) << SIMD_EXP_MANT);
+}
+
+/* sqrt has no vector extension operator, SIMD_BYTES picks the intrinsic */
+static inline VEC KERN_(sqrt) (const VEC x)
+{
+#ifdef NN_FLOAT32
+  #if SIMD_BYTES == 64
+    return (VEC) _mm512_sqrt_ps ((__m512) x);
+  #elif SIMD_BYTES == 32
+    return (VEC) _mm256_sqrt_ps ((__m256) x);
+  #else
+    return (VEC) _mm_sqrt_ps ((__m128) x);
+  #endif
+#else
+  #if SIMD_BYTES == 64
+    return (VEC) _mm512_sqrt_pd ((__m512d) x);
+  #elif SIMD_BYTES == 32
+    return (VEC) _mm256_sqrt_pd ((__m256d) x);
+  #else
+    return (VEC) _mm_sqrt_pd ((__m128d) x);
+  #endif
+#endif
+}
+
+static double_ KERN_(dot) (const double_ *x, const double_ *y, const size_t n)
+{
+  VEC s0 = { 0 }, s1 = { 0 };
+  size_t i = 0;
+  for (; i + 2*NL <= n; i += 2*NL)
+    {
+      s0 += LOAD (x + i)      * LOAD (y + i);
+      s1 += LOAD (x + i + NL) * LOAD (y + i + NL);
+    }
+  for (; i + NL <= n; i += NL)
+    s0 += LOAD (x + i) * LOAD (y + i);
+
+  double_ s = KERN_(hsum) (s0 + s1);
+  for (; i < n; i++)
+    s += x[i] * y[i];
+  return s;
+}
+
+static void 
+KERN_(axpy) (double_ *y, const double_ a, const double_ *x, const size_t n)
+{
+  size_t i = 0;
+  for (; i + NL <= n; i += NL)
+    STORE (y + i, LOAD (y + i) + a * LOAD (x + i));
+  for (; i < n; i++)
+    y[i] += a * x[i];
+}
+
+static void 
+KERN_(axpy4) (double_ *y, const double_ *a, const double_ *const *x, 
+              const size_t n)
+{
+  const double_ *x0 = x[0], *x1 = x[1], *x2 = x[2], *x3 = x[3];
+  size_t i = 0;
+  for (; i + NL <= n; i += NL)
+    STORE (y + i, LOAD (y + i) + a[0] * LOAD (x0 + i) + a[1] * LOAD (x1 + i)
+                               + a[2] * LOAD (x2 + i) + a[3] * LOAD (x3 + i));
+  for (; i < n; i++)
+    y[i] += a[0] * x0[i] + a[1] * x1[i] + a[2] * x2[i] + a[3] * x3[i];
+}
+
+static void KERN_(sigmoid) (double_ *x, const size_t n)
+{
+  const VEC one = KERN_(splat) (1.0);
+  size_t i = 0;
+  for (; i + NL <= n; i += NL)
+    STORE (x + i, one / (one + KERN_(exp) (-LOAD (x + i), SIMD_EXP_DEG)));
+  for (; i < n; i++)
+    x[i] = 1 / (1 + NN_EXP (-x[i]));
+}
+
+static void KERN_(sigmoid_fast) (double_ *x, const size_t n)
+{
+  const VEC one = KERN_(splat) (1.0);
+  size_t i = 0;
+  for (; i + NL <= n; i += NL)
+    STORE (x + i, one / (one + KERN_(exp) (-LOAD (x + i), SIMD_FEXP_DEG)));
+  for (; i < n; i++)
+    x[i] = sigmoid_fast_1_ (x[i]);
+}
+
+static void KERN_(dsigmoid) (double_ *d, const double_ *s, const size_t n)
+{
+  size_t i = 0;
+  for (; i + NL <= n; i += NL)
+    {
+      VEC s_i = LOAD (s + i);
+      STORE (d + i, LOAD (d + i) * s_i * (1.0 - s_i));
+    }
+  for (; i < n; i++)
+    d[i] *= s[i] * (1 - s[i]);
+}
+
+static void 
+KERN_(update) (double_ *w, double_ *dw, const double_ c, const double_ decay,
+               const size_t n)
+{
+  const VEC zero = { 0 };
+  size_t i = 0;
+  for (; i + NL <= n; i += NL)
+    {
+      STORE (w + i, decay * LOAD (w + i) - c * LOAD (dw + i));
+      STORE (dw + i, zero);
+    }
+  for (; i < n; i++)
+    {
+      w[i] = decay * w[i] - c * dw[i];
+      dw[i] = 0.0;
+    }
+}
+
+static void 
+KERN_(momentum) (double_ *w, double_ *dw, double_ *v, const double_ c, 
+                 const double_ l, const double_ mu, const int nesterov, 
+                 const size_t n)
+{
+  /* w -= a * v + b * g */
+  const double_ a = nesterov ? mu  : 1.0;
+  const double_ b = nesterov ? 1.0 : 0.0;
+  const VEC zero = { 0 };
+  size_t i = 0;
+  for (; i + NL <= n; i += NL)
+    {
+      VEC w_i = LOAD (w + i);
+      VEC g   = c * LOAD (dw + i) + l * w_i;
+      VEC v_i = mu * LOAD (v + i) + g;
+      STORE (w + i, w_i - (a * v_i + b * g));
+      STORE (v + i, v_i);
+      STORE (dw + i, zero);
+    }
+  for (; i < n; i++)
+    {
+      double_ g = c * dw[i] + l * w[i];
+      v[i]  = mu * v[i] + g;
+      w[i] -= a * v[i] + b * g;
+      dw[i] = 0.0;
+    }
+}
+
+static void 
+KERN_(adam) (double_ *w, double_ *dw, double_ *m, double_ *v, 
+             const nnadamk_ *k, const size_t n)
+{
+  const double_ c = k->c, l = k->l, beta1 = k->beta1, beta2 = k->beta2,
+                lr = k->lr, eps = k->eps, decay = k->decay;
+  const VEC zero = { 0 };
+  size_t i = 0;
+  for (; i + NL <= n; i += NL)
+    {
+      VEC w_i = LOAD (w + i);
+      VEC g   = c * LOAD (dw + i) + l * w_i;
+      VEC m_i = beta1 * LOAD (m + i) + (1 - beta1) * g;
+      VEC v_i = beta2 * LOAD (v + i) + (1 - beta2) * g * g;
+      STORE (w + i, decay * w_i - lr * m_i / (KERN_(sqrt) (v_i) + eps));
+      STORE (m + i, m_i);
+      STORE (v + i, v_i);
+      STORE (dw + i, zero);
+    }
+  for (; i < n; i++)
+    {
+      double_ g = c * dw[i] + l * w[i];
+      m[i]  = beta1 * m[i] + (1 - beta1) * g;
+      v[i]  = beta2 * v[i] + (1 - beta2) * g * g;
+      w[i]  = decay * w[i] - lr * m[i] / (NN_SQRT (v[i]) + eps);
+      dw[i] = 0.0;
+    }
+}
+
+static void 
+KERN_(quantize) (uint8_t *q, const double_ *x, const double_ lo, 
+                 const double_ s, const size_t n)
+{
+  const VEC zero = { 0 }, qmax = KERN_(splat) (255.0);
+  size_t i = 0;
+  for (; i + NL <= n; i += NL)
+    {
+      VEC q_i = (LOAD (x + i) - lo) * s + (double_) 0.5;
+      q_i = KERN_(select) (q_i > zero, q_i, zero);
+      q_i = KERN_(select) (q_i < qmax, q_i, qmax);
+      /* Through int32, double_ to int64 needs AVX-512 DQ */
+      *(KERN_(qvec) *)(q + i) = 
+        __builtin_convertvector (__builtin_convertvector (q_i, KERN_(ivec32)),
+                                 KERN_(qvec));
+    }
+  for (; i < n; i++)
+    q[i] = quantize_1_ (x[i], lo, s);
+}
+
+/**
+ *
+ * uint8 x int8 products are summed into int32 lanes by one VNNI
+ * instruction per 64 bytes; without VNNI both are widened to int16 
+ * and adjacent products are summed by madd, |x * w| < 2^15, so pairs
+ * never overflow; x is widened once for all 4 rows of w
+ *
+ **/
+static void 
+KERN_(qdot4) (int32_t *s, const uint8_t *x, const int8_t *const *w, 
+              const size_t n)
+{
+  const int8_t *w0 = w[0], *w1 = w[1], *w2 = w[2], *w3 = w[3];
+  size_t i = 0;
+#if defined(__AVX512VNNI__) && SIMD_BYTES == 64
+  __m512i s0 = _mm512_setzero_si512 (), s1 = s0, s2 = s0, s3 = s0;
+  for (; i + 64 <= n; i += 64)
+    {
+      const __m512i x_i = _mm512_loadu_si512 (x + i);
+      s0 = _mm512_dpbusd_epi32 (s0, x_i, _mm512_loadu_si512 (w0 + i));
+      s1 = _mm512_dpbusd_epi32 (s1, x_i, _mm512_loadu_si512 (w1 + i));
+      s2 = _mm512_dpbusd_epi32 (s2, x_i, _mm512_loadu_si512 (w2 + i));
+      s3 = _mm512_dpbusd_epi32 (s3, x_i, _mm512_loadu_si512 (w3 + i));
+    }
+  s[0] = _mm512_reduce_add_epi32 (s0);
+  s[1] = _mm512_reduce_add_epi32 (s1);
+  s[2] = _mm512_reduce_add_epi32 (s2);
+  s[3] = _mm512_reduce_add_epi32 (s3);
+#elif SIMD_BYTES >= 32
+  #define QLOAD_(p)       _mm_loadu_si128 ((const __m128i *)(p))
+  #define QMADD_(s, w)    \
+    s = _mm256_add_epi32 (s, _mm256_madd_epi16 (x_i, \
+                             _mm256_cvtepi8_epi16 (QLOAD_ ((w) + i))))
+  __m256i s_k[4] = { _mm256_setzero_si256 () };
+  s_k[1] = s_k[2] = s_k[3] = s_k[0];
+  for (; i + 16 <= n; i += 16)
+    {
+      const __m256i x_i = _mm256_cvtepu8_epi16 (QLOAD_ (x + i));
+      QMADD_ (s_k[0], w0);
+      QMADD_ (s_k[1], w1);
+      QMADD_ (s_k[2], w2);
+      QMADD_ (s_k[3], w3);
+    }
+  for (size_t k = 0; k < 4; k++)
+    {
+      int32_t t[8];
+      _mm256_storeu_si256 ((__m256i *) t, s_k[k]);
+      s[k] = t[0] + t[1] + t[2] + t[3] + t[4] + t[5] + t[6] + t[7];
+    }
+  #undef QLOAD_
+  #undef QMADD_
+#else
+  /* SSE2 has no sign extension, int8 goes to the high byte and back */
+  #define QLOAD_(p)       _mm_loadl_epi64 ((const __m128i *)(p))
+  #define QMADD_(s, w)    \
+    s = _mm_add_epi32 (s, _mm_madd_epi16 (x_i, _mm_srai_epi16 ( \
+          _mm_unpacklo_epi8 (QLOAD_ ((w) + i), QLOAD_ ((w) + i)), 8)))
+  const __m128i zero = _mm_setzero_si128 ();
+  __m128i s_k[4] = { zero, zero, zero, zero };
+  for (; i + 8 <= n; i += 8)
+    {
+      const __m128i x_i = _mm_unpacklo_epi8 (QLOAD_ (x + i), zero);
+      QMADD_ (s_k[0], w0);
+      QMADD_ (s_k[1], w1);
+      QMADD_ (s_k[2], w2);
+      QMADD_ (s_k[3], w3);
+    }
+  for (size_t k = 0; k < 4; k++)
+    {
+      int32_t t[4];
+      _mm_storeu_si128 ((__m128i *) t, s_k[k]);
+      s[k] = t[0] + t[1] + t[2] + t[3];
+    }
+  #undef QLOAD_
+  #undef QMADD_
+#endif
+  for (; i < n; i++)
+    {
+      s[0] += x[i] * w0[i];
+      s[1] += x[i] * w1[i];
+      s[2] += x[i] * w2[i];
+      s[3] += x[i] * w3[i];
+    }
+}
+
+/* One block is bc / NL vectors, tails are left to scalar code */
+static void 
+KERN_(bdot4) (double_ *s, const double_ *x, const double_ *const *w,
+              const uint32_t *cols, const size_t nblocks, const size_t bc, 
+              const size_t n)
+{
+  const double_ *w0 = w[0], *w1 = w[1], *w2 = w[2], *w3 = w[3];
+  VEC s0 = { 0 }, s1 = { 0 }, s2 = { 0 }, s3 = { 0 };
+  double_ t[4] = { 0.0 };
+  for (size_t b = 0; b < nblocks; b++)
+    {
+      size_t i0, i1, i;
+      block_range_ (cols, b, bc, n, &i0, &i1);
+      for (i = i0; i + NL <= i1; i += NL)
+        {
+          const VEC x_i = LOAD (x + i);
+          s0 += x_i * LOAD (w0 + i);
+          s1 += x_i * LOAD (w1 + i);
+          s2 += x_i * LOAD (w2 + i);
+          s3 += x_i * LOAD (w3 + i);
+        }
+      for (; i < i1; i++)
+        {
+          t[0] += x[i] * w0[i];
+          t[1] += x[i] * w1[i];
+          t[2] += x[i] * w2[i];
+          t[3] += x[i] * w3[i];
+        }
+    }
+  s[0] = t[0] + KERN_(hsum) (s0);
+  s[1] = t[1] + KERN_(hsum) (s1);
+  s[2] = t[2] + KERN_(hsum) (s2);
+  s[3] = t[3] + KERN_(hsum) (s3);
+}
+
+static void 
+KERN_(baxpy4) (double_ *y, const double_ *a, const double_ *const *w,
+               const uint32_t *cols, const size_t nblocks, const size_t bc, 
+               const size_t n)
+{
+  const double_ *w0 = w[0], *w1 = w[1], *w2 = w[2], *w3 = w[3];
+  for (size_t b = 0; b < nblocks; b++)
+    {
+      size_t i0, i1, i;
+      block_range_ (cols, b, bc, n, &i0, &i1);
+      for (i = i0; i + NL <= i1; i += NL)
+        STORE (y + i, LOAD (y + i) + a[0] * LOAD (w0 + i) 
+                                   + a[1] * LOAD (w1 + i)
+                                   + a[2] * LOAD (w2 + i) 
+                                   + a[3] * LOAD (w3 + i));
+      for (; i < i1; i++)
+        y[i] += a[0] * w0[i] + a[1] * w1[i] + a[2] * w2[i] + a[3] * w3[i];
+    }
+}
+
+static void 
+KERN_(bger4) (double_ *const *w, const double_ *a, const double_ *x,
+              const uint32_t *cols, const size_t nblocks, const size_t bc, 
+              const size_t n)
+{
+  double_ *w0 = w[0], *w1 = w[1], *w2 = w[2], *w3 = w[3];
+  for (size_t b = 0; b < nblocks; b++)
+    {
+      size_t i0, i1, i;
+      block_range_ (cols, b, bc, n, &i0, &i1);
+      for (i = i0; i + NL <= i1; i += NL)
+        {
+          const VEC x_i = LOAD (x + i);
+          STORE (w0 + i, LOAD (w0 + i) + a[0] * x_i);
+          STORE (w1 + i, LOAD (w1 + i) + a[1] * x_i);
+          STORE (w2 + i, LOAD (w2 + i) + a[2] * x_i);
+          STORE (w3 + i, LOAD (w3 + i) + a[3] * x_i);
+        }
+      for (; i < i1; i++)
+        {
+          w0[i] += a[0] * x[i];
+          w1[i] += a[1] * x[i];
+          w2[i] += a[2] * x[i];
+          w3[i] += a[3] * x[i];
+        }
+    }
+}
+
+static const nnsimd_ KERN_(simd) =
+  {
+    .name     = SIMD_STR,
+    .dot      = KERN_(dot),
+    .axpy     = KERN_(axpy),
+    .axpy4    = KERN_(axpy4),
+    .sigmoid  = KERN_(sigmoid),
+    .sigmoid_fast = KERN_(sigmoid_fast),
+    .dsigmoid = KERN_(dsigmoid),
+    .update   = KERN_(update),
+    .momentum = KERN_(momentum),
+    .adam     = KERN_(adam),
+    .quantize = KERN_(quantize),
+    .qdot4    = KERN_(qdot4),
+    .bdot4    = KERN_(bdot4),
+    .baxpy4   = KERN_(baxpy4),
+    .bger4    = KERN_(bger4)
+  };
+
+#undef KERN3_
+#undef KERN2_
+#undef KERN_
+#undef NL
+#undef VEC
+#undef IVEC
+#undef LOAD
+#undef STORE